@@ -0,0 +1,158 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Benchmark of contact id allocation in blocks
+ *
+ * Inserts contacts from an increasing number of threads, up to the number
+ * of cores, each with a connection of its own, first drawing every id
+ * from the contact id sequence and then reserving ids in blocks. Reports
+ * insert throughput and checks that no id was assigned twice.
+ *
+ * Usage: id_block_bench [contacts per thread] [block size]
+ */
+
+#include "phonebook.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#define BENCH_DATABASE          "bench_id_block.db"
+/* Contacts inserted per transaction */
+#define BENCH_BATCH             100
+/* Ids reserved per block unless given on the command line */
+#define BENCH_BLOCK_SIZE        1000
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * Insert contacts over a connection of its own, recording their ids.
+ */
+static void insert_worker(int worker, long contacts, unsigned block_size,
+    std::vector<db_uint> *ids, int *rc)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    wchar_t name[32];
+
+    *rc = pbook.open_database(db::DB_FILE_STORAGE, BENCH_DATABASE);
+    if (DB_FAILED(*rc))
+        return;
+    pbook.set_change_logging(false);
+    pbook.set_id_block_size(block_size);
+
+    for (long i = 0; i < contacts; i++) {
+        if (i % BENCH_BATCH == 0)
+            pbook.tx_start();
+        swprintf(name, sizeof name / sizeof name[0], L"Contact %d-%ld", worker, i);
+        ids->push_back(pbook.insert_contact(name, i % 8, NULL));
+        if (i % BENCH_BATCH == BENCH_BATCH - 1 || i == contacts - 1)
+            pbook.tx_commit();
+    }
+    pbook.close_database();
+}
+
+/**
+ * Insert contacts from the given number of threads into a new database.
+ *
+ * @return seconds taken, or a negative number on failure
+ */
+static double run(int threads, long contacts, unsigned block_size)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    std::vector<std::vector<db_uint> > ids(threads);
+    std::vector<int> rcs(threads, DB_NOERROR);
+    std::vector<std::thread> workers;
+    std::vector<db_uint> all;
+
+    remove(BENCH_DATABASE);
+    if (DB_FAILED(book->create_database(db::DB_FILE_STORAGE, BENCH_DATABASE)))
+        return -1;
+    book->close_database();
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::thread(insert_worker, i, contacts, block_size, &ids[i], &rcs[i]));
+    for (int i = 0; i < threads; i++)
+        workers[i].join();
+    double seconds = seconds_since(start);
+
+    for (int i = 0; i < threads; i++) {
+        if (DB_FAILED(rcs[i]))
+            return -1;
+        all.insert(all.end(), ids[i].begin(), ids[i].end());
+    }
+    std::sort(all.begin(), all.end());
+    if (all.empty() || all[0] == 0 || std::adjacent_find(all.begin(), all.end()) != all.end())
+        return -1;
+
+    return seconds;
+}
+
+int main(int argc, char *argv[])
+{
+    long contacts = argc > 1 ? atol(argv[1]) : 10000;
+    unsigned block_size = argc > 2 ? (unsigned) atol(argv[2]) : BENCH_BLOCK_SIZE;
+    int cores = (int) std::thread::hardware_concurrency();
+
+    printf("%ld contacts per thread, %d cores\n\n", contacts, cores);
+    printf("%8s %8s %12s %14s %8s\n", "block", "threads", "seconds", "contacts/s", "speedup");
+
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned size = pass == 0 ? 1 : block_size;
+        double base_rate = 0;
+
+        for (int threads = 1; threads <= (cores > 0 ? cores : 1); threads *= 2) {
+            double seconds = run(threads, contacts, size);
+
+            if (seconds < 0) {
+                printf("%8u %8d insert failed or assigned an id twice\n", size, threads);
+                return 1;
+            }
+            double rate = contacts * threads / seconds;
+            if (threads == 1)
+                base_rate = rate;
+            printf("%8u %8d %12.3f %14.0f %7.2fx\n", size, threads, seconds, rate,
+                   rate / base_rate);
+        }
+    }
+
+    remove(BENCH_DATABASE);
+
+    return 0;
+}
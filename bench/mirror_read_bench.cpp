@@ -0,0 +1,174 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Benchmark comparing remote and mirrored read latency
+ *
+ * Starts ITTIA DB Server in this process, fills a phone book through the
+ * IPC client protocol and times the same reads against the server and
+ * against a PhoneBookMirror: single contact lookups and full listings.
+ * Also reports the cost of refreshing the mirror after remote changes.
+ *
+ * Usage: mirror_read_bench [contacts] [rounds]
+ */
+
+#include "phonebook.h"
+#include "phonebook_mirror.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <streambuf>
+#include <vector>
+
+#define BENCH_DATABASE          "idb+tcp://localhost/bench_mirror.db"
+#define BENCH_PICTURE           "bench_mirror.png"
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * Discards listing output, so only the reads are timed.
+ */
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) { return c; }
+};
+
+static void report(const char *label, double seconds, long operations)
+{
+    printf("%-28s %10.1f us/op\n", label, seconds * 1e6 / operations);
+}
+
+int main(int argc, char *argv[])
+{
+    int contacts = argc > 1 ? atoi(argv[1]) : 200;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    PhoneBookMirror mirror(pbook, 60 * 1000);
+    std::vector<db_uint> ids;
+    NullBuffer null_buffer;
+    std::streambuf *console = std::cout.rdbuf();
+    wchar_t name[32];
+    char number[32];
+
+    FILE *f = fopen(BENCH_PICTURE, "wb");
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, f);
+    fclose(f);
+
+    if (DB_FAILED(db_server_start(NULL)))
+        return 1;
+    if (DB_FAILED(pbook.create_database(db::DB_FILE_STORAGE, BENCH_DATABASE)))
+        return 1;
+
+    pbook.tx_start();
+    for (int i = 0; i < contacts; i++) {
+        swprintf(name, sizeof name / sizeof name[0], L"Contact %d", i);
+        sprintf(number, "206-555-%04d", i % 10000);
+        ids.push_back(pbook.insert_contact(name, i % 8, BENCH_PICTURE));
+        pbook.insert_phone_number(ids.back(), number, PhoneBook::MOBILE, -1);
+    }
+    pbook.tx_commit();
+
+    std::cout.rdbuf(&null_buffer);
+    if (DB_FAILED(mirror.open()))
+        return 1;
+
+    printf("%d contacts, %d rounds\n\n", contacts, rounds);
+
+    //-------------------------------------------------------------------
+    // Single contact lookups
+    //-------------------------------------------------------------------
+    Clock::time_point start = Clock::now();
+    for (int r = 0; r < rounds; r++) {
+        pbook.tx_start();
+        for (size_t i = 0; i < ids.size(); i++)
+            pbook.get_picture_name(ids[i]);
+        pbook.tx_commit();
+    }
+    report("lookup, remote", seconds_since(start), (long) rounds * contacts);
+
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (size_t i = 0; i < ids.size(); i++)
+            mirror.get_picture_name(ids[i]);
+    report("lookup, mirror", seconds_since(start), (long) rounds * contacts);
+
+    //-------------------------------------------------------------------
+    // Full listings
+    //-------------------------------------------------------------------
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++) {
+        pbook.tx_start();
+        pbook.list_contacts(0);
+        pbook.tx_commit();
+    }
+    report("list, remote", seconds_since(start), rounds);
+
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        mirror.list_contacts(0);
+    report("list, mirror", seconds_since(start), rounds);
+
+    // With no staleness allowed, every read first checks the change log
+    mirror.set_max_staleness_ms(0);
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        mirror.list_contacts(0);
+    report("list, mirror, 0 ms bound", seconds_since(start), rounds);
+
+    //-------------------------------------------------------------------
+    // Refresh after a batch of remote renames
+    //-------------------------------------------------------------------
+    double refresh_time = 0;
+    for (int r = 0; r < rounds; r++) {
+        pbook.tx_start();
+        for (size_t i = 0; i < ids.size(); i += 10) {
+            swprintf(name, sizeof name / sizeof name[0], L"Renamed %d", r);
+            pbook.update_contact_name(ids[i], name);
+        }
+        pbook.tx_commit();
+
+        start = Clock::now();
+        mirror.refresh();
+        refresh_time += seconds_since(start);
+    }
+    std::cout.rdbuf(console);
+    report("refresh, per change", refresh_time, (long) rounds * ((contacts + 9) / 10));
+
+    mirror.close();
+    pbook.close_database();
+    remove(BENCH_PICTURE);
+
+    return 0;
+}
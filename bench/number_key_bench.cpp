@@ -0,0 +1,337 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Benchmark of packed number keys against text phone numbers
+ *
+ * Checks that equivalent forms of a number get the same key, then
+ * generates phone numbers written in a mix of national and international
+ * styles and reports:
+ * - digit extraction throughput of the vectorized kernel and a
+ *   byte-at-a-time loop, and of full E.164 key computation;
+ * - lookup throughput of integer keys and of normalized text in sorted
+ *   arrays;
+ * - database file size and indexed lookup throughput for a table indexed
+ *   on the text number and one indexed on the packed key.
+ *
+ * Usage: number_key_bench [numbers (default 10000000)] [database rows]
+ */
+
+#include "number_key.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define BENCH_TEXT_DATABASE     "bench_number_text.db"
+#define BENCH_KEY_DATABASE      "bench_number_key.db"
+#define BENCH_LOOKUPS           1000000
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static long file_size(const char *file_name)
+{
+    struct stat st;
+    return stat(file_name, &st) == 0 ? (long) st.st_size : 0;
+}
+
+static unsigned long long next_random(unsigned long long &state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state >> 17;
+}
+
+/**
+ * Write a random number in one of several common styles.
+ */
+static void make_number(unsigned long long &state, char *buffer)
+{
+    unsigned long long r = next_random(state);
+    unsigned area = 200 + (unsigned) (r % 800);
+    unsigned exchange = 200 + (unsigned) (r / 800 % 800);
+    unsigned line = (unsigned) (r / 640000 % 10000);
+
+    switch (next_random(state) % 5) {
+        case 0: sprintf(buffer, "%03u-%03u-%04u", area, exchange, line); break;
+        case 1: sprintf(buffer, "(%03u) %03u-%04u", area, exchange, line); break;
+        case 2: sprintf(buffer, "+1 %03u %03u %04u", area, exchange, line); break;
+        case 3: sprintf(buffer, "+44 20 %04u %04u", exchange * 10 + line % 10, line); break;
+        default: sprintf(buffer, "%03u.%03u.%04u x%u", area, exchange, line, line % 100); break;
+    }
+}
+
+/**
+ * Reference digit extraction, one byte at a time.
+ */
+static size_t extract_digits_bytewise(const char *number, size_t length, char *digits, size_t max)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        char c = number[i];
+
+        if (c == ',' || c == ';' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+            break;
+        if (c >= '0' && c <= '9') {
+            if (count < max)
+                digits[count] = c;
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Check that the forms a number is commonly written in get the same key
+ * and suffix key.
+ *
+ * @return false, after printing the first form that differs, if any do
+ */
+static bool check_equivalent_forms()
+{
+    static const char *const forms[] = {
+        "+1 800 555 1234",
+        "800 555 1234",
+        "(800) 555-1234",
+        "1 800 555 1234",
+        "1-800-555-1234",
+        "001 800 555 1234",
+    };
+    db_uint key = number_key(forms[0]);
+    db_uint suffix_key = number_suffix_key(forms[0]);
+
+    for (size_t i = 1; i < sizeof(forms) / sizeof(forms[0]); i++) {
+        if (number_key(forms[i]) != key || number_suffix_key(forms[i]) != suffix_key) {
+            fprintf(stderr, "Key mismatch between \"%s\" and \"%s\"\n", forms[0], forms[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+struct TextLess {
+    bool operator()(const char *a, const char *b) const { return strcmp(a, b) < 0; }
+};
+
+/**
+ * Create a table holding either text numbers or packed keys, each indexed,
+ * and time looking up every probe.
+ */
+static void run_database(const char *label, const char *file_name, bool packed,
+    const std::vector<std::string> &numbers, size_t rows,
+    const std::vector<db_uint> &probes)
+{
+    db::Database db;
+    db::StorageMode mode;
+    db::FieldDescSet fields;
+    db::IndexDescSet indexes;
+    db::Table t;
+    char e164[NUMBER_KEY_DIGITS + 2];
+    size_t found = 0;
+
+    remove(file_name);
+    mode.file_mode = db::DB_FILE_STORAGE;
+    if (DB_FAILED(db.create(file_name, mode)))
+        exit(1);
+
+    fields.add_uint("contact_id");
+    if (packed) {
+        fields.add_uint("number_key");
+        indexes.add_index("by_number", db::DB_MULTISET).add_field("number_key");
+    } else {
+        fields.add_string("number", NUMBER_KEY_DIGITS + 1);
+        indexes.add_index("by_number", db::DB_MULTISET).add_field("number");
+    }
+    if (DB_FAILED(db.create_table("phone_number", fields, indexes)))
+        exit(1);
+
+    Clock::time_point start = Clock::now();
+    db.tx_begin();
+    t.open(db, "phone_number");
+    for (size_t i = 0; i < rows; i++) {
+        db_uint key = number_key(numbers[i].c_str());
+
+        t.insert();
+        t["contact_id"] = (db_uint) i;
+        if (packed) {
+            t["number_key"] = key;
+        } else {
+            format_number_key(key, e164);
+            t["number"] = e164;
+        }
+        t.post();
+    }
+    t.close();
+    db.tx_commit();
+    double insert_time = seconds_since(start);
+
+    start = Clock::now();
+    db.tx_begin();
+    t.open(db, "phone_number");
+    t.set_sort_order("by_number");
+    for (size_t i = 0; i < probes.size(); i++) {
+        t.begin_seek(db::DB_SEEK_EQUAL);
+        if (packed) {
+            t["number_key"] = probes[i];
+        } else {
+            format_number_key(probes[i], e164);
+            t["number"] = e164;
+        }
+        if (DB_SUCCESS(t.apply_seek()) && !t.is_eof())
+            found++;
+    }
+    t.close();
+    db.tx_commit();
+    double lookup_time = seconds_since(start);
+
+    db.close();
+
+    printf("%-6s %12ld %10.1f %12.0f %12.0f %10lu\n", label, file_size(file_name),
+           (double) file_size(file_name) / rows, rows / insert_time,
+           probes.size() / lookup_time, (unsigned long) found);
+    remove(file_name);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = argc > 1 ? (size_t) atol(argv[1]) : 10000000;
+    size_t rows = argc > 2 ? (size_t) atol(argv[2]) : count;
+    unsigned long long state = 1;
+    std::vector<std::string> numbers(count);
+    std::vector<const char *> pointers(count);
+    std::vector<db_uint> keys(count);
+    size_t text_bytes = 0;
+    char buffer[64];
+    char digits[32];
+
+    if (rows > count)
+        rows = count;
+
+    if (!check_equivalent_forms())
+        return 1;
+
+    for (size_t i = 0; i < count; i++) {
+        make_number(state, buffer);
+        numbers[i] = buffer;
+        pointers[i] = numbers[i].c_str();
+        text_bytes += numbers[i].size();
+    }
+    double mb = text_bytes / (1024.0 * 1024.0);
+
+    //-------------------------------------------------------------------
+    // Normalization throughput
+    //-------------------------------------------------------------------
+    size_t total = 0;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < count; i++)
+        total += extract_digits_bytewise(pointers[i], numbers[i].size(), digits, sizeof(digits));
+    double bytewise_time = seconds_since(start);
+
+    size_t check = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < count; i++)
+        check += extract_digits(pointers[i], numbers[i].size(), digits, sizeof(digits));
+    double vector_time = seconds_since(start);
+
+    start = Clock::now();
+    number_keys(&pointers[0], count, &keys[0]);
+    double key_time = seconds_since(start);
+
+    if (check != total) {
+        fprintf(stderr, "Digit extraction mismatch\n");
+        return 1;
+    }
+
+    printf("%lu numbers, %.1f MB of text\n\n", (unsigned long) count, mb);
+    printf("%-22s %10s %14s\n", "normalization", "MB/s", "numbers/s");
+    printf("%-22s %10.1f %14.0f\n", "bytewise digits", mb / bytewise_time, count / bytewise_time);
+    printf("%-22s %10.1f %14.0f\n", "vectorized digits", mb / vector_time, count / vector_time);
+    printf("%-22s %10.1f %14.0f\n\n", "E.164 keys", mb / key_time, count / key_time);
+
+    //-------------------------------------------------------------------
+    // Lookup throughput in sorted arrays
+    //-------------------------------------------------------------------
+    std::vector<std::string> e164_text(count);
+    std::vector<const char *> sorted_text(count);
+    std::vector<db_uint> sorted_keys(keys);
+    std::vector<db_uint> probes(BENCH_LOOKUPS);
+    std::vector<std::string> probe_text(BENCH_LOOKUPS);
+
+    for (size_t i = 0; i < count; i++) {
+        format_number_key(keys[i], buffer);
+        e164_text[i] = buffer;
+        sorted_text[i] = e164_text[i].c_str();
+    }
+    std::sort(sorted_text.begin(), sorted_text.end(), TextLess());
+    std::sort(sorted_keys.begin(), sorted_keys.end());
+
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++) {
+        size_t row = (size_t) (next_random(state) % rows);
+
+        probes[i] = keys[row];
+        probe_text[i] = e164_text[row];
+    }
+
+    size_t text_found = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+        text_found += std::binary_search(sorted_text.begin(), sorted_text.end(),
+            probe_text[i].c_str(), TextLess());
+    double text_time = seconds_since(start);
+
+    size_t key_found = 0;
+    start = Clock::now();
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+        key_found += std::binary_search(sorted_keys.begin(), sorted_keys.end(), probes[i]);
+    double key_lookup_time = seconds_since(start);
+
+    printf("%-22s %14s %10s\n", "sorted array lookup", "lookups/s", "found");
+    printf("%-22s %14.0f %10lu\n", "text strcmp", BENCH_LOOKUPS / text_time, (unsigned long) text_found);
+    printf("%-22s %14.0f %10lu\n\n", "packed key", BENCH_LOOKUPS / key_lookup_time, (unsigned long) key_found);
+
+    //-------------------------------------------------------------------
+    // Database row and index size
+    //-------------------------------------------------------------------
+    if (rows > 0) {
+        printf("%lu database rows, indexed on the number\n", (unsigned long) rows);
+        printf("%-6s %12s %10s %12s %12s %10s\n", "column", "db file", "bytes/row",
+               "inserts/s", "lookups/s", "found");
+        run_database("text", BENCH_TEXT_DATABASE, false, numbers, rows, probes);
+        run_database("key", BENCH_KEY_DATABASE, true, numbers, rows, probes);
+    }
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Benchmark of the parallel range-partitioned export
+ *
+ * Fills a file storage phone book, then exports every contact with an
+ * increasing number of worker threads, up to the number of cores, and
+ * reports throughput and speedup over a single thread. Every export is
+ * compared with the single-threaded one to check the order is preserved.
+ *
+ * Usage: parallel_export_bench [contacts]
+ */
+
+#include "phonebook.h"
+#include "phonebook_export.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#define BENCH_DATABASE          "bench_export.db"
+#define BENCH_OUTPUT            "bench_export.txt"
+#define BENCH_BASELINE          "bench_export_1.txt"
+#define BENCH_PICTURE           "bench_export.png"
+/* Contacts inserted per transaction while filling the database. */
+#define BENCH_BATCH             10000
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static bool same_file(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    bool same = fa != NULL && fb != NULL;
+
+    while (same) {
+        int ca = fgetc(fa);
+        int cb = fgetc(fb);
+
+        same = ca == cb;
+        if (ca == EOF)
+            break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+int main(int argc, char *argv[])
+{
+    long contacts = argc > 1 ? atol(argv[1]) : 100000;
+    int cores = (int) std::thread::hardware_concurrency();
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    wchar_t name[32];
+    char number[32];
+    double base_time = 0;
+
+    // Every contact shares one small picture
+    FILE *f = fopen(BENCH_PICTURE, "wb");
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, f);
+    fclose(f);
+
+    remove(BENCH_DATABASE);
+    if (DB_FAILED(pbook.create_database(db::DB_FILE_STORAGE, BENCH_DATABASE)))
+        return 1;
+    pbook.set_change_logging(false);
+
+    for (long i = 0; i < contacts; i++) {
+        if (i % BENCH_BATCH == 0)
+            pbook.tx_start();
+        swprintf(name, sizeof name / sizeof name[0], L"Contact %ld", i);
+        db_uint id = pbook.insert_contact(name, i % 8, BENCH_PICTURE);
+        sprintf(number, "206-555-%04ld", i % 10000);
+        pbook.insert_phone_number(id, number, PhoneBook::HOME, -1);
+        pbook.insert_phone_number(id, number, PhoneBook::MOBILE, i % 10);
+        if (i % BENCH_BATCH == BENCH_BATCH - 1 || i == contacts - 1)
+            pbook.tx_commit();
+    }
+    pbook.close_database();
+
+    printf("%ld contacts, %d cores\n\n", contacts, cores);
+    printf("%8s %12s %14s %8s\n", "threads", "seconds", "contacts/s", "speedup");
+
+    for (int threads = 1; threads <= (cores > 0 ? cores : 1); threads *= 2) {
+        const char *output = threads == 1 ? BENCH_BASELINE : BENCH_OUTPUT;
+        FILE *out = fopen(output, "wb");
+
+        Clock::time_point start = Clock::now();
+        int rc = export_contacts_parallel(db::DB_FILE_STORAGE, BENCH_DATABASE, out, threads);
+        fclose(out);
+        double seconds = seconds_since(start);
+
+        if (threads == 1)
+            base_time = seconds;
+        if (DB_FAILED(rc) || (threads > 1 && !same_file(BENCH_BASELINE, BENCH_OUTPUT))) {
+            printf("%8d export failed or out of order\n", threads);
+            return 1;
+        }
+        printf("%8d %12.3f %14.0f %7.2fx\n", threads, seconds, contacts / seconds,
+               base_time / seconds);
+    }
+
+    remove(BENCH_OUTPUT);
+    remove(BENCH_BASELINE);
+    remove(BENCH_DATABASE);
+    remove(BENCH_PICTURE);
+
+    return 0;
+}
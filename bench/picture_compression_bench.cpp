@@ -0,0 +1,184 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Benchmark comparing raw and block-compressed picture storage
+ *
+ * Inserts a set of distinct pictures into a fresh file storage database,
+ * once with picture compression disabled and once enabled, then exports
+ * every picture again. Reports stored size and insert/export throughput.
+ *
+ * Usage: picture_compression_bench [pictures] [width]
+ */
+
+#include "phonebook.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define BENCH_DATABASE          "bench_pictures.db"
+#define BENCH_EXPORT            "bench_export.tmp"
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void put16(FILE *f, unsigned v) { fputc(v & 0xff, f); fputc((v >> 8) & 0xff, f); }
+static void put32(FILE *f, unsigned v) { put16(f, v & 0xffff); put16(f, v >> 16); }
+
+/**
+ * Write an uncompressed 24-bit BMP with a smooth gradient, a typical
+ * compressible picture. The seed makes every picture distinct.
+ */
+static void write_bitmap(const char *file_name, int width, unsigned seed)
+{
+    FILE *f = fopen(file_name, "wb");
+    int row_size = (width * 3 + 3) & ~3;
+    int height = width;
+
+    fputc('B', f); fputc('M', f);
+    put32(f, 54 + row_size * height); put32(f, 0); put32(f, 54);
+    put32(f, 40); put32(f, width); put32(f, height);
+    put16(f, 1); put16(f, 24);
+    put32(f, 0); put32(f, row_size * height);
+    put32(f, 2835); put32(f, 2835); put32(f, 0); put32(f, 0);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            fputc((x + seed) & 0xff, f);
+            fputc((y * 2 + seed) & 0xff, f);
+            fputc(((x + y) / 4 + seed * 7) & 0xff, f);
+        }
+        for (int pad = width * 3; pad < row_size; pad++)
+            fputc(0, f);
+    }
+    fclose(f);
+}
+
+/**
+ * Write a picture with a PNG signature and random content, which the
+ * store recognizes as already compressed and keeps raw.
+ */
+static void write_png_like(const char *file_name, int size, unsigned seed)
+{
+    FILE *f = fopen(file_name, "wb");
+
+    srand(seed);
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, f);
+    for (int i = 8; i < size; i++)
+        fputc(rand() & 0xff, f);
+    fclose(f);
+}
+
+static long file_size(const char *file_name)
+{
+    struct stat st;
+    return stat(file_name, &st) == 0 ? (long) st.st_size : 0;
+}
+
+static void run(const char *label, bool compress, const std::vector<std::string> &files)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    PhoneBook::PictureStats stats;
+    std::vector<db_uint> ids;
+
+    remove(BENCH_DATABASE);
+    if (DB_FAILED(pbook.create_database(db::DB_FILE_STORAGE, BENCH_DATABASE)))
+        exit(1);
+    pbook.set_picture_compression(compress);
+
+    Clock::time_point start = Clock::now();
+    pbook.tx_start();
+    for (size_t i = 0; i < files.size(); i++)
+        ids.push_back(pbook.insert_contact(L"Bench", 0, files[i].c_str()));
+    pbook.tx_commit();
+    double insert_time = seconds_since(start);
+
+    pbook.tx_start();
+    pbook.get_picture_stats(stats);
+    pbook.tx_commit();
+
+    start = Clock::now();
+    pbook.tx_start();
+    for (size_t i = 0; i < ids.size(); i++)
+        pbook.export_picture(ids[i], BENCH_EXPORT);
+    pbook.tx_commit();
+    double export_time = seconds_since(start);
+
+    pbook.close_database();
+
+    double mb = stats.logical_bytes / (1024.0 * 1024.0);
+    printf("%-12s %12lu %12lu %7.1f%% %12ld %10.1f %10.1f\n", label,
+           (unsigned long) stats.logical_bytes, (unsigned long) stats.stored_bytes,
+           100.0 * stats.stored_bytes / (stats.logical_bytes ? stats.logical_bytes : 1),
+           file_size(BENCH_DATABASE), mb / insert_time, mb / export_time);
+}
+
+int main(int argc, char *argv[])
+{
+    int pictures = argc > 1 ? atoi(argv[1]) : 200;
+    int width = argc > 2 ? atoi(argv[2]) : 256;
+    std::vector<std::string> bitmaps, pngs;
+    char file_name[64];
+
+    for (int i = 0; i < pictures; i++) {
+        sprintf(file_name, "bench_picture_%d.bmp", i);
+        write_bitmap(file_name, width, i);
+        bitmaps.push_back(file_name);
+
+        sprintf(file_name, "bench_picture_%d.png", i);
+        write_png_like(file_name, width * width * 3 / 4, i);
+        pngs.push_back(file_name);
+    }
+
+    printf("%d distinct pictures per run\n\n", pictures);
+    printf("%-12s %12s %12s %8s %12s %10s %10s\n", "mode", "logical", "stored",
+           "ratio", "db file", "ins MB/s", "exp MB/s");
+
+    run("bmp raw", false, bitmaps);
+    run("bmp packed", true, bitmaps);
+    run("png raw", false, pngs);
+    run("png packed", true, pngs);
+
+    for (int i = 0; i < pictures; i++) {
+        remove(bitmaps[i].c_str());
+        remove(pngs[i].c_str());
+    }
+    remove(BENCH_EXPORT);
+    remove(BENCH_DATABASE);
+
+    return 0;
+}
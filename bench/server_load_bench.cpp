@@ -0,0 +1,441 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Load test of ITTIA DB Server with many client processes
+ *
+ * Forks the client processes first, so that none inherits the server's
+ * threads, then starts ITTIA DB Server in this process and fills a phone
+ * book through it. For 1, 2, 4, ... clients up to the maximum, each client
+ * runs a mix of contact lookups, inserts, renames and removals over a
+ * connection of its own, one transaction per operation. Reports
+ * throughput, latency percentiles, and the lock timeouts and deadlocks
+ * the clients saw, as the number of clients grows. POSIX only.
+ *
+ * Usage: server_load_bench [-c clients] [-n operations] [-k contacts]
+ *                          [-m lookup,insert,rename,remove] [-d database]
+ *
+ *   -c  most client processes (default 8)
+ *   -n  operations per client in each run (default 2000)
+ *   -k  contacts in the phone book before the first run (default 10000)
+ *   -m  relative weights of the operations (default 70,10,15,5)
+ *   -d  database name (default DATABASE_NAME_SERVER)
+ */
+
+#include "phonebook.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+/* Contacts inserted per transaction while filling the database. */
+#define BENCH_BATCH             1000
+#define BENCH_CLIENTS           8
+#define BENCH_OPERATIONS        2000
+#define BENCH_CONTACTS          10000
+
+typedef std::chrono::steady_clock Clock;
+
+enum Operation { LOOKUP, INSERT, RENAME, REMOVE, OPERATION_COUNT };
+
+static const char *const operation_names[OPERATION_COUNT] = { "lookup", "insert", "rename", "remove" };
+
+/**
+ * Sent to a client to start a run. A run of no operations tells the client
+ * to exit.
+ */
+struct RunCommand {
+    long operations;
+    unsigned seed;
+    int weights[OPERATION_COUNT];
+    /* Contact ids to look up, rename and remove */
+    db_uint first_id;
+    db_uint last_id;
+};
+
+/**
+ * Sent back by a client at the end of a run, followed by the latency of
+ * each operation in microseconds.
+ */
+struct RunResult {
+    int rc;
+    long operations[OPERATION_COUNT];
+    /* Errors reported during the run */
+    PhoneBook::ErrorCounts errors;
+};
+
+/**
+ * A forked client and the pipes to it.
+ */
+struct Client {
+    pid_t pid;
+    int commands;
+    int results;
+};
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    const char *p = (const char *) data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= (size_t) n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t size)
+{
+    char *p = (char *) data;
+
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= (size_t) n;
+    }
+    return true;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[(size_t) (p / 100 * (sorted.size() - 1) + 0.5)];
+}
+
+/**
+ * Run one mix of operations on a client's connection.
+ */
+static void run_operations(PhoneBook &pbook, const RunCommand &command, int client,
+    std::vector<db_uint> &inserted, RunResult &result, std::vector<double> &latencies)
+{
+    std::minstd_rand random(command.seed);
+    std::uniform_int_distribution<db_uint> pick_id(command.first_id, command.last_id);
+    int total = 0;
+    wchar_t name[32];
+    char number[32];
+
+    for (int op = 0; op < OPERATION_COUNT; op++)
+        total += command.weights[op];
+    std::uniform_int_distribution<int> pick_operation(0, total - 1);
+
+    for (long i = 0; i < command.operations; i++) {
+        int choice = pick_operation(random);
+        int op = 0;
+        db_uint id = pick_id(random);
+
+        while (choice >= command.weights[op])
+            choice -= command.weights[op++];
+
+        Clock::time_point start = Clock::now();
+        pbook.tx_start();
+        switch (op) {
+            case LOOKUP:
+                pbook.get_picture_name(id);
+                break;
+            case INSERT:
+                swprintf(name, sizeof name / sizeof name[0], L"Client %d-%ld", client, i);
+                sprintf(number, "206-555-%04ld", i % 10000);
+                id = pbook.insert_contact(name, i % 8, NULL);
+                pbook.insert_phone_number(id, number, PhoneBook::MOBILE, -1);
+                inserted.push_back(id);
+                break;
+            case RENAME:
+                swprintf(name, sizeof name / sizeof name[0], L"Renamed %d-%ld", client, i);
+                pbook.update_contact_name(id, name);
+                break;
+            case REMOVE:
+                // Prefer the client's own contacts, which no other client removes
+                if (!inserted.empty()) {
+                    id = inserted.back();
+                    inserted.pop_back();
+                }
+                pbook.remove_contact(id);
+                break;
+        }
+        pbook.tx_commit();
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        result.operations[op]++;
+    }
+}
+
+/**
+ * Client process: run the mix of operations each command asks for over a
+ * connection of its own, until told to exit.
+ */
+static int client_main(int client, const char *database_name, int commands, int results)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    std::vector<db_uint> inserted;
+    std::vector<double> latencies;
+    RunCommand command;
+    bool opened = false;
+
+    while (read_all(commands, &command, sizeof command) && command.operations > 0) {
+        PhoneBook::ErrorCounts before, after;
+        RunResult result;
+        size_t samples;
+
+        memset(&result, 0, sizeof result);
+        latencies.clear();
+
+        // The server is only started after the clients are forked
+        if (!opened) {
+            result.rc = pbook.open_database(db::DB_FILE_STORAGE, database_name);
+            opened = DB_SUCCESS(result.rc);
+        }
+        if (opened) {
+            PhoneBook::get_error_counts(before);
+            run_operations(pbook, command, client, inserted, result, latencies);
+            PhoneBook::get_error_counts(after);
+            result.errors.lock_timeouts = after.lock_timeouts - before.lock_timeouts;
+            result.errors.deadlocks = after.deadlocks - before.deadlocks;
+            result.errors.other = after.other - before.other;
+        }
+
+        samples = latencies.size();
+        if (!write_all(results, &result, sizeof result) ||
+            !write_all(results, &samples, sizeof samples) ||
+            !write_all(results, latencies.data(), samples * sizeof(double)))
+            break;
+    }
+
+    if (opened)
+        pbook.close_database();
+    return 0;
+}
+
+/**
+ * Fork a client process, connected to this one by a pipe each way.
+ */
+static bool start_client(int client, const char *database_name, Client &started)
+{
+    int commands[2];
+    int results[2];
+
+    if (pipe(commands) != 0)
+        return false;
+    if (pipe(results) != 0) {
+        close(commands[0]);
+        close(commands[1]);
+        return false;
+    }
+
+    fflush(stdout);
+    started.pid = fork();
+    if (started.pid == 0) {
+        close(commands[1]);
+        close(results[0]);
+        _exit(client_main(client, database_name, commands[0], results[1]));
+    }
+
+    close(commands[0]);
+    close(results[1]);
+    started.commands = commands[1];
+    started.results = results[0];
+    if (started.pid < 0) {
+        close(started.commands);
+        close(started.results);
+        return false;
+    }
+    return true;
+}
+
+static void stop_clients(std::vector<Client> &clients)
+{
+    RunCommand command;
+
+    memset(&command, 0, sizeof command);
+    for (size_t i = 0; i < clients.size(); i++) {
+        write_all(clients[i].commands, &command, sizeof command);
+        close(clients[i].commands);
+        close(clients[i].results);
+    }
+    for (size_t i = 0; i < clients.size(); i++)
+        waitpid(clients[i].pid, NULL, 0);
+}
+
+static int usage()
+{
+    fprintf(stderr, "Usage: server_load_bench [-c clients] [-n operations] [-k contacts]\n"
+                    "                         [-m lookup,insert,rename,remove] [-d database]\n");
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_clients = BENCH_CLIENTS;
+    long operations = BENCH_OPERATIONS;
+    long contacts = BENCH_CONTACTS;
+    int weights[OPERATION_COUNT] = { 70, 10, 15, 5 };
+    const char *database_name = DATABASE_NAME_SERVER;
+    std::vector<Client> clients;
+    wchar_t name[32];
+    char number[32];
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            max_clients = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            operations = atol(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+            contacts = atol(argv[++i]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &weights[LOOKUP], &weights[INSERT],
+                       &weights[RENAME], &weights[REMOVE]) != OPERATION_COUNT)
+                return usage();
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            database_name = argv[++i];
+        else
+            return usage();
+    }
+    if (max_clients < 1 || operations < 1 || contacts < 1)
+        return usage();
+    for (int op = 0; op < OPERATION_COUNT; op++) {
+        if (weights[op] < 0)
+            return usage();
+    }
+    if (weights[LOOKUP] + weights[INSERT] + weights[RENAME] + weights[REMOVE] == 0)
+        return usage();
+
+    //-------------------------------------------------------------------
+    // Fork every client before the server starts any threads
+    //-------------------------------------------------------------------
+    for (int i = 0; i < max_clients; i++) {
+        Client client;
+
+        if (!start_client(i, database_name, client)) {
+            fprintf(stderr, "Cannot start client %d\n", i);
+            stop_clients(clients);
+            return 1;
+        }
+        clients.push_back(client);
+    }
+
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+
+    if (DB_FAILED(db_server_start(NULL)) ||
+        DB_FAILED(pbook.create_database(db::DB_FILE_STORAGE, database_name))) {
+        stop_clients(clients);
+        return 1;
+    }
+
+    for (long i = 0; i < contacts; i++) {
+        if (i % BENCH_BATCH == 0)
+            pbook.tx_start();
+        swprintf(name, sizeof name / sizeof name[0], L"Contact %ld", i);
+        db_uint id = pbook.insert_contact(name, i % 8, NULL);
+        sprintf(number, "206-555-%04ld", i % 10000);
+        pbook.insert_phone_number(id, number, PhoneBook::HOME, -1);
+        if (i % BENCH_BATCH == BENCH_BATCH - 1 || i == contacts - 1)
+            pbook.tx_commit();
+    }
+
+    printf("%ld contacts, %ld operations per client, mix %s %d, %s %d, %s %d, %s %d\n\n",
+           contacts, operations,
+           operation_names[LOOKUP], weights[LOOKUP], operation_names[INSERT], weights[INSERT],
+           operation_names[RENAME], weights[RENAME], operation_names[REMOVE], weights[REMOVE]);
+    printf("%8s %10s %9s %9s %9s %9s %9s %9s %9s\n", "clients", "ops/s",
+           "p50 us", "p90 us", "p99 us", "max us", "lock t/o", "deadlock", "other");
+
+    for (int active = 1; active <= max_clients; active *= 2) {
+        std::vector<double> latencies;
+        PhoneBook::ErrorCounts errors = { 0, 0, 0 };
+        long total = 0;
+        RunCommand command;
+        bool failed = false;
+
+        memset(&command, 0, sizeof command);
+        command.operations = operations;
+        memcpy(command.weights, weights, sizeof weights);
+        pbook.tx_start_snapshot();
+        pbook.get_contact_id_range(command.first_id, command.last_id);
+        pbook.tx_commit();
+
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < active; i++) {
+            command.seed = (unsigned) (active * max_clients + i + 1);
+            if (!write_all(clients[i].commands, &command, sizeof command))
+                failed = true;
+        }
+        for (int i = 0; i < active && !failed; i++) {
+            RunResult result;
+            size_t samples;
+
+            if (!read_all(clients[i].results, &result, sizeof result) ||
+                !read_all(clients[i].results, &samples, sizeof samples)) {
+                failed = true;
+                break;
+            }
+            size_t offset = latencies.size();
+            latencies.resize(offset + samples);
+            if (!read_all(clients[i].results, latencies.data() + offset, samples * sizeof(double)) ||
+                DB_FAILED(result.rc)) {
+                failed = true;
+                break;
+            }
+            for (int op = 0; op < OPERATION_COUNT; op++)
+                total += result.operations[op];
+            errors.lock_timeouts += result.errors.lock_timeouts;
+            errors.deadlocks += result.errors.deadlocks;
+            errors.other += result.errors.other;
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        if (failed) {
+            printf("%8d client failed\n", active);
+            break;
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        printf("%8d %10.0f %9.0f %9.0f %9.0f %9.0f %9lu %9lu %9lu\n", active, total / seconds,
+               percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+               latencies.back(), (unsigned long) errors.lock_timeouts,
+               (unsigned long) errors.deadlocks, (unsigned long) errors.other);
+    }
+
+    stop_clients(clients);
+    pbook.close_database();
+    return 0;
+}
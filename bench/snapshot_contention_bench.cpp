@@ -0,0 +1,207 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Benchmark of writer latency during full exports
+ *
+ * Starts ITTIA DB Server in this process and fills a phone book through
+ * the IPC client protocol. A writer thread then renames contacts and adds
+ * phone numbers, one short transaction at a time, while a reader thread
+ * on a connection of its own scans every contact over and over: first
+ * with no reader, then in regular transactions and then in read-only
+ * snapshot transactions. Reports writer commit latency percentiles and
+ * the number of full scans each run completed.
+ *
+ * Usage: snapshot_contention_bench [contacts] [writes]
+ */
+
+#include "phonebook.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#define BENCH_DATABASE          "idb+tcp://localhost/bench_snapshot.db"
+/* Contacts inserted per transaction while filling the database. */
+#define BENCH_BATCH             1000
+
+typedef std::chrono::steady_clock Clock;
+
+enum ReaderMode { NO_READER, REGULAR_READER, SNAPSHOT_READER };
+
+static const char *const mode_names[] = { "no reader", "regular tx", "snapshot tx" };
+
+/**
+ * Discards the records of a scan, so only the reads are timed.
+ */
+class ScanVisitor : public PhoneBook::ChangeVisitor {
+public:
+    unsigned long records;
+
+    ScanVisitor() : records(0) {}
+
+    bool change(const PhoneBook::ChangeRecord &)
+    {
+        records++;
+        return true;
+    }
+};
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[(size_t) (p / 100 * (sorted.size() - 1) + 0.5)];
+}
+
+/**
+ * Scan the whole phone book until told to stop.
+ */
+static void reader_worker(ReaderMode mode, std::atomic<bool> *stop, long *scans, int *rc)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+
+    *rc = pbook.open_database(db::DB_FILE_STORAGE, BENCH_DATABASE);
+    if (DB_FAILED(*rc))
+        return;
+
+    while (!stop->load()) {
+        ScanVisitor visitor;
+
+        if (mode == SNAPSHOT_READER)
+            pbook.tx_start_snapshot();
+        else
+            pbook.tx_start();
+        pbook.visit_contacts(visitor);
+        pbook.tx_commit();
+        (*scans)++;
+    }
+    pbook.close_database();
+}
+
+/**
+ * Run the writer, with a reader in the given mode alongside.
+ *
+ * @return false on failure
+ */
+static bool run(ReaderMode mode, const std::vector<db_uint> &ids, long writes)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    std::vector<double> latencies;
+    std::atomic<bool> stop(false);
+    std::thread reader;
+    long scans = 0;
+    int reader_rc = DB_NOERROR;
+    wchar_t name[32];
+    char number[32];
+
+    if (DB_FAILED(pbook.open_database(db::DB_FILE_STORAGE, BENCH_DATABASE)))
+        return false;
+    if (mode != NO_READER) {
+        reader = std::thread(reader_worker, mode, &stop, &scans, &reader_rc);
+        // Let the first scan get under way
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    latencies.reserve(writes);
+    for (long i = 0; i < writes; i++) {
+        db_uint id = ids[(size_t) (i * 7919 % (long) ids.size())];
+
+        swprintf(name, sizeof name / sizeof name[0], L"Renamed %ld", i);
+        sprintf(number, "425-555-%04ld", i % 10000);
+
+        Clock::time_point start = Clock::now();
+        pbook.tx_start();
+        pbook.update_contact_name(id, name);
+        pbook.insert_phone_number(id, number, PhoneBook::WORK, -1);
+        pbook.tx_commit();
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+
+    stop = true;
+    if (reader.joinable())
+        reader.join();
+    pbook.close_database();
+    if (DB_FAILED(reader_rc))
+        return false;
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-12s %10.0f %10.0f %10.0f %10.0f %8ld\n", mode_names[mode],
+           percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+           latencies.back(), scans);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    long contacts = argc > 1 ? atol(argv[1]) : 20000;
+    long writes = argc > 2 ? atol(argv[2]) : 2000;
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    std::vector<db_uint> ids;
+    wchar_t name[32];
+    char number[32];
+
+    if (contacts < 1 || writes < 1)
+        return 2;
+    if (DB_FAILED(db_server_start(NULL)))
+        return 1;
+    if (DB_FAILED(pbook.create_database(db::DB_FILE_STORAGE, BENCH_DATABASE)))
+        return 1;
+    pbook.set_change_logging(false);
+
+    for (long i = 0; i < contacts; i++) {
+        if (i % BENCH_BATCH == 0)
+            pbook.tx_start();
+        swprintf(name, sizeof name / sizeof name[0], L"Contact %ld", i);
+        ids.push_back(pbook.insert_contact(name, i % 8, NULL));
+        sprintf(number, "206-555-%04ld", i % 10000);
+        pbook.insert_phone_number(ids.back(), number, PhoneBook::HOME, -1);
+        if (i % BENCH_BATCH == BENCH_BATCH - 1 || i == contacts - 1)
+            pbook.tx_commit();
+    }
+    pbook.close_database();
+
+    printf("%ld contacts, %ld writes\n\n", contacts, writes);
+    printf("%-12s %10s %10s %10s %10s %8s\n", "reader", "p50 us", "p90 us", "p99 us", "max us", "scans");
+
+    for (int mode = NO_READER; mode <= SNAPSHOT_READER; mode++) {
+        if (!run((ReaderMode) mode, ids, writes)) {
+            printf("%-12s failed\n", mode_names[mode]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,427 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Replay of a recorded PhoneBook workload
+ *
+ * Reads a trace written by PhoneBookRecorder and replays every call
+ * against a phone book database from one or more threads, each with its
+ * own connection, either at the pace the calls were recorded or as fast
+ * as possible. Contact and group ids returned by recorded inserts are
+ * mapped to the ids the replay creates. Reports throughput and latency
+ * percentiles for each method, next to the latencies in the trace, so
+ * builds and data access layers can be compared on the same traffic.
+ *
+ * Usage: trace_replay [-t threads] [-f] [-c] [-m] [-d database] trace_file
+ *
+ *   -t  number of threads, each replaying the whole trace (default 1)
+ *   -f  replay as fast as possible instead of at the recorded pace
+ *   -c  create an empty database before replaying
+ *   -m  use memory storage
+ */
+
+#include "phonebook.h"
+#include "phonebook_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define REPLAY_DATABASE         "phone_book.db"
+
+typedef std::chrono::steady_clock Clock;
+
+struct ReplayOptions {
+    const char *trace_file;
+    const char *database_name;
+    int file_mode;
+    int threads;
+    bool fast;
+};
+
+/**
+ * Latencies of one thread, in microseconds, by method
+ */
+struct ReplayResult {
+    std::vector<double> latencies[TRACE_OP_COUNT];
+    int rc;
+};
+
+class CountingVisitor : public PhoneBook::ChangeVisitor {
+public:
+    db_uint count;
+
+    CountingVisitor() : count(0) {}
+
+    bool change(const PhoneBook::ChangeRecord &)
+    {
+        count++;
+        return true;
+    }
+};
+
+/**
+ * Maps ids in the trace to the ids created by the replay. Ids the replay
+ * did not create are used as recorded.
+ */
+class IdMap {
+private:
+    std::unordered_map<db_uint, db_uint> ids;
+
+public:
+    void add(db_uint recorded, db_uint replayed)
+    {
+        if (recorded != 0 && replayed != 0)
+            ids[recorded] = replayed;
+    }
+
+    db_uint operator()(db_uint recorded) const
+    {
+        std::unordered_map<db_uint, db_uint>::const_iterator i = ids.find(recorded);
+        return i != ids.end() ? i->second : recorded;
+    }
+};
+
+/**
+ * Make one recorded call.
+ */
+static void replay_call(PhoneBook &pbook, const TraceCall &call, IdMap &contact_ids,
+    IdMap &group_ids, FILE *scratch)
+{
+    PhoneBook::ContactResults results;
+    PhoneBook::PictureStats picture_stats;
+    PhoneBook::Stats stats;
+    PhoneBook::ChangeRecord record;
+    CountingVisitor visitor;
+    ContactBitmap contacts;
+    db_uint first_id, last_id;
+    db_uint count;
+
+    switch (call.op) {
+        case TRACE_INSERT_CONTACT:
+            contact_ids.add(call.uints[4], pbook.insert_contact(call.wstrings[0], call.uints[1],
+                call.strings[2], call.strings[3]));
+            break;
+        case TRACE_INSERT_PHONE_NUMBER:
+            pbook.insert_phone_number(contact_ids(call.uints[0]), call.strings[1],
+                (PhoneBook::PhoneNumberType) call.uints[2], call.sints[3]);
+            break;
+        case TRACE_UPDATE_CONTACT_NAME:
+            pbook.update_contact_name(contact_ids(call.uints[0]), call.wstrings[1]);
+            break;
+        case TRACE_UPDATE_CONTACT_PICTURE:
+            pbook.update_contact_picture(contact_ids(call.uints[0]), call.strings[1]);
+            break;
+        case TRACE_REMOVE_CONTACT:
+            pbook.remove_contact(contact_ids(call.uints[0]));
+            break;
+        case TRACE_LIST_CONTACTS_BRIEF:
+        case TRACE_GET_CONTACTS_BRIEF:
+            // Results are read but not printed
+            pbook.get_contacts_brief(results);
+            break;
+        case TRACE_LIST_CONTACTS:
+        case TRACE_GET_CONTACTS:
+            pbook.get_contacts((int) call.sints[0], results);
+            break;
+        case TRACE_GET_PICTURE_NAME:
+            pbook.get_picture_name(contact_ids(call.uints[0]));
+            break;
+        case TRACE_EXPORT_PICTURE:
+            rewind(scratch);
+            pbook.export_picture(contact_ids(call.uints[0]), scratch);
+            break;
+        case TRACE_GET_PICTURE_STATS:
+            pbook.get_picture_stats(picture_stats);
+            break;
+        case TRACE_SET_PICTURE_COMPRESSION:
+            pbook.set_picture_compression(call.uints[0] != 0);
+            break;
+        case TRACE_CHANGES_SINCE:
+            pbook.changes_since(call.uints[0], visitor);
+            break;
+        case TRACE_COMPACT_CHANGE_LOG:
+            pbook.compact_change_log(call.uints[0]);
+            break;
+        case TRACE_LAST_CHANGE_SEQ:
+            pbook.last_change_seq();
+            break;
+        case TRACE_SET_CHANGE_LOGGING:
+            pbook.set_change_logging(call.uints[0] != 0);
+            break;
+        case TRACE_SET_ID_BLOCK_SIZE:
+            pbook.set_id_block_size((unsigned) call.uints[0]);
+            break;
+        case TRACE_SET_MEMORY_STORAGE_SIZE:
+            pbook.set_memory_storage_size(call.uints[0]);
+            break;
+        case TRACE_GET_CONTACT_ID_RANGE:
+            pbook.get_contact_id_range(first_id, last_id);
+            break;
+        case TRACE_VISIT_CONTACTS:
+            pbook.visit_contacts(visitor, call.uints[0], call.uints[1]);
+            break;
+        case TRACE_FIND_PHONE_NUMBERS:
+            pbook.find_phone_numbers(call.strings[0], visitor);
+            break;
+        case TRACE_SEARCH_BY_NUMBER_SUFFIX:
+            pbook.search_by_number_suffix(call.strings[0], (size_t) call.uints[1], visitor);
+            break;
+        case TRACE_APPLY_CHANGE:
+            record.seq = call.uints[0];
+            record.type = (PhoneBook::ChangeType) call.uints[1];
+            record.contact_id = call.uints[2];
+            record.name = call.wstrings[3];
+            record.ring_id = call.uints[4];
+            record.picture_name = call.strings[5];
+            record.picture_file = NULL;
+            record.number = call.strings[6];
+            record.number_type = (PhoneBook::PhoneNumberType) call.uints[7];
+            record.speed_dial = call.sints[8];
+            record.group_id = call.uints[9];
+            pbook.apply_change(record);
+            break;
+        case TRACE_CREATE_GROUP:
+            group_ids.add(call.uints[1], pbook.create_group(call.wstrings[0]));
+            break;
+        case TRACE_ADD_TO_GROUP:
+            pbook.add_to_group(contact_ids(call.uints[0]), group_ids(call.uints[1]));
+            break;
+        case TRACE_REMOVE_FROM_GROUP:
+            pbook.remove_from_group(contact_ids(call.uints[0]), group_ids(call.uints[1]));
+            break;
+        case TRACE_GET_GROUP_MEMBERS:
+            pbook.get_group_members(group_ids(call.uints[0]), contacts);
+            break;
+        case TRACE_GET_CONTACTS_WITH_NUMBER_TYPE:
+            pbook.get_contacts_with_number_type((PhoneBook::PhoneNumberType) call.uints[0], contacts);
+            break;
+        case TRACE_GET_CONTACTS_BY_ID:
+            for (db_uint id = 0; call.contacts.find_next(id); id++)
+                contacts.add(contact_ids(id));
+            pbook.get_contacts(contacts, results);
+            break;
+        case TRACE_GET_GROUP_CONTACTS:
+            pbook.get_group_contacts(group_ids(call.uints[0]), (int) call.sints[1], results);
+            break;
+        case TRACE_GET_STATS:
+            pbook.get_stats(stats);
+            break;
+        case TRACE_GET_RING_ID_CONTACTS:
+            pbook.get_ring_id_contacts(call.uints[0], count);
+            break;
+        case TRACE_VERIFY_STATS:
+            pbook.verify_stats(count);
+            break;
+        case TRACE_TX_START:
+            pbook.tx_start();
+            break;
+        case TRACE_TX_START_SNAPSHOT:
+            pbook.tx_start_snapshot();
+            break;
+        case TRACE_TX_COMMIT:
+            pbook.tx_commit();
+            break;
+        case TRACE_VISIT_GROUPS:
+            pbook.visit_groups(visitor);
+            break;
+        case TRACE_OP_COUNT:
+            break;
+    }
+}
+
+/**
+ * Replay the whole trace on a connection of its own.
+ */
+static void replay_thread(const ReplayOptions *options, Clock::time_point origin,
+    ReplayResult *result)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    TraceReader reader;
+    TraceCall call;
+    IdMap contact_ids;
+    IdMap group_ids;
+    FILE *scratch = tmpfile();
+
+    if (DB_FAILED(result->rc = pbook.open_database(options->file_mode, options->database_name)))
+        return;
+    if (DB_FAILED(result->rc = reader.open(options->trace_file))) {
+        pbook.close_database();
+        return;
+    }
+
+    while (reader.next(call)) {
+        if (!options->fast)
+            std::this_thread::sleep_until(origin + std::chrono::microseconds(call.start_us));
+
+        Clock::time_point start = Clock::now();
+        replay_call(pbook, call, contact_ids, group_ids, scratch);
+        result->latencies[call.op].push_back(
+            std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+
+    reader.close();
+    pbook.close_database();
+    if (scratch != NULL)
+        fclose(scratch);
+}
+
+/* Percentile of sorted values, by the nearest rank. */
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[(size_t) (p / 100 * (sorted.size() - 1) + 0.5)];
+}
+
+static void print_row(const char *name, std::vector<double> &recorded, std::vector<double> &replayed)
+{
+    std::sort(recorded.begin(), recorded.end());
+    std::sort(replayed.begin(), replayed.end());
+
+    printf("%-30s %9lu %9.0f %9.0f | %9.0f %9.0f %9.0f %9.0f %9.0f\n", name,
+           (unsigned long) replayed.size(),
+           percentile(recorded, 50), percentile(recorded, 99),
+           percentile(replayed, 50), percentile(replayed, 90), percentile(replayed, 99),
+           percentile(replayed, 99.9), replayed.empty() ? 0.0 : replayed.back());
+}
+
+static int usage()
+{
+    fprintf(stderr, "Usage: trace_replay [-t threads] [-f] [-c] [-m] [-d database] trace_file\n");
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    ReplayOptions options;
+    std::vector<double> recorded[TRACE_OP_COUNT];
+    std::vector<double> all_recorded;
+    std::vector<double> all_replayed;
+    bool create = false;
+    db_uint trace_us = 0;
+    size_t calls = 0;
+
+    options.trace_file = NULL;
+    options.database_name = REPLAY_DATABASE;
+    options.file_mode = db::DB_FILE_STORAGE;
+    options.threads = 1;
+    options.fast = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            options.threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            options.database_name = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0)
+            options.fast = true;
+        else if (strcmp(argv[i], "-c") == 0)
+            create = true;
+        else if (strcmp(argv[i], "-m") == 0)
+            options.file_mode = db::DB_MEMORY_STORAGE;
+        else if (argv[i][0] != '-' && options.trace_file == NULL)
+            options.trace_file = argv[i];
+        else
+            return usage();
+    }
+    if (options.trace_file == NULL || options.threads < 1)
+        return usage();
+
+    // Read the recorded latencies, and check the trace before replaying it
+    TraceReader reader;
+    TraceCall call;
+
+    if (DB_FAILED(reader.open(options.trace_file))) {
+        fprintf(stderr, "Cannot read trace %s\n", options.trace_file);
+        return 1;
+    }
+    while (reader.next(call)) {
+        recorded[call.op].push_back((double) call.duration_us);
+        all_recorded.push_back((double) call.duration_us);
+        trace_us = call.start_us + call.duration_us;
+        calls++;
+    }
+    reader.close();
+
+    // Memory storage lives only as long as a connection holding it open
+    std::unique_ptr<PhoneBook> owner_book(PhoneBook::create());
+    PhoneBook &owner = *owner_book;
+    int rc = create ? owner.create_database(options.file_mode, options.database_name)
+                    : owner.open_database(options.file_mode, options.database_name);
+    if (DB_FAILED(rc)) {
+        fprintf(stderr, "Cannot open database %s\n", options.database_name);
+        return 1;
+    }
+
+    std::vector<ReplayResult> results(options.threads);
+    std::vector<std::thread> threads;
+    Clock::time_point origin = Clock::now();
+
+    for (int i = 0; i < options.threads; i++)
+        threads.push_back(std::thread(replay_thread, &options, origin, &results[i]));
+    for (int i = 0; i < options.threads; i++)
+        threads[i].join();
+    double seconds = std::chrono::duration<double>(Clock::now() - origin).count();
+
+    owner.close_database();
+
+    for (int i = 0; i < options.threads; i++) {
+        if (DB_FAILED(results[i].rc)) {
+            fprintf(stderr, "Thread %d could not replay the trace: error %d\n", i, results[i].rc);
+            return 1;
+        }
+    }
+
+    printf("%lu calls recorded over %.3f s; %d thread%s, %s\n\n", (unsigned long) calls,
+           trace_us / 1e6, options.threads, options.threads == 1 ? "" : "s",
+           options.fast ? "as fast as possible" : "at the recorded pace");
+    printf("%-30s %9s %9s %9s | %9s %9s %9s %9s %9s\n", "latency (us)", "calls",
+           "rec p50", "rec p99", "p50", "p90", "p99", "p99.9", "max");
+
+    for (int op = 0; op < TRACE_OP_COUNT; op++) {
+        std::vector<double> replayed;
+
+        for (int i = 0; i < options.threads; i++)
+            replayed.insert(replayed.end(), results[i].latencies[op].begin(),
+                            results[i].latencies[op].end());
+        if (replayed.empty())
+            continue;
+        all_replayed.insert(all_replayed.end(), replayed.begin(), replayed.end());
+        print_row(trace_op_names[op], recorded[op], replayed);
+    }
+    print_row("all", all_recorded, all_replayed);
+
+    printf("\n%.3f s, %.0f calls/s\n", seconds, all_replayed.size() / seconds);
+
+    return 0;
+}
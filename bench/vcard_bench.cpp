@@ -0,0 +1,197 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Benchmark of vCard scanning, parsing and import throughput
+ *
+ * Writes a vCard file of the requested size, with a small picture on one
+ * card in ten, then reports MB/s for: finding line breaks with the
+ * vectorized scanner and with a byte-at-a-time loop; parsing every card
+ * without storing it; and, unless disabled, importing the file into a
+ * file storage phone book. Pass a size of several thousand megabytes to
+ * measure multi-GB files.
+ *
+ * Usage: vcard_bench [megabytes] [import (0 or 1)]
+ */
+
+#include "phonebook.h"
+#include "phonebook_vcard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <memory>
+
+#define BENCH_VCARDS            "bench_vcards.vcf"
+#define BENCH_DATABASE          "bench_vcards.db"
+#define BENCH_PHOTO             "bench_vcards_photo.tmp"
+#define BENCH_BLOCK             (1024 * 1024)
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * Write cards until the file reaches the requested size.
+ */
+static double write_vcards(const char *file_name, double megabytes)
+{
+    FILE *f = fopen(file_name, "wb");
+    long long target = (long long) (megabytes * 1024 * 1024);
+    long long written = 0;
+    char photo[4 * 700 + 1];
+
+    // A ~2 KiB picture, base64 encoded and folded as an exporter would
+    for (int i = 0; i < 4 * 700; i++)
+        photo[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(i * 37) % 64];
+    photo[4 * 700] = '\0';
+
+    for (long i = 0; written < target; i++) {
+        written += fprintf(f,
+            "BEGIN:VCARD\r\n"
+            "VERSION:3.0\r\n"
+            "FN:Contact %ld\r\n"
+            "N:;Contact %ld;;;\r\n"
+            "X-PHONEBOOK-RING-ID:%ld\r\n"
+            "TEL;TYPE=HOME:206-555-%04ld\r\n"
+            "TEL;TYPE=CELL;X-SPEED-DIAL=%ld:425-555-%04ld\r\n",
+            i, i, i % 8, i % 10000, i % 10, (i * 7) % 10000);
+        if (i % 10 == 0) {
+            written += fprintf(f, "X-PHONEBOOK-PICTURE:photo%ld.png\r\nPHOTO;ENCODING=b;TYPE=PNG:", i);
+            for (int p = 0; p < 4 * 700; p += 74)
+                written += fprintf(f, "%s%.74s\r\n", p ? " " : "", photo + p);
+        }
+        written += fprintf(f, "END:VCARD\r\n");
+    }
+    fclose(f);
+    return written / (1024.0 * 1024.0);
+}
+
+/**
+ * Count lines of a file with the given scanner.
+ */
+static long scan_lines(const char *file_name, bool vectorized)
+{
+    FILE *f = fopen(file_name, "rb");
+    static char block[BENCH_BLOCK];
+    long lines = 0;
+    size_t n;
+
+    while ((n = fread(block, 1, sizeof block, f)) > 0) {
+        const char *end = block + n;
+
+        if (vectorized) {
+            for (const char *p = vcard_find_line_end(block, end); p != end;
+                 p = vcard_find_line_end(p + 1, end))
+                lines++;
+        } else {
+            for (const char *p = block; p != end; p++)
+                lines += *p == '\n';
+        }
+    }
+    fclose(f);
+    return lines;
+}
+
+/**
+ * Counts cards without storing them.
+ */
+class CardCounter : public VCardHandler {
+public:
+    long cards;
+    long numbers;
+
+    CardCounter() : cards(0), numbers(0) {}
+
+    bool card(const VCard &card)
+    {
+        cards++;
+        numbers += card.number_count;
+        return true;
+    }
+};
+
+static void report(const char *label, double megabytes, double seconds)
+{
+    printf("%-24s %10.1f MB/s\n", label, megabytes / seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    double megabytes = argc > 1 ? atof(argv[1]) : 256;
+    bool import = argc > 2 ? atoi(argv[2]) != 0 : true;
+
+    double size = write_vcards(BENCH_VCARDS, megabytes);
+    printf("%.1f MB of vCards\n\n", size);
+
+    // Read once so every measurement starts from the page cache
+    scan_lines(BENCH_VCARDS, false);
+
+    Clock::time_point start = Clock::now();
+    long lines = scan_lines(BENCH_VCARDS, false);
+    report("line scan, bytewise", size, seconds_since(start));
+
+    start = Clock::now();
+    if (scan_lines(BENCH_VCARDS, true) != lines)
+        printf("line counts differ\n");
+    report("line scan, vectorized", size, seconds_since(start));
+
+    CardCounter counter;
+    FILE *in = fopen(BENCH_VCARDS, "rb");
+    VCardParser parser(in, BENCH_PHOTO);
+    start = Clock::now();
+    parser.parse(counter);
+    report("parse", size, seconds_since(start));
+    fclose(in);
+    printf("%ld cards, %ld phone numbers\n", counter.cards, counter.numbers);
+
+    if (import) {
+        std::unique_ptr<PhoneBook> book(PhoneBook::create());
+        PhoneBook &pbook = *book;
+        db_uint imported;
+
+        remove(BENCH_DATABASE);
+        if (DB_FAILED(pbook.create_database(db::DB_FILE_STORAGE, BENCH_DATABASE)))
+            return 1;
+
+        in = fopen(BENCH_VCARDS, "rb");
+        start = Clock::now();
+        import_vcards(pbook, in, BENCH_PHOTO, &imported);
+        report("import", size, seconds_since(start));
+        fclose(in);
+
+        pbook.close_database();
+        remove(BENCH_DATABASE);
+    }
+
+    remove(BENCH_PHOTO);
+    remove(BENCH_VCARDS);
+
+    return 0;
+}
@@ -0,0 +1,733 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Compressed bitmaps of contact ids
+ */
+
+#include "contact_bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/* 64-bit words in a bitmap chunk */
+#define BITMAP_WORDS            ((1u << BITMAP_CHUNK_BITS) / 64)
+/* A bitmap chunk that shrinks to this many ids goes back to an array. */
+#define BITMAP_MIN_BITMAP       (BITMAP_MAX_ARRAY / 2)
+/* Array entries allocated for a new chunk */
+#define BITMAP_INITIAL_ARRAY    4
+
+static inline unsigned popcount64(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned) __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (unsigned) ((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static inline unsigned lowest_bit64(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned) __builtin_ctzll(v);
+#elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return (unsigned) index;
+#else
+    unsigned n = 0;
+    while ((v & 1) == 0) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/**
+ * Find the first array entry not less than value.
+ */
+static unsigned lower_bound(const uint16_t *values, unsigned count, unsigned value)
+{
+    unsigned low = 0, high = count;
+
+    while (low < high) {
+        unsigned mid = (low + high) / 2;
+
+        if (values[mid] < value)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+//=======================================================================
+// Chunks
+//=======================================================================
+
+int ContactBitmap::chunk_to_bitmap(Chunk &chunk)
+{
+    uint64_t *words = (uint64_t *) calloc(BITMAP_WORDS, sizeof(uint64_t));
+    const uint16_t *values = (const uint16_t *) chunk.data;
+
+    if (words == NULL)
+        return DB_ENOMEM;
+    for (unsigned i = 0; i < chunk.cardinality; i++)
+        words[values[i] >> 6] |= (uint64_t) 1 << (values[i] & 63);
+
+    free(chunk.data);
+    chunk.data = words;
+    chunk.capacity = 0;
+    return DB_NOERROR;
+}
+
+/**
+ * Convert a sparse bitmap chunk back to an array. The chunk is left
+ * unchanged if out of memory.
+ */
+void ContactBitmap::chunk_to_array(Chunk &chunk)
+{
+    unsigned capacity = chunk.cardinality > BITMAP_INITIAL_ARRAY ? chunk.cardinality : BITMAP_INITIAL_ARRAY;
+    uint16_t *values = (uint16_t *) malloc(capacity * sizeof(uint16_t));
+    const uint64_t *words = (const uint64_t *) chunk.data;
+    unsigned n = 0;
+
+    if (values == NULL)
+        return;
+    for (unsigned w = 0; w < BITMAP_WORDS; w++) {
+        for (uint64_t bits = words[w]; bits != 0; bits &= bits - 1)
+            values[n++] = (uint16_t) (w * 64 + lowest_bit64(bits));
+    }
+
+    free(chunk.data);
+    chunk.data = values;
+    chunk.capacity = capacity;
+}
+
+int ContactBitmap::chunk_add(Chunk &chunk, unsigned offset)
+{
+    if (chunk.capacity == 0) {
+        uint64_t *words = (uint64_t *) chunk.data;
+        uint64_t bit = (uint64_t) 1 << (offset & 63);
+
+        if ((words[offset >> 6] & bit) == 0) {
+            words[offset >> 6] |= bit;
+            chunk.cardinality++;
+        }
+        return DB_NOERROR;
+    }
+
+    uint16_t *values = (uint16_t *) chunk.data;
+    unsigned i = lower_bound(values, chunk.cardinality, offset);
+
+    if (i < chunk.cardinality && values[i] == offset)
+        return DB_NOERROR;
+
+    if (chunk.cardinality == BITMAP_MAX_ARRAY) {
+        if (DB_FAILED(chunk_to_bitmap(chunk)))
+            return DB_ENOMEM;
+        return chunk_add(chunk, offset);
+    }
+
+    if (chunk.cardinality == chunk.capacity) {
+        unsigned capacity = chunk.capacity * 2 < BITMAP_MAX_ARRAY ? chunk.capacity * 2 : BITMAP_MAX_ARRAY;
+
+        if ((values = (uint16_t *) realloc(values, capacity * sizeof(uint16_t))) == NULL)
+            return DB_ENOMEM;
+        chunk.data = values;
+        chunk.capacity = capacity;
+    }
+
+    memmove(values + i + 1, values + i, (chunk.cardinality - i) * sizeof(uint16_t));
+    values[i] = (uint16_t) offset;
+    chunk.cardinality++;
+    return DB_NOERROR;
+}
+
+void ContactBitmap::chunk_remove(Chunk &chunk, unsigned offset)
+{
+    if (chunk.capacity == 0) {
+        uint64_t *words = (uint64_t *) chunk.data;
+        uint64_t bit = (uint64_t) 1 << (offset & 63);
+
+        if ((words[offset >> 6] & bit) != 0) {
+            words[offset >> 6] &= ~bit;
+            if (--chunk.cardinality <= BITMAP_MIN_BITMAP)
+                chunk_to_array(chunk);
+        }
+        return;
+    }
+
+    uint16_t *values = (uint16_t *) chunk.data;
+    unsigned i = lower_bound(values, chunk.cardinality, offset);
+
+    if (i < chunk.cardinality && values[i] == offset) {
+        memmove(values + i, values + i + 1, (chunk.cardinality - i - 1) * sizeof(uint16_t));
+        chunk.cardinality--;
+    }
+}
+
+bool ContactBitmap::chunk_contains(const Chunk &chunk, unsigned offset)
+{
+    if (chunk.capacity == 0)
+        return (((const uint64_t *) chunk.data)[offset >> 6] >> (offset & 63)) & 1;
+
+    const uint16_t *values = (const uint16_t *) chunk.data;
+    unsigned i = lower_bound(values, chunk.cardinality, offset);
+
+    return i < chunk.cardinality && values[i] == offset;
+}
+
+/**
+ * Find the smallest offset in the chunk not less than offset.
+ */
+bool ContactBitmap::chunk_next(const Chunk &chunk, unsigned offset, unsigned &next)
+{
+    if (chunk.capacity == 0) {
+        const uint64_t *words = (const uint64_t *) chunk.data;
+        unsigned w = offset >> 6;
+        uint64_t bits = words[w] & (~(uint64_t) 0 << (offset & 63));
+
+        for (;;) {
+            if (bits != 0) {
+                next = w * 64 + lowest_bit64(bits);
+                return true;
+            }
+            if (++w == BITMAP_WORDS)
+                return false;
+            bits = words[w];
+        }
+    }
+
+    const uint16_t *values = (const uint16_t *) chunk.data;
+    unsigned i = lower_bound(values, chunk.cardinality, offset);
+
+    if (i == chunk.cardinality)
+        return false;
+    next = values[i];
+    return true;
+}
+
+int ContactBitmap::chunk_copy(Chunk &chunk, const Chunk &other)
+{
+    size_t size = other.capacity == 0 ? BITMAP_WORDS * sizeof(uint64_t)
+                                      : other.capacity * sizeof(uint16_t);
+
+    if ((chunk.data = malloc(size)) == NULL)
+        return DB_ENOMEM;
+    memcpy(chunk.data, other.data, size);
+    chunk.key = other.key;
+    chunk.cardinality = other.cardinality;
+    chunk.capacity = other.capacity;
+    return DB_NOERROR;
+}
+
+int ContactBitmap::chunk_intersect(Chunk &chunk, const Chunk &other)
+{
+    if (chunk.capacity != 0) {
+        // Filter the array in place
+        uint16_t *values = (uint16_t *) chunk.data;
+        unsigned n = 0;
+
+        if (other.capacity != 0) {
+            const uint16_t *other_values = (const uint16_t *) other.data;
+            unsigned i = 0, j = 0;
+
+            while (i < chunk.cardinality && j < other.cardinality) {
+                if (values[i] < other_values[j])
+                    i++;
+                else if (values[i] > other_values[j])
+                    j++;
+                else {
+                    values[n++] = values[i++];
+                    j++;
+                }
+            }
+        } else {
+            for (unsigned i = 0; i < chunk.cardinality; i++) {
+                if (chunk_contains(other, values[i]))
+                    values[n++] = values[i];
+            }
+        }
+        chunk.cardinality = n;
+        return DB_NOERROR;
+    }
+
+    if (other.capacity != 0) {
+        // Keep the entries of the other array found in this bitmap
+        unsigned capacity = other.cardinality > BITMAP_INITIAL_ARRAY ? other.cardinality : BITMAP_INITIAL_ARRAY;
+        uint16_t *values = (uint16_t *) malloc(capacity * sizeof(uint16_t));
+        const uint16_t *other_values = (const uint16_t *) other.data;
+        unsigned n = 0;
+
+        if (values == NULL)
+            return DB_ENOMEM;
+        for (unsigned i = 0; i < other.cardinality; i++) {
+            if (chunk_contains(chunk, other_values[i]))
+                values[n++] = other_values[i];
+        }
+        free(chunk.data);
+        chunk.data = values;
+        chunk.capacity = capacity;
+        chunk.cardinality = n;
+        return DB_NOERROR;
+    }
+
+    uint64_t *words = (uint64_t *) chunk.data;
+    const uint64_t *other_words = (const uint64_t *) other.data;
+    unsigned n = 0;
+
+    for (unsigned w = 0; w < BITMAP_WORDS; w++) {
+        words[w] &= other_words[w];
+        n += popcount64(words[w]);
+    }
+    chunk.cardinality = n;
+    if (n <= BITMAP_MIN_BITMAP)
+        chunk_to_array(chunk);
+    return DB_NOERROR;
+}
+
+int ContactBitmap::chunk_unite(Chunk &chunk, const Chunk &other)
+{
+    if (chunk.capacity != 0 && other.capacity != 0 &&
+        chunk.cardinality + other.cardinality <= BITMAP_MAX_ARRAY) {
+        // Merge two arrays from the back, in place
+        const uint16_t *other_values = (const uint16_t *) other.data;
+        unsigned total = chunk.cardinality + other.cardinality;
+        uint16_t *values = (uint16_t *) chunk.data;
+        unsigned i = chunk.cardinality, j = other.cardinality, n = total;
+
+        if (total > chunk.capacity) {
+            if ((values = (uint16_t *) realloc(values, total * sizeof(uint16_t))) == NULL)
+                return DB_ENOMEM;
+            chunk.data = values;
+            chunk.capacity = total;
+        }
+        while (j > 0) {
+            if (i > 0 && values[i - 1] > other_values[j - 1])
+                values[--n] = values[--i];
+            else if (i > 0 && values[i - 1] == other_values[j - 1]) {
+                values[--n] = values[--i];
+                j--;
+            } else
+                values[--n] = other_values[--j];
+        }
+        // Close the gap left by duplicates
+        if (n > i)
+            memmove(values + i, values + n, (total - n) * sizeof(uint16_t));
+        chunk.cardinality = total - (n - i);
+        return DB_NOERROR;
+    }
+
+    if (chunk.capacity != 0 && DB_FAILED(chunk_to_bitmap(chunk)))
+        return DB_ENOMEM;
+
+    uint64_t *words = (uint64_t *) chunk.data;
+    unsigned n = 0;
+
+    if (other.capacity != 0) {
+        const uint16_t *other_values = (const uint16_t *) other.data;
+
+        for (unsigned i = 0; i < other.cardinality; i++)
+            words[other_values[i] >> 6] |= (uint64_t) 1 << (other_values[i] & 63);
+    } else {
+        const uint64_t *other_words = (const uint64_t *) other.data;
+
+        for (unsigned w = 0; w < BITMAP_WORDS; w++)
+            words[w] |= other_words[w];
+    }
+    for (unsigned w = 0; w < BITMAP_WORDS; w++)
+        n += popcount64(words[w]);
+    chunk.cardinality = n;
+    if (n <= BITMAP_MIN_BITMAP)
+        chunk_to_array(chunk);
+    return DB_NOERROR;
+}
+
+void ContactBitmap::chunk_subtract(Chunk &chunk, const Chunk &other)
+{
+    if (chunk.capacity != 0) {
+        uint16_t *values = (uint16_t *) chunk.data;
+        unsigned n = 0;
+
+        for (unsigned i = 0; i < chunk.cardinality; i++) {
+            if (!chunk_contains(other, values[i]))
+                values[n++] = values[i];
+        }
+        chunk.cardinality = n;
+        return;
+    }
+
+    uint64_t *words = (uint64_t *) chunk.data;
+    unsigned n = 0;
+
+    if (other.capacity != 0) {
+        const uint16_t *other_values = (const uint16_t *) other.data;
+
+        for (unsigned i = 0; i < other.cardinality; i++)
+            words[other_values[i] >> 6] &= ~((uint64_t) 1 << (other_values[i] & 63));
+    } else {
+        const uint64_t *other_words = (const uint64_t *) other.data;
+
+        for (unsigned w = 0; w < BITMAP_WORDS; w++)
+            words[w] &= ~other_words[w];
+    }
+    for (unsigned w = 0; w < BITMAP_WORDS; w++)
+        n += popcount64(words[w]);
+    chunk.cardinality = n;
+    if (n <= BITMAP_MIN_BITMAP)
+        chunk_to_array(chunk);
+}
+
+//=======================================================================
+// ContactBitmap
+//=======================================================================
+
+ContactBitmap::ContactBitmap()
+    : chunks(NULL)
+    , count(0)
+    , chunk_capacity(0)
+{
+}
+
+ContactBitmap::~ContactBitmap()
+{
+    clear();
+    free(chunks);
+}
+
+/**
+ * Find the position of the first chunk with a key not less than key.
+ */
+size_t ContactBitmap::find_chunk(db_uint key) const
+{
+    size_t low = 0, high = count;
+
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+
+        if (chunks[mid].key < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/**
+ * Insert an empty array chunk.
+ *
+ * @return NULL if out of memory
+ */
+ContactBitmap::Chunk *ContactBitmap::insert_chunk(size_t position, db_uint key)
+{
+    Chunk *chunk;
+    void *data;
+
+    if (count == chunk_capacity) {
+        size_t capacity = chunk_capacity != 0 ? chunk_capacity * 2 : 4;
+        Chunk *p = (Chunk *) realloc(chunks, capacity * sizeof(Chunk));
+
+        if (p == NULL)
+            return NULL;
+        chunks = p;
+        chunk_capacity = capacity;
+    }
+    if ((data = malloc(BITMAP_INITIAL_ARRAY * sizeof(uint16_t))) == NULL)
+        return NULL;
+
+    memmove(chunks + position + 1, chunks + position, (count - position) * sizeof(Chunk));
+    count++;
+
+    chunk = &chunks[position];
+    chunk->key = key;
+    chunk->cardinality = 0;
+    chunk->capacity = BITMAP_INITIAL_ARRAY;
+    chunk->data = data;
+    return chunk;
+}
+
+void ContactBitmap::erase_chunk(size_t position)
+{
+    free(chunks[position].data);
+    memmove(chunks + position, chunks + position + 1, (count - position - 1) * sizeof(Chunk));
+    count--;
+}
+
+int ContactBitmap::add(db_uint id)
+{
+    db_uint key = id >> BITMAP_CHUNK_BITS;
+    size_t i = find_chunk(key);
+    Chunk *chunk = i < count && chunks[i].key == key ? &chunks[i] : insert_chunk(i, key);
+
+    if (chunk == NULL)
+        return DB_ENOMEM;
+    return chunk_add(*chunk, (unsigned) (id & ((1u << BITMAP_CHUNK_BITS) - 1)));
+}
+
+void ContactBitmap::remove(db_uint id)
+{
+    db_uint key = id >> BITMAP_CHUNK_BITS;
+    size_t i = find_chunk(key);
+
+    if (i < count && chunks[i].key == key) {
+        chunk_remove(chunks[i], (unsigned) (id & ((1u << BITMAP_CHUNK_BITS) - 1)));
+        if (chunks[i].cardinality == 0)
+            erase_chunk(i);
+    }
+}
+
+bool ContactBitmap::contains(db_uint id) const
+{
+    db_uint key = id >> BITMAP_CHUNK_BITS;
+    size_t i = find_chunk(key);
+
+    return i < count && chunks[i].key == key &&
+        chunk_contains(chunks[i], (unsigned) (id & ((1u << BITMAP_CHUNK_BITS) - 1)));
+}
+
+bool ContactBitmap::find_next(db_uint &id) const
+{
+    db_uint key = id >> BITMAP_CHUNK_BITS;
+    unsigned offset = (unsigned) (id & ((1u << BITMAP_CHUNK_BITS) - 1));
+    unsigned next;
+
+    for (size_t i = find_chunk(key); i < count; i++) {
+        // Later chunks are searched from their start
+        if (chunks[i].key != key)
+            offset = 0;
+        if (chunk_next(chunks[i], offset, next)) {
+            id = (chunks[i].key << BITMAP_CHUNK_BITS) | next;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ContactBitmap::clear()
+{
+    for (size_t i = 0; i < count; i++)
+        free(chunks[i].data);
+    count = 0;
+}
+
+db_uint ContactBitmap::cardinality() const
+{
+    db_uint total = 0;
+
+    for (size_t i = 0; i < count; i++)
+        total += chunks[i].cardinality;
+    return total;
+}
+
+size_t ContactBitmap::memory_size() const
+{
+    size_t total = chunk_capacity * sizeof(Chunk);
+
+    for (size_t i = 0; i < count; i++)
+        total += chunks[i].capacity != 0 ? chunks[i].capacity * sizeof(uint16_t)
+                                         : BITMAP_WORDS * sizeof(uint64_t);
+    return total;
+}
+
+int ContactBitmap::assign(const ContactBitmap &other)
+{
+    if (&other == this)
+        return DB_NOERROR;
+
+    clear();
+    if (other.count > chunk_capacity) {
+        Chunk *p = (Chunk *) realloc(chunks, other.count * sizeof(Chunk));
+
+        if (p == NULL)
+            return DB_ENOMEM;
+        chunks = p;
+        chunk_capacity = other.count;
+    }
+    for (size_t i = 0; i < other.count; i++) {
+        if (DB_FAILED(chunk_copy(chunks[i], other.chunks[i])))
+            return DB_ENOMEM;
+        count++;
+    }
+    return DB_NOERROR;
+}
+
+int ContactBitmap::intersect(const ContactBitmap &other)
+{
+    size_t n = 0, j = 0;
+    int rc = DB_NOERROR;
+
+    if (&other == this)
+        return DB_NOERROR;
+
+    // Chunks without a match in other are dropped, as are chunks that could
+    // not be intersected for lack of memory; the first failure is returned
+    for (size_t i = 0; i < count; i++) {
+        int chunk_rc = DB_NOERROR;
+
+        while (j < other.count && other.chunks[j].key < chunks[i].key)
+            j++;
+        if (j < other.count && other.chunks[j].key == chunks[i].key &&
+            DB_SUCCESS(chunk_rc = chunk_intersect(chunks[i], other.chunks[j])) &&
+            chunks[i].cardinality > 0) {
+            chunks[n++] = chunks[i];
+        } else {
+            free(chunks[i].data);
+        }
+        if (DB_FAILED(chunk_rc) && DB_SUCCESS(rc))
+            rc = chunk_rc;
+    }
+    count = n;
+    return rc;
+}
+
+int ContactBitmap::unite(const ContactBitmap &other)
+{
+    size_t i = 0;
+
+    if (&other == this)
+        return DB_NOERROR;
+
+    for (size_t j = 0; j < other.count; j++) {
+        const Chunk &source = other.chunks[j];
+
+        while (i < count && chunks[i].key < source.key)
+            i++;
+        if (i < count && chunks[i].key == source.key) {
+            if (DB_FAILED(chunk_unite(chunks[i], source)))
+                return DB_ENOMEM;
+        } else {
+            Chunk *chunk = insert_chunk(i, source.key);
+
+            if (chunk == NULL)
+                return DB_ENOMEM;
+            free(chunk->data);
+            if (DB_FAILED(chunk_copy(*chunk, source))) {
+                chunk->data = NULL;
+                erase_chunk(i);
+                return DB_ENOMEM;
+            }
+        }
+        i++;
+    }
+    return DB_NOERROR;
+}
+
+int ContactBitmap::subtract(const ContactBitmap &other)
+{
+    size_t n = 0, j = 0;
+
+    if (&other == this) {
+        clear();
+        return DB_NOERROR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        while (j < other.count && other.chunks[j].key < chunks[i].key)
+            j++;
+        if (j < other.count && other.chunks[j].key == chunks[i].key)
+            chunk_subtract(chunks[i], other.chunks[j]);
+        if (chunks[i].cardinality > 0)
+            chunks[n++] = chunks[i];
+        else
+            free(chunks[i].data);
+    }
+    count = n;
+    return DB_NOERROR;
+}
+
+//=======================================================================
+// ContactBitmapIndex
+//=======================================================================
+
+ContactBitmapIndex::ContactBitmapIndex()
+    : entries(NULL)
+{
+}
+
+ContactBitmapIndex::~ContactBitmapIndex()
+{
+    clear();
+}
+
+const ContactBitmap *ContactBitmapIndex::find(db_uint key) const
+{
+    for (const Entry *entry = entries; entry != NULL; entry = entry->next) {
+        if (entry->key == key)
+            return &entry->contacts;
+    }
+    return NULL;
+}
+
+ContactBitmap *ContactBitmapIndex::get(db_uint key)
+{
+    Entry *entry;
+
+    for (entry = entries; entry != NULL; entry = entry->next) {
+        if (entry->key == key)
+            return &entry->contacts;
+    }
+
+    if ((entry = new (std::nothrow) Entry) == NULL)
+        return NULL;
+    entry->key = key;
+    entry->next = entries;
+    entries = entry;
+    return &entry->contacts;
+}
+
+void ContactBitmapIndex::remove_contact(db_uint id)
+{
+    for (Entry *entry = entries; entry != NULL; entry = entry->next)
+        entry->contacts.remove(id);
+}
+
+void ContactBitmapIndex::clear()
+{
+    while (entries != NULL) {
+        Entry *entry = entries;
+
+        entries = entry->next;
+        delete entry;
+    }
+}
+
+size_t ContactBitmapIndex::memory_size() const
+{
+    size_t total = 0;
+
+    for (const Entry *entry = entries; entry != NULL; entry = entry->next)
+        total += sizeof(Entry) + entry->contacts.memory_size();
+    return total;
+}
@@ -0,0 +1,153 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Compressed bitmaps of contact ids
+ *
+ * Ids are split into chunks of 65536 by their high bits. A chunk holding
+ * few ids stores them as a sorted array of 16-bit offsets; a dense chunk
+ * switches to a plain 8 KiB bitmap. Set operations work chunk by chunk,
+ * so sparse and dense sets both stay small and fast to combine.
+ */
+
+#ifndef CONTACT_BITMAP_H
+#define CONTACT_BITMAP_H 1
+
+#include <ittia/db++.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ids per chunk */
+#define BITMAP_CHUNK_BITS       16
+/* A chunk with more ids than this is stored as a bitmap. */
+#define BITMAP_MAX_ARRAY        4096
+
+/**
+ * A set of contact ids
+ */
+class ContactBitmap {
+private:
+    struct Chunk {
+        /* Id >> BITMAP_CHUNK_BITS */
+        db_uint key;
+        /* Number of ids in the chunk */
+        unsigned cardinality;
+        /* Allocated array entries, or 0 for a bitmap chunk */
+        unsigned capacity;
+        /* uint16_t offsets, or uint64_t words for a bitmap chunk */
+        void *data;
+    };
+
+    Chunk *chunks;
+    size_t count;
+    size_t chunk_capacity;
+
+    /* Not copyable; use assign() */
+    ContactBitmap(const ContactBitmap &);
+    ContactBitmap &operator=(const ContactBitmap &);
+
+    size_t find_chunk(db_uint key) const;
+    Chunk *insert_chunk(size_t position, db_uint key);
+    void erase_chunk(size_t position);
+
+    static int chunk_to_bitmap(Chunk &chunk);
+    static void chunk_to_array(Chunk &chunk);
+    static int chunk_add(Chunk &chunk, unsigned offset);
+    static void chunk_remove(Chunk &chunk, unsigned offset);
+    static bool chunk_contains(const Chunk &chunk, unsigned offset);
+    static bool chunk_next(const Chunk &chunk, unsigned offset, unsigned &next);
+    static int chunk_copy(Chunk &chunk, const Chunk &other);
+    static int chunk_intersect(Chunk &chunk, const Chunk &other);
+    static int chunk_unite(Chunk &chunk, const Chunk &other);
+    static void chunk_subtract(Chunk &chunk, const Chunk &other);
+
+public:
+    ContactBitmap();
+    ~ContactBitmap();
+
+    /**
+     * Add an id to the set.
+     *
+     * @return DB_ENOMEM if out of memory
+     */
+    int add(db_uint id);
+    void remove(db_uint id);
+    bool contains(db_uint id) const;
+
+    /**
+     * Find the smallest id in the set that is not less than id.
+     *
+     * @return false if there is none
+     */
+    bool find_next(db_uint &id) const;
+
+    void clear();
+    bool empty() const { return count == 0; }
+    db_uint cardinality() const;
+    /* Bytes allocated for the set */
+    size_t memory_size() const;
+
+    /* Set operations; each returns DB_ENOMEM if out of memory. */
+    int assign(const ContactBitmap &other);
+    int intersect(const ContactBitmap &other);
+    int unite(const ContactBitmap &other);
+    int subtract(const ContactBitmap &other);
+};
+
+/**
+ * Bitmaps of contact ids keyed by a value, such as a group id or a phone
+ * number type
+ */
+class ContactBitmapIndex {
+private:
+    struct Entry {
+        db_uint key;
+        ContactBitmap contacts;
+        Entry *next;
+    };
+
+    Entry *entries;
+
+    /* Not copyable */
+    ContactBitmapIndex(const ContactBitmapIndex &);
+    ContactBitmapIndex &operator=(const ContactBitmapIndex &);
+
+public:
+    ContactBitmapIndex();
+    ~ContactBitmapIndex();
+
+    /* Return the bitmap for a key, or NULL if there is none. */
+    const ContactBitmap *find(db_uint key) const;
+    /* Return the bitmap for a key, adding an empty one if needed; NULL if out of memory. */
+    ContactBitmap *get(db_uint key);
+    /* Remove a contact from every bitmap. */
+    void remove_contact(db_uint id);
+    void clear();
+    size_t memory_size() const;
+};
+
+
+#endif
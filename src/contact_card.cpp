@@ -0,0 +1,148 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Encoding of the phone numbers of a contact_card row
+ */
+
+#include "contact_card.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * One decoded entry, pointing into the encoded text
+ */
+struct CardEntry {
+    db_uint type;
+    db_sint speed_dial;
+    const char *number;
+    size_t number_length;
+    /* Start of the next entry */
+    const char *next;
+};
+
+/**
+ * Decode the entry at p.
+ *
+ * @return false if it is malformed
+ */
+static bool parse_entry(const char *p, const char *end, CardEntry &entry)
+{
+    char *stop;
+    unsigned long length;
+
+    entry.type = strtoul(p, &stop, 10);
+    if (stop == p || *stop != ',')
+        return false;
+    p = stop + 1;
+
+    entry.speed_dial = strtol(p, &stop, 10);
+    if (stop == p || *stop != ',')
+        return false;
+    p = stop + 1;
+
+    length = strtoul(p, &stop, 10);
+    if (stop == p || *stop != ':' || length > (unsigned long) (end - stop - 1))
+        return false;
+
+    entry.number = stop + 1;
+    entry.number_length = length;
+    entry.next = entry.number + length;
+    return true;
+}
+
+CardNumbers::CardNumbers()
+    : length(0)
+{
+    text[0] = '\0';
+}
+
+bool CardNumbers::assign(const char *encoded)
+{
+    size_t encoded_length = strlen(encoded);
+    const char *end = encoded + encoded_length;
+    CardEntry entry;
+
+    length = 0;
+    text[0] = '\0';
+    if (encoded_length > MAX_CARD_NUMBERS)
+        return false;
+
+    for (const char *p = encoded; p < end; p = entry.next) {
+        if (!parse_entry(p, end, entry))
+            return false;
+    }
+
+    memcpy(text, encoded, encoded_length + 1);
+    length = encoded_length;
+    return true;
+}
+
+bool CardNumbers::insert(const char *number, PhoneBook::PhoneNumberType type, db_sint speed_dial)
+{
+    char header[64];
+    size_t number_length = strlen(number);
+    size_t header_length;
+    const char *end = text + length;
+    const char *at;
+    CardEntry entry;
+
+    header_length = (size_t) snprintf(header, sizeof(header), "%u,%ld,%lu:",
+        (unsigned) type, (long) speed_dial, (unsigned long) number_length);
+    if (header_length + number_length > MAX_CARD_NUMBERS - length)
+        return false;
+
+    // Find the first entry of a later type
+    for (at = text; at < end && parse_entry(at, end, entry) && entry.type <= (db_uint) type; at = entry.next)
+        ;
+
+    size_t offset = (size_t) (at - text);
+    memmove(text + offset + header_length + number_length, at, length - offset + 1);
+    memcpy(text + offset, header, header_length);
+    memcpy(text + offset + header_length, number, number_length);
+    length += header_length + number_length;
+    return true;
+}
+
+int CardNumbers::decode(PhoneBook::ContactResults &results) const
+{
+    char number[MAX_CARD_NUMBERS + 1];
+    const char *end = text + length;
+    CardEntry entry;
+    int rc = DB_NOERROR;
+
+    for (const char *p = text; DB_SUCCESS(rc) && p < end; p = entry.next) {
+        if (!parse_entry(p, end, entry))
+            return DB_EINVAL;
+
+        memcpy(number, entry.number, entry.number_length);
+        number[entry.number_length] = '\0';
+        rc = results.add_number(number, (PhoneBook::PhoneNumberType) entry.type, entry.speed_dial);
+    }
+    return rc;
+}
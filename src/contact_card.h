@@ -0,0 +1,69 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Encoding of the phone numbers of a contact_card row
+ */
+
+#ifndef CONTACT_CARD_H
+#define CONTACT_CARD_H 1
+
+#include "phonebook.h"
+
+#include <stddef.h>
+
+/**
+ * The phone numbers of a contact, encoded for the numbers field of the
+ * contact_card table. Each number is written as
+ * "<type>,<speed dial>,<length>:<number>", so numbers may contain any
+ * character. Numbers are kept in type order, numbers of the same type in
+ * the order they were added, which is the order the SQL layer lists them.
+ */
+class CardNumbers {
+private:
+    char text[MAX_CARD_NUMBERS + 1];
+    size_t length;
+
+public:
+    CardNumbers();
+
+    /* Start from the numbers field of a card. Returns false, leaving no
+       numbers, if it is malformed or too long. */
+    bool assign(const char *encoded);
+
+    /* Add a number after the others of its type. Returns false, leaving
+       the numbers unchanged, if they would no longer fit in the field. */
+    bool insert(const char *number, PhoneBook::PhoneNumberType type, db_sint speed_dial);
+
+    /* Add the numbers to the contact last added to results.
+       @return database error code */
+    int decode(PhoneBook::ContactResults &results) const;
+
+    const char *c_str() const { return text; }
+};
+
+
+#endif
@@ -0,0 +1,326 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Packed integer keys for telephone numbers
+ */
+
+#include "number_key.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NUMBER_KEY_SSE2 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/* Characters examined per block by the vectorized kernel. */
+#define BLOCK_SIZE                  16
+
+
+/**
+ * Check whether a character ends the dialable part of a number.
+ */
+static inline bool is_stop(char c)
+{
+    return c == ',' || c == ';' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+#ifdef NUMBER_KEY_SSE2
+static inline int first_bit(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/**
+ * Mask of the bytes of a block in the range [low, high].
+ */
+static inline unsigned in_range(__m128i block, char low, char high)
+{
+    // Bias to signed so unsigned ranges compare with signed instructions
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    __m128i v = _mm_xor_si128(block, bias);
+    __m128i below = _mm_cmplt_epi8(v, _mm_xor_si128(_mm_set1_epi8(low), bias));
+    __m128i above = _mm_cmpgt_epi8(v, _mm_xor_si128(_mm_set1_epi8(high), bias));
+
+    return ~(unsigned) _mm_movemask_epi8(_mm_or_si128(below, above)) & 0xffff;
+}
+#endif
+
+#ifdef NUMBER_KEY_SSE2
+/**
+ * Copy the digits of one block that come before the first stop character,
+ * considering only the first length bytes.
+ *
+ * @return true if the block holds a stop character
+ */
+static inline bool extract_block(__m128i block, const char *block_data, size_t length,
+    char *digits, size_t max, size_t &count)
+{
+    unsigned valid = length >= BLOCK_SIZE ? 0xffff : (1u << length) - 1;
+    unsigned digit_mask = in_range(block, '0', '9') & valid;
+    unsigned stop_mask = in_range(block, 'A', 'Z') | in_range(block, 'a', 'z') |
+        (unsigned) _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(block, _mm_set1_epi8(',')),
+            _mm_cmpeq_epi8(block, _mm_set1_epi8(';'))));
+
+    stop_mask &= valid;
+    if (stop_mask != 0)
+        digit_mask &= (1u << first_bit(stop_mask)) - 1;
+
+    for (; digit_mask != 0; digit_mask &= digit_mask - 1) {
+        if (count < max)
+            digits[count] = block_data[first_bit(digit_mask)];
+        count++;
+    }
+    return stop_mask != 0;
+}
+
+/**
+ * Load the last, partial block of a number. The bytes are copied into a
+ * zeroed block, so nothing past the end of the string is read.
+ */
+static inline __m128i load_tail(const char *p, size_t length)
+{
+    char tail[BLOCK_SIZE] = { 0 };
+
+    memcpy(tail, p, length);
+    return _mm_loadu_si128((const __m128i *) tail);
+}
+#endif
+
+size_t extract_digits(const char *number, size_t length, char *digits, size_t max)
+{
+    const char *p = number;
+    const char *end = number + length;
+    size_t count = 0;
+
+#ifdef NUMBER_KEY_SSE2
+    for (; end - p >= BLOCK_SIZE; p += BLOCK_SIZE) {
+        if (extract_block(_mm_loadu_si128((const __m128i *) p), p, BLOCK_SIZE, digits, max, count))
+            return count;
+    }
+
+    // Most numbers are shorter than a block
+    if (p < end)
+        extract_block(load_tail(p, end - p), p, end - p, digits, max, count);
+#else
+    for (; p < end && !is_stop(*p); p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (count < max)
+                digits[count] = *p;
+            count++;
+        }
+    }
+#endif
+    return count;
+}
+
+/**
+ * Normalize a number to its E.164 digits. A national number written with
+ * the default country code as its trunk prefix, as in "1 800 555 1234",
+ * keeps a single copy of the code.
+ *
+ * @return number of digits, or 0 if the number has none or too many
+ */
+static size_t e164_digits(const char *number, char *digits)
+{
+    const char *p = number;
+    size_t length = strlen(number);
+    size_t prefix = 0;
+    size_t count;
+
+    // Skip leading punctuation to find a '+' or "00"
+    while (length > 0 && (*p == ' ' || *p == '(')) {
+        p++;
+        length--;
+    }
+
+    if (length > 0 && *p == '+') {
+        p++;
+        length--;
+    } else if (length > 1 && p[0] == '0' && p[1] == '0') {
+        p += 2;
+        length -= 2;
+    } else {
+        char national[NUMBER_KEY_DIGITS];
+        size_t trunk = 0;
+
+        prefix = strlen(NUMBER_KEY_COUNTRY_CODE);
+        count = extract_digits(p, length, national, NUMBER_KEY_DIGITS);
+        if (count > NUMBER_KEY_DIGITS)
+            return 0;
+        if (count > prefix && memcmp(national, NUMBER_KEY_COUNTRY_CODE, prefix) == 0)
+            trunk = prefix;
+        count -= trunk;
+        if (count == 0 || count > NUMBER_KEY_DIGITS - prefix)
+            return 0;
+
+        memcpy(digits, NUMBER_KEY_COUNTRY_CODE, prefix);
+        memcpy(digits + prefix, national + trunk, count);
+        return prefix + count;
+    }
+
+    count = extract_digits(p, length, digits, NUMBER_KEY_DIGITS);
+    if (count == 0 || count > NUMBER_KEY_DIGITS)
+        return 0;
+    return count;
+}
+
+/**
+ * Pack digits, most significant first, as the digit value plus one.
+ */
+static db_uint pack_digits(const char *digits, size_t count)
+{
+    db_uint key = 0;
+    size_t i;
+
+    for (i = 0; i < NUMBER_KEY_DIGITS; i++)
+        key = (key << 4) | (i < count ? (db_uint) (digits[i] - '0' + 1) : 0);
+    return key;
+}
+
+db_uint number_key(const char *number)
+{
+    char digits[NUMBER_KEY_DIGITS];
+    size_t count = e164_digits(number, digits);
+
+    return count == 0 ? NUMBER_KEY_INVALID : pack_digits(digits, count);
+}
+
+void number_keys(const char *const *numbers, size_t count, db_uint *keys)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        keys[i] = number_key(numbers[i]);
+}
+
+bool number_key_range(const char *prefix, db_uint &low, db_uint &high)
+{
+    char digits[NUMBER_KEY_DIGITS];
+    size_t count = e164_digits(prefix, digits);
+
+    if (count == 0)
+        return false;
+
+    // Trailing digits range from none at all to the largest digit value
+    low = pack_digits(digits, count);
+    high = low | ((((db_uint) 1) << (4 * (NUMBER_KEY_DIGITS - count))) - 1);
+    return true;
+}
+
+/**
+ * Reverse digits in place.
+ */
+static void reverse_digits(char *digits, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count / 2; i++) {
+        char c = digits[i];
+
+        digits[i] = digits[count - 1 - i];
+        digits[count - 1 - i] = c;
+    }
+}
+
+/**
+ * Keep the last NUMBER_KEY_DIGITS digits of a number's dialable part, for
+ * numbers with too many digits to normalize.
+ *
+ * @return number of digits kept
+ */
+static size_t trailing_digits(const char *number, char *digits)
+{
+    size_t count = 0;
+
+    for (const char *p = number; *p != '\0' && !is_stop(*p); p++) {
+        if (*p < '0' || *p > '9')
+            continue;
+        if (count == NUMBER_KEY_DIGITS) {
+            memmove(digits, digits + 1, NUMBER_KEY_DIGITS - 1);
+            count--;
+        }
+        digits[count++] = *p;
+    }
+    return count;
+}
+
+db_uint number_suffix_key(const char *number)
+{
+    char digits[NUMBER_KEY_DIGITS];
+    size_t count = e164_digits(number, digits);
+
+    // Only the trailing digits are searched, so a number too long to
+    // normalize is still indexed by its last digits
+    if (count == 0)
+        count = trailing_digits(number, digits);
+    if (count == 0)
+        return NUMBER_KEY_INVALID;
+
+    reverse_digits(digits, count);
+    return pack_digits(digits, count);
+}
+
+bool number_suffix_range(const char *suffix, db_uint &low, db_uint &high)
+{
+    char digits[NUMBER_KEY_DIGITS];
+    size_t count = extract_digits(suffix, strlen(suffix), digits, NUMBER_KEY_DIGITS);
+
+    if (count == 0 || count > NUMBER_KEY_DIGITS)
+        return false;
+
+    // The reversed suffix is a prefix of the reversed number
+    reverse_digits(digits, count);
+    low = pack_digits(digits, count);
+    high = low | ((((db_uint) 1) << (4 * (NUMBER_KEY_DIGITS - count))) - 1);
+    return true;
+}
+
+void format_number_key(db_uint key, char *buffer)
+{
+    size_t n = 0;
+    int shift;
+
+    buffer[n++] = '+';
+    for (shift = 4 * (NUMBER_KEY_DIGITS - 1); shift >= 0; shift -= 4) {
+        int nibble = (int) ((key >> shift) & 0xf);
+
+        if (nibble == 0)
+            break;
+        buffer[n++] = (char) ('0' + nibble - 1);
+    }
+    buffer[n] = '\0';
+}
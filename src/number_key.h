@@ -0,0 +1,120 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Packed integer keys for telephone numbers
+ *
+ * A number is normalized to E.164 form, the country code followed by the
+ * subscriber number, up to 15 digits. The digits are packed four bits
+ * each, most significant first, as the digit value plus one; unused
+ * trailing digits are zero. Keys therefore compare as integers in the
+ * same order as the digit strings, and all numbers starting with a given
+ * prefix form one contiguous key range. The top four bits are always
+ * zero, so keys are also ordered correctly as signed 64-bit integers.
+ *
+ * A suffix key packs the same digits in reverse order, last digit first,
+ * so that all numbers ending with a given suffix form one key range.
+ */
+
+#ifndef NUMBER_KEY_H
+#define NUMBER_KEY_H 1
+
+#include <ittia/db++.h>
+
+#include <stddef.h>
+
+/* E.164 numbers have at most 15 digits. */
+#define NUMBER_KEY_DIGITS           15
+/* Key of a number that cannot be normalized. */
+#define NUMBER_KEY_INVALID          0
+/* Country code assumed for numbers written without a leading '+'. */
+#define NUMBER_KEY_COUNTRY_CODE     "1"
+
+/**
+ * Copy the digits of a telephone number, ignoring punctuation and stopping
+ * at an extension or pause (a letter, ',' or ';'). Uses SSE2 to classify
+ * 16 characters at a time where available.
+ *
+ * @param digits receives at most max digits
+ * @return number of digits found, which may exceed max
+ */
+size_t extract_digits(const char *number, size_t length, char *digits, size_t max);
+
+/**
+ * Compute the packed E.164 key of a telephone number.
+ *
+ * A leading '+' or international prefix "00" marks a number that already
+ * includes its country code; otherwise NUMBER_KEY_COUNTRY_CODE is
+ * prepended, unless the number already starts with it as a national trunk
+ * prefix, so "1 800 555 1234", "800 555 1234" and "+1 800 555 1234" have
+ * the same key.
+ *
+ * @return key, or NUMBER_KEY_INVALID if the number has no digits or too
+ * many
+ */
+db_uint number_key(const char *number);
+
+/**
+ * Compute the keys of many numbers at once, for bulk loads.
+ */
+void number_keys(const char *const *numbers, size_t count, db_uint *keys);
+
+/**
+ * Compute the range of keys of all numbers starting with a prefix,
+ * normalized like number_key(). The range includes the key of the prefix
+ * itself.
+ *
+ * @return false if the prefix cannot be normalized
+ */
+bool number_key_range(const char *prefix, db_uint &low, db_uint &high);
+
+/**
+ * Compute the packed key of the E.164 digits of a telephone number in
+ * reverse order. A number with too many digits to normalize is keyed by
+ * its last NUMBER_KEY_DIGITS digits, as written, so it can still be found
+ * by a suffix of that length or shorter.
+ *
+ * @return key, or NUMBER_KEY_INVALID if the number has no digits
+ */
+db_uint number_suffix_key(const char *number);
+
+/**
+ * Compute the range of suffix keys of all numbers ending with the given
+ * digits. Unlike number_key_range(), no country code is assumed: only the
+ * digits actually written are matched.
+ *
+ * @return false if the suffix has no digits or too many
+ */
+bool number_suffix_range(const char *suffix, db_uint &low, db_uint &high);
+
+/**
+ * Format a key in E.164 form, "+" followed by the digits.
+ *
+ * @param buffer at least NUMBER_KEY_DIGITS + 2 bytes
+ */
+void format_number_key(db_uint key, char *buffer);
+
+
+#endif
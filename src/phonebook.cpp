@@ -27,8 +27,12 @@
  * Command line example program demonstrating the ITTIA DB C++ API
  */
 
-#include "phonebook.h"
+#include "phonebook_backends.h"
+#include "contact_card.h"
+#include "picture_store.h"
+#include "number_key.h"
 #include "dbs_error_info.h"
+#include "span_trace.h"
 
 #include <iostream>
 #include <stdio.h>
@@ -45,15 +49,119 @@ using std::endl;
 /**
  * Helper function to print error messages.
  */
-int print_error(int rc)
+static int print_error(int rc)
 {
     if (DB_FAILED(rc)) {
         dbs_error_info_t info = dbs_get_error_info( rc );
         cerr << "ERROR " << info.name << ": " << info.description << endl;
+        count_error(rc);
     }
     return rc;
 }
 
+/**
+ * Sort a contact or contact_card cursor by id (0), name (1), or ring id
+ * and name (2). Ties are broken by id, as in the SQL engine's listings.
+ */
+static void sort_contacts(db::Table &table, int sort)
+{
+    db::IndexFieldSet sort_fields;
+    switch (sort) {
+        case 0:
+            sort_fields.add("id");
+            break;
+        case 1:
+            sort_fields.add("name");
+            sort_fields.add("id");
+            break;
+        case 2:
+            sort_fields.add("ring_id");
+            sort_fields.add("name");
+            sort_fields.add("id");
+            break;
+    }
+	TRACE_SPAN("contact sort");
+	table.sort(sort_fields);
+}
+
+/**
+ * Add the contact at the current row of a contact or contact_card cursor
+ * to a result set.
+ *
+ * @return database error code
+ */
+template <class Row>
+static int add_contact_row(TypedTable<Row> &row, PhoneBook::ContactResults &results)
+{
+	db::WString name = row[Row::NAME].as_wstring();
+	db::String picture_name = row[Row::PICTURE_NAME].as_string();
+
+	return results.add_contact(row[Row::ID].as_int(), name.c_str(),
+		!row[Row::RING_ID].is_null(), row[Row::RING_ID].as_int(),
+		row[Row::PICTURE_NAME].is_null() ? NULL : picture_name.c_str());
+}
+
+/**
+ * Add the phone numbers of a contact to the contact last added to a
+ * result set, using a phone_number cursor sorted by contact id.
+ *
+ * @return database error code
+ */
+static int add_phone_numbers(TypedTable<PhoneNumberRow> &phone_number, db_uint id,
+	PhoneBook::ContactResults &results)
+{
+	int rc = DB_NOERROR;
+
+	phone_number.begin_filter(db::DB_SEEK_EQUAL);
+	phone_number[PhoneNumberRow::CONTACT_ID] = id;
+	phone_number.apply_filters();
+	for (phone_number.seek_first(); DB_SUCCESS(rc) && !phone_number.is_eof(); phone_number.seek_next()) {
+		db::String number = phone_number[PhoneNumberRow::NUMBER].as_string();
+
+		rc = results.add_number(number.c_str(),
+			(PhoneBook::PhoneNumberType) (db_uint) phone_number[PhoneNumberRow::TYPE].as_int(),
+			phone_number[PhoneNumberRow::SPEED_DIAL].as_int());
+	}
+	return rc;
+}
+
+/**
+ * Add the phone numbers on the card at the current row of a contact_card
+ * cursor to the contact last added to a result set. Numbers too many for
+ * the card are read from the phone_number table instead.
+ *
+ * @return database error code
+ */
+static int add_card_numbers(TypedTable<ContactCardRow> &card, TypedTable<PhoneNumberRow> &phone_number,
+	PhoneBook::ContactResults &results)
+{
+	CardNumbers numbers;
+
+	if (card[ContactCardRow::NUMBERS].is_null())
+		return add_phone_numbers(phone_number, card[ContactCardRow::ID].as_int(), results);
+
+	db::String encoded = card[ContactCardRow::NUMBERS].as_string();
+	if (!numbers.assign(encoded.c_str()))
+		return DB_EINVAL;
+	return numbers.decode(results);
+}
+
+/**
+ * Construct a phone book with a connection of its own.
+ */
+CursorPhoneBook::CursorPhoneBook()
+	: state(own_state)
+{
+}
+
+/**
+ * Construct a phone book sharing the connection and caches of another.
+ */
+CursorPhoneBook::CursorPhoneBook(PhoneBookState &shared)
+	: state(shared)
+{
+}
+
 /** 
  * Create database tables, assuming an empty database has been created.
  * 
@@ -63,10 +171,16 @@ int print_error(int rc)
  * - DB_SUCCESS macro
 	 * - DB_NOERROR status code
 	 */
-int PhoneBook::create_tables(bool with_picture)
+int CursorPhoneBook::create_tables(bool with_picture)
 {
-	if (DB_SUCCESS(create_table_contact(with_picture)) &&
-			DB_SUCCESS(create_table_phone_number())) {
+	if (DB_SUCCESS(create_table(ContactRow::table)) &&
+			DB_SUCCESS(create_table(PhoneNumberRow::table)) &&
+			DB_SUCCESS(create_table(with_picture ? PictureRow::blob_table : PictureRow::file_table)) &&
+			DB_SUCCESS(create_table(ChangeLogRow::table)) &&
+			DB_SUCCESS(create_table(ContactGroupRow::table)) &&
+			DB_SUCCESS(create_table(GroupMemberRow::table)) &&
+			DB_SUCCESS(create_table(StatRow::table)) &&
+			(!state.contact_cards || DB_SUCCESS(create_table(ContactCardRow::table)))) {
 		// Success
 		return DB_NOERROR;
 	} else {
@@ -76,69 +190,60 @@ int PhoneBook::create_tables(bool with_picture)
 }
 
 /**
- * Create the table "contact", which lists contacts in the phone book.
+ * Create a table from its description in phonebook_schema.h.
  *
  * Demonstrates:
  * - defining table schema: fields and indexes
  * - unique and non-unique indexes
- * - add_datatype() functions return FieldDesc so they can be chained together
+ * - foreign keys
  * - add_index() functions return IndexDesc so they can be chained together
  */
-int PhoneBook::create_table_contact(bool with_picture)
+int CursorPhoneBook::create_table(const SchemaTable &table)
 {
 	db::FieldDescSet fields;
 	db::IndexDescSet indexes;
+	db::ForeignKeyDescSet foreign_keys;
+	int i;
+
+	for (i = 0; i < table.field_count; i++) {
+		const SchemaField &field = table.fields[i];
+
+		switch (field.type) {
+			case FIELD_UINT64:
+				fields.add_uint(field.name, sizeof(db_uint), field.nullable);
+				break;
+			case FIELD_SINT64:
+				fields.add_sint(field.name, sizeof(db_sint), field.nullable);
+				break;
+			case FIELD_UTF16STR:
+				fields.add_wstring(field.name, field.size, field.nullable);
+				break;
+			case FIELD_VARCHAR:
+			case FIELD_ANSISTR:
+				fields.add_string(field.name, field.size, field.nullable);
+				break;
+			case FIELD_BLOB:
+				fields.add_blob(field.name);
+				break;
+		}
+	}
 
-	// Create fields
-
-	// Unique contact id number
-	fields.add_uint("id");
-	// Contacts's name
-	fields.add_wstring("name", 50);
-	// Ring tone to use when this contact calls
-	fields.add_uint("ring_id", sizeof(db_uint), true);
-	// Picture name
-	fields.add_string("picture_name", 50, true);
-    if (with_picture) {
-	    // Picture of this contact
-	    fields.add_blob("picture");
-    }
-
-	// Create a primary key index named "$PK" on the field "id"
-	indexes.add_index("by_id", db::DB_PRIMARY)
-				 .add_field("id");
-
-	// Create an index on name
-	indexes.add_index("by_name", db::DB_MULTISET)
-				 .add_field("name");
-
-	return db.create_table("contact", fields, indexes);
-}
-
-/**
- * Create the table "phone_number", which lists all known telephone numbers.
- */
-int PhoneBook::create_table_phone_number()
-{
-	db::FieldDescSet fields;
-	db::IndexDescSet indexes;
-    db::ForeignKeyDescSet foreign_keys;
+	// A primary key index is also known as "$PK"
+	for (i = 0; i < table.index_count; i++)
+		indexes.add_index(table.indexes[i].name, table.indexes[i].type)
+					 .add_field(table.indexes[i].field);
 
-	// Foreign key into the "contact" table
-	fields.add_uint("contact_id");
-	// The telephone number, stored as a string
-	fields.add_string("number", 20);
-	// The type of device
-	fields.add_uint("type");
-	fields.add_sint("speed_dial", sizeof(db_sint), true);
+	if (table.foreign_key_count == 0)
+		return state.db.create_table(table.name, fields, indexes);
 
-	indexes.add_index("by_contact_id", db::DB_MULTISET)
-				 .add_field("contact_id");
+	for (i = 0; i < table.foreign_key_count; i++) {
+		const SchemaForeignKey &key = table.foreign_keys[i];
 
-    foreign_keys.add_foreign_key("contact_ref", "contact", DB_FK_MATCH_SIMPLE, DB_FK_ACTION_RESTRICT, DB_FK_ACTION_RESTRICT)
-        .add_field("contact_id", "id");
+		foreign_keys.add_foreign_key(key.name, key.parent_table, DB_FK_MATCH_SIMPLE, DB_FK_ACTION_RESTRICT, DB_FK_ACTION_RESTRICT)
+			.add_field(key.field, key.parent_field);
+	}
 
-	return db.create_table("phone_number", fields, indexes, foreign_keys);
+	return state.db.create_table(table.name, fields, indexes, foreign_keys);
 }
 
 /**
@@ -147,15 +252,41 @@ int PhoneBook::create_table_phone_number()
  * Demonstrates:
  * - defining sequences
  */
-int PhoneBook::create_sequences()
+int CursorPhoneBook::create_sequences()
 {
-	if (DB_SUCCESS(db.create_sequence("contact_id", 1))) {
-		// Success
-		return DB_NOERROR;
-	} else {
-		// Sequence error
-		return DB_ESEQ;
+	for (size_t i = 0; i < sizeof(schema_sequences) / sizeof(schema_sequences[0]); i++) {
+		if (DB_FAILED(state.db.create_sequence(schema_sequences[i], 1))) {
+			// Sequence error
+			return DB_ESEQ;
+		}
+	}
+	return DB_NOERROR;
+}
+
+/**
+ * Create the groups every phone book starts with.
+ */
+int CursorPhoneBook::create_groups()
+{
+	static const wchar_t *const names[] = { L"Favorites", L"Family", L"Work" };
+	TypedTable<ContactGroupRow> group;
+	int rc = DB_NOERROR;
+
+	state.db.tx_begin();
+	group.open(state.db);
+	for (int i = 0; DB_SUCCESS(rc) && i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+		group.insert();
+		group[ContactGroupRow::ID] = (db_uint) (GROUP_FAVORITES + i);
+		group[ContactGroupRow::NAME] = names[i];
+		rc = group.post();
 	}
+	group.close();
+	if (DB_SUCCESS(rc))
+		state.db.tx_commit();
+	else
+		state.db.tx_rollback();
+
+	return rc;
 }
 
 /** 
@@ -167,8 +298,16 @@ int PhoneBook::create_sequences()
  * - opening a database
  * - the DB_FAILED macro
  */
-int PhoneBook::open_database(int file_mode, const char* database_name)
+int CursorPhoneBook::open_database(int file_mode, const char* database_name)
 {
+	TRACE_SPAN("open_database");
+	state.contact_index_loaded = false;
+	state.group_index.clear();
+	state.number_type_index.clear();
+	state.discard_id_block();
+	state.notifier.reset();
+	state.remove_connection();
+
 	// Return code
 	int rc;
 
@@ -176,13 +315,23 @@ int PhoneBook::open_database(int file_mode, const char* database_name)
 	db::StorageMode mode;
     mode.file_mode = file_mode;
 
-	rc = db.open(database_name, mode);
+	rc = state.db.open(database_name, mode);
 
 	if (DB_FAILED(rc)) {
 		cerr << "Error opening database."<< endl;
         print_error(rc);
 		return rc;
 	}
+	state.add_connection(database_name);
+
+	// Databases created without contact cards are read with joins
+	TypedTable<ContactCardRow> card;
+	state.contact_cards = DB_SUCCESS(card.open(state.db));
+	if (state.contact_cards)
+		card.close();
+
+	if (file_mode == db::DB_MEMORY_STORAGE)
+		return open_picture_file(database_name, false);
 
 	return DB_NOERROR;
 }
@@ -194,24 +343,41 @@ int PhoneBook::open_database(int file_mode, const char* database_name)
 	 * - creation of an empty database
 	 * - StorageMode parameter
 	 */
-int PhoneBook::create_database(int file_mode, const char* database_name)
+int CursorPhoneBook::create_database(int file_mode, const char* database_name)
 {
+	TRACE_SPAN("create_database");
+	state.contact_index_loaded = false;
+	state.group_index.clear();
+	state.number_type_index.clear();
+	state.discard_id_block();
+	state.notifier.reset();
+	state.remove_connection();
+
 	int rc;
 	db::StorageMode mode;
     mode.file_mode = file_mode;
+	// Memory storage is too small to hold a second copy of every contact
+	state.contact_cards = file_mode != db::DB_MEMORY_STORAGE && PhoneBookState::default_contact_cards();
     if (file_mode == db::DB_MEMORY_STORAGE) {
-        mode.memory_storage_size = MEMORY_STORAGE_SIZE;
+        mode.memory_storage_size = (long) state.memory_storage_size;
         cout << "Creating " << mode.memory_storage_size << " byte memory storage." << endl;
     }
 
 	// Create a new empty database, overwriting existing files
-	rc = db.create(database_name, mode);
+	rc = state.db.create(database_name, mode);
 
 	if (DB_FAILED(rc)) {
 		cerr << "Error creating new database." << endl;
         print_error(rc);
 		return rc;
 	}
+	state.add_connection(database_name);
+
+	if (file_mode == db::DB_MEMORY_STORAGE) {
+		rc = open_picture_file(database_name, true);
+		if (DB_FAILED(rc))
+			return rc;
+	}
 
 	rc = create_tables(file_mode != db::DB_MEMORY_STORAGE);
 	if (DB_FAILED(rc)) {
@@ -227,6 +393,34 @@ int PhoneBook::create_database(int file_mode, const char* database_name)
 		return rc;
 	}
 
+	rc = create_groups();
+	if (DB_FAILED(rc)) {
+		cerr << "Error creating groups." << endl;
+        print_error(rc);
+		return rc;
+	}
+
+	return rc;
+}
+
+/**
+ * Open the side file that holds picture data for memory storage.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::open_picture_file(const char *database_name, bool create)
+{
+	char file_name[FILENAME_MAX];
+	int rc;
+
+	picture_file_name(database_name, file_name, sizeof file_name);
+	rc = state.side_file.open(file_name, create);
+
+	if (DB_FAILED(rc)) {
+		cerr << "Error opening picture file " << file_name << endl;
+        print_error(rc);
+	}
+
 	return rc;
 }
 
@@ -235,66 +429,75 @@ int PhoneBook::create_database(int file_mode, const char* database_name)
  * 
  * @return database error code
  */
-int PhoneBook::close_database()
+int CursorPhoneBook::close_database()
 {
-	return db.close();
+	state.contact_index_loaded = false;
+	state.group_index.clear();
+	state.number_type_index.clear();
+	state.discard_id_block();
+	state.notifier.reset();
+	state.remove_connection();
+	state.side_file.close();
+	return state.db.close();
 }
 
 /**
  * Insert a contact into the database.
  *
  * Demonstrates:
- * - use of a sequence
  * - opening of a table
  * - insert mode
  * - assigning data to a row
  * - posting data to the database
  * - closing a table
- * - inserting data into a BLOB field
+ * - referencing a shared picture
 	 */
-db_uint PhoneBook::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name)
+db_uint CursorPhoneBook::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name)
 {
-	db::Table t;
-	db::Sequence id_sequence;
+	return insert_contact(name, ring_id, picture_name, picture_name);
+}
+
+/**
+ * Insert a contact whose picture is read from a different file than the
+ * picture name recorded, such as a picture decoded to a temporary file.
+ * Pass a NULL picture_file for a contact without a picture, and a NULL
+ * picture_name as well to leave the picture name unset.
+ */
+db_uint CursorPhoneBook::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+	const char *picture_file)
+{
+	TRACE_SPAN("insert_contact");
+	TypedTable<ContactRow> t;
 	db_uint id;
+	db_uint picture_hash;
+	bool has_picture;
+
+	print_error(state.next_contact_id(id));
 
-	id_sequence.open(db, "contact_id");
-	print_error(id_sequence.get_next_value(id));
+	// Store the picture once, shared by all contacts with the same image
+	has_picture = picture_file != NULL && DB_SUCCESS(acquire_picture(picture_file, picture_hash));
 
-	t.open(db, "contact");
+	t.open(state.db);
 
 	// Put table in insert mode
 	t.insert();
 	// Store values for each field in a temporary buffer
-	t["id"] = id;
-	t["name"] = name;
-	t["ring_id"] = ring_id;
-	t["picture_name"] = picture_name;
+	t[ContactRow::ID] = id;
+	t[ContactRow::NAME] = name;
+	t[ContactRow::RING_ID] = ring_id;
+	if (picture_name != NULL)
+		t[ContactRow::PICTURE_NAME] = picture_name;
+	if (has_picture)
+		t[ContactRow::PICTURE_HASH] = picture_hash;
 	// Post the row data. This does not commit the current transaction.
-	if (DB_FAILED(print_error(t.post())))
+	if (DB_FAILED(print_error(t.post()))) {
 		id = 0;
-
-	// Open picture file
-	FILE *picture_file;
-	if ((picture_file = fopen(picture_name, "rb")) != NULL) {
-						
-		// Prepare BLOB variables
-		int picture_field = t.find_field("picture");
-		int num_chunks = 0;
-		int bytes_read = 0;
-		const db_len_t data_size = 256;
-		char data[data_size];
-
-		// Store picture into BLOB field
-		while((bytes_read = (int)fread(data, 1, data_size, picture_file)) > 0)
-		{
-			t.write_blob (picture_field, data_size * num_chunks, data, bytes_read);
-			num_chunks++;
-		}
-		fclose(picture_file);
-	
+		if (has_picture)
+			release_picture(picture_hash);
 	} else {
-		cerr << "Cannot open " << picture_name << endl;
+		log_change(CONTACT_INSERTED, id, name, ring_id, picture_name, NULL, HOME, 0);
+		count_contact(ring_id, has_picture, 1);
+		insert_card(id, name, ring_id, picture_name);
 	}
 
 	t.close();
@@ -302,22 +505,183 @@ db_uint PhoneBook::insert_contact(const wchar_t *name, db_uint ring_id, const ch
 	return id;
 }
 
+/**
+ * Find a picture in the "picture" table by content, storing it if it is
+ * new, and add a reference to it.
+ *
+ * The content hash is only where the search starts: a stored picture is
+ * shared after its size and bytes compare equal, and a different picture
+ * with the same hash is stored under the next free key. On return, hash
+ * holds the key of the picture.
+ *
+ * @return database error code
+ *
+ * Demonstrates:
+ * - incrementing a counter in edit mode
+ * - inserting data into a BLOB field
+ * - updating a row after writing its BLOB
+ */
+int CursorPhoneBook::acquire_picture(const char *picture_name, db_uint &hash)
+{
+	TRACE_SPAN("acquire_picture");
+	TypedTable<PictureRow> picture;
+	std::vector<char> data;
+	db_uint stored_size;
+	int encoding;
+	bool found = false;
+	int rc;
+
+	if (!read_picture_file(picture_name, data, hash)) {
+		cerr << "Cannot open " << picture_name << endl;
+		return DB_ENOENT;
+	}
+
+	picture.open(state.db);
+
+	// Seek using the "$PK" index, probing past pictures that only share the hash
+	picture.set_sort_order("$PK");
+	for (;; hash++) {
+		picture.begin_seek(db::DB_SEEK_EQUAL);
+		picture[PictureRow::CONTENT_HASH] = hash;
+		if (DB_FAILED(picture.apply_seek()))
+			break;
+
+		if ((db_uint) picture[PictureRow::DATA_SIZE].as_int() != data.size())
+			continue;
+
+		stored_size = picture[PictureRow::STORED_SIZE].as_int();
+		encoding = (int) picture[PictureRow::ENCODING].as_int();
+		if (state.side_file.is_open()) {
+			found = state.side_file.matches(picture[PictureRow::FILE_OFFSET].as_int(), stored_size,
+				encoding, data.data(), data.size());
+		} else {
+			TableBlobIO blob(picture, PictureRow::DATA);
+			found = picture_matches(blob, stored_size, encoding, data.data(), data.size());
+		}
+		if (found)
+			break;
+	}
+
+	if (found) {
+		// An identical picture is already stored, so share it
+		picture.edit();
+		picture[PictureRow::REF_COUNT] = picture[PictureRow::REF_COUNT].as_int() + 1;
+		rc = print_error(picture.post());
+	} else if (state.side_file.is_open()) {
+		// Memory storage: keep the picture data in the side file
+		db_uint offset;
+
+		rc = print_error(state.side_file.append(data.data(), data.size(), state.compress_pictures,
+			offset, stored_size, encoding));
+		if (DB_SUCCESS(rc)) {
+			picture.insert();
+			picture[PictureRow::CONTENT_HASH] = hash;
+			picture[PictureRow::DATA_SIZE] = (db_uint) data.size();
+			picture[PictureRow::STORED_SIZE] = stored_size;
+			picture[PictureRow::ENCODING] = encoding;
+			picture[PictureRow::REF_COUNT] = (db_uint) 1;
+			picture[PictureRow::FILE_OFFSET] = offset;
+			rc = print_error(picture.post());
+		}
+	} else {
+		picture.insert();
+		picture[PictureRow::CONTENT_HASH] = hash;
+		picture[PictureRow::DATA_SIZE] = (db_uint) data.size();
+		picture[PictureRow::STORED_SIZE] = (db_uint) 0;
+		picture[PictureRow::ENCODING] = PICTURE_RAW;
+		picture[PictureRow::REF_COUNT] = (db_uint) 1;
+		rc = print_error(picture.post());
+
+		if (DB_SUCCESS(rc)) {
+			// Store picture into BLOB field, compressing block by block
+			TableBlobIO blob(picture, PictureRow::DATA);
+			rc = print_error(store_picture(data.data(), data.size(), state.compress_pictures, blob,
+				stored_size, encoding));
+
+			if (DB_SUCCESS(rc)) {
+				// Record how the BLOB was encoded
+				picture.edit();
+				picture[PictureRow::STORED_SIZE] = stored_size;
+				picture[PictureRow::ENCODING] = encoding;
+				if (DB_FAILED(rc = print_error(picture.post())))
+					picture.cancel();
+			}
+
+			// Leave no half-stored picture for later lookups to match
+			if (DB_FAILED(rc))
+				print_error(picture.remove());
+		}
+	}
+
+	picture.close();
+
+	return rc;
+}
+
+/**
+ * Remove a reference to a stored picture, deleting the picture when no
+ * contacts refer to it.
+ */
+void CursorPhoneBook::release_picture(db_uint hash)
+{
+	TRACE_SPAN("release_picture");
+	TypedTable<PictureRow> picture;
+
+	picture.open(state.db);
+
+	// Seek using the "$PK" index
+	picture.set_sort_order("$PK");
+	picture.begin_seek(db::DB_SEEK_EQUAL);
+	picture[PictureRow::CONTENT_HASH] = hash;
+
+	if (DB_SUCCESS(print_error(picture.apply_seek()))) {
+		db_uint ref_count = picture[PictureRow::REF_COUNT].as_int();
+
+		if (ref_count > 1) {
+			picture.edit();
+			picture[PictureRow::REF_COUNT] = ref_count - 1;
+			print_error(picture.post());
+		} else {
+			// Last reference: the picture is no longer needed
+			print_error(picture.remove());
+		}
+	}
+
+	picture.close();
+}
+
 /**
  * Insert a phone entry into the database.
  */
-void PhoneBook::insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial)
+void CursorPhoneBook::insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial)
 {
-	db::Table t;
+	TRACE_SPAN("insert_phone_number");
+	TypedTable<PhoneNumberRow> t;
 
-	t.open(db, "phone_number");
+	t.open(state.db);
 
 	t.insert();
-	t["contact_id"] = contact_id;
-	t["number"] = number;
-	t["type"] = type;
-	t["speed_dial"] = speed_dial;
+	t[PhoneNumberRow::CONTACT_ID] = contact_id;
+	t[PhoneNumberRow::NUMBER] = number;
+	t[PhoneNumberRow::NUMBER_KEY] = number_key(number);
+	t[PhoneNumberRow::NUMBER_SUFFIX] = number_suffix_key(number);
+	t[PhoneNumberRow::TYPE] = type;
+	t[PhoneNumberRow::SPEED_DIAL] = speed_dial;
 	if (DB_FAILED(print_error(t.post())))
 		cerr << "Could not enter new phone number" << endl;
+	else {
+		log_change(PHONE_NUMBER_INSERTED, contact_id, NULL, 0, NULL, number, type, speed_dial);
+		add_stat(StatRow::id(StatRow::NUMBERS, type), 1);
+		add_card_number(contact_id, number, type, speed_dial);
+
+		// Keep the bitmap index current
+		if (state.contact_index_loaded) {
+			ContactBitmap *contacts = state.number_type_index.get(type);
+
+			if (contacts == NULL || DB_FAILED(contacts->add(contact_id)))
+				state.contact_index_loaded = false;
+		}
+	}
 
 	t.close();
 }
@@ -329,22 +693,26 @@ void PhoneBook::insert_phone_number(db_uint contact_id, const char *number, Phon
 	 * - searching for existence of a record using an index
 	 * - edit mode
 	 */
-void PhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
+void CursorPhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
 {
-	db::Table contact;
+	TRACE_SPAN("update_contact_name");
+	TypedTable<ContactRow> contact;
 
-	contact.open(db, "contact");
+	contact.open(state.db);
 
 	// Sort with the "$PK" index to avoid a table scan.
 	contact.set_sort_order("$PK");
     // Filter by the "id" column.
     contact.begin_filter(db::DB_SEEK_EQUAL);
-	contact["id"] = id;
+	contact[ContactRow::ID] = id;
 	if (DB_SUCCESS(print_error(contact.apply_filters()))) {
 		// Edit the current row
 		contact.edit();
-		contact["name"] = newname;
-		contact.post();
+		contact[ContactRow::NAME] = newname;
+		if (DB_SUCCESS(print_error(contact.post()))) {
+			log_change(CONTACT_RENAMED, id, newname, 0, NULL, NULL, HOME, 0);
+			update_card(id, newname, NULL);
+		}
 	} else {
 		cerr << "Could not find contact with id " << (long) id << endl;
 	}
@@ -352,6 +720,65 @@ void PhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
 	contact.close();
 }
 
+/**
+ * Replace a contact's picture.
+ *
+ * Demonstrates:
+ * - updating a reference into a shared table
+ */
+void CursorPhoneBook::update_contact_picture(db_uint contact_id, const char *picture_name)
+{
+	TRACE_SPAN("update_contact_picture");
+	set_contact_picture(contact_id, picture_name, picture_name);
+}
+
+/**
+ * Replace a contact's picture with the contents of picture_file, naming
+ * it picture_name.
+ */
+void CursorPhoneBook::set_contact_picture(db_uint contact_id, const char *picture_name,
+	const char *picture_file)
+{
+	TypedTable<ContactRow> contact;
+
+	contact.open(state.db);
+
+	// Sort with the "$PK" index to avoid a table scan.
+	contact.set_sort_order("$PK");
+    // Filter by the "id" column.
+	contact.begin_filter(db::DB_SEEK_EQUAL);
+	contact[ContactRow::ID] = contact_id;
+	if (DB_SUCCESS(print_error(contact.apply_filters()))) {
+		bool had_picture = !contact[ContactRow::PICTURE_HASH].is_null();
+		db_uint old_hash = contact[ContactRow::PICTURE_HASH].as_int();
+		db_uint new_hash;
+
+		if (DB_SUCCESS(acquire_picture(picture_file, new_hash))) {
+			contact.edit();
+			contact[ContactRow::PICTURE_NAME] = picture_name;
+			contact[ContactRow::PICTURE_HASH] = new_hash;
+			if (DB_SUCCESS(print_error(contact.post()))) {
+				log_change(PICTURE_CHANGED, contact_id, NULL, 0, picture_name, NULL, HOME, 0);
+				update_card(contact_id, NULL, picture_name);
+				if (!had_picture)
+					add_stat(StatRow::id(StatRow::PICTURES, 0), 1);
+
+				// Release the old picture only after the new one is referenced,
+				// so replacing a picture with itself never deletes it.
+				if (had_picture)
+					release_picture(old_hash);
+			} else {
+				// The contact still refers to the old picture
+				release_picture(new_hash);
+			}
+		}
+	} else {
+		cerr << "Could not find contact with id " << (long) contact_id << endl;
+	}
+
+	contact.close();
+}
+
 /**
  * Remove contact record from the database.
 	 *
@@ -361,20 +788,26 @@ void PhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
 	 * - range search loop using seek_next()
 	 * - seek_next() returns OK on end, so must explicitly check for is_eof()
  */
-void PhoneBook::remove_contact(db_uint id)
+void CursorPhoneBook::remove_contact(db_uint id)
 {
-	db::Table contact;
-	db::Table phone_number;
+	TRACE_SPAN("remove_contact");
+	TypedTable<ContactRow> contact;
+	TypedTable<PhoneNumberRow> phone_number;
+	TypedTable<GroupMemberRow> group_member;
 
-	contact.open(db, "contact");
+	contact.open(state.db);
 
 	// Sort with the "$PK" index to avoid a table scan.
 	contact.set_sort_order("$PK");
     // Filter by the "id" column.
 	contact.begin_filter(db::DB_SEEK_EQUAL);
-	contact["id"] = id;
+	contact[ContactRow::ID] = id;
 	if (DB_SUCCESS(print_error(contact.apply_filters()))) {
-		db_uint id = contact["id"].as_int();
+		db_uint id = contact[ContactRow::ID].as_int();
+		db_uint ring_id = contact[ContactRow::RING_ID].as_int();
+		bool had_picture = !contact[ContactRow::PICTURE_HASH].is_null();
+		db_uint picture_hash = contact[ContactRow::PICTURE_HASH].as_int();
+		db_sint numbers[PAGER + 1] = { 0 };
 
         // Optimization: prevent others from reading this contact while its
         // phone numbers are removed.
@@ -382,20 +815,49 @@ void PhoneBook::remove_contact(db_uint id)
 
         // Remove related telephone numbers
 
-		phone_number.open(db, "phone_number");
+		phone_number.open(state.db);
 		phone_number.set_sort_order("by_contact_id");
 
 		// Filter phone numbers by the "contact_id" column.
 		phone_number.begin_filter(db::DB_SEEK_EQUAL);
-		phone_number["contact_id"] = id;
+		phone_number[PhoneNumberRow::CONTACT_ID] = id;
 		phone_number.apply_filters();
 
-        // Remove all matching phone numbers.
-        for (phone_number.seek_first(); !phone_number.is_eof(); phone_number.seek_next())
-			phone_number.remove();
+        // Remove all matching phone numbers, counting them by type.
+        for (phone_number.seek_first(); !phone_number.is_eof(); phone_number.seek_next()) {
+			db_uint type = phone_number[PhoneNumberRow::TYPE].as_int();
+
+			if (DB_SUCCESS(phone_number.remove()) && type <= PAGER)
+				numbers[type]++;
+		}
+
+		// Remove the contact from its groups
+		group_member.open(state.db);
+		group_member.set_sort_order("by_member_contact");
+		group_member.begin_filter(db::DB_SEEK_EQUAL);
+		group_member[GroupMemberRow::CONTACT_ID] = id;
+		group_member.apply_filters();
+		for (group_member.seek_first(); !group_member.is_eof(); group_member.seek_next())
+			group_member.remove();
+		group_member.close();
 
 		// Remove the current contact
-		contact.remove();
+		if (DB_SUCCESS(print_error(contact.remove()))) {
+			log_change(CONTACT_REMOVED, id, NULL, 0, NULL, NULL, HOME, 0);
+			state.group_index.remove_contact(id);
+			state.number_type_index.remove_contact(id);
+			remove_card(id);
+
+			count_contact(ring_id, had_picture, -1);
+			for (int type = HOME; type <= PAGER; type++) {
+				if (numbers[type] != 0)
+					add_stat(StatRow::id(StatRow::NUMBERS, type), -numbers[type]);
+			}
+
+			// Drop the contact's reference to its shared picture
+			if (had_picture)
+				release_picture(picture_hash);
+		}
 
 		phone_number.close();
 	} else {
@@ -408,123 +870,169 @@ void PhoneBook::remove_contact(db_uint id)
 /**
  * Briefly list all contacts in the database.
  */
-void PhoneBook::list_contacts_brief()
+void CursorPhoneBook::list_contacts_brief()
 {
-	db::Table contact;
-	
-	contact.open(db, "contact");
-	contact.set_sort_order("by_name");
+	TRACE_SPAN("list_contacts_brief");
+	ContactResults results;
+
+	if (DB_SUCCESS(print_error(get_contacts_brief(results))))
+		print_contacts_brief(results);
+}
 
-	for (contact.seek_first(); !contact.is_eof(); contact.seek_next()) {
-		db_uint id = contact["id"].as_int();
-		db::WString name = contact["name"].as_wstring();
-        char name_mbs[50];
+/**
+ * List all contacts in the database with full phone numbers
+ */
+void CursorPhoneBook::list_contacts(int sort)
+{
+	TRACE_SPAN("list_contacts");
+	ContactResults results;
+
+	if (DB_SUCCESS(print_error(get_contacts(sort, results))))
+		print_contacts(results);
+}
+
+/**
+ * Read the id and name of every contact, in name order, replacing the
+ * contents of results.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::get_contacts_brief(ContactResults &results)
+{
+	TRACE_SPAN("get_contacts_brief");
+	TypedTable<ContactRow> contact;
+	int rc = DB_NOERROR;
 
-        wcstombs(name_mbs, name.c_str(), sizeof name_mbs/sizeof name_mbs[0]);
+	results.clear();
 
-		cout << (long) id << '\t';
-		cout << name_mbs << endl;
+	contact.open(state.db);
+	contact.set_sort_order("by_name");
+	sort_contacts(contact, 1);
+
+	for (contact.seek_first(); DB_SUCCESS(rc) && !contact.is_eof(); contact.seek_next()) {
+		db::WString name = contact[ContactRow::NAME].as_wstring();
+
+		rc = results.add_contact(contact[ContactRow::ID].as_int(), name.c_str(), false, 0, NULL);
 	}
 
 	contact.close();
+	results.finish();
+	return rc;
 }
 
 /**
- * List all contacts in the database with full phone numbers
+ * Read every contact with its phone numbers, replacing the contents of
+ * results. Contacts are sorted by id (0), name (1), or ring id and name
+ * (2).
+ *
+ * @return database error code
  *
  * Demonstrates:
  * - parent/child relationships
  */
-void PhoneBook::list_contacts(int sort)
+int CursorPhoneBook::get_contacts(int sort, ContactResults &results)
 {
-	db::Table contact;
-	db::Table phone_number;
-	
-	contact.open(db, "contact");
-	contact.set_sort_order("by_name");
+	TRACE_SPAN("get_contacts");
+	TypedTable<ContactRow> contact;
+	TypedTable<PhoneNumberRow> phone_number;
+	int rc = DB_NOERROR;
 
-    db::IndexFieldSet sort_fields;
-    switch (sort) {
-        case 0:
-            sort_fields.add("id");
-            break;
-        case 1:
-            sort_fields.add("name");
-            break;
-        case 2:
-            sort_fields.add("ring_id");
-            sort_fields.add("name");
-            break;
-    }
-    contact.sort(sort_fields);
-
-	for (contact.seek_first(); !contact.is_eof(); contact.seek_next()) {
-		db_uint id = contact["id"].as_int();
-
-		db::WString name = contact["name"].as_wstring();
-        char name_mbs[50];
-		db_uint ring_id = contact["ring_id"].as_int();
-		db::String picture_name = contact["picture_name"].as_string();
-        wcstombs(name_mbs, name.c_str(), sizeof name_mbs/sizeof name_mbs[0]);
-
-		// Output the contact's name and ring tone
-		cout << "Id: " << (long) id << endl;
-		cout << "Name: " << name_mbs << endl;
-        if (!contact["ring_id"].is_null())
-    		cout << "Ring tone id: " << (int) ring_id << endl;
-        if (!contact["picture_name"].is_null())
-    		cout << "Picture name: " << picture_name.c_str() << endl;
-
-		phone_number.open(db, "phone_number");
-		phone_number.set_sort_order("by_contact_id");
+	if (state.contact_cards)
+		return get_contact_cards(sort, results);
 
-		// List the contact's phone numbers
-		phone_number.begin_filter(db::DB_SEEK_EQUAL);
-		phone_number["contact_id"] = id;
-		phone_number.apply_filters();
-        for (phone_number.seek_first(); !phone_number.is_eof(); phone_number.seek_next()) {
-			db::String number = phone_number["number"].as_string();
-			PhoneNumberType type = (PhoneNumberType) (db_uint) phone_number["type"].as_int();
-			int speed_dial = phone_number["speed_dial"].as_int();
-
-			cout << "Phone number: " << number.c_str() << " (";
-			switch (type) {
-				case HOME:   cout << "Home"; break;
-				case MOBILE: cout << "Mobile"; break;
-				case WORK:   cout << "Work"; break;
-				case FAX:    cout << "Fax"; break;
-				case PAGER:  cout << "Pager"; break;
-			}
-			if (speed_dial >= 0)
-				cout << ", speed dial " << speed_dial;
-			cout << ")" << endl;
-		}
+	results.clear();
 
-		phone_number.close();
+	contact.open(state.db);
+	contact.set_sort_order("by_name");
+	sort_contacts(contact, sort);
+
+	phone_number.open(state.db);
+	phone_number.set_sort_order("by_contact_id");
 
-		cout << endl;
+	for (contact.seek_first(); DB_SUCCESS(rc) && !contact.is_eof(); contact.seek_next()) {
+		rc = add_contact_row(contact, results);
+
+		// Add the contact's phone numbers
+		TRACE_SPAN("phone_number filter");
+		if (DB_SUCCESS(rc))
+			rc = add_phone_numbers(phone_number, contact[ContactRow::ID].as_int(), results);
 	}
 
+	phone_number.close();
 	contact.close();
+	results.finish();
+	return rc;
 }
 
 /**
- * Retrieve picture_name field from a contact
+ * Read every contact with its phone numbers from the "contact_card"
+ * table, one row per contact, replacing the contents of results. Sorted
+ * as by get_contacts().
+ *
+ * @return database error code
  */
-db::String PhoneBook::get_picture_name(db_uint id)
+int CursorPhoneBook::get_contact_cards(int sort, ContactResults &results)
 {
-	db::Table contact;
-	
-	contact.open(db, "contact");
+	TRACE_SPAN("contact card scan");
+	TypedTable<ContactCardRow> card;
+	TypedTable<PhoneNumberRow> phone_number;
+	int rc = DB_NOERROR;
 
-	// Seek using the "$PK" index
+	results.clear();
+
+	card.open(state.db);
+	card.set_sort_order("by_card_name");
+	sort_contacts(card, sort);
+
+	// Only read for cards whose numbers do not fit
+	phone_number.open(state.db);
+	phone_number.set_sort_order("by_contact_id");
+
+	for (card.seek_first(); DB_SUCCESS(rc) && !card.is_eof(); card.seek_next()) {
+		rc = add_contact_row(card, results);
+		if (DB_SUCCESS(rc))
+			rc = add_card_numbers(card, phone_number, results);
+	}
+
+	phone_number.close();
+	card.close();
+	results.finish();
+	return rc;
+}
+
+/**
+ * Retrieve picture_name field from a contact
+ */
+db::String CursorPhoneBook::get_picture_name(db_uint id)
+{
+	ResultArena arena;
+	const char *picture_name = get_picture_name(id, arena);
+
+	return db::String(picture_name != NULL ? picture_name : "");
+}
+
+/**
+ * Retrieve picture_name field from a contact into an arena.
+ *
+ * @return the picture name, or NULL if the contact has none or does not
+ * exist
+ */
+const char *CursorPhoneBook::get_picture_name(db_uint id, ResultArena &arena)
+{
+	TRACE_SPAN("get_picture_name");
+	TypedTable<ContactRow> contact;
+	const char *picture_name = NULL;
+
+	contact.open(state.db);
+
+	// Seek using the "$PK" index
 	contact.set_sort_order("$PK");
 	contact.begin_seek(db::DB_SEEK_EQUAL);
-	contact["id"] = id;
-	db::String picture_name;
-	
+	contact[ContactRow::ID] = id;
+
 	if (DB_SUCCESS(print_error(contact.apply_seek()))) {
-		picture_name = contact["picture_name"].as_string();
+		if (!contact[ContactRow::PICTURE_NAME].is_null())
+			picture_name = arena.copy(contact[ContactRow::PICTURE_NAME].as_string().c_str());
 	} else {
 		cerr << "Could not find contact with id " << (long) id << endl;
 	}
@@ -535,70 +1043,1507 @@ db::String PhoneBook::get_picture_name(db_uint id)
 
 /**
  * Export picture file to disk
+ */
+void CursorPhoneBook::export_picture(db_uint id, const char *file_name)
+{
+	// Open file
+	FILE *picture_file = fopen(file_name, "wb");
+	int rc;
+
+	if (picture_file == NULL) {
+		cerr << "Cannot open " << file_name << endl;
+		return;
+	}
+
+	rc = export_picture(id, picture_file);
+	fclose(picture_file);
+
+	if (rc == DB_ENOENT) {
+		cerr << "Could not find picture for contact with id " << (long) id << endl;
+		remove(file_name);
+	}
+}
+
+/**
+ * Write a contact's picture to an open file.
+ *
+ * @return DB_ENOENT if the contact does not exist or has no picture, or
+ * another database error code
  *
  * Demonstrates:
+ * - following a reference into a shared table
  * - reading the contents of a BLOB
+ * - streaming decompression
  */
-void PhoneBook::export_picture(db_uint id, const char *file_name)
+int CursorPhoneBook::export_picture(db_uint id, FILE *picture_file)
 {
-	db::Table contact;
-	
-	contact.open(db, "contact");
+	TRACE_SPAN("export_picture");
+	TypedTable<ContactRow> contact;
+	TypedTable<PictureRow> picture;
+	int rc = DB_ENOENT;
+
+	contact.open(state.db);
 
 	// Seek using the "$PK" index
 	contact.set_sort_order("$PK");
 	contact.begin_filter(db::DB_SEEK_EQUAL);
-	contact["id"] = id;
+	contact[ContactRow::ID] = id;
     contact.apply_filters();
-	if (DB_SUCCESS(print_error(contact.seek_first()))) {
-
-		// Open file
-		FILE *picture_file;
-		if ((picture_file = fopen(file_name, "wb")) != NULL) {
-
-			// Prepare BLOB variables
-			int offset, bytes_read;
-			int picture_field = contact.find_field("picture");
-			db_len_t blob_size = contact.get_blob_size(picture_field);
-			const db_len_t data_size = 256;
-			char data[data_size];
-
-			// Export file from BLOB to disk
-			for(offset = 0; offset < blob_size; offset += data_size)
-			{
-				DB_SUCCESS(bytes_read = contact.read_blob(picture_field, offset, data, data_size));
-				fwrite(data, bytes_read, 1, picture_file);
+	if (DB_SUCCESS(contact.seek_first()) && !contact.is_eof() &&
+			!contact[ContactRow::PICTURE_HASH].is_null()) {
+		picture.open(state.db);
+
+		// Seek the shared copy using the "$PK" index
+		picture.set_sort_order("$PK");
+		picture.begin_seek(db::DB_SEEK_EQUAL);
+		picture[PictureRow::CONTENT_HASH] = contact[ContactRow::PICTURE_HASH].as_int();
+
+		if (DB_SUCCESS(picture.apply_seek())) {
+			db_uint stored_size = picture[PictureRow::STORED_SIZE].as_int();
+			int encoding = (int) picture[PictureRow::ENCODING].as_int();
+
+			if (state.side_file.is_open()) {
+				// Memory storage: copy from the mapped side file
+				rc = print_error(state.side_file.export_to(picture[PictureRow::FILE_OFFSET].as_int(),
+					stored_size, encoding, picture_file));
+			} else {
+				// Export file from BLOB to disk, one block at a time
+				TableBlobIO blob(picture, PictureRow::DATA);
+				rc = print_error(load_picture(blob, stored_size, encoding, picture_file));
+			}
+		}
+
+		picture.close();
+	}
+
+	contact.close();
+	return rc;
+}
+
+/**
+ * Measure how much space is saved by sharing identical pictures.
+ *
+ * Demonstrates:
+ * - aggregating values with a full table scan
+ */
+void CursorPhoneBook::get_picture_stats(PictureStats &stats)
+{
+	TRACE_SPAN("get_picture_stats");
+	TypedTable<PictureRow> picture;
+
+	stats.pictures = 0;
+	stats.references = 0;
+	stats.logical_bytes = 0;
+	stats.stored_bytes = 0;
+
+	// The table holds one row per distinct picture, so the scan is short
+	picture.open(state.db);
+
+	for (picture.seek_first(); !picture.is_eof(); picture.seek_next()) {
+		db_uint size = picture[PictureRow::DATA_SIZE].as_int();
+		db_uint ref_count = picture[PictureRow::REF_COUNT].as_int();
+
+		stats.pictures++;
+		stats.references += ref_count;
+		stats.stored_bytes += picture[PictureRow::STORED_SIZE].as_int();
+		stats.logical_bytes += size * ref_count;
+	}
+
+	picture.close();
+}
+
+/**
+ * Enable or disable compression of newly stored pictures. Pictures
+ * already stored keep their encoding.
+ */
+void CursorPhoneBook::set_picture_compression(bool enable)
+{
+	state.compress_pictures = enable;
+}
+
+/**
+ * Append a change to the change log, in the same transaction as the
+ * change itself. Only the fields belonging to the change type are stored.
+ */
+void CursorPhoneBook::log_change(ChangeType type, db_uint contact_id, const wchar_t *name,
+	db_uint ring_id, const char *picture_name,
+	const char *number, PhoneNumberType number_type, db_sint speed_dial,
+	db_uint group_id)
+{
+	TRACE_SPAN("log_change");
+	TypedTable<ChangeLogRow> log;
+	db::Sequence seq_sequence;
+	db_uint seq;
+
+	if (!state.log_changes)
+		return;
+
+	seq_sequence.open(state.db, "change_seq");
+	if (DB_FAILED(print_error(seq_sequence.get_next_value(seq)))) {
+		// Without a sequence number the change cannot be logged
+		state.contact_index_loaded = false;
+		return;
+	}
+
+	log.open(state.db);
+
+	log.insert();
+	log[ChangeLogRow::SEQ] = seq;
+	log[ChangeLogRow::OPERATION] = type;
+	log[ChangeLogRow::CONTACT_ID] = contact_id;
+	switch (type) {
+		case CONTACT_INSERTED:
+			log[ChangeLogRow::NAME] = name;
+			log[ChangeLogRow::RING_ID] = ring_id;
+			log[ChangeLogRow::PICTURE_NAME] = picture_name;
+			break;
+		case PHONE_NUMBER_INSERTED:
+			log[ChangeLogRow::NUMBER] = number;
+			log[ChangeLogRow::TYPE] = number_type;
+			log[ChangeLogRow::SPEED_DIAL] = speed_dial;
+			break;
+		case CONTACT_RENAMED:
+			log[ChangeLogRow::NAME] = name;
+			break;
+		case PICTURE_CHANGED:
+			log[ChangeLogRow::PICTURE_NAME] = picture_name;
+			break;
+		case GROUP_CREATED:
+			log[ChangeLogRow::NAME] = name;
+			log[ChangeLogRow::GROUP_ID] = group_id;
+			break;
+		case GROUP_MEMBER_ADDED:
+		case GROUP_MEMBER_REMOVED:
+			log[ChangeLogRow::GROUP_ID] = group_id;
+			break;
+		default:
+			break;
+	}
+	print_error(log.post());
+
+	log.close();
+
+	// The bitmap index stays valid only while it has seen every change
+	if (state.contact_index_loaded && seq == state.contact_index_seq + 1)
+		state.contact_index_seq = seq;
+	else
+		state.contact_index_loaded = false;
+}
+
+/**
+ * Stream the changes made after a sequence number, oldest first. Pass 0
+ * to read the whole log.
+ *
+ * @return false if changes after seq have been compacted away or the log
+ * cannot be read, in which case the caller must read the whole phone book
+ *
+ * Demonstrates:
+ * - range search starting from a key using DB_SEEK_GREATER
+ */
+bool CursorPhoneBook::changes_since(db_uint seq, ChangeVisitor &visitor)
+{
+	TRACE_SPAN("changes_since");
+	TypedTable<ChangeLogRow> log;
+	bool complete = true;
+
+	if (DB_FAILED(print_error(log.open(state.db))))
+		return false;
+	log.set_sort_order("$PK");
+
+	// The oldest entry marks how far the log has been compacted
+	log.seek_first();
+	if (!log.is_eof() && log[ChangeLogRow::OPERATION].as_int() == CHANGES_COMPACTED &&
+			(db_uint) log[ChangeLogRow::SEQ].as_int() > seq) {
+		complete = false;
+	} else {
+		log.begin_seek(db::DB_SEEK_GREATER);
+		log[ChangeLogRow::SEQ] = seq;
+
+		for (int rc = log.apply_seek(); DB_SUCCESS(rc) && !log.is_eof(); rc = log.seek_next()) {
+			ChangeRecord record;
+			db::WString name = log[ChangeLogRow::NAME].as_wstring();
+			db::String picture_name = log[ChangeLogRow::PICTURE_NAME].as_string();
+			db::String number = log[ChangeLogRow::NUMBER].as_string();
+
+			record.seq = log[ChangeLogRow::SEQ].as_int();
+			record.type = (ChangeType) (db_uint) log[ChangeLogRow::OPERATION].as_int();
+			record.contact_id = log[ChangeLogRow::CONTACT_ID].as_int();
+			record.name = log[ChangeLogRow::NAME].is_null() ? NULL : name.c_str();
+			record.ring_id = log[ChangeLogRow::RING_ID].as_int();
+			record.picture_name = log[ChangeLogRow::PICTURE_NAME].is_null() ? NULL : picture_name.c_str();
+			record.picture_file = NULL;
+			record.number = log[ChangeLogRow::NUMBER].is_null() ? NULL : number.c_str();
+			record.number_type = (PhoneNumberType) (db_uint) log[ChangeLogRow::TYPE].as_int();
+			record.speed_dial = log[ChangeLogRow::SPEED_DIAL].as_int();
+			record.group_id = log[ChangeLogRow::GROUP_ID].as_int();
+
+			if (record.type != CHANGES_COMPACTED && !visitor.change(record))
+				break;
+		}
+	}
+
+	log.close();
+
+	return complete;
+}
+
+/**
+ * Discard change log entries up to and including a sequence number, once
+ * every device has synchronized past it. A marker entry remembers the
+ * point of compaction so older devices know to read the whole phone book.
+ *
+ * Demonstrates:
+ * - deleting a range of records from the start of an index
+ */
+void CursorPhoneBook::compact_change_log(db_uint through_seq)
+{
+	TRACE_SPAN("compact_change_log");
+	TypedTable<ChangeLogRow> log;
+
+	log.open(state.db);
+	log.set_sort_order("$PK");
+
+	// Never compact past the newest entry
+	log.seek_last();
+	if (!log.is_eof() && (db_uint) log[ChangeLogRow::SEQ].as_int() < through_seq)
+		through_seq = log[ChangeLogRow::SEQ].as_int();
+
+	log.seek_first();
+	bool compacted = !log.is_eof() && log[ChangeLogRow::OPERATION].as_int() == CHANGES_COMPACTED &&
+		(db_uint) log[ChangeLogRow::SEQ].as_int() >= through_seq;
+
+	if (!compacted) {
+		bool removed = false;
+
+		for (; !log.is_eof() && (db_uint) log[ChangeLogRow::SEQ].as_int() <= through_seq; log.seek_next()) {
+			log.remove();
+			removed = true;
+		}
+
+		if (removed) {
+			log.insert();
+			log[ChangeLogRow::SEQ] = through_seq;
+			log[ChangeLogRow::OPERATION] = CHANGES_COMPACTED;
+			log[ChangeLogRow::CONTACT_ID] = (db_uint) 0;
+			print_error(log.post());
+		}
+	}
+
+	log.close();
+}
+
+/**
+ * Find the sequence number of the newest change log entry.
+ *
+ * @return 0 if the log is empty
+ */
+db_uint CursorPhoneBook::last_change_seq()
+{
+	TRACE_SPAN("last_change_seq");
+	TypedTable<ChangeLogRow> log;
+	db_uint seq = 0;
+
+	log.open(state.db);
+	log.set_sort_order("$PK");
+
+	log.seek_last();
+	if (!log.is_eof())
+		seq = log[ChangeLogRow::SEQ].as_int();
+
+	log.close();
+	return seq;
+}
+
+/**
+ * Enable or disable the change log. A replica that applies changes read
+ * from another phone book does not need to record them again.
+ *
+ * Changes made while the log is off leave no sequence number behind, so
+ * the bitmap indexes are rebuilt once it is turned back on.
+ */
+void CursorPhoneBook::set_change_logging(bool enable)
+{
+	if (enable != state.log_changes)
+		state.contact_index_loaded = false;
+	state.log_changes = enable;
+}
+
+/**
+ * Reserve contact ids for this connection in blocks of the given size,
+ * or one at a time for a size of 1.
+ */
+void CursorPhoneBook::set_id_block_size(unsigned size)
+{
+	state.set_id_block_size(size);
+}
+
+/**
+ * Set the RAM given to memory storage databases created from now on.
+ */
+void CursorPhoneBook::set_memory_storage_size(db_uint size)
+{
+	state.memory_storage_size = size;
+}
+
+/**
+ * Find the smallest and largest contact id.
+ *
+ * @return false if there are no contacts
+ */
+bool CursorPhoneBook::get_contact_id_range(db_uint &first_id, db_uint &last_id)
+{
+	TypedTable<ContactRow> contact;
+	bool found = false;
+
+	contact.open(state.db);
+	contact.set_sort_order("$PK");
+
+	contact.seek_first();
+	if (!contact.is_eof()) {
+		first_id = contact[ContactRow::ID].as_int();
+		contact.seek_last();
+		last_id = contact[ContactRow::ID].as_int();
+		found = true;
+	}
+
+	contact.close();
+	return found;
+}
+
+/**
+ * Stream the contacts with ids from first_id to last_id, inclusive, in id
+ * order, as if each had just been inserted: a CONTACT_INSERTED record
+ * followed by a PHONE_NUMBER_INSERTED record for each of its phone
+ * numbers. Records carry sequence number 0. By default every contact is
+ * streamed.
+ *
+ * Demonstrates:
+ * - parent/child relationships
+ * - range search starting from a key using DB_SEEK_GREATER_OR_EQUAL
+ */
+void CursorPhoneBook::visit_contacts(ChangeVisitor &visitor, db_uint first_id, db_uint last_id)
+{
+	TRACE_SPAN("visit_contacts");
+	TypedTable<ContactRow> contact;
+	TypedTable<PhoneNumberRow> phone_number;
+	bool more = true;
+
+	contact.open(state.db);
+	contact.set_sort_order("$PK");
+	phone_number.open(state.db);
+	phone_number.set_sort_order("by_contact_id");
+
+	contact.begin_seek(db::DB_SEEK_GREATER_OR_EQUAL);
+	contact[ContactRow::ID] = first_id;
+
+	for (int rc = contact.apply_seek(); more && DB_SUCCESS(rc) && !contact.is_eof(); rc = contact.seek_next()) {
+		ChangeRecord record;
+
+		record.contact_id = contact[ContactRow::ID].as_int();
+		if (record.contact_id > last_id)
+			break;
+
+		db::WString name = contact[ContactRow::NAME].as_wstring();
+		db::String picture_name = contact[ContactRow::PICTURE_NAME].as_string();
+
+		record.seq = 0;
+		record.type = CONTACT_INSERTED;
+		record.name = name.c_str();
+		record.ring_id = contact[ContactRow::RING_ID].as_int();
+		record.picture_name = contact[ContactRow::PICTURE_NAME].is_null() ? NULL : picture_name.c_str();
+		record.picture_file = NULL;
+		record.number = NULL;
+		record.number_type = HOME;
+		record.speed_dial = 0;
+		record.group_id = 0;
+		more = visitor.change(record);
+
+		// Follow with the contact's phone numbers
+		phone_number.begin_filter(db::DB_SEEK_EQUAL);
+		phone_number[PhoneNumberRow::CONTACT_ID] = record.contact_id;
+		phone_number.apply_filters();
+		for (phone_number.seek_first(); more && !phone_number.is_eof(); phone_number.seek_next()) {
+			db::String number = phone_number[PhoneNumberRow::NUMBER].as_string();
+
+			record.type = PHONE_NUMBER_INSERTED;
+			record.name = NULL;
+			record.ring_id = 0;
+			record.picture_name = NULL;
+			record.picture_file = NULL;
+			record.number = number.c_str();
+			record.number_type = (PhoneNumberType) (db_uint) phone_number[PhoneNumberRow::TYPE].as_int();
+			record.speed_dial = phone_number[PhoneNumberRow::SPEED_DIAL].as_int();
+			more = visitor.change(record);
+		}
+	}
+
+	phone_number.close();
+	contact.close();
+}
+
+/**
+ * Pass every group to the visitor as a GROUP_CREATED record, then every
+ * membership as a GROUP_MEMBER_ADDED record, with sequence number 0.
+ * Applying them after visit_contacts() rebuilds the groups.
+ */
+void CursorPhoneBook::visit_groups(ChangeVisitor &visitor)
+{
+	TRACE_SPAN("visit_groups");
+	TypedTable<ContactGroupRow> group;
+	TypedTable<GroupMemberRow> group_member;
+	ChangeRecord record;
+	bool more = true;
+
+	record.seq = 0;
+	record.contact_id = 0;
+	record.ring_id = 0;
+	record.picture_name = NULL;
+	record.picture_file = NULL;
+	record.number = NULL;
+	record.number_type = HOME;
+	record.speed_dial = 0;
+
+	group.open(state.db);
+	group.set_sort_order("$PK");
+	for (group.seek_first(); more && !group.is_eof(); group.seek_next()) {
+		db::WString name = group[ContactGroupRow::NAME].as_wstring();
+
+		record.type = GROUP_CREATED;
+		record.group_id = group[ContactGroupRow::ID].as_int();
+		record.name = name.c_str();
+		more = visitor.change(record);
+	}
+	group.close();
+
+	record.name = NULL;
+	group_member.open(state.db);
+	group_member.set_sort_order("by_member_group");
+	for (group_member.seek_first(); more && !group_member.is_eof(); group_member.seek_next()) {
+		record.type = GROUP_MEMBER_ADDED;
+		record.group_id = group_member[GroupMemberRow::GROUP_ID].as_int();
+		record.contact_id = group_member[GroupMemberRow::CONTACT_ID].as_int();
+		more = visitor.change(record);
+	}
+	group_member.close();
+}
+
+/**
+ * Find the phone numbers starting with the given digits, in E.164 order.
+ * Punctuation is ignored and a number without a leading '+' is taken to
+ * be in the default country. Each match is passed to the visitor as a
+ * PHONE_NUMBER_INSERTED record with sequence number 0 and the name of the
+ * contact it belongs to.
+ *
+ * Demonstrates:
+ * - range search on an integer index using DB_SEEK_GREATER_OR_EQUAL
+ * - joining tables by seeking on the primary key
+ */
+void CursorPhoneBook::find_phone_numbers(const char *number, ChangeVisitor &visitor)
+{
+	TRACE_SPAN("find_phone_numbers");
+	TypedTable<ContactRow> contact;
+	TypedTable<PhoneNumberRow> phone_number;
+	db_uint low, high;
+	bool more = true;
+
+	if (!number_key_range(number, low, high))
+		return;
+
+	contact.open(state.db);
+	contact.set_sort_order("$PK");
+	phone_number.open(state.db);
+	phone_number.set_sort_order("by_number_key");
+
+	phone_number.begin_seek(db::DB_SEEK_GREATER_OR_EQUAL);
+	phone_number[PhoneNumberRow::NUMBER_KEY] = low;
+
+	for (int rc = phone_number.apply_seek(); more && DB_SUCCESS(rc) && !phone_number.is_eof(); rc = phone_number.seek_next()) {
+		ChangeRecord record;
+
+		if ((db_uint) phone_number[PhoneNumberRow::NUMBER_KEY].as_int() > high)
+			break;
+
+		db::String number_value = phone_number[PhoneNumberRow::NUMBER].as_string();
+		db::WString name;
+
+		record.seq = 0;
+		record.type = PHONE_NUMBER_INSERTED;
+		record.contact_id = phone_number[PhoneNumberRow::CONTACT_ID].as_int();
+		record.ring_id = 0;
+		record.picture_name = NULL;
+		record.picture_file = NULL;
+		record.number = number_value.c_str();
+		record.number_type = (PhoneNumberType) (db_uint) phone_number[PhoneNumberRow::TYPE].as_int();
+		record.speed_dial = phone_number[PhoneNumberRow::SPEED_DIAL].as_int();
+		record.group_id = 0;
+
+		contact.begin_seek(db::DB_SEEK_EQUAL);
+		contact[ContactRow::ID] = record.contact_id;
+		if (DB_SUCCESS(contact.apply_seek()) && !contact.is_eof())
+			name = contact[ContactRow::NAME].as_wstring();
+		record.name = name.c_str();
+
+		more = visitor.change(record);
+	}
+
+	phone_number.close();
+	contact.close();
+}
+
+/**
+ * Find the phone numbers ending with the given digits, ordered by their
+ * digits read backwards. Punctuation is ignored. At most limit matches are
+ * passed to the visitor, or all of them if limit is 0, each as a
+ * PHONE_NUMBER_INSERTED record with sequence number 0 and the name of the
+ * contact it belongs to.
+ *
+ * Demonstrates:
+ * - range search on an index of reversed keys
+ * - joining tables by seeking on the primary key
+ *
+ * @return database error code; DB_EINVAL if digits holds no digits
+ */
+int CursorPhoneBook::search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor)
+{
+	TRACE_SPAN("search_by_number_suffix");
+	TypedTable<ContactRow> contact;
+	TypedTable<PhoneNumberRow> phone_number;
+	db_uint low, high;
+	size_t count = 0;
+	bool more = true;
+	int rc;
+
+	if (!number_suffix_range(digits, low, high))
+		return DB_EINVAL;
+
+	contact.open(state.db);
+	contact.set_sort_order("$PK");
+	phone_number.open(state.db);
+	phone_number.set_sort_order("by_number_suffix");
+
+	phone_number.begin_seek(db::DB_SEEK_GREATER_OR_EQUAL);
+	phone_number[PhoneNumberRow::NUMBER_SUFFIX] = low;
+
+	for (rc = phone_number.apply_seek(); more && DB_SUCCESS(rc) && !phone_number.is_eof(); rc = phone_number.seek_next()) {
+		ChangeRecord record;
+
+		if ((db_uint) phone_number[PhoneNumberRow::NUMBER_SUFFIX].as_int() > high)
+			break;
+		if (limit != 0 && count == limit)
+			break;
+
+		db::String number_value = phone_number[PhoneNumberRow::NUMBER].as_string();
+		db::WString name;
+
+		record.seq = 0;
+		record.type = PHONE_NUMBER_INSERTED;
+		record.contact_id = phone_number[PhoneNumberRow::CONTACT_ID].as_int();
+		record.ring_id = 0;
+		record.picture_name = NULL;
+		record.picture_file = NULL;
+		record.number = number_value.c_str();
+		record.number_type = (PhoneNumberType) (db_uint) phone_number[PhoneNumberRow::TYPE].as_int();
+		record.speed_dial = phone_number[PhoneNumberRow::SPEED_DIAL].as_int();
+		record.group_id = 0;
+
+		contact.begin_seek(db::DB_SEEK_EQUAL);
+		contact[ContactRow::ID] = record.contact_id;
+		if (DB_SUCCESS(contact.apply_seek()) && !contact.is_eof())
+			name = contact[ContactRow::NAME].as_wstring();
+		record.name = name.c_str();
+
+		count++;
+		more = visitor.change(record);
+	}
+
+	phone_number.close();
+	contact.close();
+
+	// Running past the last matching number is not an error
+	if (rc == DB_ENOTFOUND)
+		rc = DB_NOERROR;
+	return print_error(rc);
+}
+
+/**
+ * Apply a change read from another phone book, keeping its contact id.
+ * Picture data is copied only from a record's picture_file; otherwise the
+ * contact keeps only its picture name.
+ */
+void CursorPhoneBook::apply_change(const ChangeRecord &record)
+{
+	TRACE_SPAN("apply_change");
+	TypedTable<ContactRow> contact;
+	TypedTable<ContactGroupRow> group;
+
+	switch (record.type) {
+		case CONTACT_INSERTED:
+			contact.open(state.db);
+			contact.insert();
+			contact[ContactRow::ID] = record.contact_id;
+			contact[ContactRow::NAME] = record.name;
+			contact[ContactRow::RING_ID] = record.ring_id;
+			if (record.picture_name != NULL)
+				contact[ContactRow::PICTURE_NAME] = record.picture_name;
+			if (DB_SUCCESS(print_error(contact.post()))) {
+				log_change(CONTACT_INSERTED, record.contact_id, record.name,
+					record.ring_id, record.picture_name, NULL, HOME, 0);
+				count_contact(record.ring_id, false, 1);
+				insert_card(record.contact_id, record.name, record.ring_id, record.picture_name);
+				reserve_contact_id(record.contact_id);
+				if (record.picture_file != NULL)
+					set_contact_picture(record.contact_id, record.picture_name, record.picture_file);
+			}
+			contact.close();
+			break;
+		case PHONE_NUMBER_INSERTED:
+			insert_phone_number(record.contact_id, record.number, record.number_type,
+				record.speed_dial);
+			break;
+		case CONTACT_RENAMED:
+			update_contact_name(record.contact_id, record.name);
+			break;
+		case PICTURE_CHANGED:
+			if (record.picture_file != NULL) {
+				set_contact_picture(record.contact_id, record.picture_name, record.picture_file);
+				break;
+			}
+			contact.open(state.db);
+			contact.set_sort_order("$PK");
+			contact.begin_seek(db::DB_SEEK_EQUAL);
+			contact[ContactRow::ID] = record.contact_id;
+			if (DB_SUCCESS(print_error(contact.apply_seek()))) {
+				contact.edit();
+				contact[ContactRow::PICTURE_NAME] = record.picture_name;
+				if (DB_SUCCESS(print_error(contact.post()))) {
+					log_change(PICTURE_CHANGED, record.contact_id, NULL, 0,
+						record.picture_name, NULL, HOME, 0);
+					update_card(record.contact_id, NULL, record.picture_name);
+				}
+			}
+			contact.close();
+			break;
+		case CONTACT_REMOVED:
+			remove_contact(record.contact_id);
+			break;
+		case GROUP_CREATED:
+			group.open(state.db);
+			group.insert();
+			group[ContactGroupRow::ID] = record.group_id;
+			group[ContactGroupRow::NAME] = record.name;
+			if (DB_SUCCESS(print_error(group.post())))
+				log_change(GROUP_CREATED, 0, record.name, 0, NULL, NULL, HOME, 0,
+					record.group_id);
+			group.close();
+			break;
+		case GROUP_MEMBER_ADDED:
+			add_to_group(record.contact_id, record.group_id);
+			break;
+		case GROUP_MEMBER_REMOVED:
+			remove_from_group(record.contact_id, record.group_id);
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+ * Draw from the contact id sequence until it has passed an id assigned
+ * elsewhere, so that insert_contact() never issues it again. An id from a
+ * block reserves its whole block.
+ */
+void CursorPhoneBook::reserve_contact_id(db_uint id)
+{
+	if (id >= CONTACT_ID_BLOCK_BASE)
+		reserve_sequence("contact_id_block", (id - CONTACT_ID_BLOCK_BASE) >> CONTACT_ID_BLOCK_BITS);
+	else
+		reserve_sequence("contact_id", id);
+}
+
+/**
+ * Draw from a sequence until it has passed the given value.
+ */
+void CursorPhoneBook::reserve_sequence(const char *name, db_uint value)
+{
+	db::Sequence sequence;
+	db_uint next = 0;
+
+	sequence.open(state.db, name);
+	while (next < value && DB_SUCCESS(print_error(sequence.get_next_value(next))))
+		;
+	sequence.close();
+}
+
+/**
+ * Lock every table a change writes to, exclusively, until the current
+ * transaction ends. Other connections wait to change the phone book, and
+ * the locks are granted once their transactions in progress end.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::lock_tables()
+{
+	static const char *const names[] = {
+		ContactRow::name, PhoneNumberRow::name, ChangeLogRow::name,
+		ContactGroupRow::name, GroupMemberRow::name,
+	};
+	int rc = DB_NOERROR;
+
+	for (size_t i = 0; DB_SUCCESS(rc) && i < sizeof(names) / sizeof(names[0]); i++) {
+		db::Table table;
+
+		rc = table.open(state.db, names[i]);
+		if (DB_SUCCESS(rc))
+			rc = table.lock_table(db::DB_LOCK_EXCLUSIVE);
+		table.close();
+	}
+	return print_error(rc);
+}
+
+/**
+ * Draw the next value of the contact id, id block and change log
+ * sequences. The values drawn are never assigned. next_id_block is 0 for a
+ * database without the id block sequence.
+ */
+void CursorPhoneBook::draw_sequences(db_uint &next_contact_id, db_uint &next_id_block,
+	db_uint &next_change_seq)
+{
+	db::Sequence sequence;
+
+	next_contact_id = 0;
+	sequence.open(state.db, "contact_id");
+	print_error(sequence.get_next_value(next_contact_id));
+	sequence.close();
+
+	next_id_block = 0;
+	if (DB_SUCCESS(sequence.open(state.db, "contact_id_block"))) {
+		print_error(sequence.get_next_value(next_id_block));
+		sequence.close();
+	}
+
+	next_change_seq = 0;
+	sequence.open(state.db, "change_seq");
+	print_error(sequence.get_next_value(next_change_seq));
+	sequence.close();
+}
+
+/**
+ * Continue the sequences of the phone book this one replaces, from values
+ * read with draw_sequences(). The change log is marked compacted through
+ * the last change of the old phone book, so a device that had read that
+ * far carries on reading changes from this one.
+ */
+void CursorPhoneBook::continue_sequences(db_uint next_contact_id, db_uint next_id_block,
+	db_uint next_change_seq)
+{
+	TypedTable<ChangeLogRow> log;
+
+	if (next_contact_id > 1)
+		reserve_sequence("contact_id", next_contact_id - 1);
+	if (next_id_block > 1)
+		reserve_sequence("contact_id_block", next_id_block - 1);
+	if (next_change_seq <= 1)
+		return;
+	reserve_sequence("change_seq", next_change_seq - 1);
+
+	log.open(state.db);
+	log.insert();
+	log[ChangeLogRow::SEQ] = next_change_seq - 1;
+	log[ChangeLogRow::OPERATION] = CHANGES_COMPACTED;
+	log[ChangeLogRow::CONTACT_ID] = (db_uint) 0;
+	print_error(log.post());
+	log.close();
+}
+
+/**
+ * Add a contact's card, with no phone numbers yet.
+ */
+void CursorPhoneBook::insert_card(db_uint id, const wchar_t *name, db_uint ring_id,
+	const char *picture_name)
+{
+	TypedTable<ContactCardRow> card;
+
+	if (!state.contact_cards)
+		return;
+
+	card.open(state.db);
+	card.insert();
+	card[ContactCardRow::ID] = id;
+	card[ContactCardRow::NAME] = name;
+	card[ContactCardRow::RING_ID] = ring_id;
+	if (picture_name != NULL)
+		card[ContactCardRow::PICTURE_NAME] = picture_name;
+	card[ContactCardRow::NUMBER_COUNT] = (db_uint) 0;
+	card[ContactCardRow::NUMBERS] = "";
+	print_error(card.post());
+	card.close();
+}
+
+/**
+ * Copy a contact's new name or picture name, whichever is not NULL, to
+ * its card.
+ */
+void CursorPhoneBook::update_card(db_uint id, const wchar_t *name, const char *picture_name)
+{
+	TypedTable<ContactCardRow> card;
+
+	if (!state.contact_cards)
+		return;
+
+	card.open(state.db);
+	card.set_sort_order("$PK");
+	card.begin_seek(db::DB_SEEK_EQUAL);
+	card[ContactCardRow::ID] = id;
+	if (DB_SUCCESS(print_error(card.apply_seek()))) {
+		card.edit();
+		if (name != NULL)
+			card[ContactCardRow::NAME] = name;
+		if (picture_name != NULL)
+			card[ContactCardRow::PICTURE_NAME] = picture_name;
+		print_error(card.post());
+	}
+	card.close();
+}
+
+/**
+ * Add a phone number to a contact's card. Once the numbers no longer fit,
+ * the card's numbers are set to null and read from the "phone_number"
+ * table instead.
+ */
+void CursorPhoneBook::add_card_number(db_uint id, const char *number, PhoneNumberType type,
+	db_sint speed_dial)
+{
+	TypedTable<ContactCardRow> card;
+
+	if (!state.contact_cards)
+		return;
+
+	card.open(state.db);
+	card.set_sort_order("$PK");
+	card.begin_seek(db::DB_SEEK_EQUAL);
+	card[ContactCardRow::ID] = id;
+	if (DB_SUCCESS(print_error(card.apply_seek()))) {
+		CardNumbers numbers;
+		db_uint count = card[ContactCardRow::NUMBER_COUNT].as_int();
+		bool fits = false;
+
+		if (!card[ContactCardRow::NUMBERS].is_null()) {
+			db::String encoded = card[ContactCardRow::NUMBERS].as_string();
+			fits = numbers.assign(encoded.c_str()) && numbers.insert(number, type, speed_dial);
+		}
+
+		card.edit();
+		card[ContactCardRow::NUMBER_COUNT] = count + 1;
+		if (fits)
+			card[ContactCardRow::NUMBERS] = numbers.c_str();
+		else
+			card[ContactCardRow::NUMBERS].set_null();
+		print_error(card.post());
+	}
+	card.close();
+}
+
+/**
+ * Remove a contact's card.
+ */
+void CursorPhoneBook::remove_card(db_uint id)
+{
+	TypedTable<ContactCardRow> card;
+
+	if (!state.contact_cards)
+		return;
+
+	card.open(state.db);
+	card.set_sort_order("$PK");
+	card.begin_seek(db::DB_SEEK_EQUAL);
+	card[ContactCardRow::ID] = id;
+	if (DB_SUCCESS(print_error(card.apply_seek())))
+		print_error(card.remove());
+	card.close();
+}
+
+/**
+ * Create a contact group.
+ *
+ * @return the new group id, or 0 on failure
+ */
+db_uint CursorPhoneBook::create_group(const wchar_t *name)
+{
+	TRACE_SPAN("create_group");
+	TypedTable<ContactGroupRow> group;
+	db_uint id = GROUP_FAVORITES;
+
+	group.open(state.db);
+
+	// Group ids follow the largest id in use
+	group.set_sort_order("$PK");
+	group.seek_last();
+	if (!group.is_eof())
+		id = group[ContactGroupRow::ID].as_int() + 1;
+
+	group.insert();
+	group[ContactGroupRow::ID] = id;
+	group[ContactGroupRow::NAME] = name;
+
+	if (DB_FAILED(print_error(group.post())))
+		id = 0;
+	else
+		log_change(GROUP_CREATED, 0, name, 0, NULL, NULL, HOME, 0, id);
+
+	group.close();
+	return id;
+}
+
+/**
+ * Position a group_member cursor on the row joining a contact to a group.
+ * A contact belongs to few groups, so its rows are scanned.
+ *
+ * @return true if the contact is a member of the group
+ */
+static bool find_group_member(TypedTable<GroupMemberRow> &group_member,
+	db_uint contact_id, db_uint group_id)
+{
+	group_member.set_sort_order("by_member_contact");
+	group_member.begin_filter(db::DB_SEEK_EQUAL);
+	group_member[GroupMemberRow::CONTACT_ID] = contact_id;
+	group_member.apply_filters();
+
+	for (group_member.seek_first(); !group_member.is_eof(); group_member.seek_next())
+		if ((db_uint) group_member[GroupMemberRow::GROUP_ID].as_int() == group_id)
+			return true;
+
+	return false;
+}
+
+/**
+ * Add a contact to a group. Adding a contact that is already a member
+ * has no effect.
+ */
+void CursorPhoneBook::add_to_group(db_uint contact_id, db_uint group_id)
+{
+	TRACE_SPAN("add_to_group");
+	TypedTable<GroupMemberRow> group_member;
+
+	group_member.open(state.db);
+	if (!find_group_member(group_member, contact_id, group_id)) {
+		group_member.insert();
+		group_member[GroupMemberRow::GROUP_ID] = group_id;
+		group_member[GroupMemberRow::CONTACT_ID] = contact_id;
+
+		if (DB_SUCCESS(print_error(group_member.post()))) {
+			log_change(GROUP_MEMBER_ADDED, contact_id, NULL, 0, NULL, NULL, HOME, 0, group_id);
+
+			if (state.contact_index_loaded) {
+				ContactBitmap *contacts = state.group_index.get(group_id);
+
+				if (contacts == NULL || DB_FAILED(contacts->add(contact_id)))
+					state.contact_index_loaded = false;
 			}
+		}
+	}
+
+	group_member.close();
+}
+
+/**
+ * Remove a contact from a group.
+ */
+void CursorPhoneBook::remove_from_group(db_uint contact_id, db_uint group_id)
+{
+	TRACE_SPAN("remove_from_group");
+	TypedTable<GroupMemberRow> group_member;
+
+	group_member.open(state.db);
+	if (find_group_member(group_member, contact_id, group_id) &&
+			DB_SUCCESS(print_error(group_member.remove()))) {
+		log_change(GROUP_MEMBER_REMOVED, contact_id, NULL, 0, NULL, NULL, HOME, 0, group_id);
+
+		ContactBitmap *contacts = state.group_index.get(group_id);
+		if (contacts != NULL)
+			contacts->remove(contact_id);
+	}
+
+	group_member.close();
+}
+
+/**
+ * Build the in-memory bitmap indexes from the group_member and
+ * phone_number tables. The indexes remember the change log position they
+ * reflect, so a change made by another connection causes a reload.
+ *
+ * @return database error code
+ *
+ * Demonstrates:
+ * - full scans over a compound index
+ */
+int CursorPhoneBook::load_contact_index()
+{
+	TRACE_SPAN("load_contact_index");
+	TypedTable<GroupMemberRow> group_member;
+	TypedTable<PhoneNumberRow> phone_number;
+	ContactBitmap *contacts = NULL;
+	db_uint key = 0;
+	int rc = DB_NOERROR;
+
+	state.contact_index_loaded = false;
+	state.group_index.clear();
+	state.number_type_index.clear();
+
+	// Members arrive grouped by group id, so look up each bitmap once
+	group_member.open(state.db);
+	group_member.set_sort_order("by_member_group");
+	for (group_member.seek_first(); DB_SUCCESS(rc) && !group_member.is_eof(); group_member.seek_next()) {
+		db_uint group_id = group_member[GroupMemberRow::GROUP_ID].as_int();
+
+		if (contacts == NULL || key != group_id) {
+			key = group_id;
+			contacts = state.group_index.get(group_id);
+		}
+		rc = contacts != NULL ? contacts->add(group_member[GroupMemberRow::CONTACT_ID].as_int()) : DB_ENOMEM;
+	}
+	group_member.close();
+
+	phone_number.open(state.db);
+	phone_number.set_sort_order("by_contact_id");
+	for (phone_number.seek_first(); DB_SUCCESS(rc) && !phone_number.is_eof(); phone_number.seek_next()) {
+		contacts = state.number_type_index.get(phone_number[PhoneNumberRow::TYPE].as_int());
+		rc = contacts != NULL ? contacts->add(phone_number[PhoneNumberRow::CONTACT_ID].as_int()) : DB_ENOMEM;
+	}
+	phone_number.close();
+
+	if (DB_SUCCESS(rc)) {
+		state.contact_index_seq = last_change_seq();
+		state.contact_index_loaded = true;
+	} else {
+		state.group_index.clear();
+		state.number_type_index.clear();
+	}
+
+	return rc;
+}
+
+/**
+ * Reload the bitmap indexes unless they already reflect the newest change.
+ * Without the change log there is no way to tell whether another
+ * connection changed the tables, so the indexes are reloaded every time.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::refresh_contact_index()
+{
+	if (state.contact_index_loaded && state.log_changes && last_change_seq() == state.contact_index_seq)
+		return DB_NOERROR;
+
+	return load_contact_index();
+}
+
+/**
+ * Find the members of a group, replacing the contents of contacts.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::get_group_members(db_uint group_id, ContactBitmap &contacts)
+{
+	int rc = refresh_contact_index();
+	const ContactBitmap *members = state.group_index.find(group_id);
+
+	if (DB_FAILED(rc))
+		return rc;
+
+	if (members == NULL) {
+		contacts.clear();
+		return DB_NOERROR;
+	}
+
+	return contacts.assign(*members);
+}
+
+/**
+ * Find the contacts with at least one phone number of a type, replacing
+ * the contents of contacts.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::get_contacts_with_number_type(PhoneNumberType type, ContactBitmap &contacts)
+{
+	int rc = refresh_contact_index();
+	const ContactBitmap *matches = state.number_type_index.find(type);
+
+	if (DB_FAILED(rc))
+		return rc;
+
+	if (matches == NULL) {
+		contacts.clear();
+		return DB_NOERROR;
+	}
+
+	return contacts.assign(*matches);
+}
 
-			fclose(picture_file);
+/**
+ * Read the contacts in a bitmap with their phone numbers, in id order,
+ * replacing the contents of results. Each contact is found by its primary
+ * key, so contacts outside the bitmap are never read.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::get_contacts(const ContactBitmap &ids, ContactResults &results)
+{
+	TRACE_SPAN("get_contacts by id");
+	TypedTable<ContactRow> contact;
+	TypedTable<ContactCardRow> card;
+	TypedTable<PhoneNumberRow> phone_number;
+	int rc = DB_NOERROR;
+
+	results.clear();
+
+	if (state.contact_cards) {
+		card.open(state.db);
+		card.set_sort_order("$PK");
+	} else {
+		contact.open(state.db);
+		contact.set_sort_order("$PK");
+	}
+
+	phone_number.open(state.db);
+	phone_number.set_sort_order("by_contact_id");
 
+	for (db_uint id = 0; DB_SUCCESS(rc) && ids.find_next(id); id++) {
+		if (state.contact_cards) {
+			card.begin_seek(db::DB_SEEK_EQUAL);
+			card[ContactCardRow::ID] = id;
+			if (DB_FAILED(card.apply_seek()))
+				continue;
+
+			rc = add_contact_row(card, results);
+			if (DB_SUCCESS(rc))
+				rc = add_card_numbers(card, phone_number, results);
 		} else {
-			cerr << "Cannot open " << file_name << endl;
+			contact.begin_seek(db::DB_SEEK_EQUAL);
+			contact[ContactRow::ID] = id;
+			if (DB_FAILED(contact.apply_seek()))
+				continue;
+
+			rc = add_contact_row(contact, results);
+			if (DB_SUCCESS(rc))
+				rc = add_phone_numbers(phone_number, id, results);
 		}
+	}
+
+	phone_number.close();
+	if (state.contact_cards)
+		card.close();
+	else
+		contact.close();
+	results.finish();
+	return rc;
+}
+
+/**
+ * Read the members of a group with their phone numbers, replacing the
+ * contents of results. When number_type is not negative, only members
+ * with a phone number of that type are read.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::get_group_contacts(db_uint group_id, int number_type, ContactResults &results)
+{
+	TRACE_SPAN("get_group_contacts");
+	ContactBitmap contacts;
+	int rc = get_group_members(group_id, contacts);
+
+	if (DB_SUCCESS(rc) && number_type >= 0) {
+		const ContactBitmap *matches = state.number_type_index.find(number_type);
+
+		if (matches != NULL)
+			rc = contacts.intersect(*matches);
+		else
+			contacts.clear();
+	}
+
+	if (DB_FAILED(rc)) {
+		results.clear();
+		results.finish();
+		return rc;
+	}
+
+	return get_contacts(contacts, results);
+}
+
+/**
+ * Read a counter from the "statistic" table. A counter that has never
+ * been changed reads as 0.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::read_stat(db_uint id, db_sint &value)
+{
+	TypedTable<StatRow> stat;
+	int rc;
+
+	stat.open(state.db);
+	stat.set_sort_order("$PK");
+	stat.begin_seek(db::DB_SEEK_EQUAL);
+	stat[StatRow::ID] = id;
+
+	value = 0;
+	rc = stat.apply_seek();
+	if (DB_SUCCESS(rc))
+		value = stat[StatRow::VALUE].as_int();
+	else if (rc == DB_ENOTFOUND)
+		rc = DB_NOERROR;
 
+	stat.close();
+	return print_error(rc);
+}
+
+/**
+ * Add to a counter in the "statistic" table, in the same transaction as
+ * the change it counts.
+ *
+ * @return database error code
+ *
+ * Demonstrates:
+ * - updating a row, or inserting it if it does not exist
+ */
+int CursorPhoneBook::add_stat(db_uint id, db_sint delta)
+{
+	TRACE_SPAN("add_stat");
+	TypedTable<StatRow> stat;
+	int rc;
+
+	stat.open(state.db);
+	stat.set_sort_order("$PK");
+	stat.begin_seek(db::DB_SEEK_EQUAL);
+	stat[StatRow::ID] = id;
+
+	if (DB_SUCCESS(stat.apply_seek())) {
+		db_sint value = stat[StatRow::VALUE].as_int();
+
+		stat.edit();
+		stat[StatRow::VALUE] = value + delta;
 	} else {
-		cerr << "Could not find contact with id " << (long) id << endl;
+		stat.insert();
+		stat[StatRow::ID] = id;
+		stat[StatRow::VALUE] = delta;
+	}
+	rc = stat.post();
+
+	stat.close();
+	return print_error(rc);
+}
+
+/**
+ * Count a contact being inserted (delta 1) or removed (delta -1).
+ */
+void CursorPhoneBook::count_contact(db_uint ring_id, bool has_picture, db_sint delta)
+{
+	add_stat(StatRow::id(StatRow::CONTACTS, 0), delta);
+	add_stat(StatRow::id(StatRow::RING_ID, ring_id), delta);
+	if (has_picture)
+		add_stat(StatRow::id(StatRow::PICTURES, 0), delta);
+}
+
+/**
+ * Read the phone book counters. Each is a single primary key lookup, so
+ * the cost does not grow with the number of contacts.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::get_stats(Stats &stats)
+{
+	TRACE_SPAN("get_stats");
+	db_sint value;
+	int rc;
+
+	rc = read_stat(StatRow::id(StatRow::CONTACTS, 0), value);
+	stats.contacts = value;
+	if (DB_SUCCESS(rc))
+		rc = read_stat(StatRow::id(StatRow::PICTURES, 0), value);
+	stats.contacts_with_picture = value;
+	for (int type = HOME; type <= PAGER; type++) {
+		value = 0;
+		if (DB_SUCCESS(rc))
+			rc = read_stat(StatRow::id(StatRow::NUMBERS, type), value);
+		stats.numbers[type] = value;
+	}
+
+	return rc;
+}
+
+/**
+ * Read the number of contacts using a ring id.
+ *
+ * @return database error code
+ */
+int CursorPhoneBook::get_ring_id_contacts(db_uint ring_id, db_uint &count)
+{
+	db_sint value;
+	int rc = read_stat(StatRow::id(StatRow::RING_ID, ring_id), value);
+
+	count = value;
+	return rc;
+}
+
+/**
+ * Report a counter whose stored value differs from its recomputed value.
+ */
+static void check_stat(const char *counter, db_uint key, db_sint stored, db_sint actual,
+	db_uint &drift)
+{
+	if (stored != actual) {
+		cerr << "Counter " << counter << " " << (unsigned long) key << ": stored "
+			 << (long) stored << ", actual " << (long) actual << endl;
+		drift++;
+	}
+}
+
+/**
+ * Recompute every counter from the contact and phone_number tables and
+ * compare it with the stored value. Each difference is printed.
+ *
+ * @param drift the number of counters that differ
+ * @return database error code
+ *
+ * Demonstrates:
+ * - sorting a table on a field with no index
+ * - merging two sorted scans
+ */
+int CursorPhoneBook::verify_stats(db_uint &drift)
+{
+	TRACE_SPAN("verify_stats");
+	TypedTable<ContactRow> contact;
+	TypedTable<PhoneNumberRow> phone_number;
+	TypedTable<StatRow> stat;
+	db::IndexFieldSet sort_fields;
+	db_sint contacts = 0;
+	db_sint pictures = 0;
+	db_sint numbers[PAGER + 1] = { 0 };
+	db_sint stored;
+	int rc = DB_NOERROR;
+
+	drift = 0;
+
+	// Count contacts in ring id order, merging with the ring id counters
+	contact.open(state.db);
+	sort_fields.add("ring_id");
+	contact.sort(sort_fields);
+
+	stat.open(state.db);
+	stat.set_sort_order("$PK");
+	stat.begin_seek(db::DB_SEEK_GREATER_OR_EQUAL);
+	stat[StatRow::ID] = StatRow::id(StatRow::RING_ID, 0);
+	stat.apply_seek();
+
+	contact.seek_first();
+	for (;;) {
+		bool more = !contact.is_eof();
+		db_uint ring_id = 0;
+		db_sint actual = 0;
+
+		if (more) {
+			ring_id = contact[ContactRow::RING_ID].as_int() & StatRow::KEY_MASK;
+			for (; !contact.is_eof() &&
+					(contact[ContactRow::RING_ID].as_int() & StatRow::KEY_MASK) == ring_id;
+					contact.seek_next()) {
+				actual++;
+				if (!contact[ContactRow::PICTURE_HASH].is_null())
+					pictures++;
+			}
+			contacts += actual;
+		}
+
+		// Counters for ring ids that no contact uses
+		for (; !stat.is_eof() &&
+				(!more || (stat[StatRow::ID].as_int() & StatRow::KEY_MASK) < ring_id);
+				stat.seek_next())
+			check_stat("ring_id", stat[StatRow::ID].as_int() & StatRow::KEY_MASK,
+				stat[StatRow::VALUE].as_int(), 0, drift);
+		if (!more)
+			break;
+
+		stored = 0;
+		if (!stat.is_eof() && (stat[StatRow::ID].as_int() & StatRow::KEY_MASK) == ring_id) {
+			stored = stat[StatRow::VALUE].as_int();
+			stat.seek_next();
+		}
+		check_stat("ring_id", ring_id, stored, actual, drift);
 	}
 
+	stat.close();
 	contact.close();
+
+	phone_number.open(state.db);
+	for (phone_number.seek_first(); !phone_number.is_eof(); phone_number.seek_next()) {
+		db_uint type = phone_number[PhoneNumberRow::TYPE].as_int();
+
+		if (type <= PAGER)
+			numbers[type]++;
+	}
+	phone_number.close();
+
+	if (DB_SUCCESS(rc = read_stat(StatRow::id(StatRow::CONTACTS, 0), stored)))
+		check_stat("contacts", 0, stored, contacts, drift);
+	if (DB_SUCCESS(rc) && DB_SUCCESS(rc = read_stat(StatRow::id(StatRow::PICTURES, 0), stored)))
+		check_stat("pictures", 0, stored, pictures, drift);
+	for (int type = HOME; DB_SUCCESS(rc) && type <= PAGER; type++) {
+		if (DB_SUCCESS(rc = read_stat(StatRow::id(StatRow::NUMBERS, type), stored)))
+			check_stat("numbers", type, stored, numbers[type], drift);
+	}
+
+	return rc;
+}
+
+/**
+ * Deliver committed changes to a subscriber, coalesced per contact, from
+ * now on. Call outside a transaction.
+ */
+void CursorPhoneBook::subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options)
+{
+	state.notifier.subscribe(*this, subscriber, options);
+}
+
+void CursorPhoneBook::unsubscribe(ChangeSubscriber &subscriber)
+{
+	state.notifier.unsubscribe(subscriber);
+}
+
+/**
+ * Deliver events whose coalescing window has passed since the last
+ * commit, and changes committed by other connections. Call outside a
+ * transaction.
+ */
+void CursorPhoneBook::poll_subscriptions()
+{
+	state.notifier.poll(*this);
 }
 
 /**
  * Start transaction
  */
-void PhoneBook::tx_start()
+void CursorPhoneBook::tx_start()
+{
+	print_error(state.db.tx_begin());
+}
+
+/**
+ * Start read-only snapshot transaction
+ */
+void CursorPhoneBook::tx_start_snapshot()
 {
-	db.tx_begin();
+	print_error(state.db.tx_begin(SNAPSHOT_TX_MODE));
 }
 
 /**
  * Commit transaction
  */
-void PhoneBook::tx_commit()
+void CursorPhoneBook::tx_commit()
 {
-	if (DB_FAILED(db.tx_commit())) {
+	TRACE_SPAN("tx_commit");
+	if (DB_FAILED(print_error(state.db.tx_commit()))) {
 		cerr << "Failed to commit transaction." << endl;
 		return;
 	}
+	state.notifier.poll(*this);
 }
 
@@ -32,24 +32,42 @@
 
 #include <ittia/db++.h>
 
+#include "picture_store.h"
+#include "phonebook_schema.h"
+#include "phonebook_results.h"
+#include "contact_bitmap.h"
+
 
 /* Use a local database file. */
 #define DATABASE_NAME_LOCAL     "phone_book.db"
 /* Use the IPC client protocol to access database through dbserver. */
 #define DATABASE_NAME_SERVER    "idb+tcp://localhost/phone_book.db"
 
-/* Use 128KiB of RAM for memory storage, when selected. */
-#define MEMORY_STORAGE_SIZE     128 * 1024
+/* Use 128KiB of RAM for memory storage, when selected, unless
+   set_memory_storage_size() or PHONEBOOK_MEMORY_SIZE asks for more. */
+#define MEMORY_STORAGE_SIZE     (128 * 1024)
 
 /** 
- * A list of telephone contacts stored on a mobile phone
+ * A list of telephone contacts stored on a mobile phone.
+ *
+ * PhoneBook is an interface implemented by two engines, one using table
+ * cursors (CursorPhoneBook, phonebook.cpp) and one using SQL statements
+ * (SqlPhoneBook, phonebook_sql.cpp), and by HybridPhoneBook, which routes
+ * each method to one of the two over a shared connection. Use create() to
+ * construct one.
  */
 class PhoneBook {
-private:
-	db::Database db;
-
 public:
 
+	/**
+	 * Implementations selectable with create()
+	 */
+	enum Backend {
+		CURSOR_BACKEND = 0,
+		SQL_BACKEND,
+		HYBRID_BACKEND
+	};
+
 	/** 
 	 * Types of telephone numbers
 	 */
@@ -70,36 +88,316 @@ public:
 		MISSED
 	};
 
-private:
+	/**
+	 * Space used by the shared "picture" table
+	 */
+	struct PictureStats {
+		/* Number of distinct pictures stored */
+		db_uint pictures;
+		/* Number of contacts referencing a stored picture */
+		db_uint references;
+		/* Bytes needed if every contact held its own copy */
+		db_uint logical_bytes;
+		/* Bytes actually stored, after compression */
+		db_uint stored_bytes;
+	};
 
-	int create_tables(bool with_picture);
-	int create_table_contact(bool with_picture);
-	int create_table_phone_number();
-	int create_sequences();
+	/**
+	 * Counters kept in the "statistic" table, returned by get_stats()
+	 */
+	struct Stats {
+		/* Number of contacts */
+		db_uint contacts;
+		/* Number of contacts with a stored picture */
+		db_uint contacts_with_picture;
+		/* Number of phone numbers of each PhoneNumberType */
+		db_uint numbers[PAGER + 1];
+	};
 
-public:
+	/**
+	 * Database errors reported by the phone books of this process,
+	 * returned by get_error_counts()
+	 */
+	struct ErrorCounts {
+		/* Lock requests that timed out waiting for another transaction */
+		db_uint lock_timeouts;
+		/* Transactions chosen as the victim of a deadlock */
+		db_uint deadlocks;
+		/* Every other error */
+		db_uint other;
+	};
+
+	/**
+	 * Detects errors reported by any phone book while it is in scope, for
+	 * methods that return no error code of their own
+	 */
+	class ErrorWatch {
+	private:
+		ErrorCounts start;
+
+	public:
+		ErrorWatch();
+		/* DB_EDEADLOCK, DB_ELOCKED or DB_EIO if an error has been
+		   reported since construction, otherwise DB_NOERROR */
+		int rc() const;
+	};
+
+	/**
+	 * Mutations recorded in the "change_log" table
+	 */
+	enum ChangeType {
+		CONTACT_INSERTED = 0,
+		PHONE_NUMBER_INSERTED,
+		CONTACT_RENAMED,
+		PICTURE_CHANGED,
+		CONTACT_REMOVED,
+		/* Internal: marks the point up to which the log was compacted */
+		CHANGES_COMPACTED,
+		GROUP_CREATED,
+		GROUP_MEMBER_ADDED,
+		GROUP_MEMBER_REMOVED
+	};
+
+	/**
+	 * Groups created with every phone book
+	 */
+	enum ContactGroupId {
+		GROUP_FAVORITES = 1,
+		GROUP_FAMILY,
+		GROUP_WORK
+	};
+
+	/**
+	 * One entry of the change log. Only the fields that are part of the
+	 * change are set; strings are NULL otherwise and are valid only for
+	 * the duration of ChangeVisitor::change().
+	 */
+	struct ChangeRecord {
+		db_uint seq;
+		ChangeType type;
+		db_uint contact_id;
+		/* CONTACT_INSERTED, CONTACT_RENAMED, GROUP_CREATED */
+		const wchar_t *name;
+		/* CONTACT_INSERTED */
+		db_uint ring_id;
+		/* CONTACT_INSERTED, PICTURE_CHANGED */
+		const char *picture_name;
+		/* CONTACT_INSERTED, PICTURE_CHANGED: a file whose contents
+		   apply_change() stores as the picture, or NULL to set only the
+		   picture name. Always NULL in changes read from a phone book. */
+		const char *picture_file;
+		/* PHONE_NUMBER_INSERTED */
+		const char *number;
+		PhoneNumberType number_type;
+		db_sint speed_dial;
+		/* GROUP_CREATED, GROUP_MEMBER_ADDED, GROUP_MEMBER_REMOVED */
+		db_uint group_id;
+	};
+
+	/**
+	 * A phone number in a ContactResults set
+	 */
+	struct PhoneNumberResult {
+		const char *number;
+		PhoneNumberType type;
+		/* Negative if the number has no speed dial */
+		db_sint speed_dial;
+	};
 
-	int open_database(int file_mode, const char* database_name);
-	int create_database(int file_mode, const char* database_name);
-	int close_database();
+	/**
+	 * A contact in a ContactResults set. Strings point into the set's
+	 * arena; picture_name is NULL if the contact has none.
+	 */
+	struct ContactResult {
+		db_uint id;
+		const wchar_t *name;
+		bool has_ring_id;
+		db_uint ring_id;
+		const char *picture_name;
+		const PhoneNumberResult *numbers;
+		size_t number_count;
+	};
+
+	/**
+	 * Contacts returned by get_contacts(), held in two flat arrays with
+	 * every string in one arena. Filling a set that was used before reuses
+	 * its memory, so repeated queries allocate nothing per row. Each
+	 * contact's numbers are in type order, numbers of the same type in
+	 * the order they were added.
+	 */
+	class ContactResults {
+	private:
+		ContactResult *contacts;
+		size_t count;
+		size_t contact_capacity;
+		PhoneNumberResult *numbers;
+		size_t total_numbers;
+		size_t number_capacity;
+		/* Index of the first number of each contact, while filling */
+		size_t *first_number;
+		ResultArena arena;
+
+		/* Not copyable */
+		ContactResults(const ContactResults &);
+		ContactResults &operator=(const ContactResults &);
+
+	public:
+		ContactResults();
+		~ContactResults();
+
+		size_t size() const { return count; }
+		const ContactResult &operator[](size_t i) const { return contacts[i]; }
+		size_t number_count() const { return total_numbers; }
+
+		/* Used by the data access layer to fill the set */
+		void clear();
+		int add_contact(db_uint id, const wchar_t *name, bool has_ring_id,
+			db_uint ring_id, const char *picture_name);
+		int add_number(const char *number, PhoneNumberType type, db_sint speed_dial);
+		void finish();
+	};
+
+	/**
+	 * Receives change log entries from changes_since(), in sequence order
+	 */
+	class ChangeVisitor {
+	public:
+		virtual ~ChangeVisitor() {}
+		/* Return false to stop before the next change. */
+		virtual bool change(const ChangeRecord &record) = 0;
+	};
+
+	/**
+	 * Committed changes to one contact, coalesced by a subscription.
+	 * changes has bit (1 << type) set for each ChangeType made; a removed
+	 * contact has the CONTACT_REMOVED bit set.
+	 */
+	struct ContactEvent {
+		db_uint contact_id;
+		unsigned changes;
+		/* Newest change log entry coalesced into the event */
+		db_uint seq;
+	};
 
-	db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name);
-	void insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial);
+	/**
+	 * Receives events from subscribe(), after the changes are committed
+	 */
+	class ChangeSubscriber {
+	public:
+		virtual ~ChangeSubscriber() {}
+		/* Return false to hold this and later events until the next
+		   delivery. */
+		virtual bool contact_changed(const ContactEvent &event) = 0;
+		/* Events were dropped: read the phone book again. It reflects
+		   every change up to seq. */
+		virtual void resync(db_uint seq) = 0;
+	};
+
+	/**
+	 * Coalescing and back-pressure of a subscription
+	 */
+	struct SubscriptionOptions {
+		/* Changes to a contact within this many milliseconds of its first
+		   undelivered change are delivered as one event. */
+		unsigned long window_ms;
+		/* Contacts with undelivered events before the subscriber is told
+		   to resync instead */
+		size_t max_pending;
+		/* Bits (1 << type) of the ChangeTypes to deliver */
+		unsigned change_mask;
+
+		/* NOTIFY_WINDOW_MS, NOTIFY_MAX_PENDING and every contact change */
+		SubscriptionOptions();
+	};
+
+	/* Construct a phone book using the given implementation. */
+	static PhoneBook *create(Backend backend);
+	/* Construct a phone book using default_backend(). */
+	static PhoneBook *create();
+	/* The backend named by the PHONEBOOK_BACKEND environment variable, or hybrid */
+	static Backend default_backend();
+	/* Parse "cursor", "sql" or "hybrid" */
+	static bool parse_backend(const char *name, Backend &backend);
+	static const char *backend_name(Backend backend);
+	/* Errors reported by every phone book of this process so far */
+	static void get_error_counts(ErrorCounts &counts);
+	/* Bytes of RAM for new memory storage databases: the
+	   PHONEBOOK_MEMORY_SIZE environment variable, or MEMORY_STORAGE_SIZE */
+	static db_uint default_memory_storage_size();
+
+	virtual ~PhoneBook() {}
 
-	void update_contact_name(db_uint id, const wchar_t *newname);
-    void update_contact_picture(db_uint contact_id, const char *picture_name);
-	void remove_contact(db_uint id);
+	virtual int open_database(int file_mode, const char* database_name) = 0;
+	virtual int create_database(int file_mode, const char* database_name) = 0;
+	virtual int close_database() = 0;
 
-	void list_contacts_brief();
-	void list_contacts(int sort);
+	virtual db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name) = 0;
+	virtual db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+		const char *picture_file) = 0;
+	virtual void insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial) = 0;
 
-	db::String get_picture_name(db_uint id);
-	void export_picture(db_uint id, const char *file_name);
+	virtual void update_contact_name(db_uint id, const wchar_t *newname) = 0;
+	virtual void update_contact_picture(db_uint contact_id, const char *picture_name) = 0;
+	virtual void remove_contact(db_uint id) = 0;
 
-	void tx_start();
-	void tx_commit();
+	virtual void list_contacts_brief() = 0;
+	virtual void list_contacts(int sort) = 0;
+	virtual int get_contacts_brief(ContactResults &results) = 0;
+	virtual int get_contacts(int sort, ContactResults &results) = 0;
+
+	virtual db::String get_picture_name(db_uint id) = 0;
+	virtual const char *get_picture_name(db_uint id, ResultArena &arena) = 0;
+	virtual void export_picture(db_uint id, const char *file_name) = 0;
+	virtual int export_picture(db_uint id, FILE *picture_file) = 0;
+	virtual void get_picture_stats(PictureStats &stats) = 0;
+	virtual void set_picture_compression(bool enable) = 0;
+
+	virtual bool changes_since(db_uint seq, ChangeVisitor &visitor) = 0;
+	virtual void compact_change_log(db_uint through_seq) = 0;
+	virtual db_uint last_change_seq() = 0;
+	virtual void set_change_logging(bool enable) = 0;
+	virtual void set_id_block_size(unsigned size) = 0;
+	virtual void set_memory_storage_size(db_uint size) = 0;
+
+	virtual bool get_contact_id_range(db_uint &first_id, db_uint &last_id) = 0;
+	virtual void visit_contacts(ChangeVisitor &visitor, db_uint first_id = 0, db_uint last_id = ~(db_uint) 0 >> 1) = 0;
+	virtual void visit_groups(ChangeVisitor &visitor) = 0;
+	virtual void find_phone_numbers(const char *number, ChangeVisitor &visitor) = 0;
+	virtual int search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor) = 0;
+	virtual void apply_change(const ChangeRecord &record) = 0;
+
+	virtual db_uint create_group(const wchar_t *name) = 0;
+	virtual void add_to_group(db_uint contact_id, db_uint group_id) = 0;
+	virtual void remove_from_group(db_uint contact_id, db_uint group_id) = 0;
+	virtual int get_group_members(db_uint group_id, ContactBitmap &contacts) = 0;
+	virtual int get_contacts_with_number_type(PhoneNumberType type, ContactBitmap &contacts) = 0;
+	virtual int get_contacts(const ContactBitmap &ids, ContactResults &results) = 0;
+	virtual int get_group_contacts(db_uint group_id, int number_type, ContactResults &results) = 0;
+
+	virtual int get_stats(Stats &stats) = 0;
+	virtual int get_ring_id_contacts(db_uint ring_id, db_uint &count) = 0;
+	virtual int verify_stats(db_uint &drift) = 0;
+
+	virtual void subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options) = 0;
+	virtual void unsubscribe(ChangeSubscriber &subscriber) = 0;
+	virtual void poll_subscriptions() = 0;
+
+	virtual void tx_start() = 0;
+	/* Start a read-only transaction that sees the phone book as of its
+	   start and takes no locks that writers wait on. End it with
+	   tx_commit(). */
+	virtual void tx_start_snapshot() = 0;
+	virtual void tx_commit() = 0;
 };
 
 
+/* Print result sets in the formats of list_contacts_brief() and list_contacts(). */
+void print_contacts_brief(const PhoneBook::ContactResults &results);
+void print_contacts(const PhoneBook::ContactResults &results);
+/* Whether two result sets hold the same contacts and numbers in the same
+   order, as when both engines list one database. */
+bool same_contacts(const PhoneBook::ContactResults &a, const PhoneBook::ContactResults &b);
+
+
 #endif
 
@@ -0,0 +1,291 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Construction of phone books with a backend chosen at run time
+ */
+
+#include "phonebook_hybrid.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <mutex>
+
+#ifdef __embedded_cplusplus
+#define cerr cout
+#else
+using std::cerr;
+using std::endl;
+#endif
+
+/* Names a backend for PhoneBook::create(): cursor, sql or hybrid. */
+#define BACKEND_ENV_VAR         "PHONEBOOK_BACKEND"
+/* Set to 0 to create databases without a contact_card table. */
+#define CONTACT_CARDS_ENV_VAR   "PHONEBOOK_CONTACT_CARDS"
+/* Bytes of RAM for memory storage databases, with an optional K or M suffix. */
+#define MEMORY_SIZE_ENV_VAR     "PHONEBOOK_MEMORY_SIZE"
+
+static const char *const backend_names[] = { "cursor", "sql", "hybrid" };
+
+/* Errors counted by count_error() */
+static std::atomic<db_uint> lock_timeout_count(0);
+static std::atomic<db_uint> deadlock_count(0);
+static std::atomic<db_uint> other_error_count(0);
+
+/* Open engine states by database name, for PhoneBookState::open_connections() */
+static std::mutex connections_mutex;
+static std::map<std::string, int> connections;
+
+/**
+ * Construct the state of a phone book with picture compression enabled.
+ */
+PhoneBookState::PhoneBookState()
+    : compress_pictures(true)
+    , memory_storage_size(PhoneBook::default_memory_storage_size())
+    , log_changes(true)
+    , contact_index_loaded(false)
+    , contact_index_seq(0)
+    , contact_cards(default_contact_cards())
+    , id_block_size(1)
+    , next_block_id(0)
+    , block_end(0)
+{
+}
+
+PhoneBookState::~PhoneBookState()
+{
+    remove_connection();
+}
+
+bool PhoneBookState::default_contact_cards()
+{
+    const char *value = getenv(CONTACT_CARDS_ENV_VAR);
+
+    return value == NULL || strcmp(value, "0") != 0;
+}
+
+/**
+ * Assign the next contact id. With a block size above one, a whole block
+ * is reserved with a single draw from the "contact_id_block" sequence and
+ * handed out from memory, so concurrent connections inserting contacts
+ * do not all wait on the same sequence. Ids left unassigned in a block
+ * are skipped for good.
+ *
+ * @return database error code
+ */
+int PhoneBookState::next_contact_id(db_uint &id)
+{
+    db::Sequence sequence;
+    db_uint block;
+    int rc;
+
+    if (next_block_id < block_end) {
+        id = next_block_id++;
+        return DB_NOERROR;
+    }
+
+    // Databases created without the block sequence draw every id
+    if (id_block_size > 1 && DB_SUCCESS(sequence.open(db, "contact_id_block"))) {
+        rc = sequence.get_next_value(block);
+        sequence.close();
+        if (DB_SUCCESS(rc)) {
+            next_block_id = CONTACT_ID_BLOCK_BASE + (block << CONTACT_ID_BLOCK_BITS);
+            block_end = next_block_id + id_block_size;
+            id = next_block_id++;
+            return DB_NOERROR;
+        }
+    }
+
+    sequence.open(db, "contact_id");
+    rc = sequence.get_next_value(id);
+    sequence.close();
+    return rc;
+}
+
+void PhoneBookState::add_connection(const char *database_name)
+{
+    std::lock_guard<std::mutex> lock(connections_mutex);
+
+    connected_name = database_name;
+    connections[connected_name]++;
+}
+
+void PhoneBookState::remove_connection()
+{
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    std::map<std::string, int>::iterator i;
+
+    if (connected_name.empty())
+        return;
+    i = connections.find(connected_name);
+    if (i != connections.end() && --i->second == 0)
+        connections.erase(i);
+    connected_name.clear();
+}
+
+int PhoneBookState::open_connections(const char *database_name)
+{
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    std::map<std::string, int>::const_iterator i = connections.find(database_name);
+
+    return i == connections.end() ? 0 : i->second;
+}
+
+/**
+ * Set the number of ids reserved at a time, from 1 to MAX_ID_BLOCK_SIZE.
+ * The current block is given up, so the new size applies to the next id.
+ */
+void PhoneBookState::set_id_block_size(unsigned size)
+{
+    if (size < 1)
+        size = 1;
+    if (size > MAX_ID_BLOCK_SIZE)
+        size = MAX_ID_BLOCK_SIZE;
+    id_block_size = size;
+    discard_id_block();
+}
+
+/**
+ * Construct a phone book using the given implementation. A hybrid phone
+ * book takes its routes from the PHONEBOOK_ROUTES environment variable,
+ * if set.
+ */
+PhoneBook *PhoneBook::create(Backend backend)
+{
+    switch (backend) {
+        case CURSOR_BACKEND:
+            return new CursorPhoneBook();
+        case SQL_BACKEND:
+            return new SqlPhoneBook();
+        default:
+            break;
+    }
+
+    HybridPhoneBook *hybrid = new HybridPhoneBook();
+    const char *routes = getenv(ROUTES_ENV_VAR);
+
+    if (routes != NULL && DB_FAILED(hybrid->set_routes(routes)))
+        cerr << "Ignoring invalid " ROUTES_ENV_VAR ": " << routes << endl;
+
+    return hybrid;
+}
+
+PhoneBook *PhoneBook::create()
+{
+    return create(default_backend());
+}
+
+PhoneBook::Backend PhoneBook::default_backend()
+{
+    const char *name = getenv(BACKEND_ENV_VAR);
+    Backend backend = HYBRID_BACKEND;
+
+    if (name != NULL && name[0] != '\0' && !parse_backend(name, backend)) {
+        cerr << "Unknown " BACKEND_ENV_VAR " " << name << "; using hybrid" << endl;
+        backend = HYBRID_BACKEND;
+    }
+    return backend;
+}
+
+db_uint PhoneBook::default_memory_storage_size()
+{
+    const char *value = getenv(MEMORY_SIZE_ENV_VAR);
+    char *end;
+
+    if (value == NULL || value[0] == '\0')
+        return MEMORY_STORAGE_SIZE;
+
+    db_uint size = strtoull(value, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        size <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size <<= 20;
+        end++;
+    }
+
+    if (*end != '\0' || size < MEMORY_STORAGE_SIZE) {
+        cerr << "Ignoring " MEMORY_SIZE_ENV_VAR " " << value << "; using "
+            << MEMORY_STORAGE_SIZE << " bytes" << endl;
+        return MEMORY_STORAGE_SIZE;
+    }
+    return size;
+}
+
+bool PhoneBook::parse_backend(const char *name, Backend &backend)
+{
+    for (int i = 0; i < (int) (sizeof(backend_names) / sizeof(backend_names[0])); i++) {
+        if (strcmp(name, backend_names[i]) == 0) {
+            backend = (Backend) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *PhoneBook::backend_name(Backend backend)
+{
+    return backend_names[backend];
+}
+
+void count_error(int rc)
+{
+    if (rc == DB_ELOCKED)
+        lock_timeout_count++;
+    else if (rc == DB_EDEADLOCK)
+        deadlock_count++;
+    else
+        other_error_count++;
+}
+
+void PhoneBook::get_error_counts(ErrorCounts &counts)
+{
+    counts.lock_timeouts = lock_timeout_count;
+    counts.deadlocks = deadlock_count;
+    counts.other = other_error_count;
+}
+
+PhoneBook::ErrorWatch::ErrorWatch()
+{
+    get_error_counts(start);
+}
+
+int PhoneBook::ErrorWatch::rc() const
+{
+    ErrorCounts now;
+
+    get_error_counts(now);
+    if (now.deadlocks != start.deadlocks)
+        return DB_EDEADLOCK;
+    if (now.lock_timeouts != start.lock_timeouts)
+        return DB_ELOCKED;
+    if (now.other != start.other)
+        return DB_EIO;
+    return DB_NOERROR;
+}
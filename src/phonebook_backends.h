@@ -0,0 +1,338 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * The table cursor and SQL implementations of PhoneBook
+ */
+
+#ifndef PHONEBOOK_BACKENDS_H
+#define PHONEBOOK_BACKENDS_H 1
+
+#include "phonebook.h"
+#include "phonebook_notify.h"
+
+#include <string>
+
+/* Contact ids handed out in blocks start above every id drawn one at a
+   time from the "contact_id" sequence. Block b of the "contact_id_block"
+   sequence holds the ids from CONTACT_ID_BLOCK_BASE + (b << BITS), one
+   ContactBitmap chunk per block. */
+#define CONTACT_ID_BLOCK_BASE   ((db_uint) 1 << 32)
+#define CONTACT_ID_BLOCK_BITS   BITMAP_CHUNK_BITS
+#define MAX_ID_BLOCK_SIZE       ((unsigned) 1 << CONTACT_ID_BLOCK_BITS)
+
+/* Transaction mode of tx_start_snapshot(): reads see the database as of
+   the start of the transaction, from row versions that writers do not
+   lock, and writes are refused. */
+#define SNAPSHOT_TX_MODE        (db::DB_SNAPSHOT_ISOLATION | db::DB_READ_ONLY)
+
+/* Count an error reported by an engine, for PhoneBook::get_error_counts(). */
+void count_error(int rc);
+
+/**
+ * Connection and cached state of a phone book engine. Each engine has one
+ * of its own unless constructed with one to share, so that the engines of
+ * a HybridPhoneBook work on the same connection and caches.
+ */
+struct PhoneBookState {
+    db::Database db;
+    /* Picture data for memory storage, which is too small to hold it. */
+    PictureFile side_file;
+    /* Compress pictures as they are stored. */
+    bool compress_pictures;
+    /* Bytes of RAM for memory storage databases created from now on */
+    db_uint memory_storage_size;
+    /* Record mutations in the change log. */
+    bool log_changes;
+    /* Bitmap indexes of contacts by group and by phone number type */
+    ContactBitmapIndex group_index;
+    ContactBitmapIndex number_type_index;
+    bool contact_index_loaded;
+    /* Last change log entry reflected in the bitmap indexes */
+    db_uint contact_index_seq;
+    /* The database has a contact_card table, kept current and read by
+       get_contacts(). */
+    bool contact_cards;
+    /* Contact ids reserved per draw from the "contact_id_block" sequence;
+       1 draws every id from "contact_id". */
+    unsigned id_block_size;
+    /* Ids of the current block not yet assigned */
+    db_uint next_block_id;
+    db_uint block_end;
+    /* Subscriptions to committed changes */
+    ChangeNotifier notifier;
+    /* Name of the open database, counted by open_connections() */
+    std::string connected_name;
+
+    PhoneBookState();
+    ~PhoneBookState();
+
+    /* Whether new file storage databases get a contact_card table:
+       unless the PHONEBOOK_CONTACT_CARDS environment variable is 0 */
+    static bool default_contact_cards();
+
+    /* Assign an id to a new contact. */
+    int next_contact_id(db_uint &id);
+    void set_id_block_size(unsigned size);
+    /* Give up the rest of the current block, as when the connection closes. */
+    void discard_id_block() { next_block_id = block_end = 0; }
+
+    /* Count the connection as open on a database, or no longer open. */
+    void add_connection(const char *database_name);
+    void remove_connection();
+    /* Number of engine states in this process open on a database */
+    static int open_connections(const char *database_name);
+};
+
+/**
+ * Phone book implemented with table cursors and no dependency on SQL,
+ * in phonebook.cpp.
+ */
+class CursorPhoneBook : public PhoneBook {
+private:
+    PhoneBookState own_state;
+    PhoneBookState &state;
+
+    int create_tables(bool with_picture);
+    int create_table(const SchemaTable &table);
+    int create_sequences();
+    int create_groups();
+
+    int open_picture_file(const char *database_name, bool create);
+
+    int acquire_picture(const char *picture_name, db_uint &hash);
+    void release_picture(db_uint hash);
+
+    void log_change(ChangeType type, db_uint contact_id, const wchar_t *name,
+        db_uint ring_id, const char *picture_name,
+        const char *number, PhoneNumberType number_type, db_sint speed_dial,
+        db_uint group_id = 0);
+
+    int load_contact_index();
+    int refresh_contact_index();
+
+    int read_stat(db_uint id, db_sint &value);
+    int add_stat(db_uint id, db_sint delta);
+    void count_contact(db_uint ring_id, bool has_picture, db_sint delta);
+
+    void set_contact_picture(db_uint contact_id, const char *picture_name, const char *picture_file);
+    void reserve_contact_id(db_uint id);
+    void reserve_sequence(const char *name, db_uint value);
+
+    void insert_card(db_uint id, const wchar_t *name, db_uint ring_id, const char *picture_name);
+    void update_card(db_uint id, const wchar_t *name, const char *picture_name);
+    void add_card_number(db_uint id, const char *number, PhoneNumberType type, db_sint speed_dial);
+    void remove_card(db_uint id);
+    int get_contact_cards(int sort, ContactResults &results);
+
+    /* Not copyable */
+    CursorPhoneBook(const CursorPhoneBook &);
+    CursorPhoneBook &operator=(const CursorPhoneBook &);
+
+public:
+    /* Use a connection of its own. */
+    CursorPhoneBook();
+    /* Use a connection shared with other engines; see HybridPhoneBook. */
+    explicit CursorPhoneBook(PhoneBookState &shared);
+
+    int open_database(int file_mode, const char* database_name);
+    int create_database(int file_mode, const char* database_name);
+    int close_database();
+
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name);
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+        const char *picture_file);
+    void insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial);
+
+    void update_contact_name(db_uint id, const wchar_t *newname);
+    void update_contact_picture(db_uint contact_id, const char *picture_name);
+    void remove_contact(db_uint id);
+
+    void list_contacts_brief();
+    void list_contacts(int sort);
+    int get_contacts_brief(ContactResults &results);
+    int get_contacts(int sort, ContactResults &results);
+
+    db::String get_picture_name(db_uint id);
+    const char *get_picture_name(db_uint id, ResultArena &arena);
+    void export_picture(db_uint id, const char *file_name);
+    int export_picture(db_uint id, FILE *picture_file);
+    void get_picture_stats(PictureStats &stats);
+    void set_picture_compression(bool enable);
+
+    bool changes_since(db_uint seq, ChangeVisitor &visitor);
+    void compact_change_log(db_uint through_seq);
+    db_uint last_change_seq();
+    void set_change_logging(bool enable);
+    void set_id_block_size(unsigned size);
+    void set_memory_storage_size(db_uint size);
+
+    bool get_contact_id_range(db_uint &first_id, db_uint &last_id);
+    void visit_contacts(ChangeVisitor &visitor, db_uint first_id = 0, db_uint last_id = ~(db_uint) 0 >> 1);
+    void visit_groups(ChangeVisitor &visitor);
+    void find_phone_numbers(const char *number, ChangeVisitor &visitor);
+    int search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor);
+    void apply_change(const ChangeRecord &record);
+
+    db_uint create_group(const wchar_t *name);
+    void add_to_group(db_uint contact_id, db_uint group_id);
+    void remove_from_group(db_uint contact_id, db_uint group_id);
+    int get_group_members(db_uint group_id, ContactBitmap &contacts);
+    int get_contacts_with_number_type(PhoneNumberType type, ContactBitmap &contacts);
+    int get_contacts(const ContactBitmap &ids, ContactResults &results);
+    int get_group_contacts(db_uint group_id, int number_type, ContactResults &results);
+
+    int get_stats(Stats &stats);
+    int get_ring_id_contacts(db_uint ring_id, db_uint &count);
+    int verify_stats(db_uint &drift);
+
+    void subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options);
+    void unsubscribe(ChangeSubscriber &subscriber);
+    void poll_subscriptions();
+
+    void tx_start();
+    void tx_start_snapshot();
+    void tx_commit();
+
+    /* Keep other connections from changing the phone book until the
+       current transaction ends; see compact_phone_book(). */
+    int lock_tables();
+    /* Carry the sequences over to a rebuilt copy; see compact_phone_book(). */
+    void draw_sequences(db_uint &next_contact_id, db_uint &next_id_block, db_uint &next_change_seq);
+    void continue_sequences(db_uint next_contact_id, db_uint next_id_block, db_uint next_change_seq);
+};
+
+/**
+ * Phone book implemented with SQL statements, in phonebook_sql.cpp.
+ */
+class SqlPhoneBook : public PhoneBook {
+private:
+    PhoneBookState own_state;
+    PhoneBookState &state;
+
+    int create_tables(bool with_picture);
+    int create_table(const SchemaTable &table);
+    int create_sequences();
+    int create_groups();
+
+    int open_picture_file(const char *database_name, bool create);
+
+    int acquire_picture(const char *picture_name, db_uint &hash);
+    void release_picture(db_uint hash);
+
+    void log_change(ChangeType type, db_uint contact_id, const wchar_t *name,
+        db_uint ring_id, const char *picture_name,
+        const char *number, PhoneNumberType number_type, db_sint speed_dial,
+        db_uint group_id = 0);
+
+    int load_contact_index();
+    int refresh_contact_index();
+
+    int read_stat(db_uint id, db_sint &value);
+    int add_stat(db_uint id, db_sint delta);
+    void count_contact(db_uint ring_id, bool has_picture, db_sint delta);
+
+    void set_contact_picture(db_uint contact_id, const char *picture_name, const char *picture_file);
+    void reserve_contact_id(db_uint id);
+
+    void insert_card(db_uint id, const wchar_t *name, db_uint ring_id, const char *picture_name);
+    void update_card(db_uint id, const wchar_t *name, const char *picture_name);
+    void add_card_number(db_uint id, const char *number, PhoneNumberType type, db_sint speed_dial);
+    void remove_card(db_uint id);
+    int get_contact_cards(int sort, ContactResults &results);
+
+    /* Not copyable */
+    SqlPhoneBook(const SqlPhoneBook &);
+    SqlPhoneBook &operator=(const SqlPhoneBook &);
+
+public:
+    /* Use a connection of its own. */
+    SqlPhoneBook();
+    /* Use a connection shared with other engines; see HybridPhoneBook. */
+    explicit SqlPhoneBook(PhoneBookState &shared);
+
+    int open_database(int file_mode, const char* database_name);
+    int create_database(int file_mode, const char* database_name);
+    int close_database();
+
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name);
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+        const char *picture_file);
+    void insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial);
+
+    void update_contact_name(db_uint id, const wchar_t *newname);
+    void update_contact_picture(db_uint contact_id, const char *picture_name);
+    void remove_contact(db_uint id);
+
+    void list_contacts_brief();
+    void list_contacts(int sort);
+    int get_contacts_brief(ContactResults &results);
+    int get_contacts(int sort, ContactResults &results);
+
+    db::String get_picture_name(db_uint id);
+    const char *get_picture_name(db_uint id, ResultArena &arena);
+    void export_picture(db_uint id, const char *file_name);
+    int export_picture(db_uint id, FILE *picture_file);
+    void get_picture_stats(PictureStats &stats);
+    void set_picture_compression(bool enable);
+
+    bool changes_since(db_uint seq, ChangeVisitor &visitor);
+    void compact_change_log(db_uint through_seq);
+    db_uint last_change_seq();
+    void set_change_logging(bool enable);
+    void set_id_block_size(unsigned size);
+    void set_memory_storage_size(db_uint size);
+
+    bool get_contact_id_range(db_uint &first_id, db_uint &last_id);
+    void visit_contacts(ChangeVisitor &visitor, db_uint first_id = 0, db_uint last_id = ~(db_uint) 0 >> 1);
+    void visit_groups(ChangeVisitor &visitor);
+    void find_phone_numbers(const char *number, ChangeVisitor &visitor);
+    int search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor);
+    void apply_change(const ChangeRecord &record);
+
+    db_uint create_group(const wchar_t *name);
+    void add_to_group(db_uint contact_id, db_uint group_id);
+    void remove_from_group(db_uint contact_id, db_uint group_id);
+    int get_group_members(db_uint group_id, ContactBitmap &contacts);
+    int get_contacts_with_number_type(PhoneNumberType type, ContactBitmap &contacts);
+    int get_contacts(const ContactBitmap &ids, ContactResults &results);
+    int get_group_contacts(db_uint group_id, int number_type, ContactResults &results);
+
+    int get_stats(Stats &stats);
+    int get_ring_id_contacts(db_uint ring_id, db_uint &count);
+    int verify_stats(db_uint &drift);
+
+    void subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options);
+    void unsubscribe(ChangeSubscriber &subscriber);
+    void poll_subscriptions();
+
+    void tx_start();
+    void tx_start_snapshot();
+    void tx_commit();
+};
+
+
+#endif
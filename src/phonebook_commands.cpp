@@ -0,0 +1,470 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Non-interactive phone book commands, from the command line or a script
+ */
+
+#include "phonebook_commands.h"
+#include "phonebook_vcard.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+
+#ifdef __embedded_cplusplus
+#define cerr cout
+#else
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::flush;
+#endif
+
+/**
+ * A command: its name, the arguments it takes and the method that runs it
+ */
+struct CommandRunner::Command {
+    const char *name;
+    const char *usage;
+    int min_args;
+    int max_args;
+    /* Commits in batches of its own, outside the runner's transactions */
+    bool own_transactions;
+    int (CommandRunner::*handler)(int argc, char *const argv[]);
+};
+
+const CommandRunner::Command CommandRunner::commands[] = {
+    { "add",            "NAME [RING_ID [PICTURE]]",             1, 3, false, &CommandRunner::add_contact },
+    { "add-number",     "ID NUMBER [TYPE [SPEED_DIAL]]",        2, 4, false, &CommandRunner::add_phone_number },
+    { "remove",         "ID",                                   1, 1, false, &CommandRunner::remove_contact },
+    { "rename",         "ID NAME",                              2, 2, false, &CommandRunner::rename_contact },
+    { "list",           "[name|id|ring]",                       0, 1, false, &CommandRunner::list_contacts },
+    { "export-picture", "ID [FILE]",                            1, 2, false, &CommandRunner::export_picture },
+    { "import",         "VCARD_FILE",                           1, 1, true,  &CommandRunner::import_vcard_file },
+    { "export",         "VCARD_FILE|- [3|4]",                   1, 2, true,  &CommandRunner::export_vcard_file },
+    { "find",           "NUMBER",                               1, 1, false, &CommandRunner::find_phone_numbers },
+    { "suffix",         "DIGITS [LIMIT]",                       1, 2, false, &CommandRunner::find_number_suffix },
+};
+
+static const char *const number_type_names[] = { "home", "mobile", "work", "fax", "pager" };
+static const char *const sort_names[] = { "id", "name", "ring" };
+
+/**
+ * Parse a whole unsigned number.
+ */
+static bool parse_uint(const char *arg, db_uint &value)
+{
+    char *end;
+
+    if (arg[0] < '0' || arg[0] > '9')
+        return false;
+    value = (db_uint) strtoull(arg, &end, 10);
+    return *end == '\0';
+}
+
+/**
+ * Parse one of the given names, or its position in the list.
+ */
+static bool parse_choice(const char *arg, const char *const names[], int count, int &choice)
+{
+    db_uint value;
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(arg, names[i]) == 0) {
+            choice = i;
+            return true;
+        }
+    }
+    if (!parse_uint(arg, value) || value >= (db_uint) count)
+        return false;
+    choice = (int) value;
+    return true;
+}
+
+static void to_wide(const char *arg, wchar_t *name, size_t size)
+{
+    if (mbstowcs(name, arg, size) == (size_t) -1)
+        name[0] = L'\0';
+    name[size - 1] = L'\0';
+}
+
+CommandRunner::CommandRunner(PhoneBook &pbook, const char *photo_file)
+    : pbook(pbook)
+    , photo_file(photo_file)
+    , batch_size(1)
+    , pending(0)
+    , in_transaction(false)
+    , last_contact_id(0)
+{
+}
+
+CommandRunner::~CommandRunner()
+{
+    finish();
+}
+
+void CommandRunner::commit()
+{
+    if (in_transaction)
+        pbook.tx_commit();
+    in_transaction = false;
+    pending = 0;
+}
+
+void CommandRunner::finish()
+{
+    commit();
+}
+
+/**
+ * Parse a contact id, or "$" for the contact added last.
+ */
+int CommandRunner::parse_id(const char *arg, db_uint &id)
+{
+    if (strcmp(arg, "$") == 0) {
+        if (last_contact_id == 0) {
+            cerr << "No contact has been added yet for $" << endl;
+            return DB_ENOENT;
+        }
+        id = last_contact_id;
+        return DB_NOERROR;
+    }
+    if (!parse_uint(arg, id)) {
+        cerr << "Invalid contact id " << arg << endl;
+        return DB_EINVAL;
+    }
+    return DB_NOERROR;
+}
+
+/**
+ * Parse a contact id, as parse_id() does, and check that the contact
+ * exists, since the phone book methods that change a contact report no
+ * error for a missing one.
+ */
+int CommandRunner::find_contact(const char *arg, db_uint &id)
+{
+    ContactBitmap ids;
+    PhoneBook::ContactResults results;
+    int rc;
+
+    if (DB_FAILED(rc = parse_id(arg, id)) ||
+        DB_FAILED(rc = ids.add(id)) ||
+        DB_FAILED(rc = pbook.get_contacts(ids, results)))
+        return rc;
+    if (results.size() == 0) {
+        cerr << "No contact with id " << (unsigned long) id << endl;
+        return DB_ENOENT;
+    }
+    return DB_NOERROR;
+}
+
+int CommandRunner::run(int argc, char *const argv[])
+{
+    const Command *command = NULL;
+    int rc;
+
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strcmp(argv[0], commands[i].name) == 0)
+            command = &commands[i];
+    }
+    if (command == NULL) {
+        cerr << "Unknown command " << argv[0] << endl;
+        return DB_EINVAL;
+    }
+    if (argc - 1 < command->min_args || argc - 1 > command->max_args) {
+        cerr << "Usage: " << command->name << " " << command->usage << endl;
+        return DB_EINVAL;
+    }
+
+    if (command->own_transactions) {
+        commit();
+        return (this->*command->handler)(argc, argv);
+    }
+
+    if (!in_transaction) {
+        pbook.tx_start();
+        in_transaction = true;
+    }
+    rc = (this->*command->handler)(argc, argv);
+    if (batch_size != 0 && ++pending >= batch_size)
+        commit();
+    return rc;
+}
+
+unsigned long CommandRunner::run_script(FILE *in, const char *script_name)
+{
+    char line[COMMAND_MAX_LINE];
+    char *argv[COMMAND_MAX_ARGS + 1];
+    unsigned long line_number = 0;
+    unsigned long failed = 0;
+
+    while (fgets(line, sizeof line, in) != NULL) {
+        size_t length = strlen(line);
+        int argc = 0;
+        char *p = line;
+
+        line_number++;
+        if (length == sizeof line - 1 && line[length - 1] != '\n' && !feof(in)) {
+            int c;
+
+            while ((c = getc(in)) != EOF && c != '\n')
+                ;
+            cerr << script_name << ":" << line_number << ": line too long" << endl;
+            failed++;
+            continue;
+        }
+
+        //-------------------------------------------------------------------
+        // Split into words, with quotes around words containing spaces
+        //-------------------------------------------------------------------
+        for (;;) {
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+                p++;
+            if (*p == '\0' || argc > COMMAND_MAX_ARGS)
+                break;
+            if (*p == '"') {
+                argv[argc++] = ++p;
+                p += strcspn(p, "\"");
+            } else {
+                argv[argc++] = p;
+                p += strcspn(p, " \t\r\n");
+            }
+            if (*p != '\0')
+                *p++ = '\0';
+        }
+
+        if (argc == 0 || argv[0][0] == '#')
+            continue;
+        if (argc > COMMAND_MAX_ARGS) {
+            cerr << script_name << ":" << line_number << ": too many arguments" << endl;
+            failed++;
+            continue;
+        }
+        if (DB_FAILED(run(argc, argv))) {
+            cerr << script_name << ":" << line_number << ": " << argv[0] << " failed" << endl;
+            failed++;
+        }
+    }
+    finish();
+
+    return failed;
+}
+
+void CommandRunner::print_usage(FILE *out, const char *indent)
+{
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        fprintf(out, "%s%s %s\n", indent, commands[i].name, commands[i].usage);
+}
+
+//=======================================================================
+// Commands
+//=======================================================================
+
+int CommandRunner::add_contact(int argc, char *const argv[])
+{
+    wchar_t name[MAX_CONTACT_NAME + 1];
+    db_uint ring_id = 0;
+    db_uint id;
+
+    to_wide(argv[1], name, sizeof name / sizeof name[0]);
+    if (argc > 2 && !parse_uint(argv[2], ring_id)) {
+        cerr << "Invalid ring id " << argv[2] << endl;
+        return DB_EINVAL;
+    }
+
+    id = pbook.insert_contact(name, ring_id, argc > 3 ? argv[3] : NULL);
+    if (id == 0)
+        return DB_EIO;
+
+    last_contact_id = id;
+    cout << (unsigned long) id << endl;
+    return DB_NOERROR;
+}
+
+int CommandRunner::add_phone_number(int argc, char *const argv[])
+{
+    db_uint id;
+    int type = PhoneBook::HOME;
+    db_sint speed_dial = -1;
+    int rc;
+
+    if (DB_FAILED(rc = find_contact(argv[1], id)))
+        return rc;
+    if (argc > 3 && !parse_choice(argv[3], number_type_names, PhoneBook::PAGER + 1, type)) {
+        cerr << "Invalid phone number type " << argv[3] << endl;
+        return DB_EINVAL;
+    }
+    if (argc > 4)
+        speed_dial = (db_sint) atol(argv[4]);
+
+    PhoneBook::ErrorWatch errors;
+
+    pbook.insert_phone_number(id, argv[2], (PhoneBook::PhoneNumberType) type, speed_dial);
+    return errors.rc();
+}
+
+int CommandRunner::remove_contact(int, char *const argv[])
+{
+    db_uint id;
+    int rc;
+
+    if (DB_FAILED(rc = find_contact(argv[1], id)))
+        return rc;
+
+    PhoneBook::ErrorWatch errors;
+
+    pbook.remove_contact(id);
+    return errors.rc();
+}
+
+int CommandRunner::rename_contact(int, char *const argv[])
+{
+    wchar_t name[MAX_CONTACT_NAME + 1];
+    db_uint id;
+    int rc;
+
+    if (DB_FAILED(rc = find_contact(argv[1], id)))
+        return rc;
+    to_wide(argv[2], name, sizeof name / sizeof name[0]);
+
+    PhoneBook::ErrorWatch errors;
+
+    pbook.update_contact_name(id, name);
+    return errors.rc();
+}
+
+int CommandRunner::list_contacts(int argc, char *const argv[])
+{
+    int sort = 1;
+
+    if (argc > 1 && !parse_choice(argv[1], sort_names, 3, sort)) {
+        cerr << "Invalid sort order " << argv[1] << endl;
+        return DB_EINVAL;
+    }
+    pbook.list_contacts(sort);
+    return DB_NOERROR;
+}
+
+int CommandRunner::export_picture(int argc, char *const argv[])
+{
+    db_uint id;
+    int rc;
+
+    if (DB_FAILED(rc = parse_id(argv[1], id)))
+        return rc;
+
+    db::String file_name = argc > 2 ? db::String(argv[2]) : pbook.get_picture_name(id);
+    if (file_name.c_str() == NULL || file_name.c_str()[0] == '\0') {
+        cerr << "Contact " << (unsigned long) id << " has no picture name; give a file" << endl;
+        return DB_ENOENT;
+    }
+    pbook.export_picture(id, file_name.c_str());
+    return DB_NOERROR;
+}
+
+int CommandRunner::import_vcard_file(int, char *const argv[])
+{
+    db_uint imported = 0;
+    FILE *in;
+    int rc;
+
+    if ((in = fopen(argv[1], "rb")) == NULL) {
+        cerr << "Cannot open " << argv[1] << endl;
+        return DB_ENOENT;
+    }
+    rc = import_vcards(pbook, in, photo_file, &imported);
+    fclose(in);
+
+    cout << "Imported " << (unsigned long) imported << " contacts" << endl;
+    return rc;
+}
+
+int CommandRunner::export_vcard_file(int argc, char *const argv[])
+{
+    bool to_stdout = strcmp(argv[1], "-") == 0;
+    int version = argc > 2 ? atoi(argv[2]) : 3;
+    FILE *out;
+    int rc;
+
+    if (version != 3 && version != 4) {
+        cerr << "Invalid vCard version " << argv[2] << endl;
+        return DB_EINVAL;
+    }
+    if ((out = to_stdout ? stdout : fopen(argv[1], "wb")) == NULL) {
+        cerr << "Cannot open " << argv[1] << endl;
+        return DB_ENOENT;
+    }
+    cout << flush;
+    rc = ::export_vcards(pbook, out, version);
+    if (to_stdout)
+        fflush(out);
+    else
+        fclose(out);
+    return rc;
+}
+
+/**
+ * Prints the contacts found by "find" and "suffix", one number per line
+ */
+class FoundNumberPrinter : public PhoneBook::ChangeVisitor {
+public:
+    bool change(const PhoneBook::ChangeRecord &record)
+    {
+        char name_mbs[256];
+
+        wcstombs(name_mbs, record.name, sizeof(name_mbs));
+        name_mbs[sizeof(name_mbs) - 1] = '\0';
+        cout << (unsigned long) record.contact_id << "\t" << name_mbs
+             << "\t" << record.number << endl;
+        return true;
+    }
+};
+
+int CommandRunner::find_phone_numbers(int, char *const argv[])
+{
+    FoundNumberPrinter printer;
+
+    pbook.find_phone_numbers(argv[1], printer);
+    return DB_NOERROR;
+}
+
+int CommandRunner::find_number_suffix(int argc, char *const argv[])
+{
+    FoundNumberPrinter printer;
+    db_uint limit = 0;
+    int rc;
+
+    if (argc > 2 && !parse_uint(argv[2], limit)) {
+        cerr << "Invalid limit " << argv[2] << endl;
+        return DB_EINVAL;
+    }
+
+    rc = pbook.search_by_number_suffix(argv[1], (size_t) limit, printer);
+    if (rc == DB_EINVAL)
+        cerr << "Invalid digits " << argv[1] << endl;
+    return rc;
+}
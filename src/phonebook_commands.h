@@ -0,0 +1,117 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Non-interactive phone book commands, from the command line or a script
+ */
+
+#ifndef PHONEBOOK_COMMANDS_H
+#define PHONEBOOK_COMMANDS_H 1
+
+#include "phonebook.h"
+
+#include <stdio.h>
+
+/* Longest script line, and most words in one command */
+#define COMMAND_MAX_LINE        1024
+#define COMMAND_MAX_ARGS        8
+
+/**
+ * Runs commands such as "add", "remove" and "list" against a phone book.
+ *
+ * Commands are words: a name followed by its arguments, with double
+ * quotes around arguments that contain spaces. In a script, an id of "$"
+ * stands for the contact added last, so a script can add a contact and
+ * then its phone numbers. Commands are grouped into transactions of
+ * set_batch_size() commands each; "import" and "export" commit in batches
+ * of their own, so the transaction open before them is committed first.
+ */
+class CommandRunner {
+private:
+    struct Command;
+    static const Command commands[];
+
+    PhoneBook &pbook;
+    /* Scratch file for pictures decoded by "import" */
+    const char *photo_file;
+    /* Commands per transaction, or 0 for a single transaction */
+    unsigned long batch_size;
+    /* Commands run in the open transaction */
+    unsigned long pending;
+    bool in_transaction;
+    db_uint last_contact_id;
+
+    void commit();
+    int parse_id(const char *arg, db_uint &id);
+    int find_contact(const char *arg, db_uint &id);
+
+    int add_contact(int argc, char *const argv[]);
+    int add_phone_number(int argc, char *const argv[]);
+    int remove_contact(int argc, char *const argv[]);
+    int rename_contact(int argc, char *const argv[]);
+    int list_contacts(int argc, char *const argv[]);
+    int export_picture(int argc, char *const argv[]);
+    int import_vcard_file(int argc, char *const argv[]);
+    int export_vcard_file(int argc, char *const argv[]);
+    int find_phone_numbers(int argc, char *const argv[]);
+    int find_number_suffix(int argc, char *const argv[]);
+
+    /* Not copyable */
+    CommandRunner(const CommandRunner &);
+    CommandRunner &operator=(const CommandRunner &);
+
+public:
+    CommandRunner(PhoneBook &pbook, const char *photo_file);
+    ~CommandRunner();
+
+    /* Commit every n commands; 1 commits each command, 0 commits once at
+       the end. */
+    void set_batch_size(unsigned long n) { batch_size = n; }
+
+    /**
+     * Run one command; argv[0] is its name.
+     *
+     * @return database error code
+     */
+    int run(int argc, char *const argv[]);
+
+    /**
+     * Run one command per line until the end of the input, skipping blank
+     * lines and lines starting with '#'. A failed command is reported with
+     * its line number and the script goes on.
+     *
+     * @return number of commands that failed
+     */
+    unsigned long run_script(FILE *in, const char *script_name);
+
+    /* Commit the open transaction, if any. */
+    void finish();
+
+    /* Write the list of commands. */
+    static void print_usage(FILE *out, const char *indent);
+};
+
+
+#endif
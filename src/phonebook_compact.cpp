@@ -0,0 +1,353 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Online compaction of a file storage phone book
+ */
+
+#include "phonebook_compact.h"
+#include "phonebook_backends.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <chrono>
+#include <iostream>
+
+#ifdef __embedded_cplusplus
+#define cerr cout
+#else
+using std::cerr;
+using std::endl;
+#endif
+
+
+static db_uint steady_us()
+{
+    return (db_uint) std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static db_uint file_size(const char *file_name)
+{
+    struct stat st;
+
+    return stat(file_name, &st) == 0 ? (db_uint) st.st_size : 0;
+}
+
+/**
+ * Replace a file with another in one step. The original is never removed
+ * first, so if the replacement fails it is still in place.
+ *
+ * @return false on failure
+ */
+static bool replace_file(const char *from, const char *to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+/**
+ * Time a read of every contact in name order with its phone numbers.
+ */
+static db_uint time_name_scan(PhoneBook &pbook)
+{
+    PhoneBook::ContactResults results;
+    db_uint started;
+
+    pbook.tx_start();
+    started = steady_us();
+    pbook.get_contacts(1, results);
+    started = steady_us() - started;
+    pbook.tx_commit();
+
+    return started;
+}
+
+/**
+ * Copies contacts and changes from the old phone book to the new one.
+ * Picture data is passed to apply_change() through a scratch file.
+ */
+class CompactCopier : public PhoneBook::ChangeVisitor {
+private:
+    PhoneBook &source;
+    CursorPhoneBook &target;
+    const char *picture_file;
+
+public:
+    db_uint seq;
+    db_uint changes;
+
+    CompactCopier(PhoneBook &source, CursorPhoneBook &target, const char *picture_file)
+        : source(source)
+        , target(target)
+        , picture_file(picture_file)
+        , seq(0)
+        , changes(0)
+    {
+    }
+
+    /* Apply a change, first fetching the data of any picture it sets. */
+    bool change(const PhoneBook::ChangeRecord &record)
+    {
+        PhoneBook::ChangeRecord copy = record;
+
+        if ((record.type == PhoneBook::CONTACT_INSERTED || record.type == PhoneBook::PICTURE_CHANGED) &&
+            record.picture_name != NULL)
+        {
+            FILE *f = fopen(picture_file, "wb");
+
+            if (f != NULL) {
+                int rc = source.export_picture(record.contact_id, f);
+
+                if (fclose(f) == 0 && DB_SUCCESS(rc))
+                    copy.picture_file = picture_file;
+            }
+        }
+
+        target.apply_change(copy);
+        if (record.seq > seq)
+            seq = record.seq;
+        changes++;
+        return true;
+    }
+};
+
+/**
+ * Copies groups and their members, except the groups every new phone
+ * book already has.
+ */
+class GroupCopier : public PhoneBook::ChangeVisitor {
+private:
+    CursorPhoneBook &target;
+
+public:
+    GroupCopier(CursorPhoneBook &target)
+        : target(target)
+    {
+    }
+
+    bool change(const PhoneBook::ChangeRecord &record)
+    {
+        if (record.type != PhoneBook::GROUP_CREATED || record.group_id > PhoneBook::GROUP_WORK)
+            target.apply_change(record);
+        return true;
+    }
+};
+
+/**
+ * Copy every contact, in name order with its phone numbers, and every
+ * group, as of one transaction of the old phone book.
+ *
+ * @return the newest change included in the copy
+ */
+static db_uint copy_contacts(CursorPhoneBook &source, CursorPhoneBook &target,
+    CompactCopier &copier, CompactStats &stats)
+{
+    PhoneBook::ContactResults results;
+    GroupCopier groups(target);
+    db_uint seq;
+
+    source.tx_start();
+    seq = source.last_change_seq();
+    source.get_contacts(1, results);
+
+    target.tx_start();
+    for (size_t i = 0; i < results.size(); i++) {
+        const PhoneBook::ContactResult &contact = results[i];
+        PhoneBook::ChangeRecord record;
+
+        if (i > 0 && i % COMPACT_BATCH_SIZE == 0) {
+            target.tx_commit();
+            target.tx_start();
+        }
+
+        memset(&record, 0, sizeof(record));
+        record.type = PhoneBook::CONTACT_INSERTED;
+        record.contact_id = contact.id;
+        record.name = contact.name;
+        record.ring_id = contact.ring_id;
+        record.picture_name = contact.picture_name;
+        copier.change(record);
+
+        record.type = PhoneBook::PHONE_NUMBER_INSERTED;
+        for (size_t j = 0; j < contact.number_count; j++) {
+            record.number = contact.numbers[j].number;
+            record.number_type = contact.numbers[j].type;
+            record.speed_dial = contact.numbers[j].speed_dial;
+            target.apply_change(record);
+        }
+    }
+    source.visit_groups(groups);
+    target.tx_commit();
+
+    source.tx_commit();
+
+    stats.contacts = results.size();
+    stats.phone_numbers = results.number_count();
+    return seq;
+}
+
+/**
+ * Apply the changes made to the old phone book since seq.
+ *
+ * @return false if they have been compacted away
+ */
+static bool catch_up(CursorPhoneBook &source, CursorPhoneBook &target, CompactCopier &copier)
+{
+    bool complete;
+
+    source.tx_start();
+    target.tx_start();
+    complete = source.changes_since(copier.seq, copier);
+    target.tx_commit();
+    source.tx_commit();
+
+    return complete;
+}
+
+int compact_phone_book(PhoneBook &pbook, const char *database_name, CompactStats &stats)
+{
+    char compact_name[FILENAME_MAX];
+    char picture_name[FILENAME_MAX];
+    CursorPhoneBook source;
+    CursorPhoneBook target;
+    CompactCopier copier(source, target, picture_name);
+    db_uint next_contact_id;
+    db_uint next_id_block;
+    db_uint next_change_seq;
+    db_uint changes;
+    bool writers_blocked = false;
+    int rc;
+
+    memset(&stats, 0, sizeof(stats));
+    if (strlen(database_name) + sizeof(COMPACT_SUFFIX ".picture") > sizeof(compact_name))
+        return DB_EINVAL;
+    strcpy(compact_name, database_name);
+    strcat(compact_name, COMPACT_SUFFIX);
+    strcpy(picture_name, compact_name);
+    strcat(picture_name, ".picture");
+
+    rc = source.open_database(db::DB_FILE_STORAGE, database_name);
+    if (DB_FAILED(rc))
+        return rc;
+
+    rc = target.create_database(db::DB_FILE_STORAGE, compact_name);
+    if (DB_FAILED(rc)) {
+        source.close_database();
+        return rc;
+    }
+
+    stats.old_size = file_size(database_name);
+    stats.old_scan_us = time_name_scan(source);
+
+    // Rows are copied as they are; the new file records no changes of its own
+    target.set_change_logging(false);
+    copier.seq = copy_contacts(source, target, copier, stats);
+    copier.changes = 0;
+
+    // Catch up while other connections keep writing
+    for (int pass = 0; pass < COMPACT_CATCH_UP_PASSES; pass++) {
+        changes = copier.changes;
+        if (!catch_up(source, target, copier)) {
+            cerr << "Changes made during compaction were compacted away from the change log." << endl;
+            rc = DB_ENOENT;
+            break;
+        }
+        if (copier.changes - changes <= COMPACT_SWITCH_CHANGES)
+            break;
+    }
+
+    if (DB_SUCCESS(rc))
+        stats.new_scan_us = time_name_scan(target);
+
+    if (DB_SUCCESS(rc)) {
+        // Keep writers out for the last pass and the switch. A connection
+        // left open would go on writing to the old file after it is
+        // replaced, so only pbook and source may have it open.
+        source.tx_start();
+        writers_blocked = true;
+        rc = source.lock_tables();
+        if (DB_SUCCESS(rc) && PhoneBookState::open_connections(database_name) > 2) {
+            cerr << "Close the other connections to " << database_name << " before compacting." << endl;
+            rc = DB_ELOCKED;
+        }
+
+        // The last few changes, with the sequences continuing from them
+        if (DB_SUCCESS(rc)) {
+            target.tx_start();
+            if (source.changes_since(copier.seq, copier)) {
+                source.draw_sequences(next_contact_id, next_id_block, next_change_seq);
+                target.continue_sequences(next_contact_id, next_id_block, next_change_seq);
+            } else {
+                cerr << "Changes made during compaction were compacted away from the change log." << endl;
+                rc = DB_ENOENT;
+            }
+            target.tx_commit();
+        }
+    }
+    remove(picture_name);
+    stats.changes = copier.changes;
+    target.close_database();
+
+    if (DB_FAILED(rc)) {
+        if (writers_blocked)
+            source.tx_commit();
+        source.close_database();
+        remove(compact_name);
+        return rc;
+    }
+    stats.new_size = file_size(compact_name);
+
+    // Switch over. On Windows an open file cannot be replaced, so the locks
+    // are given up first; elsewhere they are held until the new file is in
+    // place.
+    pbook.close_database();
+#ifdef _WIN32
+    source.tx_commit();
+    source.close_database();
+#endif
+    if (!replace_file(compact_name, database_name)) {
+        cerr << "Cannot replace " << database_name << " with " << compact_name << endl;
+        remove(compact_name);
+        rc = DB_EIO;
+    }
+#ifndef _WIN32
+    source.tx_commit();
+    source.close_database();
+#endif
+
+    int open_rc = pbook.open_database(db::DB_FILE_STORAGE, database_name);
+    return DB_FAILED(rc) ? rc : open_rc;
+}
@@ -0,0 +1,89 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Online compaction of a file storage phone book
+ */
+
+#ifndef PHONEBOOK_COMPACT_H
+#define PHONEBOOK_COMPACT_H 1
+
+#include "phonebook.h"
+
+/* The rebuilt database is written next to the original under this suffix. */
+#define COMPACT_SUFFIX          ".compact"
+/* Contacts copied per transaction of the rebuilt database */
+#define COMPACT_BATCH_SIZE      500
+/* Catch up with changes until a pass finds no more than this many... */
+#define COMPACT_SWITCH_CHANGES  64
+/* ...or this many passes have been made, then switch over. */
+#define COMPACT_CATCH_UP_PASSES 8
+
+/**
+ * What compact_phone_book() did
+ */
+struct CompactStats {
+    /* Rows copied to the new file */
+    db_uint contacts;
+    db_uint phone_numbers;
+    /* Changes made during the copy and applied to the new file */
+    db_uint changes;
+    /* File sizes in bytes */
+    db_uint old_size;
+    db_uint new_size;
+    /* Time to read every contact in name order with its phone numbers,
+       in microseconds, from each file */
+    db_uint old_scan_us;
+    db_uint new_scan_us;
+};
+
+/**
+ * Rebuild a file storage phone book into a fresh file and switch to it.
+ *
+ * The contact table is written in name order and each contact's phone
+ * numbers are written right after it, so scans of by_name and lookups by
+ * contact id read neighbouring pages, and the space of removed rows is
+ * left behind. The copy is read on a connection of its own in a single
+ * transaction, so other connections go on reading the phone book
+ * meanwhile. Changes committed during the copy are then applied from the
+ * change log, pass after pass, until few enough remain. The last pass
+ * runs with every table locked against writers, which are held off until
+ * the switch: pbook, the caller's connection, is closed, the new file
+ * replaces the old one and pbook opens it again. A connection left open
+ * would keep writing to the old file, so compaction fails with
+ * DB_ELOCKED if any connection in the process other than pbook has the
+ * database open.
+ *
+ * Contact ids and the change sequence continue from the old file. The new
+ * change log starts with a compaction marker, so devices that have read
+ * every change carry on, and the others read the phone book again.
+ *
+ * @return database error code; on failure the old file is left in use
+ */
+int compact_phone_book(PhoneBook &pbook, const char *database_name, CompactStats &stats);
+
+
+#endif
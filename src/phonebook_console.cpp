@@ -27,16 +27,27 @@
  * Command line example program demonstrating the ITTIA DB C++ API
  */
 
-#include "phonebook.h"
+#include "phonebook_commands.h"
+#include "phonebook_compact.h"
+#include "phonebook_hybrid.h"
+#include "phonebook_journal.h"
+#include "phonebook_mirror.h"
+#include "phonebook_snapshot.h"
+#include "phonebook_trace.h"
+#include "span_trace.h"
+#include "phonebook_vcard.h"
+#include "number_key.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef _MSC_VER
 #pragma warning (push, 1)
 #endif
 
 #include <iostream>
+#include <memory>
 
 #ifdef __embedded_cplusplus
 #define cerr cout
@@ -53,39 +64,118 @@ using std::flush;
 #endif
 
 #define DEFAULT_PICTURE "unknown.png"
+#define DEFAULT_SNAPSHOT "phone_book.snap"
+#define DEFAULT_VCARDS "phone_book.vcf"
+#define VCARD_PHOTO_FILE "vcard_photo.tmp"
+/* Most numbers listed by a search on their last digits */
+#define SUFFIX_SEARCH_LIMIT 100
+/* Names a file to record every phone book call to, for trace_replay. */
+#define TRACE_ENV_VAR "PHONEBOOK_TRACE"
+#ifdef PHONEBOOK_TRACING
+/* Names a file to write timing spans to on exit, as Chrome trace JSON. */
+#define SPANS_ENV_VAR "PHONEBOOK_SPANS"
+#endif
 
 
 /**
  * Console application for browsing the phone book.
  */
 class PhoneBookConsoleApp {
-    PhoneBook pbook;
+    /* Implementation named by the PHONEBOOK_BACKEND environment variable */
+    PhoneBook::Backend backend;
+    std::unique_ptr<PhoneBook> book;
+    /* Logs committed changes when memory storage is opened with a journal. */
+    PhoneBookJournal journal;
+    /* Every call goes through the recorder, which traces it on request. */
+    PhoneBookRecorder pbook;
+    /* Serves reads locally when connected to a server with a mirror. */
+    PhoneBookMirror mirror;
+    bool mirrored;
+    /* Only a local file storage database can be compacted. */
+    bool local_file;
+    /* Prompting on the console, rather than running commands */
+    bool interactive;
 
 public:
+    PhoneBookConsoleApp()
+        : backend(PhoneBook::default_backend())
+        , book(PhoneBook::create(backend))
+        , journal(*book)
+        , pbook(journal)
+        , mirror(pbook)
+        , mirrored(false)
+        , local_file(false)
+        , interactive(true)
+    {
+    }
+
+    void set_interactive(bool enable) { interactive = enable; }
+
     //=======================================================================
     // CONNECT TO DATABASE
     //=======================================================================
     int connect()
     {
         int     connection_method;
-        const char* database_name;
-        int     storage_mode;
 
         /* Prompt for a connection method. */
         do {
             connection_method = connection_menu();
             if (connection_method == 0)
                 return 1;
-
-            /* Check the library disposition before connecting to a server. */
-            if ((connection_method == 3 || connection_method == 4) &&
-                db_info(NULL, DB_INFO_DISPOSITION) == DB_DISPOSITION_STANDALONE)
-            {
+            if (!connection_supported(connection_method))
                 connection_method = 0;
-                printf("This is a stand-alone build of ITTIA DB SQL.\n");
-                printf("Client/server is not supported; select another option.\n\n");
+        } while (connection_method < 1 || connection_method > 6);
+
+        cout << "Using the " << PhoneBook::backend_name(backend) << " backend" << endl;
+        return connect(connection_method);
+    }
+
+    /* Check the library disposition before connecting to a server. */
+    static bool connection_supported(int connection_method)
+    {
+        if ((connection_method >= 3 && connection_method <= 5) &&
+            db_info(NULL, DB_INFO_DISPOSITION) == DB_DISPOSITION_STANDALONE)
+        {
+            printf("This is a stand-alone build of ITTIA DB SQL.\n");
+            printf("Client/server is not supported; select another option.\n\n");
+            return false;
+        }
+        return true;
+    }
+
+    /* Connect with one of the methods of connection_menu(). A database
+       created for the console is populated with sample data; one created
+       to run commands starts empty. */
+    int connect(int connection_method)
+    {
+        const char* database_name;
+        int     storage_mode;
+
+        /* A journaled database is rebuilt from its journal, never created empty. */
+        if (connection_method == 6) {
+            FILE *existing = fopen(JOURNAL_NAME, "rb");
+            bool restoring = existing != NULL;
+            if (restoring)
+                fclose(existing);
+
+            if (DB_FAILED(journal.open_journaled(DATABASE_NAME_LOCAL, JOURNAL_NAME)))
+                return 1;
+            if (!restoring && interactive) {
+                cout << "Populating tables with sample data" << endl;
+                populate_tables();
             }
-        } while (connection_method < 1 || connection_method > 4);
+            start_recording();
+            return 0;
+        }
+
+        local_file = connection_method == 1;
+
+        /* A mirror is kept for a server connection with file storage. */
+        if (connection_method == 5) {
+            mirrored = interactive;
+            connection_method = 3;
+        }
 
         /* First choice is file vs. memory storage. */
         storage_mode = (connection_method - 1) & 0x1 ? db::DB_MEMORY_STORAGE : db::DB_FILE_STORAGE;
@@ -99,37 +189,64 @@ public:
 
         /* Start server if a connection error occurs. */
         if (result == DB_ESOCKETOPEN) {
-            printf("Cannot connect to server. Starting server in this process.\n");
+            fprintf(interactive ? stdout : stderr, "Cannot connect to server. Starting server in this process.\n");
             db_server_start(NULL);
             result = pbook.open_database(storage_mode, database_name);
         }
 
         if (result == DB_ENOENT) {
             // The database does not exist, so create it
-            cout << "Creating new database file" << endl;
+            (interactive ? cout : cerr) << "Creating new database file" << endl;
 
-            if (DB_SUCCESS(pbook.create_database(storage_mode, database_name))) {
+            if (DB_FAILED(pbook.create_database(storage_mode, database_name)))
+                return 1;
+            if (interactive) {
                 cout << "Populating tables with sample data" << endl;
                 populate_tables();
             }
-            else {
-                return 1;
-            }
         }
         else if (!DB_SUCCESS(result))
         {
             return 1;
         }
 
+        if (mirrored && DB_FAILED(mirror.open())) {
+            cout << "Cannot create local mirror; reading from the server." << endl;
+            mirrored = false;
+        }
+
+        start_recording();
         return 0;
     }
 
+    void start_recording()
+    {
+        const char *trace_file = getenv(TRACE_ENV_VAR);
+        if (trace_file != NULL && trace_file[0] != '\0') {
+            if (DB_SUCCESS(pbook.start(trace_file)))
+                cout << "Recording calls to " << trace_file << endl;
+            else
+                cerr << "Cannot record calls to " << trace_file << endl;
+        }
+    }
+
     //=======================================================================
     // CLASS DESTRUCT FUNCTION
     //=======================================================================
     ~PhoneBookConsoleApp()
     {
+        pbook.stop();
+        mirror.close();
         pbook.close_database();
+
+#ifdef PHONEBOOK_TRACING
+        const char *spans_file = getenv(SPANS_ENV_VAR);
+        if (spans_file != NULL && spans_file[0] != '\0' &&
+            DB_FAILED(span_trace_write_file(spans_file)))
+        {
+            cerr << "Cannot write timing spans to " << spans_file << endl;
+        }
+#endif
     }
 
     int connection_menu()
@@ -143,6 +260,8 @@ Choose a database connection method:\
 2) Open memory storage\n\
 3) Connect to ITTIA DB Server on localhost, open file storage\n\
 4) Connect to ITTIA DB Server on localhost, open memory storage\n\
+5) Connect to ITTIA DB Server on localhost, open file storage with a local read mirror\n\
+6) Open memory storage with a journal\n\
 0) Quit\n\
 \n\
 Enter the number of your choice: " << flush;
@@ -163,6 +282,7 @@ Enter the number of your choice: " << flush;
     //=======================================================================
     void populate_tables()
     {
+        TRACE_SPAN("console populate_tables");
         pbook.tx_start();
 
         //-------------------------------------------------------------------
@@ -199,6 +319,19 @@ Enter the number of your choice: " << flush;
                 "6) List contacts by id\n"
                 "7) List contacts by ring id, name\n"
                 "8) Export picture from existing contact\n"
+                "9) Show picture storage savings\n"
+                "10) Show changes since a sequence number\n"
+                "11) Compact change log\n"
+                "12) Export read-only snapshot\n"
+                "13) Import contacts from vCard file\n"
+                "14) Export contacts to vCard file\n"
+                "15) Find contacts by phone number\n"
+                "16) Add contact to group\n"
+                "17) List group contacts\n"
+                "18) Show contact statistics\n"
+                "19) Show backend routes\n"
+                "20) Compact database file\n"
+                "21) Find contacts by last digits of phone number\n"
                 "0) Quit\n"
                 "\n"
                 "Enter the number of your choice: " << flush;
@@ -222,48 +355,168 @@ Enter the number of your choice: " << flush;
             switch (choice) {
                 case 1: // Add contact
                     add_contact();
+                    refresh_mirror();
                     break;
                 case 2: // Remove contact
                     remove_contact();
+                    refresh_mirror();
                     break;
                 case 3: // Add phone number to existing contact
                     add_phone_number();
+                    refresh_mirror();
                     break;
                 case 4: // Rename contact
                     rename_contact();
+                    refresh_mirror();
                     break;
                 case 5: // List contacts
-                    cout << "------ Contacts ------" << endl;
-                    pbook.tx_start();
-                    pbook.list_contacts(1);
-                    pbook.tx_commit();
+                    list_contacts(1);
                     break;
                 case 6: // List contacts
-                    cout << "------ Contacts ------" << endl;
-                    pbook.tx_start();
-                    pbook.list_contacts(0);
-                    pbook.tx_commit();
+                    list_contacts(0);
                     break;
                 case 7: // List contacts
-                    cout << "------ Contacts ------" << endl;
-                    pbook.tx_start();
-                    pbook.list_contacts(2);
-                    pbook.tx_commit();
+                    list_contacts(2);
                     break;
                 case 8: // Export picture from existing contact
                     export_picture();
                     break;
+                case 9: // Show picture storage savings
+                    show_picture_stats();
+                    break;
+                case 10: // Show changes since a sequence number
+                    show_changes();
+                    break;
+                case 11: // Compact change log
+                    compact_changes();
+                    break;
+                case 12: // Export read-only snapshot
+                    export_snapshot();
+                    break;
+                case 13: // Import contacts from vCard file
+                    import_vcards();
+                    refresh_mirror();
+                    break;
+                case 14: // Export contacts to vCard file
+                    export_vcards();
+                    break;
+                case 15: // Find contacts by phone number
+                    find_phone_numbers();
+                    break;
+                case 16: // Add contact to group
+                    add_to_group();
+                    refresh_mirror();
+                    break;
+                case 17: // List group contacts
+                    list_group_contacts();
+                    break;
+                case 18: // Show contact statistics
+                    show_stats();
+                    break;
+                case 19: // Show backend routes
+                    show_routes();
+                    break;
+                case 20: // Compact database file
+                    compact_database();
+                    break;
+                case 21: // Find contacts by last digits of phone number
+                    find_number_suffix();
+                    break;
                 default:
                     cout << "Unknown option: " << choice << endl;
             }
         }
     }
 
+    //=======================================================================
+    // COMMAND LINE AND SCRIPT MODE
+    //=======================================================================
+    static void usage(const char *program)
+    {
+        fprintf(stderr,
+                "Usage: %s                    choose from menus\n"
+                "       %s [-c METHOD] COMMAND [ARGUMENTS]\n"
+                "       %s [-c METHOD] script [--batch N | --single] [FILE]\n"
+                "\n"
+                "METHOD is a connection method of the menu, 1 (open file storage) by default.\n"
+                "A script holds one command per line and is read from stdin unless FILE is\n"
+                "given; an id of $ names the contact added last. Each command commits on its\n"
+                "own unless --batch commits every N commands or --single commits once.\n"
+                "\n"
+                "Commands:\n", program, program, program);
+        CommandRunner::print_usage(stderr, "  ");
+    }
+
+    /* Run the command named by argv[0], or a script. */
+    int run_commands(int argc, char *argv[])
+    {
+        TRACE_SPAN("console run_commands");
+        CommandRunner runner(pbook, VCARD_PHOTO_FILE);
+
+        if (strcmp(argv[0], "script") != 0)
+            return DB_SUCCESS(runner.run(argc, argv)) ? 0 : 1;
+
+        const char *script_name = NULL;
+        FILE *in = stdin;
+        unsigned long failed;
+
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--single") == 0)
+                runner.set_batch_size(0);
+            else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+                runner.set_batch_size((unsigned long) atol(argv[++i]));
+            else if (argv[i][0] != '-' && script_name == NULL)
+                script_name = argv[i];
+            else
+                return 2;
+        }
+
+        if (script_name != NULL && (in = fopen(script_name, "r")) == NULL) {
+            cerr << "Cannot open " << script_name << endl;
+            return 1;
+        }
+        failed = runner.run_script(in, script_name != NULL ? script_name : "stdin");
+        if (in != stdin)
+            fclose(in);
+
+        if (failed != 0)
+            cerr << failed << " commands failed" << endl;
+        return failed != 0 ? 1 : 0;
+    }
+
+    //=======================================================================
+    // CONTACT LISTING, from the local mirror when there is one
+    //=======================================================================
+    void list_contacts(int sort)
+    {
+        TRACE_SPAN("console list_contacts");
+        cout << "------ Contacts ------" << endl;
+        if (mirrored) {
+            mirror.list_contacts(sort);
+            cout << "(mirror is " << mirror.staleness_ms() << " ms old)" << endl << endl;
+        } else {
+            pbook.tx_start_snapshot();
+            pbook.list_contacts(sort);
+            pbook.tx_commit();
+        }
+    }
+
+    //=======================================================================
+    // Read our own writes back through the mirror
+    //=======================================================================
+    void refresh_mirror()
+    {
+        TRACE_SPAN("console refresh_mirror");
+        if (mirrored)
+            mirror.refresh();
+    }
+
     //=======================================================================
     // CONTACT ADDING UI
     //=======================================================================
     void add_contact()
     {
+        TRACE_SPAN("console add_contact");
         const int buffer_size = 256;
 
         char picture_name[buffer_size];
@@ -304,9 +557,13 @@ Enter the number of your choice: " << flush;
         cout << "Id\tName" << endl
              << "--\t----" << endl;
 
-        pbook.tx_start();
-        pbook.list_contacts_brief();
-        pbook.tx_commit();
+        if (mirrored) {
+            mirror.list_contacts_brief();
+        } else {
+            pbook.tx_start_snapshot();
+            pbook.list_contacts_brief();
+            pbook.tx_commit();
+        }
 
         cout << "Enter id number: ";
         cin >> id;
@@ -320,6 +577,7 @@ Enter the number of your choice: " << flush;
     //=======================================================================
     void add_phone_number(db_uint contact_id = 0)
     {
+        TRACE_SPAN("console add_phone_number");
         const int buffer_size = 256;
 
         char number[buffer_size];
@@ -361,6 +619,7 @@ Enter the number of your choice: " << flush;
     //=======================================================================
     void remove_contact()
     {
+        TRACE_SPAN("console remove_contact");
         db_uint id;
 
         cout << "------ Remove Contact ------" << endl;
@@ -375,6 +634,7 @@ Enter the number of your choice: " << flush;
     //=======================================================================
     void rename_contact()
     {
+        TRACE_SPAN("console rename_contact");
         const int buffer_size = 256;
         wchar_t name[buffer_size];
         char name_mbs[buffer_size];
@@ -396,6 +656,7 @@ Enter the number of your choice: " << flush;
     //=======================================================================
     void export_picture()
     {
+        TRACE_SPAN("console export_picture");
         db_uint id;
         const int buffer_size = 256;
         char buffer[buffer_size];
@@ -418,6 +679,387 @@ Enter the number of your choice: " << flush;
         pbook.export_picture(id, file_name.c_str());
         pbook.tx_commit();
     }
+
+    //=======================================================================
+    // PICTURE STORAGE STATISTICS UI
+    //=======================================================================
+    void show_picture_stats()
+    {
+        TRACE_SPAN("console show_picture_stats");
+        PhoneBook::PictureStats stats;
+
+        pbook.tx_start();
+        pbook.get_picture_stats(stats);
+        pbook.tx_commit();
+
+        cout << "------ Picture Storage ------" << endl;
+        cout << "Distinct pictures: " << (unsigned long) stats.pictures << endl;
+        cout << "Contacts with a picture: " << (unsigned long) stats.references << endl;
+        cout << "Bytes stored: " << (unsigned long) stats.stored_bytes << endl;
+        cout << "Bytes saved by sharing: "
+             << (unsigned long) (stats.logical_bytes - stats.stored_bytes) << endl;
+        cout << endl;
+    }
+
+    //=======================================================================
+    // CONTACT STATISTICS UI
+    //=======================================================================
+    void show_stats()
+    {
+        TRACE_SPAN("console show_stats");
+        static const char *const type_names[] = { "Home", "Mobile", "Work", "Fax", "Pager" };
+        PhoneBook::Stats stats;
+        unsigned long ring_id = 0;
+        db_uint ring_contacts = 0;
+        db_uint drift = 0;
+        char verify = 'n';
+
+        cout << "Ring id to count: ";
+        cin >> ring_id;
+        cin.ignore(1000, '\n');
+
+        cout << "Recount from the tables to check the counters (y/n): ";
+        cin >> verify;
+        cin.ignore(1000, '\n');
+
+        pbook.tx_start();
+        pbook.get_stats(stats);
+        pbook.get_ring_id_contacts(ring_id, ring_contacts);
+        if (verify == 'y' || verify == 'Y')
+            pbook.verify_stats(drift);
+        pbook.tx_commit();
+
+        cout << "------ Contact Statistics ------" << endl;
+        cout << "Contacts: " << (unsigned long) stats.contacts << endl;
+        cout << "Contacts with a picture: " << (unsigned long) stats.contacts_with_picture << endl;
+        for (int type = PhoneBook::HOME; type <= PhoneBook::PAGER; type++)
+            cout << type_names[type] << " numbers: " << (unsigned long) stats.numbers[type] << endl;
+        cout << "Contacts with ring id " << ring_id << ": " << (unsigned long) ring_contacts << endl;
+        if (verify == 'y' || verify == 'Y')
+            cout << "Counters that drifted: " << (unsigned long) drift << endl;
+        cout << endl;
+    }
+
+    //=======================================================================
+    // BACKEND ROUTES UI
+    //=======================================================================
+    void show_routes()
+    {
+        cout << "------ Backend Routes ------" << endl;
+        if (backend != PhoneBook::HYBRID_BACKEND) {
+            cout << "Every call uses the " << PhoneBook::backend_name(backend) << " backend." << endl;
+            cout << "Set PHONEBOOK_BACKEND=hybrid to route calls per method." << endl << endl;
+            return;
+        }
+
+        HybridPhoneBook &hybrid = static_cast<HybridPhoneBook &>(*book);
+        char compare = 'n';
+
+        cout << "Check that both engines list the same contacts (y/n): ";
+        cin >> compare;
+        cin.ignore(1000, '\n');
+
+        cout << flush;
+        hybrid.print_routes(stdout);
+        if (compare == 'y' || compare == 'Y') {
+            int differ = hybrid.compare_engines(stdout);
+
+            if (DB_FAILED(differ))
+                printf("Cannot compare the engines: %d\n", differ);
+            else
+                printf("Listings that differ: %d\n", differ);
+        }
+        fflush(stdout);
+        cout << endl;
+    }
+
+    //=======================================================================
+    // DATABASE COMPACTION
+    //=======================================================================
+    void compact_database()
+    {
+        CompactStats stats;
+
+        cout << "------ Compact Database ------" << endl;
+        if (!local_file) {
+            cout << "Only a local file storage database can be compacted." << endl << endl;
+            return;
+        }
+
+        if (DB_FAILED(compact_phone_book(pbook, DATABASE_NAME_LOCAL, stats))) {
+            cout << "Compaction failed." << endl << endl;
+            return;
+        }
+
+        cout << "Copied " << stats.contacts << " contacts and " << stats.phone_numbers
+             << " phone numbers in name order, then " << stats.changes
+             << " changes made meanwhile." << endl;
+        cout << "File size: " << stats.old_size << " -> " << stats.new_size << " bytes";
+        if (stats.old_size > stats.new_size)
+            cout << " (" << stats.old_size - stats.new_size << " bytes reclaimed)";
+        cout << endl;
+        cout << "Name order scan: " << stats.old_scan_us << " -> " << stats.new_scan_us << " us";
+        if (stats.new_scan_us > 0)
+            cout << " (" << (double) stats.old_scan_us / stats.new_scan_us << "x)";
+        cout << endl << endl;
+    }
+
+    //=======================================================================
+    // CHANGE LOG UI
+    //=======================================================================
+    class ChangePrinter : public PhoneBook::ChangeVisitor
+    {
+    public:
+        bool change(const PhoneBook::ChangeRecord &record)
+        {
+            static const char *const names[] = {
+                "insert contact", "insert number", "rename", "picture", "remove", "compacted",
+                "group", "join group", "leave group"
+            };
+            char name_mbs[256];
+
+            cout << (unsigned long) record.seq << "\t" << names[record.type]
+                 << "\t" << (unsigned long) record.contact_id;
+            if (record.name != NULL) {
+                wcstombs(name_mbs, record.name, sizeof(name_mbs));
+                name_mbs[sizeof(name_mbs) - 1] = '\0';
+                cout << "\t" << name_mbs;
+            }
+            if (record.picture_name != NULL)
+                cout << "\t" << record.picture_name;
+            if (record.number != NULL)
+                cout << "\t" << record.number;
+            cout << endl;
+            return true;
+        }
+    };
+
+    void show_changes()
+    {
+        TRACE_SPAN("console show_changes");
+        unsigned long seq = 0;
+        ChangePrinter printer;
+
+        cout << "Show changes after sequence number (0=all): ";
+        cin >> seq;
+        cin.ignore(1000, '\n');
+
+        cout << "------ Changes ------" << endl;
+        pbook.tx_start();
+        if (!pbook.changes_since(seq, printer))
+            cout << "Changes were compacted; read the whole phone book instead." << endl;
+        pbook.tx_commit();
+        cout << endl;
+    }
+
+    void compact_changes()
+    {
+        TRACE_SPAN("console compact_changes");
+        unsigned long seq = 0;
+
+        cout << "Discard changes up to sequence number: ";
+        cin >> seq;
+        cin.ignore(1000, '\n');
+
+        pbook.tx_start();
+        pbook.compact_change_log(seq);
+        pbook.tx_commit();
+    }
+
+    //=======================================================================
+    // SNAPSHOT EXPORT UI
+    //=======================================================================
+    void export_snapshot()
+    {
+        TRACE_SPAN("console export_snapshot");
+        const int buffer_size = 256;
+        char file_name[buffer_size];
+        PhoneBookSnapshot snapshot;
+
+        cout << "Choose a filename for the snapshot (default=\"" DEFAULT_SNAPSHOT "\"): ";
+        cin.getline(file_name, buffer_size);
+        if (file_name[0] == '\0')
+            strcpy(file_name, DEFAULT_SNAPSHOT);
+
+        if (DB_FAILED(write_snapshot(pbook, file_name))) {
+            cerr << "Could not write snapshot " << file_name << endl;
+        } else if (snapshot.open(file_name)) {
+            cout << "Wrote " << (unsigned long) snapshot.contact_count() << " contacts and "
+                 << (unsigned long) snapshot.number_count() << " phone numbers" << endl;
+        }
+        cout << endl;
+    }
+
+    //=======================================================================
+    // VCARD IMPORT AND EXPORT UI
+    //=======================================================================
+    void import_vcards()
+    {
+        TRACE_SPAN("console import_vcards");
+        const int buffer_size = 256;
+        char file_name[buffer_size];
+        db_uint imported = 0;
+        FILE *in;
+
+        cout << "Choose a vCard file to import (default=\"" DEFAULT_VCARDS "\"): ";
+        cin.getline(file_name, buffer_size);
+        if (file_name[0] == '\0')
+            strcpy(file_name, DEFAULT_VCARDS);
+
+        if ((in = fopen(file_name, "rb")) == NULL) {
+            cerr << "Cannot open " << file_name << endl;
+            return;
+        }
+        ::import_vcards(pbook, in, VCARD_PHOTO_FILE, &imported);
+        fclose(in);
+
+        cout << "Imported " << (unsigned long) imported << " contacts" << endl << endl;
+    }
+
+    void export_vcards()
+    {
+        TRACE_SPAN("console export_vcards");
+        const int buffer_size = 256;
+        char file_name[buffer_size];
+        int version = 3;
+        FILE *out;
+
+        cout << "Choose a filename for the vCards (default=\"" DEFAULT_VCARDS "\"): ";
+        cin.getline(file_name, buffer_size);
+        if (file_name[0] == '\0')
+            strcpy(file_name, DEFAULT_VCARDS);
+
+        cout << "vCard version (3 or 4): ";
+        cin >> version;
+        cin.ignore(1000, '\n');
+
+        if ((out = fopen(file_name, "wb")) == NULL) {
+            cerr << "Cannot open " << file_name << endl;
+            return;
+        }
+        if (DB_FAILED(::export_vcards(pbook, out, version)))
+            cerr << "Could not write " << file_name << endl;
+        fclose(out);
+        cout << endl;
+    }
+
+    //=======================================================================
+    // PHONE NUMBER SEARCH UI
+    //=======================================================================
+    class NumberPrinter : public PhoneBook::ChangeVisitor
+    {
+    public:
+        unsigned long count;
+
+        NumberPrinter() : count(0) {}
+
+        bool change(const PhoneBook::ChangeRecord &record)
+        {
+            char name_mbs[256];
+            char e164[NUMBER_KEY_DIGITS + 2];
+
+            wcstombs(name_mbs, record.name, sizeof(name_mbs));
+            name_mbs[sizeof(name_mbs) - 1] = '\0';
+            format_number_key(number_key(record.number), e164);
+
+            cout << (unsigned long) record.contact_id << "\t" << name_mbs
+                 << "\t" << record.number << "\t" << e164 << endl;
+            count++;
+            return true;
+        }
+    };
+
+    void find_phone_numbers()
+    {
+        TRACE_SPAN("console find_phone_numbers");
+        const int buffer_size = 64;
+        char number[buffer_size];
+        NumberPrinter printer;
+
+        cout << "Enter a phone number or its first digits: ";
+        cin.getline(number, buffer_size);
+
+        cout << "------ Matching Numbers ------" << endl;
+        pbook.tx_start_snapshot();
+        pbook.find_phone_numbers(number, printer);
+        pbook.tx_commit();
+        cout << printer.count << " found" << endl << endl;
+    }
+
+    void find_number_suffix()
+    {
+        TRACE_SPAN("console find_number_suffix");
+        const int buffer_size = 64;
+        char digits[buffer_size];
+        NumberPrinter printer;
+
+        cout << "Enter the last digits of a phone number: ";
+        cin.getline(digits, buffer_size);
+
+        cout << "------ Matching Numbers ------" << endl;
+        pbook.tx_start_snapshot();
+        if (pbook.search_by_number_suffix(digits, SUFFIX_SEARCH_LIMIT, printer) == DB_EINVAL)
+            cout << "Invalid digits: " << digits << endl;
+        pbook.tx_commit();
+        cout << printer.count << " found" << endl << endl;
+    }
+
+    //=======================================================================
+    // CONTACT GROUP UI
+    //=======================================================================
+    db_uint select_group()
+    {
+        unsigned int group_id;
+
+        cout << "Group: \n"
+                "1) Favorites\n"
+                "2) Family\n"
+                "3) Work\n"
+                "Enter the number of your choice: ";
+        cin >> group_id;
+        cin.ignore(1000, '\n');
+
+        return group_id;
+    }
+
+    void add_to_group()
+    {
+        TRACE_SPAN("console add_to_group");
+        cout << "------ Add Contact to Group ------" << endl;
+        db_uint contact_id = select_contact();
+        db_uint group_id = select_group();
+
+        pbook.tx_start();
+        pbook.add_to_group(contact_id, group_id);
+        pbook.tx_commit();
+    }
+
+    void list_group_contacts()
+    {
+        TRACE_SPAN("console list_group_contacts");
+        PhoneBook::ContactResults results;
+        int type = -1;
+
+        cout << "------ List Group Contacts ------" << endl;
+        db_uint group_id = select_group();
+
+        cout << "Only contacts with a phone number of type: \n"
+                "-1) Any\n"
+                "0) Home\n"
+                "1) Mobile\n"
+                "2) Work\n"
+                "3) Fax\n"
+                "4) Pager\n"
+                "Enter the number of your choice: ";
+        cin >> type;
+        cin.ignore(1000, '\n');
+
+        pbook.tx_start_snapshot();
+        if (DB_SUCCESS(pbook.get_group_contacts(group_id, type, results)))
+            print_contacts(results);
+        pbook.tx_commit();
+        cout << endl;
+    }
 };
 
 //=======================================================================
@@ -425,13 +1067,35 @@ Enter the number of your choice: " << flush;
 // PROGRAM ENTRY
 //=======================================================================
 //=======================================================================
-int main()
+int main(int argc, char *argv[])
 {
     PhoneBookConsoleApp app;
+    int connection_method = 1;
+    int arg = 1;
+
+    if (argc == 1) {
+        if (app.connect())
+            return 1;
+
+        app.run();
+        return 0;
+    }
+
+    if (arg + 1 < argc && strcmp(argv[arg], "-c") == 0) {
+        connection_method = atoi(argv[arg + 1]);
+        arg += 2;
+    }
+    if (arg == argc || argv[arg][0] == '-' || connection_method < 1 || connection_method > 6) {
+        PhoneBookConsoleApp::usage(argv[0]);
+        return 2;
+    }
 
-    if (app.connect())
+    app.set_interactive(false);
+    if (!PhoneBookConsoleApp::connection_supported(connection_method) || app.connect(connection_method))
         return 1;
 
-	app.run();
-	return 0;
+    int status = app.run_commands(argc - arg, argv + arg);
+    if (status == 2)
+        PhoneBookConsoleApp::usage(argv[0]);
+    return status;
 }
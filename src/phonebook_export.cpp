@@ -0,0 +1,286 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Parallel export of the whole phone book
+ */
+
+#include "phonebook_export.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Size of the buffer used to copy finished partitions to the output. */
+#define EXPORT_COPY_BUFFER      65536
+
+
+ContactFormatter::ContactFormatter(FILE *out)
+    : out(out)
+    , started(false)
+{
+}
+
+bool ContactFormatter::change(const PhoneBook::ChangeRecord &record)
+{
+    if (record.type == PhoneBook::CONTACT_INSERTED) {
+        char name_mbs[256];
+        size_t length = 0;
+        mbstate_t state;
+
+        // wcrtomb keeps its state locally, so workers can convert at once.
+        // Characters the locale cannot represent are replaced.
+        memset(&state, 0, sizeof state);
+        for (const wchar_t *c = record.name; c != NULL && *c != 0; c++) {
+            char mb[MB_LEN_MAX];
+            size_t n = wcrtomb(mb, *c, &state);
+
+            if (n == (size_t) -1) {
+                memset(&state, 0, sizeof state);
+                mb[0] = '?';
+                n = 1;
+            }
+            if (length + n >= sizeof name_mbs)
+                break;
+            memcpy(name_mbs + length, mb, n);
+            length += n;
+        }
+        name_mbs[length] = '\0';
+
+        if (started)
+            fputc('\n', out);
+        started = true;
+
+        fprintf(out, "Id: %lu\nName: %s\nRing tone id: %d\n",
+                (unsigned long) record.contact_id, name_mbs, (int) record.ring_id);
+        if (record.picture_name != NULL)
+            fprintf(out, "Picture name: %s\n", record.picture_name);
+    } else if (record.type == PhoneBook::PHONE_NUMBER_INSERTED) {
+        static const char *const types[] = { "Home", "Mobile", "Work", "Fax", "Pager" };
+
+        fprintf(out, "Phone number: %s (", record.number);
+        if ((unsigned) record.number_type < sizeof types / sizeof types[0])
+            fputs(types[record.number_type], out);
+        if (record.speed_dial >= 0)
+            fprintf(out, ", speed dial %ld", (long) record.speed_dial);
+        fputs(")\n", out);
+    }
+    return true;
+}
+
+/**
+ * End the last contact written.
+ */
+void ContactFormatter::finish()
+{
+    if (started)
+        fputc('\n', out);
+    started = false;
+}
+
+/**
+ * One contiguous range of contact ids
+ */
+struct ExportPartition {
+    db_uint first_id;
+    db_uint last_id;
+    /* Formatted contacts, once done */
+    FILE *data;
+    bool done;
+};
+
+/**
+ * State shared by the worker threads and the thread writing the output
+ */
+struct ExportJob {
+    int file_mode;
+    const char *database_name;
+    std::vector<ExportPartition> partitions;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t next;
+    int workers;
+    int rc;
+    bool stop;
+};
+
+/**
+ * Worker thread: format partitions until none are left.
+ */
+static void export_worker(ExportJob *job)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    int rc = pbook.open_database(job->file_mode, job->database_name);
+
+    for (;;) {
+        size_t p;
+
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            if (DB_FAILED(rc) || job->stop || job->next == job->partitions.size())
+                break;
+            p = job->next++;
+        }
+
+        ExportPartition &partition = job->partitions[p];
+        FILE *data = tmpfile();
+
+        if (data == NULL) {
+            rc = DB_EIO;
+            // Let the writer see the failure instead of waiting for this partition
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->rc = rc;
+            job->finished.notify_all();
+            break;
+        }
+
+        ContactFormatter formatter(data);
+        pbook.tx_start_snapshot();
+        pbook.visit_contacts(formatter, partition.first_id, partition.last_id);
+        pbook.tx_commit();
+        formatter.finish();
+        rewind(data);
+
+        std::lock_guard<std::mutex> lock(job->mutex);
+        partition.data = data;
+        partition.done = true;
+        job->finished.notify_all();
+    }
+
+    pbook.close_database();
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (DB_FAILED(rc) && job->rc == DB_NOERROR)
+        job->rc = rc;
+    job->workers--;
+    job->finished.notify_all();
+}
+
+int export_contacts_parallel(int file_mode, const char *database_name, FILE *out, int threads)
+{
+    std::unique_ptr<PhoneBook> book(PhoneBook::create());
+    PhoneBook &pbook = *book;
+    ExportJob job;
+    db_uint first_id, last_id;
+    bool found;
+    int rc;
+
+    //-------------------------------------------------------------------
+    // Split the id range into partitions of equal width
+    //-------------------------------------------------------------------
+    rc = pbook.open_database(file_mode, database_name);
+    if (DB_FAILED(rc))
+        return rc;
+    pbook.tx_start_snapshot();
+    found = pbook.get_contact_id_range(first_id, last_id);
+    pbook.tx_commit();
+    pbook.close_database();
+
+    if (!found)
+        return DB_NOERROR;
+    if (threads < 1)
+        threads = 1;
+
+    db_uint span = last_id - first_id + 1;
+    db_uint count = (db_uint) threads * EXPORT_PARTITIONS_PER_THREAD;
+    if (count > span)
+        count = span;
+    for (db_uint i = 0; i < count; i++) {
+        ExportPartition partition;
+
+        partition.first_id = first_id + span / count * i + (i < span % count ? i : span % count);
+        partition.last_id = partition.first_id + span / count - (i < span % count ? 0 : 1);
+        partition.data = NULL;
+        partition.done = false;
+        job.partitions.push_back(partition);
+    }
+
+    job.file_mode = file_mode;
+    job.database_name = database_name;
+    job.next = 0;
+    job.workers = threads;
+    job.rc = DB_NOERROR;
+    job.stop = false;
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++)
+        workers.push_back(std::thread(export_worker, &job));
+
+    //-------------------------------------------------------------------
+    // Copy partitions to the output in order, as they complete
+    //-------------------------------------------------------------------
+    char *buffer = (char *) malloc(EXPORT_COPY_BUFFER);
+    if (buffer == NULL)
+        rc = DB_ENOMEM;
+
+    for (size_t p = 0; DB_SUCCESS(rc) && p < job.partitions.size(); p++) {
+        ExportPartition &partition = job.partitions[p];
+
+        {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            while (!partition.done && job.workers > 0 && job.rc == DB_NOERROR)
+                job.finished.wait(lock);
+            if (!partition.done) {
+                rc = job.rc != DB_NOERROR ? job.rc : DB_EIO;
+                break;
+            }
+        }
+
+        size_t length;
+        while ((length = fread(buffer, 1, EXPORT_COPY_BUFFER, partition.data)) > 0) {
+            if (fwrite(buffer, 1, length, out) != length) {
+                rc = DB_EIO;
+                break;
+            }
+        }
+        fclose(partition.data);
+        partition.data = NULL;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        job.stop = true;
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    // Discard partitions not copied after a failure
+    for (size_t p = 0; p < job.partitions.size(); p++) {
+        if (job.partitions[p].data != NULL)
+            fclose(job.partitions[p].data);
+    }
+    free(buffer);
+
+    return rc;
+}
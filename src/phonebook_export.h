@@ -0,0 +1,70 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Parallel export of the whole phone book
+ */
+
+#ifndef PHONEBOOK_EXPORT_H
+#define PHONEBOOK_EXPORT_H 1
+
+#include "phonebook.h"
+
+#include <stdio.h>
+
+/* Partitions per worker thread, so fast workers can take up the slack. */
+#define EXPORT_PARTITIONS_PER_THREAD    4
+
+/**
+ * Writes contacts to a file in the same format as PhoneBook::list_contacts.
+ */
+class ContactFormatter : public PhoneBook::ChangeVisitor {
+private:
+    FILE *out;
+    bool started;
+
+public:
+    ContactFormatter(FILE *out);
+
+    bool change(const PhoneBook::ChangeRecord &record);
+    void finish();
+};
+
+/**
+ * Write every contact of a database to a file, in id order, in the same
+ * format as PhoneBook::list_contacts.
+ *
+ * The contact id range is split into partitions. Each worker thread opens
+ * its own connection to the database and formats whole partitions, each in
+ * its own transaction, into temporary files, which are copied to the
+ * output in order as they complete. Changes made during the export may be
+ * seen by some partitions and not others.
+ *
+ * @return database error code
+ */
+int export_contacts_parallel(int file_mode, const char *database_name, FILE *out, int threads);
+
+
+#endif
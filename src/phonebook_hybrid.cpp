@@ -0,0 +1,479 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Phone book that routes each method to the cursor or the SQL engine
+ */
+
+#include "phonebook_hybrid.h"
+
+#include <string.h>
+#include <chrono>
+
+/* Methods sent to the SQL engine by default: listings that read whole
+   tables, where one joined or aggregated query replaces a cursor seek per
+   contact. Everything else uses cursor seeks. */
+static const TraceOp default_sql_routes[] = {
+    TRACE_LIST_CONTACTS_BRIEF,
+    TRACE_LIST_CONTACTS,
+    TRACE_GET_CONTACTS_BRIEF,
+    TRACE_GET_CONTACTS,
+    TRACE_GET_PICTURE_STATS,
+};
+
+static db_uint steady_ns()
+{
+    return (db_uint) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//=======================================================================
+// Routing
+//=======================================================================
+
+HybridPhoneBook::HybridPhoneBook()
+    : cursor(state)
+    , sql(state)
+{
+    reset_routes();
+    reset_counters();
+}
+
+HybridPhoneBook::RoutedCall::RoutedCall(HybridPhoneBook &owner, TraceOp op)
+    : owner(owner)
+    , op(op)
+    , start_ns(steady_ns())
+{
+}
+
+HybridPhoneBook::RoutedCall::~RoutedCall()
+{
+    RouteCounter &counter = owner.counters[op];
+
+    counter.calls++;
+    counter.total_ns += steady_ns() - start_ns;
+}
+
+PhoneBook &HybridPhoneBook::RoutedCall::engine()
+{
+    if (owner.routes[op] == SQL_BACKEND)
+        return owner.sql;
+    return owner.cursor;
+}
+
+void HybridPhoneBook::set_route(TraceOp op, Backend backend)
+{
+    routes[op] = backend == SQL_BACKEND ? SQL_BACKEND : CURSOR_BACKEND;
+}
+
+int HybridPhoneBook::set_routes(const char *spec)
+{
+    Backend parsed[TRACE_OP_COUNT];
+    const char *p = spec;
+
+    memcpy(parsed, routes, sizeof(parsed));
+
+    while (*p != '\0') {
+        const char *end = p + strcspn(p, ",");
+        const char *equals = (const char *) memchr(p, '=', end - p);
+        char engine[16];
+        Backend backend;
+        int op;
+
+        if (equals == NULL || (size_t) (end - equals - 1) >= sizeof(engine))
+            return DB_EINVAL;
+        memcpy(engine, equals + 1, end - equals - 1);
+        engine[end - equals - 1] = '\0';
+
+        for (op = 0; op < TRACE_OP_COUNT; op++) {
+            if (strlen(trace_op_names[op]) == (size_t) (equals - p) &&
+                strncmp(trace_op_names[op], p, equals - p) == 0)
+                break;
+        }
+        if (op == TRACE_OP_COUNT || !parse_backend(engine, backend) || backend == HYBRID_BACKEND)
+            return DB_EINVAL;
+        parsed[op] = backend;
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    memcpy(routes, parsed, sizeof(routes));
+    return DB_NOERROR;
+}
+
+void HybridPhoneBook::reset_routes()
+{
+    for (int op = 0; op < TRACE_OP_COUNT; op++)
+        routes[op] = CURSOR_BACKEND;
+    for (size_t i = 0; i < sizeof(default_sql_routes) / sizeof(default_sql_routes[0]); i++)
+        routes[default_sql_routes[i]] = SQL_BACKEND;
+}
+
+void HybridPhoneBook::reset_counters()
+{
+    memset(counters, 0, sizeof(counters));
+}
+
+void HybridPhoneBook::print_routes(FILE *out) const
+{
+    fprintf(out, "%-30s %-7s %10s %12s\n", "method", "engine", "calls", "mean us");
+    for (int op = 0; op < TRACE_OP_COUNT; op++) {
+        const RouteCounter &counter = counters[op];
+
+        fprintf(out, "%-30s %-7s %10llu %12.1f\n", trace_op_names[op], backend_name(routes[op]),
+            (unsigned long long) counter.calls,
+            counter.calls != 0 ? counter.total_ns / 1000.0 / counter.calls : 0.0);
+    }
+}
+
+/**
+ * Read every contact listing with the cursor and the SQL engine, in one
+ * transaction, and compare the results.
+ *
+ * @return the number of listings that differ, or a database error code
+ */
+int HybridPhoneBook::compare_engines(FILE *out)
+{
+    static const char *const sort_names[] = { "id", "name", "ring id and name" };
+    ContactResults cursor_results;
+    ContactResults sql_results;
+    int differ = 0;
+    int rc;
+
+    cursor.tx_start();
+
+    if (DB_SUCCESS(rc = cursor.get_contacts_brief(cursor_results)) &&
+        DB_SUCCESS(rc = sql.get_contacts_brief(sql_results)) &&
+        !same_contacts(cursor_results, sql_results))
+    {
+        fprintf(out, "get_contacts_brief differs: cursor %lu contacts, sql %lu\n",
+            (unsigned long) cursor_results.size(), (unsigned long) sql_results.size());
+        differ++;
+    }
+
+    for (int sort = 0; DB_SUCCESS(rc) && sort < 3; sort++) {
+        if (DB_SUCCESS(rc = cursor.get_contacts(sort, cursor_results)) &&
+            DB_SUCCESS(rc = sql.get_contacts(sort, sql_results)) &&
+            !same_contacts(cursor_results, sql_results))
+        {
+            fprintf(out, "get_contacts by %s differs: cursor %lu contacts, %lu numbers; "
+                "sql %lu contacts, %lu numbers\n", sort_names[sort],
+                (unsigned long) cursor_results.size(), (unsigned long) cursor_results.number_count(),
+                (unsigned long) sql_results.size(), (unsigned long) sql_results.number_count());
+            differ++;
+        }
+    }
+
+    cursor.tx_commit();
+    return DB_SUCCESS(rc) ? differ : rc;
+}
+
+//=======================================================================
+// Routed methods
+//=======================================================================
+
+int HybridPhoneBook::open_database(int file_mode, const char* database_name)
+{
+    return cursor.open_database(file_mode, database_name);
+}
+
+int HybridPhoneBook::create_database(int file_mode, const char* database_name)
+{
+    return cursor.create_database(file_mode, database_name);
+}
+
+int HybridPhoneBook::close_database()
+{
+    return cursor.close_database();
+}
+
+db_uint HybridPhoneBook::insert_contact(const wchar_t *name, db_uint ring_id,
+    const char *picture_name)
+{
+    RoutedCall routed(*this, TRACE_INSERT_CONTACT);
+    return routed.engine().insert_contact(name, ring_id, picture_name);
+}
+
+db_uint HybridPhoneBook::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+    const char *picture_file)
+{
+    RoutedCall routed(*this, TRACE_INSERT_CONTACT);
+    return routed.engine().insert_contact(name, ring_id, picture_name, picture_file);
+}
+
+void HybridPhoneBook::insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type,
+    db_sint speed_dial)
+{
+    RoutedCall routed(*this, TRACE_INSERT_PHONE_NUMBER);
+    routed.engine().insert_phone_number(contact_id, number, type, speed_dial);
+}
+
+void HybridPhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
+{
+    RoutedCall routed(*this, TRACE_UPDATE_CONTACT_NAME);
+    routed.engine().update_contact_name(id, newname);
+}
+
+void HybridPhoneBook::update_contact_picture(db_uint contact_id, const char *picture_name)
+{
+    RoutedCall routed(*this, TRACE_UPDATE_CONTACT_PICTURE);
+    routed.engine().update_contact_picture(contact_id, picture_name);
+}
+
+void HybridPhoneBook::remove_contact(db_uint id)
+{
+    RoutedCall routed(*this, TRACE_REMOVE_CONTACT);
+    routed.engine().remove_contact(id);
+}
+
+void HybridPhoneBook::list_contacts_brief()
+{
+    RoutedCall routed(*this, TRACE_LIST_CONTACTS_BRIEF);
+    routed.engine().list_contacts_brief();
+}
+
+void HybridPhoneBook::list_contacts(int sort)
+{
+    RoutedCall routed(*this, TRACE_LIST_CONTACTS);
+    routed.engine().list_contacts(sort);
+}
+
+int HybridPhoneBook::get_contacts_brief(ContactResults &results)
+{
+    RoutedCall routed(*this, TRACE_GET_CONTACTS_BRIEF);
+    return routed.engine().get_contacts_brief(results);
+}
+
+int HybridPhoneBook::get_contacts(int sort, ContactResults &results)
+{
+    RoutedCall routed(*this, TRACE_GET_CONTACTS);
+    return routed.engine().get_contacts(sort, results);
+}
+
+db::String HybridPhoneBook::get_picture_name(db_uint id)
+{
+    RoutedCall routed(*this, TRACE_GET_PICTURE_NAME);
+    return routed.engine().get_picture_name(id);
+}
+
+const char *HybridPhoneBook::get_picture_name(db_uint id, ResultArena &arena)
+{
+    RoutedCall routed(*this, TRACE_GET_PICTURE_NAME);
+    return routed.engine().get_picture_name(id, arena);
+}
+
+void HybridPhoneBook::export_picture(db_uint id, const char *file_name)
+{
+    RoutedCall routed(*this, TRACE_EXPORT_PICTURE);
+    routed.engine().export_picture(id, file_name);
+}
+
+int HybridPhoneBook::export_picture(db_uint id, FILE *picture_file)
+{
+    RoutedCall routed(*this, TRACE_EXPORT_PICTURE);
+    return routed.engine().export_picture(id, picture_file);
+}
+
+void HybridPhoneBook::get_picture_stats(PictureStats &stats)
+{
+    RoutedCall routed(*this, TRACE_GET_PICTURE_STATS);
+    routed.engine().get_picture_stats(stats);
+}
+
+void HybridPhoneBook::set_picture_compression(bool enable)
+{
+    RoutedCall routed(*this, TRACE_SET_PICTURE_COMPRESSION);
+    routed.engine().set_picture_compression(enable);
+}
+
+bool HybridPhoneBook::changes_since(db_uint seq, ChangeVisitor &visitor)
+{
+    RoutedCall routed(*this, TRACE_CHANGES_SINCE);
+    return routed.engine().changes_since(seq, visitor);
+}
+
+void HybridPhoneBook::compact_change_log(db_uint through_seq)
+{
+    RoutedCall routed(*this, TRACE_COMPACT_CHANGE_LOG);
+    routed.engine().compact_change_log(through_seq);
+}
+
+db_uint HybridPhoneBook::last_change_seq()
+{
+    RoutedCall routed(*this, TRACE_LAST_CHANGE_SEQ);
+    return routed.engine().last_change_seq();
+}
+
+void HybridPhoneBook::set_change_logging(bool enable)
+{
+    RoutedCall routed(*this, TRACE_SET_CHANGE_LOGGING);
+    routed.engine().set_change_logging(enable);
+}
+
+void HybridPhoneBook::set_id_block_size(unsigned size)
+{
+    RoutedCall routed(*this, TRACE_SET_ID_BLOCK_SIZE);
+    routed.engine().set_id_block_size(size);
+}
+
+void HybridPhoneBook::set_memory_storage_size(db_uint size)
+{
+    RoutedCall routed(*this, TRACE_SET_MEMORY_STORAGE_SIZE);
+    routed.engine().set_memory_storage_size(size);
+}
+
+bool HybridPhoneBook::get_contact_id_range(db_uint &first_id, db_uint &last_id)
+{
+    RoutedCall routed(*this, TRACE_GET_CONTACT_ID_RANGE);
+    return routed.engine().get_contact_id_range(first_id, last_id);
+}
+
+void HybridPhoneBook::visit_contacts(ChangeVisitor &visitor, db_uint first_id,
+    db_uint last_id)
+{
+    RoutedCall routed(*this, TRACE_VISIT_CONTACTS);
+    routed.engine().visit_contacts(visitor, first_id, last_id);
+}
+
+void HybridPhoneBook::visit_groups(ChangeVisitor &visitor)
+{
+    RoutedCall routed(*this, TRACE_VISIT_GROUPS);
+    routed.engine().visit_groups(visitor);
+}
+
+void HybridPhoneBook::find_phone_numbers(const char *number, ChangeVisitor &visitor)
+{
+    RoutedCall routed(*this, TRACE_FIND_PHONE_NUMBERS);
+    routed.engine().find_phone_numbers(number, visitor);
+}
+
+int HybridPhoneBook::search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor)
+{
+    RoutedCall routed(*this, TRACE_SEARCH_BY_NUMBER_SUFFIX);
+    return routed.engine().search_by_number_suffix(digits, limit, visitor);
+}
+
+void HybridPhoneBook::apply_change(const ChangeRecord &record)
+{
+    RoutedCall routed(*this, TRACE_APPLY_CHANGE);
+    routed.engine().apply_change(record);
+}
+
+db_uint HybridPhoneBook::create_group(const wchar_t *name)
+{
+    RoutedCall routed(*this, TRACE_CREATE_GROUP);
+    return routed.engine().create_group(name);
+}
+
+void HybridPhoneBook::add_to_group(db_uint contact_id, db_uint group_id)
+{
+    RoutedCall routed(*this, TRACE_ADD_TO_GROUP);
+    routed.engine().add_to_group(contact_id, group_id);
+}
+
+void HybridPhoneBook::remove_from_group(db_uint contact_id, db_uint group_id)
+{
+    RoutedCall routed(*this, TRACE_REMOVE_FROM_GROUP);
+    routed.engine().remove_from_group(contact_id, group_id);
+}
+
+int HybridPhoneBook::get_group_members(db_uint group_id, ContactBitmap &contacts)
+{
+    RoutedCall routed(*this, TRACE_GET_GROUP_MEMBERS);
+    return routed.engine().get_group_members(group_id, contacts);
+}
+
+int HybridPhoneBook::get_contacts_with_number_type(PhoneNumberType type,
+    ContactBitmap &contacts)
+{
+    RoutedCall routed(*this, TRACE_GET_CONTACTS_WITH_NUMBER_TYPE);
+    return routed.engine().get_contacts_with_number_type(type, contacts);
+}
+
+int HybridPhoneBook::get_contacts(const ContactBitmap &ids, ContactResults &results)
+{
+    RoutedCall routed(*this, TRACE_GET_CONTACTS_BY_ID);
+    return routed.engine().get_contacts(ids, results);
+}
+
+int HybridPhoneBook::get_group_contacts(db_uint group_id, int number_type,
+    ContactResults &results)
+{
+    RoutedCall routed(*this, TRACE_GET_GROUP_CONTACTS);
+    return routed.engine().get_group_contacts(group_id, number_type, results);
+}
+
+int HybridPhoneBook::get_stats(Stats &stats)
+{
+    RoutedCall routed(*this, TRACE_GET_STATS);
+    return routed.engine().get_stats(stats);
+}
+
+int HybridPhoneBook::get_ring_id_contacts(db_uint ring_id, db_uint &count)
+{
+    RoutedCall routed(*this, TRACE_GET_RING_ID_CONTACTS);
+    return routed.engine().get_ring_id_contacts(ring_id, count);
+}
+
+int HybridPhoneBook::verify_stats(db_uint &drift)
+{
+    RoutedCall routed(*this, TRACE_VERIFY_STATS);
+    return routed.engine().verify_stats(drift);
+}
+
+// Subscriptions are kept in the shared state, so either engine serves them
+void HybridPhoneBook::subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options)
+{
+    cursor.subscribe(subscriber, options);
+}
+
+void HybridPhoneBook::unsubscribe(ChangeSubscriber &subscriber)
+{
+    cursor.unsubscribe(subscriber);
+}
+
+void HybridPhoneBook::poll_subscriptions()
+{
+    cursor.poll_subscriptions();
+}
+
+void HybridPhoneBook::tx_start()
+{
+    RoutedCall routed(*this, TRACE_TX_START);
+    routed.engine().tx_start();
+}
+
+void HybridPhoneBook::tx_start_snapshot()
+{
+    RoutedCall routed(*this, TRACE_TX_START_SNAPSHOT);
+    routed.engine().tx_start_snapshot();
+}
+
+void HybridPhoneBook::tx_commit()
+{
+    RoutedCall routed(*this, TRACE_TX_COMMIT);
+    routed.engine().tx_commit();
+}
@@ -0,0 +1,177 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Phone book that routes each method to the cursor or the SQL engine
+ */
+
+#ifndef PHONEBOOK_HYBRID_H
+#define PHONEBOOK_HYBRID_H 1
+
+#include "phonebook_backends.h"
+#include "phonebook_trace.h"
+
+#include <stdio.h>
+
+/* Routes applied by PhoneBook::create(HYBRID_BACKEND), as for set_routes() */
+#define ROUTES_ENV_VAR          "PHONEBOOK_ROUTES"
+
+/**
+ * A phone book that sends each method to whichever of the cursor and SQL
+ * engines handles it faster. Both engines share one connection, so a
+ * transaction may mix them freely.
+ *
+ * Routes are kept per method, numbered as in the trace format (TraceOp),
+ * and default to cursor seeks for point lookups and updates and SQL for
+ * listings that join or aggregate over whole tables. Replaying a trace
+ * with each backend (see bench/trace_replay.cpp) shows which is faster for
+ * a workload. Opening, creating and closing the database always use the
+ * cursor engine.
+ *
+ * Each route counts its calls and the time spent in them. Both engines
+ * return the same results, so a route changes only the speed of a call;
+ * compare_engines() checks the contact listings.
+ */
+class HybridPhoneBook : public PhoneBook {
+public:
+    /**
+     * Calls made through one route
+     */
+    struct RouteCounter {
+        db_uint calls;
+        /* Total time spent in the calls, in nanoseconds */
+        db_uint total_ns;
+    };
+
+private:
+    PhoneBookState state;
+    CursorPhoneBook cursor;
+    SqlPhoneBook sql;
+    Backend routes[TRACE_OP_COUNT];
+    RouteCounter counters[TRACE_OP_COUNT];
+
+    /* Times one call and selects the engine for it */
+    class RoutedCall {
+    private:
+        HybridPhoneBook &owner;
+        TraceOp op;
+        db_uint start_ns;
+
+    public:
+        RoutedCall(HybridPhoneBook &owner, TraceOp op);
+        ~RoutedCall();
+
+        PhoneBook &engine();
+    };
+
+    /* Not copyable */
+    HybridPhoneBook(const HybridPhoneBook &);
+    HybridPhoneBook &operator=(const HybridPhoneBook &);
+
+public:
+    HybridPhoneBook();
+
+    /* Send a method to CURSOR_BACKEND or SQL_BACKEND. */
+    void set_route(TraceOp op, Backend backend);
+    Backend get_route(TraceOp op) const { return routes[op]; }
+    /* Apply routes written as "method=engine,...", for example
+       "list_contacts=sql,get_picture_name=cursor". Nothing is changed
+       if any route is invalid. */
+    int set_routes(const char *spec);
+    /* Restore the default routes. */
+    void reset_routes();
+
+    const RouteCounter &get_counter(TraceOp op) const { return counters[op]; }
+    void reset_counters();
+    /* Print each route with its call count and mean call time. */
+    void print_routes(FILE *out) const;
+    /* Read the listings routed between the engines with both of them,
+       printing each listing they return differently. Returns the number
+       of listings that differ, or a database error code. */
+    int compare_engines(FILE *out);
+
+    int open_database(int file_mode, const char* database_name);
+    int create_database(int file_mode, const char* database_name);
+    int close_database();
+
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name);
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+        const char *picture_file);
+    void insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial);
+
+    void update_contact_name(db_uint id, const wchar_t *newname);
+    void update_contact_picture(db_uint contact_id, const char *picture_name);
+    void remove_contact(db_uint id);
+
+    void list_contacts_brief();
+    void list_contacts(int sort);
+    int get_contacts_brief(ContactResults &results);
+    int get_contacts(int sort, ContactResults &results);
+
+    db::String get_picture_name(db_uint id);
+    const char *get_picture_name(db_uint id, ResultArena &arena);
+    void export_picture(db_uint id, const char *file_name);
+    int export_picture(db_uint id, FILE *picture_file);
+    void get_picture_stats(PictureStats &stats);
+    void set_picture_compression(bool enable);
+
+    bool changes_since(db_uint seq, ChangeVisitor &visitor);
+    void compact_change_log(db_uint through_seq);
+    db_uint last_change_seq();
+    void set_change_logging(bool enable);
+    void set_id_block_size(unsigned size);
+    void set_memory_storage_size(db_uint size);
+
+    bool get_contact_id_range(db_uint &first_id, db_uint &last_id);
+    void visit_contacts(ChangeVisitor &visitor, db_uint first_id = 0, db_uint last_id = ~(db_uint) 0 >> 1);
+    void visit_groups(ChangeVisitor &visitor);
+    void find_phone_numbers(const char *number, ChangeVisitor &visitor);
+    int search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor);
+    void apply_change(const ChangeRecord &record);
+
+    db_uint create_group(const wchar_t *name);
+    void add_to_group(db_uint contact_id, db_uint group_id);
+    void remove_from_group(db_uint contact_id, db_uint group_id);
+    int get_group_members(db_uint group_id, ContactBitmap &contacts);
+    int get_contacts_with_number_type(PhoneNumberType type, ContactBitmap &contacts);
+    int get_contacts(const ContactBitmap &ids, ContactResults &results);
+    int get_group_contacts(db_uint group_id, int number_type, ContactResults &results);
+
+    int get_stats(Stats &stats);
+    int get_ring_id_contacts(db_uint ring_id, db_uint &count);
+    int verify_stats(db_uint &drift);
+
+    void subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options);
+    void unsubscribe(ChangeSubscriber &subscriber);
+    void poll_subscriptions();
+
+    void tx_start();
+    void tx_start_snapshot();
+    void tx_commit();
+};
+
+
+#endif
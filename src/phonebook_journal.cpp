@@ -0,0 +1,1065 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Memory storage phone book made durable by an append-only journal
+ */
+
+#include "phonebook_journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <chrono>
+#include <iostream>
+
+#ifdef __embedded_cplusplus
+#define cerr cout
+#else
+using std::cerr;
+using std::endl;
+#endif
+
+/* Longest record accepted when reading a journal */
+#define JOURNAL_MAX_RECORD      (64 * 1024 * 1024)
+/* Changes applied per transaction while replaying */
+#define JOURNAL_REPLAY_BATCH    1000
+/* Memory storage reserved for each journal record replayed: a contact or
+   phone number row with its indexes and statistics, at the largest name,
+   number and file name sizes. Pictures are kept in the side file. */
+#define JOURNAL_STORAGE_PER_RECORD 512
+/* Type of the records holding picture data, after the ChangeType values */
+#define JOURNAL_PICTURE         0x80
+
+static db_uint steady_ms()
+{
+    return (db_uint) std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Flush a file and sync it to disk.
+ *
+ * @return database error code
+ */
+static int sync_to_disk(FILE *f)
+{
+    if (fflush(f) != 0)
+        return DB_EIO;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0 ? DB_NOERROR : DB_EIO;
+#else
+    return fsync(fileno(f)) == 0 ? DB_NOERROR : DB_EIO;
+#endif
+}
+
+/**
+ * Sync the directory holding a file, so that a rename into it is durable.
+ */
+static void sync_directory(const char *file_name)
+{
+#ifndef _WIN32
+    char directory[FILENAME_MAX];
+    const char *slash = strrchr(file_name, '/');
+    int fd;
+
+    if (slash == NULL) {
+        strcpy(directory, ".");
+    } else {
+        size_t length = slash == file_name ? 1 : (size_t) (slash - file_name);
+
+        memcpy(directory, file_name, length);
+        directory[length] = '\0';
+    }
+
+    fd = open(directory, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#else
+    (void) file_name;
+#endif
+}
+
+static void put32(unsigned char *p, db_uint value)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char) (value >> (8 * i));
+}
+
+static db_uint get32(const unsigned char *p)
+{
+    db_uint value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (db_uint) p[i] << (8 * i);
+    return value;
+}
+
+static db_uint get64(const unsigned char *p)
+{
+    db_uint value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (db_uint) p[i] << (8 * i);
+    return value;
+}
+
+//=======================================================================
+// Record decoding
+//=======================================================================
+
+/**
+ * Reads the fields of one journal record, checking every length against
+ * the end of the record.
+ */
+class JournalDecoder {
+private:
+    const unsigned char *p;
+    const unsigned char *end;
+
+public:
+    bool ok;
+
+    JournalDecoder(const unsigned char *data, size_t size)
+        : p(data), end(data + size), ok(true) {}
+
+    db_uint get_uint()
+    {
+        db_uint value = 0;
+
+        for (int shift = 0; ok; shift += 7) {
+            if (p == end || shift > 63) {
+                ok = false;
+                break;
+            }
+            value |= (db_uint) (*p & 0x7f) << shift;
+            if ((*p++ & 0x80) == 0)
+                break;
+        }
+        return value;
+    }
+
+    db_sint get_sint()
+    {
+        db_uint value = get_uint();
+        return (db_sint) (value >> 1) ^ -(db_sint) (value & 1);
+    }
+
+    /* NULL strings are stored as length 0, others as length + 1. */
+    const char *get_string(std::vector<char> &buffer)
+    {
+        db_uint length = get_uint();
+
+        if (!ok || length == 0)
+            return NULL;
+        if (length - 1 > (db_uint) (end - p)) {
+            ok = false;
+            return NULL;
+        }
+        buffer.assign(p, p + (length - 1));
+        buffer.push_back('\0');
+        p += length - 1;
+        return &buffer[0];
+    }
+
+    const wchar_t *get_wstring(std::vector<wchar_t> &buffer)
+    {
+        db_uint length = get_uint();
+
+        if (!ok || length == 0)
+            return NULL;
+        buffer.clear();
+        for (db_uint i = 1; ok && i < length; i++)
+            buffer.push_back((wchar_t) get_uint());
+        buffer.push_back(L'\0');
+        return ok ? &buffer[0] : NULL;
+    }
+
+    /* The rest of the record, which must hold exactly size bytes */
+    const unsigned char *get_bytes(db_uint size)
+    {
+        const unsigned char *bytes = p;
+
+        if (size != (db_uint) (end - p)) {
+            ok = false;
+            return NULL;
+        }
+        p = end;
+        return bytes;
+    }
+};
+
+/**
+ * Appends the changes passed to it to a journal file.
+ */
+class JournalAppender : public PhoneBook::ChangeVisitor {
+private:
+    PhoneBookJournal &journal;
+    FILE *out;
+    /* Writing a checkpoint, where the groups every phone book starts
+       with are left out */
+    bool checkpoint;
+
+public:
+    int rc;
+    db_uint seq;
+    db_uint bytes;
+
+    JournalAppender(PhoneBookJournal &journal, FILE *out, bool checkpoint, db_uint seq)
+        : journal(journal), out(out), checkpoint(checkpoint), rc(DB_NOERROR), seq(seq), bytes(0) {}
+
+    bool change(const PhoneBook::ChangeRecord &record)
+    {
+        if (checkpoint && record.type == PhoneBook::GROUP_CREATED &&
+            record.group_id <= PhoneBook::GROUP_WORK)
+            return true;
+
+        rc = journal.write_record(out, record, bytes);
+        if (DB_FAILED(rc))
+            return false;
+        if (record.seq > seq)
+            seq = record.seq;
+        return true;
+    }
+};
+
+//=======================================================================
+// PhoneBookJournal
+//=======================================================================
+
+PhoneBookJournal::PhoneBookJournal(PhoneBook &pbook)
+    : pbook(pbook)
+    , file(NULL)
+    , journaled_seq(0)
+    , journal_size(0)
+    , checkpoint_size(0)
+    , unsynced_bytes(0)
+    , synced_at_ms(0)
+    , memory_storage_size(PhoneBook::default_memory_storage_size())
+    , in_transaction(false)
+    , damaged(false)
+    , picture(NULL)
+{
+    journal_name[0] = '\0';
+}
+
+PhoneBookJournal::~PhoneBookJournal()
+{
+    if (file != NULL) {
+        sync();
+        fclose(file);
+    }
+    if (picture != NULL)
+        fclose(picture);
+}
+
+void PhoneBookJournal::put_uint(db_uint value)
+{
+    while (value >= 0x80) {
+        record.push_back((unsigned char) (value | 0x80));
+        value >>= 7;
+    }
+    record.push_back((unsigned char) value);
+}
+
+void PhoneBookJournal::put_sint(db_sint value)
+{
+    put_uint(((db_uint) value << 1) ^ (db_uint) (value >> 63));
+}
+
+void PhoneBookJournal::put_string(const char *value)
+{
+    if (value == NULL) {
+        put_uint(0);
+        return;
+    }
+
+    size_t length = strlen(value);
+    put_uint(length + 1);
+    record.insert(record.end(), value, value + length);
+}
+
+void PhoneBookJournal::put_wstring(const wchar_t *value)
+{
+    if (value == NULL) {
+        put_uint(0);
+        return;
+    }
+
+    size_t length = wcslen(value);
+    put_uint(length + 1);
+    for (size_t i = 0; i < length; i++)
+        put_uint((db_uint) value[i]);
+}
+
+/**
+ * Add the length and hash to the record being encoded and append it to a
+ * journal.
+ *
+ * @return database error code
+ */
+int PhoneBookJournal::write_framed(FILE *out, db_uint &bytes)
+{
+    PictureHash hash;
+    unsigned char hash_bytes[8];
+
+    put32(&record[0], record.size() - 4);
+    hash.update(&record[4], record.size() - 4);
+    for (int i = 0; i < 8; i++)
+        hash_bytes[i] = (unsigned char) (hash.value() >> (8 * i));
+    record.insert(record.end(), hash_bytes, hash_bytes + 8);
+
+    if (fwrite(&record[0], 1, record.size(), out) != record.size())
+        return DB_EIO;
+    bytes += record.size();
+    return DB_NOERROR;
+}
+
+/**
+ * Find the key of a contact's picture in the journal, appending the
+ * picture first if the journal does not hold it yet. Pictures are keyed
+ * by the hash of their contents; a different picture with the same hash
+ * takes the next free key.
+ *
+ * @return database error code, or DB_ENOENT if the picture cannot be exported
+ */
+int PhoneBookJournal::write_picture(FILE *out, db_uint contact_id, db_uint &key, db_uint &bytes)
+{
+    PictureHash hash;
+    long size;
+    int rc;
+
+    if (picture == NULL && (picture = tmpfile()) == NULL)
+        return DB_EIO;
+    rewind(picture);
+    if (DB_FAILED(pbook.export_picture(contact_id, picture)))
+        return DB_ENOENT;
+    if (fflush(picture) != 0 || (size = ftell(picture)) < 0)
+        return DB_EIO;
+    if (size == 0)
+        return DB_ENOENT;
+
+    picture_data.resize((size_t) size);
+    rewind(picture);
+    if (fread(&picture_data[0], 1, picture_data.size(), picture) != picture_data.size())
+        return DB_EIO;
+
+    hash.update(&picture_data[0], picture_data.size());
+    for (key = hash.value(); ; key++) {
+        std::map<db_uint, std::vector<unsigned char> >::iterator it = journaled_pictures.find(key);
+
+        if (it == journaled_pictures.end())
+            break;
+        if (it->second == picture_data)
+            return DB_NOERROR;
+    }
+
+    record.assign(4, 0);
+    put_uint(JOURNAL_PICTURE);
+    put_uint(key);
+    put_uint(picture_data.size());
+    record.insert(record.end(), picture_data.begin(), picture_data.end());
+    rc = write_framed(out, bytes);
+    if (DB_SUCCESS(rc))
+        journaled_pictures[key].swap(picture_data);
+    return rc;
+}
+
+/**
+ * Append one change to a journal. A change that sets a picture refers to
+ * the picture as the database holds it now, which is appended first
+ * unless the journal already holds it.
+ *
+ * @return database error code
+ */
+int PhoneBookJournal::write_record(FILE *out, const ChangeRecord &change, db_uint &bytes)
+{
+    bool has_picture = false;
+    db_uint picture_key = 0;
+
+    if ((change.type == CONTACT_INSERTED || change.type == PICTURE_CHANGED) &&
+        change.picture_name != NULL)
+    {
+        int rc = write_picture(out, change.contact_id, picture_key, bytes);
+
+        // A picture that cannot be exported leaves only its name
+        if (DB_FAILED(rc) && rc != DB_ENOENT)
+            return rc;
+        has_picture = DB_SUCCESS(rc);
+    }
+
+    record.assign(4, 0);
+    put_uint(change.type);
+    put_uint(change.contact_id);
+    put_wstring(change.name);
+    put_uint(change.ring_id);
+    put_string(change.picture_name);
+    put_string(change.number);
+    put_uint(change.number_type);
+    put_sint(change.speed_dial);
+    put_uint(change.group_id);
+    put_uint(has_picture);
+    if (has_picture)
+        put_uint(picture_key);
+
+    return write_framed(out, bytes);
+}
+
+/**
+ * Apply the records of a journal, stopping at the first damaged one.
+ *
+ * @return database error code
+ */
+int PhoneBookJournal::replay(FILE *in)
+{
+    char picture_file[FILENAME_MAX + 16];
+    unsigned char header[4];
+    unsigned char hash_bytes[8];
+    std::vector<wchar_t> name;
+    std::vector<char> picture_name;
+    std::vector<char> number;
+    /* Pictures read so far, by key, and the one in the picture file */
+    std::map<db_uint, std::vector<unsigned char> > pictures;
+    std::map<db_uint, std::vector<unsigned char> >::iterator written = pictures.end();
+    db_uint applied = 0;
+    int rc = DB_NOERROR;
+
+    snprintf(picture_file, sizeof picture_file, "%s.picture", journal_name);
+
+    // The replayed changes are already in the journal
+    pbook.set_change_logging(false);
+    pbook.tx_start();
+
+    while (fread(header, 1, sizeof header, in) == sizeof header) {
+        db_uint length = get32(header);
+        PictureHash hash;
+        ChangeRecord change;
+
+        if (length > JOURNAL_MAX_RECORD)
+            break;
+        record.resize((size_t) length);
+        if ((length > 0 && fread(&record[0], 1, (size_t) length, in) != length) ||
+            fread(hash_bytes, 1, sizeof hash_bytes, in) != sizeof hash_bytes)
+            break;
+        hash.update(record.empty() ? NULL : &record[0], record.size());
+        if (hash.value() != get64(hash_bytes))
+            break;
+
+        JournalDecoder decoder(record.empty() ? NULL : &record[0], record.size());
+
+        db_uint type = decoder.get_uint();
+
+        if (type == JOURNAL_PICTURE) {
+            db_uint key = decoder.get_uint();
+            db_uint picture_size = decoder.get_uint();
+            const unsigned char *picture_data = decoder.get_bytes(picture_size);
+
+            if (!decoder.ok || picture_size == 0)
+                break;
+            if (written != pictures.end() && written->first == key)
+                written = pictures.end();
+            pictures[key].assign(picture_data, picture_data + picture_size);
+            continue;
+        }
+
+        change.seq = 0;
+        change.type = (ChangeType) type;
+        change.contact_id = decoder.get_uint();
+        change.name = decoder.get_wstring(name);
+        change.ring_id = decoder.get_uint();
+        change.picture_name = decoder.get_string(picture_name);
+        change.picture_file = NULL;
+        change.number = decoder.get_string(number);
+        change.number_type = (PhoneNumberType) decoder.get_uint();
+        change.speed_dial = decoder.get_sint();
+        change.group_id = decoder.get_uint();
+
+        bool has_picture = decoder.get_uint() != 0;
+        db_uint picture_key = has_picture ? decoder.get_uint() : 0;
+
+        if (!decoder.ok)
+            break;
+
+        if (has_picture) {
+            std::map<db_uint, std::vector<unsigned char> >::iterator it = pictures.find(picture_key);
+
+            // The picture is appended before the first change that uses it
+            if (it == pictures.end())
+                break;
+            if (it != written) {
+                FILE *f = fopen(picture_file, "wb");
+                size_t size = it->second.size();
+
+                written = pictures.end();
+                if (f == NULL || fwrite(&it->second[0], 1, size, f) != size) {
+                    if (f != NULL)
+                        fclose(f);
+                    rc = DB_EIO;
+                    break;
+                }
+                fclose(f);
+                written = it;
+            }
+            change.picture_file = picture_file;
+        }
+
+        pbook.apply_change(change);
+
+        if (++applied % JOURNAL_REPLAY_BATCH == 0) {
+            pbook.tx_commit();
+            pbook.tx_start();
+        }
+    }
+
+    pbook.tx_commit();
+    pbook.set_change_logging(true);
+    remove(picture_file);
+
+    if (!feof(in) && DB_SUCCESS(rc))
+        cerr << "Journal " << journal_name << " ends with a damaged record; "
+            "later changes are lost" << endl;
+
+    return rc;
+}
+
+/**
+ * Count the records of a journal, without reading picture data, and
+ * return to the first record.
+ */
+static db_uint count_records(FILE *in)
+{
+    long first = ftell(in);
+    unsigned char header[4];
+    db_uint records = 0;
+
+    while (fread(header, 1, sizeof header, in) == sizeof header) {
+        db_uint length = get32(header);
+
+        if (length > JOURNAL_MAX_RECORD || fseek(in, (long) length + 8, SEEK_CUR) != 0)
+            break;
+        records++;
+    }
+
+    fseek(in, first, SEEK_SET);
+    return records;
+}
+
+/**
+ * Create a memory storage database holding the contents of a journal,
+ * then continue journaling to it. The journal is created if it does not
+ * exist.
+ *
+ * The database gets the configured memory storage size plus room for
+ * every journal record, so that a journal written with a larger database
+ * than the configured size still replays in full.
+ *
+ * @return database error code
+ */
+int PhoneBookJournal::open_journaled(const char *database_name, const char *name)
+{
+    FILE *in;
+    db_uint records = 0;
+    int rc;
+
+    if (file != NULL || strlen(name) >= sizeof(journal_name))
+        return DB_EINVAL;
+    strcpy(journal_name, name);
+
+    in = fopen(journal_name, "rb");
+    if (in != NULL) {
+        char magic[JOURNAL_MAGIC_SIZE];
+
+        if (fread(magic, 1, JOURNAL_MAGIC_SIZE, in) != JOURNAL_MAGIC_SIZE ||
+            memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0)
+        {
+            cerr << journal_name << " is not a phone book journal" << endl;
+            fclose(in);
+            return DB_EINVAL;
+        }
+        records = count_records(in);
+    }
+
+    pbook.set_memory_storage_size(memory_storage_size + records * JOURNAL_STORAGE_PER_RECORD);
+    rc = pbook.create_database(db::DB_MEMORY_STORAGE, database_name);
+    pbook.set_memory_storage_size(memory_storage_size);
+    if (DB_FAILED(rc)) {
+        if (in != NULL)
+            fclose(in);
+        return rc;
+    }
+
+    if (in != NULL) {
+        rc = replay(in);
+        fclose(in);
+
+        if (DB_FAILED(rc)) {
+            pbook.close_database();
+            return rc;
+        }
+    }
+
+    rc = checkpoint();
+    if (DB_FAILED(rc)) {
+        cerr << "Cannot write journal " << journal_name << endl;
+        pbook.close_database();
+    }
+    return rc;
+}
+
+/**
+ * Write the current contents of the phone book to a new journal and
+ * replace the old one with it. Call outside a transaction.
+ *
+ * @return database error code
+ */
+int PhoneBookJournal::checkpoint()
+{
+    char temp_name[FILENAME_MAX + 16];
+    FILE *out;
+    int rc;
+
+    snprintf(temp_name, sizeof temp_name, "%s.tmp", journal_name);
+    out = fopen(temp_name, "wb");
+    if (out == NULL)
+        return DB_EIO;
+
+    JournalAppender appender(*this, out, true, 0);
+    std::map<db_uint, std::vector<unsigned char> > old_pictures;
+
+    // The new journal starts without pictures
+    journaled_pictures.swap(old_pictures);
+
+    rc = fwrite(JOURNAL_MAGIC, 1, JOURNAL_MAGIC_SIZE, out) == JOURNAL_MAGIC_SIZE ? DB_NOERROR : DB_EIO;
+
+    pbook.tx_start();
+    db_uint seq = pbook.last_change_seq();
+    if (DB_SUCCESS(rc))
+        pbook.visit_contacts(appender);
+    if (DB_SUCCESS(rc) && DB_SUCCESS(appender.rc))
+        pbook.visit_groups(appender);
+    pbook.tx_commit();
+
+    if (DB_SUCCESS(rc))
+        rc = appender.rc;
+    if (DB_SUCCESS(rc))
+        rc = sync_to_disk(out);
+    if ((ferror(out) | fclose(out)) && DB_SUCCESS(rc))
+        rc = DB_EIO;
+    if (DB_FAILED(rc)) {
+        remove(temp_name);
+        journaled_pictures.swap(old_pictures);
+        return rc;
+    }
+
+    // The old journal stays in place if the new one cannot replace it
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+#ifdef _WIN32
+    remove(journal_name);
+#endif
+    if (rename(temp_name, journal_name) != 0) {
+        remove(temp_name);
+        journaled_pictures.swap(old_pictures);
+        rc = DB_EIO;
+    } else {
+        sync_directory(journal_name);
+        journaled_seq = seq;
+        journal_size = JOURNAL_MAGIC_SIZE + appender.bytes;
+        checkpoint_size = journal_size;
+        damaged = false;
+    }
+
+    file = fopen(journal_name, "ab");
+    if (file == NULL)
+        return DB_EIO;
+    unsynced_bytes = 0;
+    synced_at_ms = steady_ms();
+
+    if (DB_SUCCESS(rc)) {
+        // Entries in the journal are no longer needed in memory
+        pbook.tx_start();
+        pbook.compact_change_log(journaled_seq);
+        pbook.tx_commit();
+    }
+    return rc;
+}
+
+/**
+ * Sync the journal to disk.
+ *
+ * @return database error code
+ */
+int PhoneBookJournal::sync()
+{
+    if (file == NULL)
+        return DB_NOERROR;
+
+    unsynced_bytes = 0;
+    synced_at_ms = steady_ms();
+    return sync_to_disk(file);
+}
+
+/**
+ * Append the changes committed since the last call to the journal, then
+ * sync or checkpoint it when due. A checkpoint is due once the records
+ * appended since the last one pass JOURNAL_CHECKPOINT_BYTES, so a phone
+ * book whose checkpoint alone is larger is not rewritten at every commit.
+ */
+void PhoneBookJournal::committed()
+{
+    bool appended = false;
+
+    if (file == NULL)
+        return;
+
+    if (!damaged) {
+        JournalAppender appender(*this, file, false, journaled_seq);
+
+        pbook.tx_start();
+        pbook.changes_since(journaled_seq, appender);
+        pbook.tx_commit();
+
+        if (DB_SUCCESS(appender.rc) && fflush(file) == 0) {
+            if (appender.seq != journaled_seq) {
+                journaled_seq = appender.seq;
+                journal_size += appender.bytes;
+                appended = true;
+                unsynced_bytes += appender.bytes;
+
+                pbook.tx_start();
+                pbook.compact_change_log(journaled_seq);
+                pbook.tx_commit();
+            }
+        } else {
+            // A partly written record would hide everything after it
+            damaged = true;
+        }
+    }
+
+    if (damaged || (appended && journal_size - checkpoint_size > JOURNAL_CHECKPOINT_BYTES)) {
+        if (DB_FAILED(checkpoint()))
+            cerr << "Cannot write journal " << journal_name << endl;
+    } else if (unsynced_bytes >= JOURNAL_SYNC_BYTES ||
+               (unsynced_bytes > 0 && steady_ms() - synced_at_ms >= JOURNAL_SYNC_MS)) {
+        if (DB_FAILED(sync()))
+            cerr << "Cannot sync journal " << journal_name << endl;
+    }
+}
+
+//=======================================================================
+// Forwarded methods
+//=======================================================================
+
+int PhoneBookJournal::close_database()
+{
+    if (file != NULL) {
+        sync();
+        fclose(file);
+        file = NULL;
+    }
+    return pbook.close_database();
+}
+
+int PhoneBookJournal::open_database(int file_mode, const char* database_name)
+{
+    return pbook.open_database(file_mode, database_name);
+}
+
+int PhoneBookJournal::create_database(int file_mode, const char* database_name)
+{
+    return pbook.create_database(file_mode, database_name);
+}
+
+db_uint PhoneBookJournal::insert_contact(const wchar_t *name, db_uint ring_id,
+    const char *picture_name)
+{
+    db_uint result = pbook.insert_contact(name, ring_id, picture_name);
+
+    if (!in_transaction)
+        committed();
+    return result;
+}
+
+db_uint PhoneBookJournal::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+    const char *picture_file)
+{
+    db_uint result = pbook.insert_contact(name, ring_id, picture_name, picture_file);
+
+    if (!in_transaction)
+        committed();
+    return result;
+}
+
+void PhoneBookJournal::insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type,
+    db_sint speed_dial)
+{
+    pbook.insert_phone_number(contact_id, number, type, speed_dial);
+    if (!in_transaction)
+        committed();
+}
+
+void PhoneBookJournal::update_contact_name(db_uint id, const wchar_t *newname)
+{
+    pbook.update_contact_name(id, newname);
+    if (!in_transaction)
+        committed();
+}
+
+void PhoneBookJournal::update_contact_picture(db_uint contact_id,
+    const char *picture_name)
+{
+    pbook.update_contact_picture(contact_id, picture_name);
+    if (!in_transaction)
+        committed();
+}
+
+void PhoneBookJournal::remove_contact(db_uint id)
+{
+    pbook.remove_contact(id);
+    if (!in_transaction)
+        committed();
+}
+
+void PhoneBookJournal::list_contacts_brief()
+{
+    pbook.list_contacts_brief();
+}
+
+void PhoneBookJournal::list_contacts(int sort)
+{
+    pbook.list_contacts(sort);
+}
+
+int PhoneBookJournal::get_contacts_brief(ContactResults &results)
+{
+    return pbook.get_contacts_brief(results);
+}
+
+int PhoneBookJournal::get_contacts(int sort, ContactResults &results)
+{
+    return pbook.get_contacts(sort, results);
+}
+
+db::String PhoneBookJournal::get_picture_name(db_uint id)
+{
+    return pbook.get_picture_name(id);
+}
+
+const char *PhoneBookJournal::get_picture_name(db_uint id, ResultArena &arena)
+{
+    return pbook.get_picture_name(id, arena);
+}
+
+void PhoneBookJournal::export_picture(db_uint id, const char *file_name)
+{
+    pbook.export_picture(id, file_name);
+}
+
+int PhoneBookJournal::export_picture(db_uint id, FILE *picture_file)
+{
+    return pbook.export_picture(id, picture_file);
+}
+
+void PhoneBookJournal::get_picture_stats(PictureStats &stats)
+{
+    pbook.get_picture_stats(stats);
+}
+
+void PhoneBookJournal::set_picture_compression(bool enable)
+{
+    pbook.set_picture_compression(enable);
+}
+
+bool PhoneBookJournal::changes_since(db_uint seq, ChangeVisitor &visitor)
+{
+    return pbook.changes_since(seq, visitor);
+}
+
+db_uint PhoneBookJournal::last_change_seq()
+{
+    return pbook.last_change_seq();
+}
+
+bool PhoneBookJournal::get_contact_id_range(db_uint &first_id, db_uint &last_id)
+{
+    return pbook.get_contact_id_range(first_id, last_id);
+}
+
+void PhoneBookJournal::visit_contacts(ChangeVisitor &visitor, db_uint first_id,
+    db_uint last_id)
+{
+    pbook.visit_contacts(visitor, first_id, last_id);
+}
+
+void PhoneBookJournal::visit_groups(ChangeVisitor &visitor)
+{
+    pbook.visit_groups(visitor);
+}
+
+void PhoneBookJournal::find_phone_numbers(const char *number, ChangeVisitor &visitor)
+{
+    pbook.find_phone_numbers(number, visitor);
+}
+
+int PhoneBookJournal::search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor)
+{
+    return pbook.search_by_number_suffix(digits, limit, visitor);
+}
+
+void PhoneBookJournal::apply_change(const ChangeRecord &record)
+{
+    pbook.apply_change(record);
+    if (!in_transaction)
+        committed();
+}
+
+db_uint PhoneBookJournal::create_group(const wchar_t *name)
+{
+    db_uint result = pbook.create_group(name);
+
+    if (!in_transaction)
+        committed();
+    return result;
+}
+
+void PhoneBookJournal::add_to_group(db_uint contact_id, db_uint group_id)
+{
+    pbook.add_to_group(contact_id, group_id);
+    if (!in_transaction)
+        committed();
+}
+
+void PhoneBookJournal::remove_from_group(db_uint contact_id, db_uint group_id)
+{
+    pbook.remove_from_group(contact_id, group_id);
+    if (!in_transaction)
+        committed();
+}
+
+int PhoneBookJournal::get_group_members(db_uint group_id, ContactBitmap &contacts)
+{
+    return pbook.get_group_members(group_id, contacts);
+}
+
+int PhoneBookJournal::get_contacts_with_number_type(PhoneNumberType type,
+    ContactBitmap &contacts)
+{
+    return pbook.get_contacts_with_number_type(type, contacts);
+}
+
+int PhoneBookJournal::get_contacts(const ContactBitmap &ids, ContactResults &results)
+{
+    return pbook.get_contacts(ids, results);
+}
+
+int PhoneBookJournal::get_group_contacts(db_uint group_id, int number_type,
+    ContactResults &results)
+{
+    return pbook.get_group_contacts(group_id, number_type, results);
+}
+
+int PhoneBookJournal::get_stats(Stats &stats)
+{
+    return pbook.get_stats(stats);
+}
+
+int PhoneBookJournal::get_ring_id_contacts(db_uint ring_id, db_uint &count)
+{
+    return pbook.get_ring_id_contacts(ring_id, count);
+}
+
+int PhoneBookJournal::verify_stats(db_uint &drift)
+{
+    return pbook.verify_stats(drift);
+}
+
+void PhoneBookJournal::compact_change_log(db_uint through_seq)
+{
+    // Keep entries that are not in the journal yet
+    if (file != NULL && through_seq > journaled_seq)
+        through_seq = journaled_seq;
+    pbook.compact_change_log(through_seq);
+}
+
+void PhoneBookJournal::set_change_logging(bool enable)
+{
+    // The journal is written from the change log
+    pbook.set_change_logging(enable || file != NULL);
+}
+
+void PhoneBookJournal::set_id_block_size(unsigned size)
+{
+    pbook.set_id_block_size(size);
+}
+
+void PhoneBookJournal::set_memory_storage_size(db_uint size)
+{
+    memory_storage_size = size;
+    pbook.set_memory_storage_size(size);
+}
+
+void PhoneBookJournal::subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options)
+{
+    pbook.subscribe(subscriber, options);
+}
+
+void PhoneBookJournal::unsubscribe(ChangeSubscriber &subscriber)
+{
+    pbook.unsubscribe(subscriber);
+}
+
+void PhoneBookJournal::poll_subscriptions()
+{
+    pbook.poll_subscriptions();
+}
+
+void PhoneBookJournal::tx_start()
+{
+    in_transaction = true;
+    pbook.tx_start();
+}
+
+void PhoneBookJournal::tx_start_snapshot()
+{
+    in_transaction = true;
+    pbook.tx_start_snapshot();
+}
+
+void PhoneBookJournal::tx_commit()
+{
+    pbook.tx_commit();
+    in_transaction = false;
+    committed();
+}
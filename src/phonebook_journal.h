@@ -0,0 +1,194 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+
+/** @file
+ *
+ * Memory storage phone book made durable by an append-only journal
+ */
+
+#ifndef PHONEBOOK_JOURNAL_H
+#define PHONEBOOK_JOURNAL_H 1
+
+#include "phonebook.h"
+
+#include <stdio.h>
+
+#include <map>
+#include <vector>
+
+/* Journal of the console's memory storage database, selected with option 6. */
+#define JOURNAL_NAME            "phone_book.journal"
+
+#define JOURNAL_MAGIC           "PBJOURN\002"
+#define JOURNAL_MAGIC_SIZE      8
+/* Synchronize the journal to disk at least this often while writing... */
+#define JOURNAL_SYNC_MS         50
+/* ...or once this many bytes are waiting. */
+#define JOURNAL_SYNC_BYTES      (256 * 1024)
+/* Rewrite the journal from the database once this much is appended to it. */
+#define JOURNAL_CHECKPOINT_BYTES (4 * 1024 * 1024)
+
+/**
+ * Forwards calls to a PhoneBook and, once open_journaled() has been
+ * called, appends every committed change to a journal file.
+ *
+ * The phone book lives in memory storage, so reads and writes run at
+ * memory speed. At each commit the new change log entries are appended to
+ * the journal and flushed to the operating system, so they survive the process crashing. Syncing to disk
+ * is batched: a commit syncs once JOURNAL_SYNC_MS milliseconds have passed
+ * since the last sync or JOURNAL_SYNC_BYTES bytes are waiting, and closing
+ * syncs what is left, so a power failure loses at most one batch. The
+ * change log is compacted once its entries are in the journal.
+ *
+ * open_journaled() rebuilds the database by applying the journal, sizing
+ * the memory storage for its records on top of the configured size, then
+ * checkpoints: the journal is replaced by one holding the current
+ * contents. A checkpoint is also taken whenever the records appended
+ * since the last one pass JOURNAL_CHECKPOINT_BYTES, which bounds the time
+ * to start up.
+ *
+ * Each journal record is a 32-bit length, the change as variable-length
+ * integers and strings, and a 64-bit FNV-1a hash of the change. A torn
+ * or damaged record ends the replay. Each picture is journaled once, in
+ * a record of its own keyed by the hash of its contents, before the
+ * first change that sets it; changes refer to the picture by its key.
+ */
+class PhoneBookJournal : public PhoneBook {
+private:
+    PhoneBook &pbook;
+    FILE *file;
+    char journal_name[FILENAME_MAX];
+    /* Newest change log entry in the journal */
+    db_uint journaled_seq;
+    db_uint journal_size;
+    /* Size of the journal when the last checkpoint wrote it */
+    db_uint checkpoint_size;
+    db_uint unsynced_bytes;
+    db_uint synced_at_ms;
+    /* RAM for the database before room is added for a replay */
+    db_uint memory_storage_size;
+    bool in_transaction;
+    /* An append failed; the next commit rewrites the journal instead */
+    bool damaged;
+    /* The record being encoded or decoded */
+    std::vector<unsigned char> record;
+    /* Picture being encoded, as exported and as read back */
+    FILE *picture;
+    std::vector<unsigned char> picture_data;
+    /* Pictures in the journal, by key */
+    std::map<db_uint, std::vector<unsigned char> > journaled_pictures;
+
+    friend class JournalAppender;
+
+    void put_uint(db_uint value);
+    void put_sint(db_sint value);
+    void put_string(const char *value);
+    void put_wstring(const wchar_t *value);
+    int write_framed(FILE *out, db_uint &bytes);
+    int write_picture(FILE *out, db_uint contact_id, db_uint &key, db_uint &bytes);
+    int write_record(FILE *out, const ChangeRecord &change, db_uint &bytes);
+    int replay(FILE *in);
+
+    void committed();
+
+    /* Not copyable */
+    PhoneBookJournal(const PhoneBookJournal &);
+    PhoneBookJournal &operator=(const PhoneBookJournal &);
+
+public:
+    PhoneBookJournal(PhoneBook &pbook);
+    ~PhoneBookJournal();
+
+    /* Create a memory storage database from a journal and start
+       journaling to it. A missing journal starts an empty phone book. */
+    int open_journaled(const char *database_name, const char *journal_name);
+    bool journaled() const { return file != NULL; }
+    /* Replace the journal by one holding the current contents. */
+    int checkpoint();
+    /* Sync the journal to disk now. */
+    int sync();
+
+    int open_database(int file_mode, const char* database_name);
+    int create_database(int file_mode, const char* database_name);
+    int close_database();
+
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name);
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+        const char *picture_file);
+    void insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial);
+
+    void update_contact_name(db_uint id, const wchar_t *newname);
+    void update_contact_picture(db_uint contact_id, const char *picture_name);
+    void remove_contact(db_uint id);
+
+    void list_contacts_brief();
+    void list_contacts(int sort);
+    int get_contacts_brief(ContactResults &results);
+    int get_contacts(int sort, ContactResults &results);
+
+    db::String get_picture_name(db_uint id);
+    const char *get_picture_name(db_uint id, ResultArena &arena);
+    void export_picture(db_uint id, const char *file_name);
+    int export_picture(db_uint id, FILE *picture_file);
+    void get_picture_stats(PictureStats &stats);
+    void set_picture_compression(bool enable);
+
+    bool changes_since(db_uint seq, ChangeVisitor &visitor);
+    void compact_change_log(db_uint through_seq);
+    db_uint last_change_seq();
+    void set_change_logging(bool enable);
+    void set_id_block_size(unsigned size);
+    void set_memory_storage_size(db_uint size);
+
+    bool get_contact_id_range(db_uint &first_id, db_uint &last_id);
+    void visit_contacts(ChangeVisitor &visitor, db_uint first_id = 0, db_uint last_id = ~(db_uint) 0 >> 1);
+    void visit_groups(ChangeVisitor &visitor);
+    void find_phone_numbers(const char *number, ChangeVisitor &visitor);
+    int search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor);
+    void apply_change(const ChangeRecord &record);
+
+    db_uint create_group(const wchar_t *name);
+    void add_to_group(db_uint contact_id, db_uint group_id);
+    void remove_from_group(db_uint contact_id, db_uint group_id);
+    int get_group_members(db_uint group_id, ContactBitmap &contacts);
+    int get_contacts_with_number_type(PhoneNumberType type, ContactBitmap &contacts);
+    int get_contacts(const ContactBitmap &ids, ContactResults &results);
+    int get_group_contacts(db_uint group_id, int number_type, ContactResults &results);
+
+    int get_stats(Stats &stats);
+    int get_ring_id_contacts(db_uint ring_id, db_uint &count);
+    int verify_stats(db_uint &drift);
+
+    void subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options);
+    void unsubscribe(ChangeSubscriber &subscriber);
+    void poll_subscriptions();
+
+    void tx_start();
+    void tx_start_snapshot();
+    void tx_commit();
+};
+
+
+#endif
@@ -0,0 +1,288 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Client-side read mirror of a phone book accessed through dbserver
+ */
+
+#include "phonebook_mirror.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+
+/* Memory storage reserved in the local copy per remote contact and phone
+   number, with its indexes. */
+#define MIRROR_STORAGE_PER_ROW  256
+
+
+/**
+ * Read a monotonic clock in milliseconds. Only differences are meaningful;
+ * unsigned arithmetic keeps them correct when the counter wraps.
+ */
+static unsigned long now_ms()
+{
+#ifdef _WIN32
+    return GetTickCount();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000UL + (unsigned long) (ts.tv_nsec / 1000000);
+#endif
+}
+
+/**
+ * Applies changes read from the remote phone book to the local copy.
+ */
+class MirrorApplier : public PhoneBook::ChangeVisitor {
+private:
+    PhoneBook &local;
+
+public:
+    db_uint seq;
+
+    MirrorApplier(PhoneBook &local, db_uint seq)
+        : local(local)
+        , seq(seq)
+    {
+    }
+
+    bool change(const PhoneBook::ChangeRecord &record)
+    {
+        local.apply_change(record);
+        if (record.seq > seq)
+            seq = record.seq;
+        return true;
+    }
+};
+
+
+PhoneBookMirror::PhoneBookMirror(PhoneBook &remote, unsigned long max_staleness_ms)
+    : remote(remote)
+    , local_name(DATABASE_NAME_MIRROR)
+    , seq(0)
+    , max_staleness_ms(max_staleness_ms)
+    , refreshed_at(0)
+    , loaded(false)
+{
+}
+
+/**
+ * Create the local copy and fill it from the remote phone book, which
+ * must already be open.
+ */
+int PhoneBookMirror::open(const char *local_name)
+{
+    this->local_name = local_name;
+    return reload();
+}
+
+/**
+ * Discard the local copy.
+ */
+int PhoneBookMirror::close()
+{
+    if (!loaded)
+        return DB_NOERROR;
+
+    loaded = false;
+    return local.close_database();
+}
+
+/**
+ * Copy every contact from the remote phone book into a new local copy,
+ * sized for the remote contents. The newest change sequence number is
+ * read in the same transaction, so later refreshes continue exactly where
+ * the copy left off. If anything fails, no copy is kept.
+ */
+int PhoneBookMirror::reload()
+{
+    PhoneBook::Stats stats;
+    db_uint size = PhoneBook::default_memory_storage_size();
+    db_uint remote_seq;
+    int rc;
+
+    close();
+
+    remote.tx_start_snapshot();
+    if (DB_SUCCESS(remote.get_stats(stats))) {
+        size += stats.contacts * MIRROR_STORAGE_PER_ROW;
+        for (int type = 0; type <= PhoneBook::PAGER; type++)
+            size += stats.numbers[type] * MIRROR_STORAGE_PER_ROW;
+    }
+
+    PhoneBook::ErrorWatch errors;
+
+    local.set_memory_storage_size(size);
+    rc = local.create_database(db::DB_MEMORY_STORAGE, local_name);
+    if (DB_FAILED(rc)) {
+        remote.tx_commit();
+        cerr << "Error creating mirror database." << endl;
+        return rc;
+    }
+    loaded = true;
+
+    // The copy is never a source of changes itself
+    local.set_change_logging(false);
+
+    MirrorApplier applier(local, 0);
+
+    local.tx_start();
+    remote_seq = remote.last_change_seq();
+    remote.visit_contacts(applier);
+    local.tx_commit();
+    remote.tx_commit();
+
+    if (DB_FAILED(rc = errors.rc())) {
+        cerr << "Error loading mirror database." << endl;
+        close();
+        return rc;
+    }
+
+    seq = remote_seq;
+    refreshed_at = now_ms();
+    return DB_NOERROR;
+}
+
+/**
+ * Bring the local copy up to date with the remote change log. If the
+ * changes needed have been compacted away, the copy is rebuilt.
+ *
+ * If an error is reported, the copy may hold only some of the changes, so
+ * it is discarded and rebuilt by the next read; neither the sequence
+ * number nor the refresh time advance.
+ */
+int PhoneBookMirror::refresh()
+{
+    if (!loaded)
+        return reload();
+
+    PhoneBook::ErrorWatch errors;
+    MirrorApplier applier(local, seq);
+    bool complete;
+    int rc;
+
+    remote.tx_start_snapshot();
+    local.tx_start();
+    complete = remote.changes_since(seq, applier);
+    local.tx_commit();
+    remote.tx_commit();
+
+    if (DB_FAILED(rc = errors.rc())) {
+        cerr << "Error refreshing mirror database; it will be reloaded." << endl;
+        close();
+        return rc;
+    }
+
+    if (!complete)
+        return reload();
+
+    seq = applier.seq;
+    refreshed_at = now_ms();
+    return DB_NOERROR;
+}
+
+/**
+ * Measure how long ago the local copy was last brought up to date.
+ */
+unsigned long PhoneBookMirror::staleness_ms() const
+{
+    return now_ms() - refreshed_at;
+}
+
+/**
+ * Refresh the local copy if it is older than the staleness bound.
+ *
+ * @return database error code; on failure, read from the remote instead
+ */
+int PhoneBookMirror::ensure_fresh()
+{
+    if (!loaded || staleness_ms() >= max_staleness_ms)
+        return refresh();
+    return DB_NOERROR;
+}
+
+/**
+ * Briefly list all contacts from the local copy.
+ */
+void PhoneBookMirror::list_contacts_brief()
+{
+    if (DB_FAILED(ensure_fresh())) {
+        remote.tx_start_snapshot();
+        remote.list_contacts_brief();
+        remote.tx_commit();
+        return;
+    }
+
+    local.tx_start();
+    local.list_contacts_brief();
+    local.tx_commit();
+}
+
+/**
+ * List all contacts with full phone numbers from the local copy.
+ */
+void PhoneBookMirror::list_contacts(int sort)
+{
+    if (DB_FAILED(ensure_fresh())) {
+        remote.tx_start_snapshot();
+        remote.list_contacts(sort);
+        remote.tx_commit();
+        return;
+    }
+
+    local.tx_start();
+    local.list_contacts(sort);
+    local.tx_commit();
+}
+
+/**
+ * Retrieve a contact's picture name from the local copy.
+ */
+db::String PhoneBookMirror::get_picture_name(db_uint id)
+{
+    db::String picture_name;
+
+    if (DB_FAILED(ensure_fresh())) {
+        remote.tx_start_snapshot();
+        picture_name = remote.get_picture_name(id);
+        remote.tx_commit();
+        return picture_name;
+    }
+
+    local.tx_start();
+    picture_name = local.get_picture_name(id);
+    local.tx_commit();
+
+    return picture_name;
+}
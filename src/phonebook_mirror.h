@@ -0,0 +1,93 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Client-side read mirror of a phone book accessed through dbserver
+ */
+
+#ifndef PHONEBOOK_MIRROR_H
+#define PHONEBOOK_MIRROR_H 1
+
+#include "phonebook_backends.h"
+
+/* Name of the local memory storage database that holds the mirror. */
+#define DATABASE_NAME_MIRROR    "phone_book_mirror.db"
+
+/* Refresh the mirror before a read if it is older than this. */
+#define MIRROR_MAX_STALENESS_MS 1000
+
+/**
+ * A local memory storage copy of the "contact" and "phone_number" tables
+ * of a remote phone book.
+ *
+ * Reads are served from the copy, avoiding an IPC round trip for every
+ * row fetched. The copy is refreshed incrementally from the remote change
+ * log whenever a read finds it older than the staleness bound, so reads
+ * never see data older than that. Writes go to the remote phone book;
+ * call refresh() to read them back immediately.
+ *
+ * A refresh that fails leaves the copy stale: it is discarded and rebuilt
+ * by the next read, and reads that cannot bring it up to date are served
+ * by the remote phone book instead. The copy's memory storage is sized
+ * for the remote contents when it is built.
+ */
+class PhoneBookMirror {
+private:
+    PhoneBook &remote;
+    /* Local memory storage is read with table cursors. */
+    CursorPhoneBook local;
+    const char *local_name;
+    /* Newest remote change applied to the copy */
+    db_uint seq;
+    unsigned long max_staleness_ms;
+    /* Time of the last successful refresh, in milliseconds */
+    unsigned long refreshed_at;
+    bool loaded;
+
+    int reload();
+    int ensure_fresh();
+
+public:
+    PhoneBookMirror(PhoneBook &remote, unsigned long max_staleness_ms = MIRROR_MAX_STALENESS_MS);
+
+    int open(const char *local_name = DATABASE_NAME_MIRROR);
+    int close();
+
+    int refresh();
+
+    /* Milliseconds since the copy was last brought up to date. */
+    unsigned long staleness_ms() const;
+    unsigned long get_max_staleness_ms() const { return max_staleness_ms; }
+    void set_max_staleness_ms(unsigned long ms) { max_staleness_ms = ms; }
+    /* Newest remote change sequence number reflected in the copy. */
+    db_uint last_seq() const { return seq; }
+
+    void list_contacts_brief();
+    void list_contacts(int sort);
+    db::String get_picture_name(db_uint id);
+};
+
+
+#endif
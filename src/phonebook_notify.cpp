@@ -0,0 +1,233 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Change notification subscriptions, coalesced per contact
+ */
+
+#include "phonebook_notify.h"
+
+#include <chrono>
+
+/* Changes made to a contact, delivered by default */
+#define CONTACT_CHANGE_MASK \
+    (1u << PhoneBook::CONTACT_INSERTED | 1u << PhoneBook::PHONE_NUMBER_INSERTED | \
+     1u << PhoneBook::CONTACT_RENAMED | 1u << PhoneBook::PICTURE_CHANGED | \
+     1u << PhoneBook::CONTACT_REMOVED | 1u << PhoneBook::GROUP_MEMBER_ADDED | \
+     1u << PhoneBook::GROUP_MEMBER_REMOVED)
+
+static db_uint steady_ms()
+{
+    return (db_uint) std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+PhoneBook::SubscriptionOptions::SubscriptionOptions()
+    : window_ms(NOTIFY_WINDOW_MS)
+    , max_pending(NOTIFY_MAX_PENDING)
+    , change_mask(CONTACT_CHANGE_MASK)
+{
+}
+
+ChangeNotifier::ChangeNotifier()
+    : seq(0)
+    , seq_known(false)
+    , busy(false)
+    , read_ms(0)
+{
+}
+
+ChangeNotifier::~ChangeNotifier()
+{
+    for (size_t i = 0; i < subscriptions.size(); i++)
+        delete subscriptions[i];
+}
+
+void ChangeNotifier::subscribe(PhoneBook &pbook, PhoneBook::ChangeSubscriber &subscriber,
+    const PhoneBook::SubscriptionOptions &options)
+{
+    Subscription *subscription = new Subscription;
+
+    // Changes committed before now go to the existing subscribers alone
+    if (active()) {
+        poll(pbook);
+    } else if (!busy) {
+        busy = true;
+        pbook.tx_start_snapshot();
+        seq = pbook.last_change_seq();
+        pbook.tx_commit();
+        seq_known = true;
+        busy = false;
+    }
+
+    subscription->subscriber = &subscriber;
+    subscription->options = options;
+    subscription->must_resync = false;
+    subscriptions.push_back(subscription);
+}
+
+void ChangeNotifier::unsubscribe(PhoneBook::ChangeSubscriber &subscriber)
+{
+    for (size_t i = 0; i < subscriptions.size(); i++) {
+        if (subscriptions[i]->subscriber != &subscriber)
+            continue;
+        if (busy) {
+            // Removed once the delivery in progress is over
+            subscriptions[i]->subscriber = NULL;
+        } else {
+            delete subscriptions[i];
+            subscriptions.erase(subscriptions.begin() + i);
+        }
+        return;
+    }
+}
+
+void ChangeNotifier::reset()
+{
+    seq_known = false;
+}
+
+void ChangeNotifier::poll(PhoneBook &pbook)
+{
+    if (!active() || busy)
+        return;
+
+    busy = true;
+    read_changes(pbook);
+    for (size_t i = 0; i < subscriptions.size(); i++) {
+        if (subscriptions[i]->subscriber != NULL)
+            deliver(*subscriptions[i], steady_ms());
+    }
+
+    // Remove the subscriptions that ended during delivery
+    for (size_t i = 0; i < subscriptions.size(); ) {
+        if (subscriptions[i]->subscriber == NULL) {
+            delete subscriptions[i];
+            subscriptions.erase(subscriptions.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    busy = false;
+}
+
+/**
+ * Add the changes committed since the newest one read to the pending
+ * events. If changes were lost, every subscriber resyncs.
+ *
+ * This runs after every commit while there are subscribers, so the change
+ * log is read in a snapshot transaction, which takes no locks; committing
+ * it does not poll again, since busy is set.
+ */
+void ChangeNotifier::read_changes(PhoneBook &pbook)
+{
+    bool complete;
+
+    read_ms = steady_ms();
+    pbook.tx_start_snapshot();
+    complete = seq_known && pbook.changes_since(seq, *this);
+    if (!complete)
+        seq = pbook.last_change_seq();
+    pbook.tx_commit();
+
+    if (!complete) {
+        seq_known = true;
+        for (size_t i = 0; i < subscriptions.size(); i++)
+            drop(*subscriptions[i]);
+    }
+}
+
+bool ChangeNotifier::change(const PhoneBook::ChangeRecord &record)
+{
+    unsigned bit = 1u << record.type;
+
+    seq = record.seq;
+    if (record.contact_id == 0)
+        return true;
+
+    for (size_t i = 0; i < subscriptions.size(); i++) {
+        Subscription &subscription = *subscriptions[i];
+
+        if (subscription.subscriber == NULL || subscription.must_resync ||
+            (subscription.options.change_mask & bit) == 0)
+        {
+            continue;
+        }
+
+        std::unordered_map<db_uint, Pending>::iterator found = subscription.pending.find(record.contact_id);
+        if (found != subscription.pending.end()) {
+            // Coalesce with the changes already waiting
+            found->second.event.changes |= bit;
+            found->second.event.seq = record.seq;
+        } else if (subscription.pending.size() >= subscription.options.max_pending) {
+            drop(subscription);
+        } else {
+            Pending &pending = subscription.pending[record.contact_id];
+
+            pending.event.contact_id = record.contact_id;
+            pending.event.changes = bit;
+            pending.event.seq = record.seq;
+            pending.first_ms = read_ms;
+            subscription.order.push_back(record.contact_id);
+        }
+    }
+    return true;
+}
+
+/**
+ * Deliver the events whose window has passed, oldest first, until the
+ * subscriber pushes back.
+ */
+void ChangeNotifier::deliver(Subscription &subscription, db_uint now_ms)
+{
+    if (subscription.must_resync) {
+        subscription.must_resync = false;
+        subscription.subscriber->resync(seq);
+        return;
+    }
+
+    while (!subscription.order.empty() && subscription.subscriber != NULL) {
+        std::unordered_map<db_uint, Pending>::iterator found =
+            subscription.pending.find(subscription.order.front());
+
+        if (now_ms - found->second.first_ms < subscription.options.window_ms)
+            break;
+        if (!subscription.subscriber->contact_changed(found->second.event))
+            break;
+        subscription.pending.erase(found);
+        subscription.order.pop_front();
+    }
+}
+
+/**
+ * Give up the pending events of a subscription; its subscriber resyncs
+ * instead.
+ */
+void ChangeNotifier::drop(Subscription &subscription)
+{
+    subscription.pending.clear();
+    subscription.order.clear();
+    subscription.must_resync = true;
+}
@@ -0,0 +1,118 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Change notification subscriptions, coalesced per contact
+ */
+
+#ifndef PHONEBOOK_NOTIFY_H
+#define PHONEBOOK_NOTIFY_H 1
+
+#include "phonebook.h"
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+/* Default coalescing window of a subscription */
+#define NOTIFY_WINDOW_MS        50
+/* Default number of contacts with undelivered events before a resync */
+#define NOTIFY_MAX_PENDING      1024
+
+/**
+ * The subscriptions of one connection.
+ *
+ * After every commit, and on poll(), the notifier reads the change log
+ * from the newest entry it has seen, so it picks up changes committed by
+ * other connections as well as its own. Each change is added to the
+ * pending event of its contact in every subscription that wants it; an
+ * event is delivered once its window has passed since the first change
+ * it holds. A subscriber that returns false from contact_changed() keeps
+ * its events pending. When a subscription has max_pending contacts
+ * waiting, or the change log was compacted past the changes not yet
+ * read, its events are dropped and the subscriber is told to resync.
+ *
+ * Events are only as complete as the change log: nothing is delivered
+ * while change logging is disabled.
+ */
+class ChangeNotifier : public PhoneBook::ChangeVisitor {
+private:
+    struct Pending {
+        PhoneBook::ContactEvent event;
+        db_uint first_ms;
+    };
+
+    struct Subscription {
+        /* NULL once unsubscribed during a delivery */
+        PhoneBook::ChangeSubscriber *subscriber;
+        PhoneBook::SubscriptionOptions options;
+        std::unordered_map<db_uint, Pending> pending;
+        /* Contacts with pending events, oldest first */
+        std::deque<db_uint> order;
+        bool must_resync;
+    };
+
+    std::vector<Subscription *> subscriptions;
+    /* Newest change log entry read */
+    db_uint seq;
+    /* False until seq is read from a newly opened database */
+    bool seq_known;
+    /* Reading or delivering; calls made by subscribers do not recurse. */
+    bool busy;
+    /* Time the changes being read were read */
+    db_uint read_ms;
+
+    void read_changes(PhoneBook &pbook);
+    void deliver(Subscription &subscription, db_uint now_ms);
+    void drop(Subscription &subscription);
+
+    /* Not copyable */
+    ChangeNotifier(const ChangeNotifier &);
+    ChangeNotifier &operator=(const ChangeNotifier &);
+
+public:
+    ChangeNotifier();
+    ~ChangeNotifier();
+
+    bool active() const { return !subscriptions.empty(); }
+
+    /* Deliver changes committed after this call. Call outside a
+       transaction. */
+    void subscribe(PhoneBook &pbook, PhoneBook::ChangeSubscriber &subscriber,
+        const PhoneBook::SubscriptionOptions &options);
+    void unsubscribe(PhoneBook::ChangeSubscriber &subscriber);
+
+    /* Read new changes and deliver the events that are due. Call outside
+       a transaction. */
+    void poll(PhoneBook &pbook);
+    /* The database was closed or replaced: subscribers resync once the
+       next one is read. */
+    void reset();
+
+    bool change(const PhoneBook::ChangeRecord &record);
+};
+
+
+#endif
@@ -0,0 +1,354 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Arena allocation for query results shared by both data access layers
+ */
+
+#include "phonebook.h"
+#include "phonebook_results.h"
+#include "span_trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+using std::cout;
+using std::endl;
+
+/* Allocations are rounded up to this alignment. */
+#define RESULT_ALIGNMENT        sizeof(double)
+/* Rows reserved when a result array is first allocated. */
+#define RESULT_INITIAL_ROWS     64
+
+static inline size_t align_up(size_t size)
+{
+    return (size + RESULT_ALIGNMENT - 1) & ~(RESULT_ALIGNMENT - 1);
+}
+
+//=======================================================================
+// ResultArena
+//=======================================================================
+
+ResultArena::ResultArena()
+    : blocks(NULL)
+    , next_block_size(RESULT_ARENA_BLOCK_SIZE)
+{
+}
+
+ResultArena::~ResultArena()
+{
+    clear();
+    free(blocks);
+}
+
+void *ResultArena::allocate(size_t size)
+{
+    const size_t header = align_up(sizeof(Block));
+    Block *block;
+
+    size = align_up(size);
+    if (blocks == NULL || blocks->size - blocks->used < size) {
+        size_t block_size = next_block_size;
+
+        while (block_size - header < size)
+            block_size *= 2;
+        block = (Block *) malloc(block_size);
+        if (block == NULL)
+            return NULL;
+        block->next = blocks;
+        block->size = block_size;
+        block->used = header;
+        blocks = block;
+
+        if (next_block_size < RESULT_ARENA_MAX_BLOCK_SIZE)
+            next_block_size *= 2;
+    }
+
+    block = blocks;
+    block->used += size;
+    return (char *) block + block->used - size;
+}
+
+const char *ResultArena::copy(const char *s)
+{
+    size_t size = strlen(s) + 1;
+    char *p = (char *) allocate(size);
+
+    if (p != NULL)
+        memcpy(p, s, size);
+    return p;
+}
+
+const wchar_t *ResultArena::copy(const wchar_t *s)
+{
+    size_t size = (wcslen(s) + 1) * sizeof(wchar_t);
+    wchar_t *p = (wchar_t *) allocate(size);
+
+    if (p != NULL)
+        memcpy(p, s, size);
+    return p;
+}
+
+void ResultArena::clear()
+{
+    Block *block;
+
+    if (blocks == NULL)
+        return;
+
+    // Keep the newest block, which is the largest, and free the rest
+    while (blocks->next != NULL) {
+        block = blocks->next;
+        blocks->next = block->next;
+        free(block);
+    }
+    blocks->used = align_up(sizeof(Block));
+}
+
+size_t ResultArena::capacity() const
+{
+    size_t total = 0;
+
+    for (const Block *block = blocks; block != NULL; block = block->next)
+        total += block->size;
+    return total;
+}
+
+//=======================================================================
+// PhoneBook::ContactResults
+//=======================================================================
+
+PhoneBook::ContactResults::ContactResults()
+    : contacts(NULL)
+    , count(0)
+    , contact_capacity(0)
+    , numbers(NULL)
+    , total_numbers(0)
+    , number_capacity(0)
+    , first_number(NULL)
+{
+}
+
+PhoneBook::ContactResults::~ContactResults()
+{
+    free(contacts);
+    free(numbers);
+    free(first_number);
+}
+
+/**
+ * Grow an array geometrically, so filling n rows reallocates only
+ * O(log n) times.
+ */
+static bool reserve(void **array, size_t &capacity, size_t needed, size_t row_size)
+{
+    size_t new_capacity = capacity != 0 ? capacity : RESULT_INITIAL_ROWS;
+    void *p;
+
+    if (needed <= capacity)
+        return true;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    if ((p = realloc(*array, new_capacity * row_size)) == NULL)
+        return false;
+    *array = p;
+    capacity = new_capacity;
+    return true;
+}
+
+void PhoneBook::ContactResults::clear()
+{
+    count = 0;
+    total_numbers = 0;
+    arena.clear();
+}
+
+/**
+ * Append a contact. Numbers added next belong to it.
+ *
+ * @return DB_ENOMEM if out of memory
+ */
+int PhoneBook::ContactResults::add_contact(db_uint id, const wchar_t *name, bool has_ring_id,
+    db_uint ring_id, const char *picture_name)
+{
+    size_t first_capacity = contact_capacity;
+    ContactResult *contact;
+
+    if (!reserve((void **) &first_number, first_capacity, count + 1, sizeof(size_t)) ||
+        !reserve((void **) &contacts, contact_capacity, count + 1, sizeof(ContactResult)))
+        return DB_ENOMEM;
+
+    contact = &contacts[count];
+    contact->id = id;
+    contact->name = arena.copy(name);
+    contact->has_ring_id = has_ring_id;
+    contact->ring_id = has_ring_id ? ring_id : 0;
+    contact->picture_name = picture_name != NULL ? arena.copy(picture_name) : NULL;
+    contact->numbers = NULL;
+    contact->number_count = 0;
+    if (contact->name == NULL || (picture_name != NULL && contact->picture_name == NULL))
+        return DB_ENOMEM;
+
+    first_number[count++] = total_numbers;
+    return DB_NOERROR;
+}
+
+/**
+ * Append a phone number to the last contact added.
+ *
+ * @return DB_ENOMEM if out of memory
+ */
+int PhoneBook::ContactResults::add_number(const char *number, PhoneNumberType type, db_sint speed_dial)
+{
+    PhoneNumberResult *result;
+
+    if (count == 0)
+        return DB_EINVAL;
+    if (!reserve((void **) &numbers, number_capacity, total_numbers + 1, sizeof(PhoneNumberResult)))
+        return DB_ENOMEM;
+
+    result = &numbers[total_numbers++];
+    result->number = arena.copy(number);
+    result->type = type;
+    result->speed_dial = speed_dial;
+    contacts[count - 1].number_count++;
+    return result->number != NULL ? DB_NOERROR : DB_ENOMEM;
+}
+
+/**
+ * Put each contact's numbers in type order, keeping the order numbers of
+ * one type were added in, and point each contact at its numbers, once the
+ * arrays stop moving. Engines read numbers in different orders, so this
+ * makes their results the same.
+ */
+void PhoneBook::ContactResults::finish()
+{
+    for (size_t i = 0; i < count; i++) {
+        PhoneNumberResult *first = numbers + first_number[i];
+
+        // Insertion sort: a contact has few numbers, usually in order
+        for (size_t j = 1; j < contacts[i].number_count; j++) {
+            PhoneNumberResult number = first[j];
+            size_t k = j;
+
+            for (; k > 0 && first[k - 1].type > number.type; k--)
+                first[k] = first[k - 1];
+            first[k] = number;
+        }
+        contacts[i].numbers = contacts[i].number_count != 0 ? first : NULL;
+    }
+}
+
+//=======================================================================
+// Comparison
+//=======================================================================
+
+static bool same_string(const char *a, const char *b)
+{
+    return a == NULL || b == NULL ? a == b : strcmp(a, b) == 0;
+}
+
+bool same_contacts(const PhoneBook::ContactResults &a, const PhoneBook::ContactResults &b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); i++) {
+        const PhoneBook::ContactResult &x = a[i];
+        const PhoneBook::ContactResult &y = b[i];
+
+        if (x.id != y.id || wcscmp(x.name, y.name) != 0 ||
+            x.has_ring_id != y.has_ring_id || x.ring_id != y.ring_id ||
+            !same_string(x.picture_name, y.picture_name) ||
+            x.number_count != y.number_count)
+            return false;
+
+        for (size_t j = 0; j < x.number_count; j++) {
+            if (strcmp(x.numbers[j].number, y.numbers[j].number) != 0 ||
+                x.numbers[j].type != y.numbers[j].type ||
+                x.numbers[j].speed_dial != y.numbers[j].speed_dial)
+                return false;
+        }
+    }
+    return true;
+}
+
+//=======================================================================
+// Printing
+//=======================================================================
+
+void print_contacts_brief(const PhoneBook::ContactResults &results)
+{
+    TRACE_SPAN("print_contacts_brief");
+
+    for (size_t i = 0; i < results.size(); i++) {
+        char name_mbs[50];
+
+        wcstombs(name_mbs, results[i].name, sizeof name_mbs/sizeof name_mbs[0]);
+
+        cout << (long) results[i].id << '\t';
+        cout << name_mbs << endl;
+    }
+}
+
+void print_contacts(const PhoneBook::ContactResults &results)
+{
+    TRACE_SPAN("print_contacts");
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const PhoneBook::ContactResult &contact = results[i];
+        char name_mbs[50];
+
+        wcstombs(name_mbs, contact.name, sizeof name_mbs/sizeof name_mbs[0]);
+
+        // Output the contact's name and ring tone
+        cout << "Id: " << (long) contact.id << endl;
+        cout << "Name: " << name_mbs << endl;
+        if (contact.has_ring_id)
+            cout << "Ring tone id: " << (int) contact.ring_id << endl;
+        if (contact.picture_name != NULL)
+            cout << "Picture name: " << contact.picture_name << endl;
+
+        // List the contact's phone numbers
+        for (size_t j = 0; j < contact.number_count; j++) {
+            const PhoneBook::PhoneNumberResult &number = contact.numbers[j];
+
+            cout << "Phone number: " << number.number << " (";
+            switch (number.type) {
+                case PhoneBook::HOME:   cout << "Home"; break;
+                case PhoneBook::MOBILE: cout << "Mobile"; break;
+                case PhoneBook::WORK:   cout << "Work"; break;
+                case PhoneBook::FAX:    cout << "Fax"; break;
+                case PhoneBook::PAGER:  cout << "Pager"; break;
+            }
+            if (number.speed_dial >= 0)
+                cout << ", speed dial " << (long) number.speed_dial;
+            cout << ")" << endl;
+        }
+
+        cout << endl;
+    }
+}
@@ -0,0 +1,84 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Arena allocation for query results shared by both data access layers
+ */
+
+#ifndef PHONEBOOK_RESULTS_H
+#define PHONEBOOK_RESULTS_H 1
+
+#include <ittia/db++.h>
+
+#include <stddef.h>
+#include <wchar.h>
+
+/* Size of the first arena block; later blocks double up to the maximum. */
+#define RESULT_ARENA_BLOCK_SIZE     4096
+#define RESULT_ARENA_MAX_BLOCK_SIZE (1024 * 1024)
+
+/**
+ * Memory for the strings of a result set. Allocations are carved from
+ * large blocks and freed all at once by clear() or the destructor.
+ */
+class ResultArena {
+private:
+    struct Block {
+        Block *next;
+        size_t size;
+        size_t used;
+    };
+
+    Block *blocks;
+    size_t next_block_size;
+
+    /* Not copyable */
+    ResultArena(const ResultArena &);
+    ResultArena &operator=(const ResultArena &);
+
+public:
+    ResultArena();
+    ~ResultArena();
+
+    /**
+     * Allocate memory aligned for any scalar type.
+     *
+     * @return NULL if out of memory
+     */
+    void *allocate(size_t size);
+
+    /* Copy a string into the arena. Returns NULL if out of memory. */
+    const char *copy(const char *s);
+    const wchar_t *copy(const wchar_t *s);
+
+    /* Free every allocation. The largest block is kept for reuse. */
+    void clear();
+
+    /* Bytes held in blocks */
+    size_t capacity() const;
+};
+
+
+#endif
@@ -0,0 +1,96 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Phone book database schema, defined once for both data access layers
+ */
+
+#include "phonebook_schema.h"
+
+#define COUNT_OF(array) ((int) (sizeof(array) / sizeof((array)[0])))
+
+constexpr const char *ContactRow::name;
+constexpr SchemaField ContactRow::fields[];
+constexpr SchemaIndex ContactRow::indexes[];
+const SchemaTable ContactRow::table = {
+    name, fields, COUNT_OF(fields), indexes, COUNT_OF(indexes), NULL, 0
+};
+
+constexpr const char *PhoneNumberRow::name;
+constexpr SchemaField PhoneNumberRow::fields[];
+constexpr SchemaIndex PhoneNumberRow::indexes[];
+constexpr SchemaForeignKey PhoneNumberRow::foreign_keys[];
+const SchemaTable PhoneNumberRow::table = {
+    name, fields, COUNT_OF(fields), indexes, COUNT_OF(indexes),
+    foreign_keys, COUNT_OF(foreign_keys)
+};
+
+constexpr const char *PictureRow::name;
+constexpr SchemaField PictureRow::blob_fields[];
+constexpr SchemaField PictureRow::file_fields[];
+constexpr SchemaIndex PictureRow::indexes[];
+const SchemaTable PictureRow::blob_table = {
+    name, blob_fields, COUNT_OF(blob_fields), indexes, COUNT_OF(indexes), NULL, 0
+};
+const SchemaTable PictureRow::file_table = {
+    name, file_fields, COUNT_OF(file_fields), indexes, COUNT_OF(indexes), NULL, 0
+};
+
+constexpr const char *ChangeLogRow::name;
+constexpr SchemaField ChangeLogRow::fields[];
+constexpr SchemaIndex ChangeLogRow::indexes[];
+const SchemaTable ChangeLogRow::table = {
+    name, fields, COUNT_OF(fields), indexes, COUNT_OF(indexes), NULL, 0
+};
+
+constexpr const char *ContactGroupRow::name;
+constexpr SchemaField ContactGroupRow::fields[];
+constexpr SchemaIndex ContactGroupRow::indexes[];
+const SchemaTable ContactGroupRow::table = {
+    name, fields, COUNT_OF(fields), indexes, COUNT_OF(indexes), NULL, 0
+};
+
+constexpr const char *GroupMemberRow::name;
+constexpr SchemaField GroupMemberRow::fields[];
+constexpr SchemaIndex GroupMemberRow::indexes[];
+constexpr SchemaForeignKey GroupMemberRow::foreign_keys[];
+const SchemaTable GroupMemberRow::table = {
+    name, fields, COUNT_OF(fields), indexes, COUNT_OF(indexes),
+    foreign_keys, COUNT_OF(foreign_keys)
+};
+
+constexpr const char *StatRow::name;
+constexpr SchemaField StatRow::fields[];
+constexpr SchemaIndex StatRow::indexes[];
+const SchemaTable StatRow::table = {
+    name, fields, COUNT_OF(fields), indexes, COUNT_OF(indexes), NULL, 0
+};
+
+constexpr const char *ContactCardRow::name;
+constexpr SchemaField ContactCardRow::fields[];
+constexpr SchemaIndex ContactCardRow::indexes[];
+const SchemaTable ContactCardRow::table = {
+    name, fields, COUNT_OF(fields), indexes, COUNT_OF(indexes), NULL, 0
+};
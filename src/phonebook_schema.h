@@ -0,0 +1,446 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Phone book database schema, defined once for both data access layers
+ *
+ * Each table is described by a row struct: an enum of field numbers, in
+ * the order the fields are created, and constexpr arrays describing the
+ * fields, indexes and foreign keys. The table cursor layer builds
+ * FieldDescSet/IndexDescSet objects from these descriptions and the SQL
+ * layer formats CREATE TABLE statements from them, so the two stay
+ * identical.
+ *
+ * Rows are accessed through TypedTable, which only accepts the field enum
+ * of its row struct: field numbers are fixed at compile time and no field
+ * name is looked up per row.
+ */
+
+#ifndef PHONEBOOK_SCHEMA_H
+#define PHONEBOOK_SCHEMA_H 1
+
+#include <ittia/db++.h>
+
+#define MAX_CONTACT_NAME        50   // Unicode characters
+#define MAX_FILE_NAME           50   // ANSI characters
+#define MAX_PHONE_NUMBER        20   // phone number length
+#define MAX_GROUP_NAME          30   // Unicode characters
+#define MAX_CARD_NUMBERS        255  // encoded phone numbers of a contact card
+
+/**
+ * Column data types, named after their SQL types
+ */
+enum SchemaFieldType {
+    FIELD_UINT64,
+    FIELD_SINT64,
+    /* Unicode string */
+    FIELD_UTF16STR,
+    /* Variable length ANSI string */
+    FIELD_VARCHAR,
+    /* ANSI string stored at its full length */
+    FIELD_ANSISTR,
+    FIELD_BLOB
+};
+
+struct SchemaField {
+    const char *name;
+    SchemaFieldType type;
+    /* Maximum length of string fields, in characters */
+    int size;
+    bool nullable;
+};
+
+/* Indexes cover a single field. */
+struct SchemaIndex {
+    const char *name;
+    /* db::DB_PRIMARY, db::DB_UNIQUE or db::DB_MULTISET */
+    int type;
+    const char *field;
+};
+
+struct SchemaForeignKey {
+    const char *name;
+    const char *field;
+    const char *parent_table;
+    const char *parent_field;
+};
+
+struct SchemaTable {
+    const char *name;
+    const SchemaField *fields;
+    int field_count;
+    const SchemaIndex *indexes;
+    int index_count;
+    const SchemaForeignKey *foreign_keys;
+    int foreign_key_count;
+};
+
+/**
+ * The "contact" table: a list of contacts.
+ */
+struct ContactRow {
+    enum Field { ID, NAME, RING_ID, PICTURE_NAME, PICTURE_HASH, FIELD_COUNT };
+
+    static constexpr const char *name = "contact";
+    static constexpr SchemaField fields[FIELD_COUNT] = {
+        // Unique contact id number
+        { "id",             FIELD_UINT64,   0,                  false },
+        // Contacts's name
+        { "name",           FIELD_UTF16STR, MAX_CONTACT_NAME,   false },
+        // Ring tone to use when this contact calls
+        { "ring_id",        FIELD_UINT64,   0,                  true },
+        // Picture name
+        { "picture_name",   FIELD_VARCHAR,  MAX_FILE_NAME,      true },
+        // Content hash of this contact's picture in the "picture" table
+        { "picture_hash",   FIELD_UINT64,   0,                  true },
+    };
+    static constexpr SchemaIndex indexes[2] = {
+        { "by_id",          db::DB_PRIMARY,     "id" },
+        { "by_name",        db::DB_MULTISET,    "name" },
+    };
+
+    static const SchemaTable table;
+};
+
+/**
+ * The "phone_number" table: phone numbers associated with each contact.
+ */
+struct PhoneNumberRow {
+    enum Field { CONTACT_ID, NUMBER, NUMBER_KEY, NUMBER_SUFFIX, TYPE, SPEED_DIAL, FIELD_COUNT };
+
+    static constexpr const char *name = "phone_number";
+    static constexpr SchemaField fields[FIELD_COUNT] = {
+        // Foreign key into the "contact" table
+        { "contact_id",     FIELD_UINT64,   0,                  false },
+        // The telephone number, as entered
+        { "number",         FIELD_ANSISTR,  MAX_PHONE_NUMBER,   false },
+        // The number in E.164 form, packed into an integer; see number_key.h
+        { "number_key",     FIELD_UINT64,   0,                  false },
+        // The same digits in reverse order, for search by trailing digits
+        { "number_suffix",  FIELD_UINT64,   0,                  false },
+        // The type of device
+        { "type",           FIELD_UINT64,   0,                  false },
+        { "speed_dial",     FIELD_SINT64,   0,                  true },
+    };
+    static constexpr SchemaIndex indexes[3] = {
+        { "by_contact_id",  db::DB_MULTISET,    "contact_id" },
+        // Lookup by number compares integers rather than strings
+        { "by_number_key",  db::DB_MULTISET,    "number_key" },
+        { "by_number_suffix", db::DB_MULTISET,  "number_suffix" },
+    };
+    static constexpr SchemaForeignKey foreign_keys[1] = {
+        { "contact_ref",    "contact_id",   "contact",  "id" },
+    };
+
+    static const SchemaTable table;
+};
+
+/**
+ * The "picture" table: each distinct picture, stored once. Picture data is
+ * kept in a BLOB field in file storage, or in the picture side file in
+ * memory storage; either way it is the last field.
+ */
+struct PictureRow {
+    enum Field {
+        CONTENT_HASH, DATA_SIZE, STORED_SIZE, ENCODING, REF_COUNT,
+        DATA, FILE_OFFSET = DATA, FIELD_COUNT
+    };
+
+    static constexpr const char *name = "picture";
+    static constexpr SchemaField blob_fields[FIELD_COUNT] = {
+        // Hash of the picture content; a different picture with the same
+        // hash takes the next free value
+        { "content_hash",   FIELD_UINT64,   0,  false },
+        // Size of the picture in bytes
+        { "data_size",      FIELD_UINT64,   0,  false },
+        // Size of the picture as stored, after compression
+        { "stored_size",    FIELD_UINT64,   0,  false },
+        // PictureEncoding of the stored data
+        { "encoding",       FIELD_UINT64,   0,  false },
+        // Number of contacts sharing this picture
+        { "ref_count",      FIELD_UINT64,   0,  false },
+        // Picture data
+        { "data",           FIELD_BLOB,     0,  true },
+    };
+    static constexpr SchemaField file_fields[FIELD_COUNT] = {
+        { "content_hash",   FIELD_UINT64,   0,  false },
+        { "data_size",      FIELD_UINT64,   0,  false },
+        { "stored_size",    FIELD_UINT64,   0,  false },
+        { "encoding",       FIELD_UINT64,   0,  false },
+        { "ref_count",      FIELD_UINT64,   0,  false },
+        // Location of the picture data in the picture side file
+        { "file_offset",    FIELD_UINT64,   0,  false },
+    };
+    static constexpr SchemaIndex indexes[1] = {
+        { "by_content_hash", db::DB_PRIMARY,    "content_hash" },
+    };
+
+    /* Table with BLOB data, for file storage */
+    static const SchemaTable blob_table;
+    /* Table with side file offsets, for memory storage */
+    static const SchemaTable file_table;
+};
+
+/**
+ * The "change_log" table: an append-only record of every mutation used to
+ * synchronize devices incrementally.
+ */
+struct ChangeLogRow {
+    enum Field {
+        SEQ, OPERATION, CONTACT_ID, NAME, RING_ID, PICTURE_NAME,
+        NUMBER, TYPE, SPEED_DIAL, GROUP_ID, FIELD_COUNT
+    };
+
+    static constexpr const char *name = "change_log";
+    static constexpr SchemaField fields[FIELD_COUNT] = {
+        // Position of this change in the log
+        { "seq",            FIELD_UINT64,   0,                  false },
+        // ChangeType of this change
+        { "operation",      FIELD_UINT64,   0,                  false },
+        // The contact that was changed
+        { "contact_id",     FIELD_UINT64,   0,                  false },
+        // New contact fields, when part of the change
+        { "name",           FIELD_UTF16STR, MAX_CONTACT_NAME,   true },
+        { "ring_id",        FIELD_UINT64,   0,                  true },
+        { "picture_name",   FIELD_VARCHAR,  MAX_FILE_NAME,      true },
+        // New phone number fields, when part of the change
+        { "number",         FIELD_ANSISTR,  MAX_PHONE_NUMBER,   true },
+        { "type",           FIELD_UINT64,   0,                  true },
+        { "speed_dial",     FIELD_SINT64,   0,                  true },
+        // The group, for group changes; the name holds a new group's name
+        { "group_id",       FIELD_UINT64,   0,                  true },
+    };
+    static constexpr SchemaIndex indexes[1] = {
+        { "by_seq",         db::DB_PRIMARY,     "seq" },
+    };
+
+    static const SchemaTable table;
+};
+
+/**
+ * The "contact_group" table: named groups of contacts, such as favorites.
+ */
+struct ContactGroupRow {
+    enum Field { ID, NAME, FIELD_COUNT };
+
+    static constexpr const char *name = "contact_group";
+    static constexpr SchemaField fields[FIELD_COUNT] = {
+        // Unique group id number
+        { "id",             FIELD_UINT64,   0,                  false },
+        // Group name
+        { "name",           FIELD_UTF16STR, MAX_GROUP_NAME,     false },
+    };
+    static constexpr SchemaIndex indexes[1] = {
+        { "by_group_id",    db::DB_PRIMARY,     "id" },
+    };
+
+    static const SchemaTable table;
+};
+
+/**
+ * The "group_member" table: which contacts belong to which groups.
+ */
+struct GroupMemberRow {
+    enum Field { GROUP_ID, CONTACT_ID, FIELD_COUNT };
+
+    static constexpr const char *name = "group_member";
+    static constexpr SchemaField fields[FIELD_COUNT] = {
+        // Foreign key into the "contact_group" table
+        { "group_id",       FIELD_UINT64,   0,  false },
+        // Foreign key into the "contact" table
+        { "contact_id",     FIELD_UINT64,   0,  false },
+    };
+    static constexpr SchemaIndex indexes[2] = {
+        { "by_member_group",    db::DB_MULTISET,    "group_id" },
+        { "by_member_contact",  db::DB_MULTISET,    "contact_id" },
+    };
+    static constexpr SchemaForeignKey foreign_keys[2] = {
+        { "member_group_ref",   "group_id",     "contact_group",    "id" },
+        { "member_contact_ref", "contact_id",   "contact",          "id" },
+    };
+
+    static const SchemaTable table;
+};
+
+/**
+ * The "statistic" table: counters kept current by every change to the
+ * contact and phone_number tables. Each counter is one row, identified by
+ * its kind in the top byte of the id and a key, such as a phone number
+ * type or ring id, in the remaining bits.
+ */
+struct StatRow {
+    enum Field { ID, VALUE, FIELD_COUNT };
+
+    enum Kind {
+        // Number of contacts
+        CONTACTS = 0,
+        // Number of contacts with a stored picture
+        PICTURES,
+        // Number of phone numbers of the type in the key
+        NUMBERS,
+        // Number of contacts with the ring id in the key
+        RING_ID,
+    };
+
+    static constexpr int KIND_SHIFT = 56;
+    static constexpr db_uint KEY_MASK = ((db_uint) 1 << KIND_SHIFT) - 1;
+
+    /* Ring ids are truncated to the low 56 bits. */
+    static constexpr db_uint id(Kind kind, db_uint key)
+    {
+        return (db_uint) kind << KIND_SHIFT | (key & KEY_MASK);
+    }
+
+    static constexpr const char *name = "statistic";
+    static constexpr SchemaField fields[FIELD_COUNT] = {
+        // Counter kind and key
+        { "id",             FIELD_UINT64,   0,                  false },
+        // Counter value
+        { "value",          FIELD_SINT64,   0,                  false },
+    };
+    static constexpr SchemaIndex indexes[1] = {
+        { "by_stat_id",     db::DB_PRIMARY,     "id" },
+    };
+
+    static const SchemaTable table;
+};
+
+/**
+ * The "contact_card" table: optional copy of each contact with its phone
+ * numbers, so a contact is displayed from one row without reading the
+ * phone_number table. Kept current by every change to a contact.
+ */
+struct ContactCardRow {
+    enum Field { ID, NAME, RING_ID, PICTURE_NAME, NUMBER_COUNT, NUMBERS, FIELD_COUNT };
+
+    static constexpr const char *name = "contact_card";
+    static constexpr SchemaField fields[FIELD_COUNT] = {
+        // The contact's id in the "contact" table
+        { "id",             FIELD_UINT64,   0,                  false },
+        { "name",           FIELD_UTF16STR, MAX_CONTACT_NAME,   false },
+        { "ring_id",        FIELD_UINT64,   0,                  true },
+        { "picture_name",   FIELD_VARCHAR,  MAX_FILE_NAME,      true },
+        // Number of the contact's rows in the "phone_number" table
+        { "number_count",   FIELD_UINT64,   0,                  false },
+        // The phone numbers encoded by CardNumbers, or null if they do not fit
+        { "numbers",        FIELD_VARCHAR,  MAX_CARD_NUMBERS,   true },
+    };
+    static constexpr SchemaIndex indexes[2] = {
+        { "by_card_id",     db::DB_PRIMARY,     "id" },
+        { "by_card_name",   db::DB_MULTISET,    "name" },
+    };
+
+    static const SchemaTable table;
+};
+
+/* Sequences, each starting at 1 */
+static constexpr const char *const schema_sequences[] = {
+    // Contact id numbers
+    "contact_id",
+    // Blocks of contact id numbers; see PhoneBookState::next_contact_id()
+    "contact_id_block",
+    // Change log sequence numbers
+    "change_seq",
+};
+
+/**
+ * Check at compile time that a field enum matches its position in the
+ * field array.
+ */
+constexpr bool schema_name_equal(const char *a, const char *b)
+{
+    return *a == *b && (*a == '\0' || schema_name_equal(a + 1, b + 1));
+}
+
+#define SCHEMA_CHECK_FIELD(fields, field, field_name) \
+    static_assert(schema_name_equal(fields[field].name, field_name), \
+        #fields "[" #field "] is not \"" field_name "\"")
+
+SCHEMA_CHECK_FIELD(ContactRow::fields, ContactRow::ID, "id");
+SCHEMA_CHECK_FIELD(ContactRow::fields, ContactRow::NAME, "name");
+SCHEMA_CHECK_FIELD(ContactRow::fields, ContactRow::RING_ID, "ring_id");
+SCHEMA_CHECK_FIELD(ContactRow::fields, ContactRow::PICTURE_NAME, "picture_name");
+SCHEMA_CHECK_FIELD(ContactRow::fields, ContactRow::PICTURE_HASH, "picture_hash");
+SCHEMA_CHECK_FIELD(PhoneNumberRow::fields, PhoneNumberRow::CONTACT_ID, "contact_id");
+SCHEMA_CHECK_FIELD(PhoneNumberRow::fields, PhoneNumberRow::NUMBER, "number");
+SCHEMA_CHECK_FIELD(PhoneNumberRow::fields, PhoneNumberRow::NUMBER_KEY, "number_key");
+SCHEMA_CHECK_FIELD(PhoneNumberRow::fields, PhoneNumberRow::NUMBER_SUFFIX, "number_suffix");
+SCHEMA_CHECK_FIELD(PhoneNumberRow::fields, PhoneNumberRow::TYPE, "type");
+SCHEMA_CHECK_FIELD(PhoneNumberRow::fields, PhoneNumberRow::SPEED_DIAL, "speed_dial");
+SCHEMA_CHECK_FIELD(PictureRow::blob_fields, PictureRow::CONTENT_HASH, "content_hash");
+SCHEMA_CHECK_FIELD(PictureRow::blob_fields, PictureRow::DATA_SIZE, "data_size");
+SCHEMA_CHECK_FIELD(PictureRow::blob_fields, PictureRow::STORED_SIZE, "stored_size");
+SCHEMA_CHECK_FIELD(PictureRow::blob_fields, PictureRow::ENCODING, "encoding");
+SCHEMA_CHECK_FIELD(PictureRow::blob_fields, PictureRow::REF_COUNT, "ref_count");
+SCHEMA_CHECK_FIELD(PictureRow::blob_fields, PictureRow::DATA, "data");
+SCHEMA_CHECK_FIELD(PictureRow::file_fields, PictureRow::CONTENT_HASH, "content_hash");
+SCHEMA_CHECK_FIELD(PictureRow::file_fields, PictureRow::DATA_SIZE, "data_size");
+SCHEMA_CHECK_FIELD(PictureRow::file_fields, PictureRow::STORED_SIZE, "stored_size");
+SCHEMA_CHECK_FIELD(PictureRow::file_fields, PictureRow::ENCODING, "encoding");
+SCHEMA_CHECK_FIELD(PictureRow::file_fields, PictureRow::REF_COUNT, "ref_count");
+SCHEMA_CHECK_FIELD(PictureRow::file_fields, PictureRow::FILE_OFFSET, "file_offset");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::SEQ, "seq");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::OPERATION, "operation");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::CONTACT_ID, "contact_id");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::NAME, "name");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::RING_ID, "ring_id");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::PICTURE_NAME, "picture_name");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::NUMBER, "number");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::TYPE, "type");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::SPEED_DIAL, "speed_dial");
+SCHEMA_CHECK_FIELD(ChangeLogRow::fields, ChangeLogRow::GROUP_ID, "group_id");
+SCHEMA_CHECK_FIELD(ContactGroupRow::fields, ContactGroupRow::ID, "id");
+SCHEMA_CHECK_FIELD(ContactGroupRow::fields, ContactGroupRow::NAME, "name");
+SCHEMA_CHECK_FIELD(GroupMemberRow::fields, GroupMemberRow::GROUP_ID, "group_id");
+SCHEMA_CHECK_FIELD(GroupMemberRow::fields, GroupMemberRow::CONTACT_ID, "contact_id");
+SCHEMA_CHECK_FIELD(StatRow::fields, StatRow::ID, "id");
+SCHEMA_CHECK_FIELD(StatRow::fields, StatRow::VALUE, "value");
+SCHEMA_CHECK_FIELD(ContactCardRow::fields, ContactCardRow::ID, "id");
+SCHEMA_CHECK_FIELD(ContactCardRow::fields, ContactCardRow::NAME, "name");
+SCHEMA_CHECK_FIELD(ContactCardRow::fields, ContactCardRow::RING_ID, "ring_id");
+SCHEMA_CHECK_FIELD(ContactCardRow::fields, ContactCardRow::PICTURE_NAME, "picture_name");
+SCHEMA_CHECK_FIELD(ContactCardRow::fields, ContactCardRow::NUMBER_COUNT, "number_count");
+SCHEMA_CHECK_FIELD(ContactCardRow::fields, ContactCardRow::NUMBERS, "numbers");
+
+/**
+ * A table cursor whose fields are addressed by the field enum of a row
+ * struct. Access by field name is hidden.
+ */
+template <class Row>
+class TypedTable : public db::Table {
+public:
+    int open(db::Database &db)
+    {
+        return db::Table::open(db, Row::name);
+    }
+
+    db::Value &operator[](typename Row::Field field)
+    {
+        return db::Table::operator[]((int) field);
+    }
+};
+
+
+#endif
@@ -0,0 +1,301 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Writer for the read-only columnar snapshot of the phone book
+ */
+
+#include "phonebook.h"
+#include "phonebook_snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * A growable column of fixed-width values, or the string heap.
+ */
+class SnapshotColumn {
+private:
+    unsigned char *data;
+    size_t used;
+    size_t capacity;
+
+public:
+    bool failed;
+
+    SnapshotColumn() : data(NULL), used(0), capacity(0), failed(false) {}
+    ~SnapshotColumn() { free(data); }
+
+    const unsigned char *bytes() const { return data; }
+    size_t size() const { return used; }
+
+    void append(const void *value, size_t length)
+    {
+        if (used + length > capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 4096;
+            while (new_capacity < used + length)
+                new_capacity *= 2;
+
+            unsigned char *p = (unsigned char *) realloc(data, new_capacity);
+            if (p == NULL) {
+                failed = true;
+                return;
+            }
+            data = p;
+            capacity = new_capacity;
+        }
+        memcpy(data + used, value, length);
+        used += length;
+    }
+
+    template <class T>
+    void push(T value) { append(&value, sizeof value); }
+};
+
+/**
+ * Collects contacts and phone numbers into snapshot columns.
+ */
+class SnapshotCollector : public PhoneBook::ChangeVisitor {
+public:
+    SnapshotColumn column[SNAPSHOT_SECTIONS];
+    uint64_t contacts;
+    uint64_t numbers;
+
+    SnapshotCollector()
+        : contacts(0)
+        , numbers(0)
+    {
+        // Offset 0 of the heap is the empty string
+        column[SNAPSHOT_HEAP].push((char) 0);
+    }
+
+    bool change(const PhoneBook::ChangeRecord &record)
+    {
+        if (record.type == PhoneBook::CONTACT_INSERTED) {
+            column[SNAPSHOT_IDS].push((uint64_t) record.contact_id);
+            column[SNAPSHOT_RING_IDS].push((uint64_t) record.ring_id);
+            column[SNAPSHOT_NAMES].push(add_wstring(record.name));
+            column[SNAPSHOT_PICTURES].push(add_string(record.picture_name));
+            column[SNAPSHOT_FIRST].push((uint32_t) numbers);
+            contacts++;
+        } else if (record.type == PhoneBook::PHONE_NUMBER_INSERTED) {
+            column[SNAPSHOT_NUMBERS].push(add_string(record.number));
+            column[SNAPSHOT_SPEED_DIAL].push((int32_t) record.speed_dial);
+            column[SNAPSHOT_TYPES].push((uint8_t) record.number_type);
+            numbers++;
+        }
+        return true;
+    }
+
+    /* Add a string to the heap and return its offset. */
+    uint32_t add_string(const char *s)
+    {
+        if (s == NULL)
+            return SNAPSHOT_NULL;
+
+        uint32_t offset = (uint32_t) column[SNAPSHOT_HEAP].size();
+        column[SNAPSHOT_HEAP].append(s, strlen(s) + 1);
+        return offset;
+    }
+
+    /* Add a wide string to the heap as UTF-8 and return its offset. */
+    uint32_t add_wstring(const wchar_t *s)
+    {
+        SnapshotColumn &heap = column[SNAPSHOT_HEAP];
+        uint32_t offset = (uint32_t) heap.size();
+
+        for (; s != NULL && *s != 0; s++) {
+            uint32_t c = (uint32_t) *s;
+
+            // Combine UTF-16 surrogate pairs where wchar_t is 16 bits
+            if (sizeof(wchar_t) == 2 && c >= 0xd800 && c < 0xdc00 &&
+                s[1] >= 0xdc00 && s[1] < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + ((uint32_t) s[1] - 0xdc00);
+                s++;
+            }
+
+            if (c < 0x80) {
+                heap.push((char) c);
+            } else if (c < 0x800) {
+                heap.push((char) (0xc0 | (c >> 6)));
+                heap.push((char) (0x80 | (c & 0x3f)));
+            } else if (c < 0x10000) {
+                heap.push((char) (0xe0 | (c >> 12)));
+                heap.push((char) (0x80 | ((c >> 6) & 0x3f)));
+                heap.push((char) (0x80 | (c & 0x3f)));
+            } else {
+                heap.push((char) (0xf0 | (c >> 18)));
+                heap.push((char) (0x80 | ((c >> 12) & 0x3f)));
+                heap.push((char) (0x80 | ((c >> 6) & 0x3f)));
+                heap.push((char) (0x80 | (c & 0x3f)));
+            }
+        }
+        heap.push((char) 0);
+        return offset;
+    }
+};
+
+/**
+ * Sort key for the name index
+ */
+struct SnapshotNameKey {
+    const char *name;
+    uint32_t row;
+};
+
+static int compare_names(const void *a, const void *b)
+{
+    const SnapshotNameKey *x = (const SnapshotNameKey *) a;
+    const SnapshotNameKey *y = (const SnapshotNameKey *) b;
+    int c = strcmp(x->name, y->name);
+
+    // Equal names keep id order
+    if (c == 0)
+        c = x->row < y->row ? -1 : x->row > y->row;
+    return c;
+}
+
+/**
+ * Sort contact rows by name into the name index column.
+ */
+static int build_name_index(SnapshotCollector &collector)
+{
+    const uint32_t *names = (const uint32_t *) collector.column[SNAPSHOT_NAMES].bytes();
+    const char *heap = (const char *) collector.column[SNAPSHOT_HEAP].bytes();
+    SnapshotNameKey *keys;
+    uint32_t i;
+
+    if (collector.contacts == 0)
+        return DB_NOERROR;
+
+    keys = (SnapshotNameKey *) malloc(collector.contacts * sizeof *keys);
+    if (keys == NULL)
+        return DB_ENOMEM;
+
+    for (i = 0; i < collector.contacts; i++) {
+        keys[i].name = heap + names[i];
+        keys[i].row = i;
+    }
+    qsort(keys, collector.contacts, sizeof *keys, compare_names);
+    for (i = 0; i < collector.contacts; i++)
+        collector.column[SNAPSHOT_BY_NAME].push(keys[i].row);
+
+    free(keys);
+    return DB_NOERROR;
+}
+
+/**
+ * Write the contacts and phone numbers of an open phone book to a snapshot
+ * file. The file is written under a temporary name and renamed into place,
+ * so readers never see a partial snapshot.
+ *
+ * @return database error code
+ */
+int write_snapshot(PhoneBook &pbook, const char *file_name)
+{
+    static const char padding[8] = { 0 };
+    SnapshotCollector collector;
+    SnapshotHeader header;
+    char temp_name[FILENAME_MAX];
+    FILE *f;
+    uint64_t offset;
+    int rc;
+    int i;
+
+    // Read both tables in one transaction for a consistent snapshot
+    pbook.tx_start_snapshot();
+    pbook.visit_contacts(collector);
+    pbook.tx_commit();
+
+    // Heap offsets and row indexes are 32 bits, with SNAPSHOT_NULL reserved
+    if (collector.column[SNAPSHOT_HEAP].size() > SNAPSHOT_NULL ||
+        collector.contacts > UINT32_MAX || collector.numbers > UINT32_MAX)
+        return DB_EINVAL;
+
+    collector.column[SNAPSHOT_FIRST].push((uint32_t) collector.numbers);
+    rc = build_name_index(collector);
+    for (i = 0; i < SNAPSHOT_SECTIONS; i++) {
+        if (collector.column[i].failed)
+            rc = DB_ENOMEM;
+    }
+    if (DB_FAILED(rc))
+        return rc;
+
+    //-------------------------------------------------------------------
+    // Lay out the sections after the header, each 8-byte aligned
+    //-------------------------------------------------------------------
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof header;
+    header.contacts = collector.contacts;
+    header.numbers = collector.numbers;
+
+    offset = (sizeof header + 7) & ~(uint64_t) 7;
+    for (i = 0; i < SNAPSHOT_SECTIONS; i++) {
+        header.section[i] = offset;
+        offset += collector.column[i].size();
+        if (i < SNAPSHOT_HEAP)
+            offset = (offset + 7) & ~(uint64_t) 7;
+    }
+    header.file_size = offset;
+
+    //-------------------------------------------------------------------
+    // Write the file and move it into place
+    //-------------------------------------------------------------------
+    if (strlen(file_name) + 5 > sizeof temp_name)
+        return DB_EINVAL;
+    strcpy(temp_name, file_name);
+    strcat(temp_name, ".tmp");
+
+    f = fopen(temp_name, "wb");
+    if (f == NULL)
+        return DB_EIO;
+
+    offset = sizeof header;
+    fwrite(&header, sizeof header, 1, f);
+    for (i = 0; i < SNAPSHOT_SECTIONS; i++) {
+        fwrite(padding, 1, (size_t) (header.section[i] - offset), f);
+        fwrite(collector.column[i].bytes(), 1, collector.column[i].size(), f);
+        offset = header.section[i] + collector.column[i].size();
+    }
+
+    if (ferror(f) | fclose(f)) {
+        remove(temp_name);
+        return DB_EIO;
+    }
+
+#ifdef _WIN32
+    remove(file_name);
+#endif
+    if (rename(temp_name, file_name) != 0) {
+        remove(temp_name);
+        return DB_EIO;
+    }
+
+    return DB_NOERROR;
+}
@@ -0,0 +1,381 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Read-only columnar snapshot of the phone book
+ *
+ * A snapshot holds the "contact" and "phone_number" tables in a single
+ * file laid out for direct use after mapping it into memory:
+ *
+ *   header     magic, version, row counts and section offsets
+ *   ids        uint64[contacts], ascending
+ *   ring_ids   uint64[contacts]
+ *   names      uint32[contacts], heap offset of the UTF-8 name
+ *   pictures   uint32[contacts], heap offset of the picture name,
+ *              or SNAPSHOT_NULL
+ *   first      uint32[contacts + 1], index of each contact's first
+ *              phone number; a contact's numbers end where the next
+ *              contact's begin
+ *   numbers    uint32[numbers], heap offset of the phone number
+ *   speed_dial int32[numbers]
+ *   types      uint8[numbers]
+ *   by_name    uint32[contacts], contact rows sorted by name
+ *   heap       NUL-terminated strings
+ *
+ * Every section starts on an 8-byte boundary. Values are in the byte
+ * order of the host that wrote the snapshot.
+ *
+ * The reader is header-only and does not depend on the database library,
+ * so read-only consumers can use a snapshot without opening the database.
+ * Opening checks every section, offset and index against the file once, so
+ * a damaged file is rejected instead of read out of bounds; after that,
+ * lookups and listings neither parse the file nor allocate memory.
+ */
+
+#ifndef PHONEBOOK_SNAPSHOT_H
+#define PHONEBOOK_SNAPSHOT_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SNAPSHOT_MAGIC          "PBSNAP01"
+#define SNAPSHOT_VERSION        1
+/* Heap offset of a missing string. */
+#define SNAPSHOT_NULL           0xffffffffU
+/* Row number returned when a lookup finds nothing. */
+#define SNAPSHOT_NOT_FOUND      ((size_t) -1)
+
+class PhoneBook;
+
+/**
+ * Write the contacts and phone numbers of an open phone book to a snapshot
+ * file. The file is written under a temporary name and renamed into place,
+ * so readers never see a partial snapshot.
+ *
+ * @return database error code
+ */
+int write_snapshot(PhoneBook &pbook, const char *file_name);
+
+/**
+ * Sections of a snapshot file, in file order
+ */
+enum SnapshotSection {
+    SNAPSHOT_IDS = 0,
+    SNAPSHOT_RING_IDS,
+    SNAPSHOT_NAMES,
+    SNAPSHOT_PICTURES,
+    SNAPSHOT_FIRST,
+    SNAPSHOT_NUMBERS,
+    SNAPSHOT_SPEED_DIAL,
+    SNAPSHOT_TYPES,
+    SNAPSHOT_BY_NAME,
+    SNAPSHOT_HEAP,
+    SNAPSHOT_SECTIONS
+};
+
+/**
+ * Fixed header at the start of a snapshot file
+ */
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t contacts;
+    uint64_t numbers;
+    uint64_t file_size;
+    /* File offset of each section */
+    uint64_t section[SNAPSHOT_SECTIONS];
+};
+
+/**
+ * A snapshot file mapped into memory for reading.
+ *
+ * Contacts are addressed by row, in id order. Phone numbers are addressed
+ * by their index in the numbers column.
+ */
+class PhoneBookSnapshot {
+private:
+    const unsigned char *base;
+    size_t size;
+    const SnapshotHeader *header;
+#ifdef _WIN32
+    HANDLE file_handle;
+    HANDLE mapping;
+#endif
+
+    template <class T>
+    const T *column(SnapshotSection section) const
+    {
+        return (const T *) (base + header->section[section]);
+    }
+
+    const char *string(uint32_t offset) const
+    {
+        return offset == SNAPSHOT_NULL ? NULL : column<char>(SNAPSHOT_HEAP) + offset;
+    }
+
+    /* Check that a heap offset starts a string inside the heap. */
+    static bool valid_string(uint32_t offset, uint64_t heap_size, bool nullable)
+    {
+        return offset < heap_size || (nullable && offset == SNAPSHOT_NULL);
+    }
+
+    /* Check that every section, heap offset and row index in the file
+       stays inside it. */
+    bool valid() const
+    {
+        uint64_t c = header->contacts;
+        uint64_t n = header->numbers;
+        uint64_t i;
+
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 ||
+            header->version != SNAPSHOT_VERSION ||
+            header->header_size != sizeof(SnapshotHeader) ||
+            header->file_size != size)
+            return false;
+
+        // Every row takes space in the file, so larger counts are damaged;
+        // this also keeps the section lengths below from overflowing
+        if (c >= size || n >= size)
+            return false;
+
+        const uint64_t length[SNAPSHOT_HEAP] = {
+            c * 8, c * 8, c * 4, c * 4, (c + 1) * 4, n * 4, n * 4, n, c * 4
+        };
+        for (int s = 0; s < SNAPSHOT_HEAP; s++) {
+            if (header->section[s] % 8 != 0 || header->section[s] > size ||
+                length[s] > size - header->section[s])
+                return false;
+        }
+
+        // The heap must end with a terminator so no string runs past it
+        if (header->section[SNAPSHOT_HEAP] >= size || base[size - 1] != '\0')
+            return false;
+        uint64_t heap_size = size - header->section[SNAPSHOT_HEAP];
+
+        const uint32_t *names = column<uint32_t>(SNAPSHOT_NAMES);
+        const uint32_t *pictures = column<uint32_t>(SNAPSHOT_PICTURES);
+        const uint32_t *first = column<uint32_t>(SNAPSHOT_FIRST);
+        const uint32_t *by_name = column<uint32_t>(SNAPSHOT_BY_NAME);
+        const uint32_t *numbers = column<uint32_t>(SNAPSHOT_NUMBERS);
+
+        // Each contact's numbers are a range of the numbers column
+        if (first[0] != 0 || first[c] != n)
+            return false;
+        for (i = 0; i < c; i++) {
+            if (!valid_string(names[i], heap_size, false) ||
+                !valid_string(pictures[i], heap_size, true) ||
+                first[i] > first[i + 1] || by_name[i] >= c)
+                return false;
+        }
+        for (i = 0; i < n; i++) {
+            if (!valid_string(numbers[i], heap_size, true))
+                return false;
+        }
+        return true;
+    }
+
+public:
+    PhoneBookSnapshot()
+        : base(NULL)
+        , size(0)
+        , header(NULL)
+#ifdef _WIN32
+        , file_handle(INVALID_HANDLE_VALUE)
+        , mapping(NULL)
+#endif
+    {
+    }
+
+    ~PhoneBookSnapshot()
+    {
+        close();
+    }
+
+    /**
+     * Map a snapshot file.
+     *
+     * @return false if the file cannot be mapped or is not a valid snapshot
+     */
+    bool open(const char *file_name)
+    {
+        close();
+
+#ifdef _WIN32
+        LARGE_INTEGER file_size;
+
+        file_handle = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                  NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_handle, &file_size) ||
+            file_size.QuadPart < (LONGLONG) sizeof(SnapshotHeader)) {
+            close();
+            return false;
+        }
+        size = (size_t) file_size.QuadPart;
+        mapping = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL)
+            base = (const unsigned char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (base == NULL) {
+            close();
+            return false;
+        }
+#else
+        struct stat st;
+        int fd = ::open(file_name, O_RDONLY);
+
+        if (fd < 0)
+            return false;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(SnapshotHeader)) {
+            ::close(fd);
+            return false;
+        }
+        size = (size_t) st.st_size;
+        void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        // The mapping stays valid after the descriptor is closed
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        base = (const unsigned char *) p;
+#endif
+
+        header = (const SnapshotHeader *) base;
+        if (!valid()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Unmap the snapshot. Strings returned earlier become invalid.
+     */
+    void close()
+    {
+#ifdef _WIN32
+        if (base != NULL)
+            UnmapViewOfFile(base);
+        if (mapping != NULL)
+            CloseHandle(mapping);
+        if (file_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(file_handle);
+        mapping = NULL;
+        file_handle = INVALID_HANDLE_VALUE;
+#else
+        if (base != NULL)
+            munmap((void *) base, size);
+#endif
+        base = NULL;
+        size = 0;
+        header = NULL;
+    }
+
+    bool is_open() const { return base != NULL; }
+
+    size_t contact_count() const { return (size_t) header->contacts; }
+    size_t number_count() const { return (size_t) header->numbers; }
+
+    //-------------------------------------------------------------------
+    // Contact columns, by row
+    //-------------------------------------------------------------------
+    uint64_t id(size_t row) const { return column<uint64_t>(SNAPSHOT_IDS)[row]; }
+    uint64_t ring_id(size_t row) const { return column<uint64_t>(SNAPSHOT_RING_IDS)[row]; }
+    const char *name(size_t row) const { return string(column<uint32_t>(SNAPSHOT_NAMES)[row]); }
+    /* NULL if the contact has no picture. */
+    const char *picture_name(size_t row) const { return string(column<uint32_t>(SNAPSHOT_PICTURES)[row]); }
+
+    /* A contact's phone numbers are [first_number(row), end_number(row)). */
+    size_t first_number(size_t row) const { return column<uint32_t>(SNAPSHOT_FIRST)[row]; }
+    size_t end_number(size_t row) const { return column<uint32_t>(SNAPSHOT_FIRST)[row + 1]; }
+
+    //-------------------------------------------------------------------
+    // Phone number columns, by index
+    //-------------------------------------------------------------------
+    const char *number(size_t index) const { return string(column<uint32_t>(SNAPSHOT_NUMBERS)[index]); }
+    /* A PhoneBook::PhoneNumberType value. */
+    int number_type(size_t index) const { return column<uint8_t>(SNAPSHOT_TYPES)[index]; }
+    int speed_dial(size_t index) const { return column<int32_t>(SNAPSHOT_SPEED_DIAL)[index]; }
+
+    /**
+     * Row of the i-th contact in name order, for listing by name.
+     */
+    size_t row_by_name(size_t i) const { return column<uint32_t>(SNAPSHOT_BY_NAME)[i]; }
+
+    /**
+     * Find a contact by id with a binary search of the id column.
+     *
+     * @return row, or SNAPSHOT_NOT_FOUND
+     */
+    size_t find_id(uint64_t contact_id) const
+    {
+        const uint64_t *ids = column<uint64_t>(SNAPSHOT_IDS);
+        size_t lo = 0, hi = contact_count();
+
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (ids[mid] < contact_id)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo < contact_count() && ids[lo] == contact_id ? lo : SNAPSHOT_NOT_FOUND;
+    }
+
+    /**
+     * Find the first contact, in name order, whose name is not less than
+     * the given UTF-8 string. Use row_by_name() to walk on from there, for
+     * example to list all names with a prefix.
+     *
+     * @return position in name order, or contact_count() if none
+     */
+    size_t lower_bound_name(const char *contact_name) const
+    {
+        const uint32_t *by_name = column<uint32_t>(SNAPSHOT_BY_NAME);
+        size_t lo = 0, hi = contact_count();
+
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (strcmp(name(by_name[mid]), contact_name) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+};
+
+
+#endif
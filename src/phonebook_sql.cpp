@@ -26,8 +26,12 @@
  * Command line example program demonstrating the ITTIA DB C++ SQL API
  */
 
-#include "phonebook.h"
+#include "phonebook_backends.h"
+#include "contact_card.h"
+#include "picture_store.h"
+#include "number_key.h"
 #include "dbs_error_info.h"
+#include "span_trace.h"
 
 #include <stdio.h>
 
@@ -51,20 +55,18 @@ using std::cout;
 
 using namespace db;
 
-#define MAX_CONTACT_NAME        50   // Unicode characters
-#define MAX_FILE_NAME           50   // ANSI characters
 #define DATA_SIZE               1024 // BLOB chunk size
-#define MAX_PHONE_NUMBER        20   // phone number length
 
 
 /**
  * Helper function to print error messages.
  */
-int print_error(int rc)
+static int print_error(int rc)
 {
     if (DB_FAILED(rc)) {
         dbs_error_info_t info = dbs_get_error_info( rc );
         cerr << "ERROR " << info.name << ": " << info.description << endl;
+        count_error(rc);
     }
     return rc;
 }
@@ -72,7 +74,7 @@ int print_error(int rc)
 /**
  * Helper function to print error messages.
  */
-int print_error(int rc, const Query& query)
+static int print_error(int rc, const Query& query)
 {
     if (DB_FAILED(rc)) {
         dbs_error_info_t info = dbs_get_error_info( rc );
@@ -82,10 +84,65 @@ int print_error(int rc, const Query& query)
         if (query_message.size() > 0) {
             cerr << query_message.c_str() << endl;
         }
+        count_error(rc);
     }
     return rc;
 }
 
+/**
+ * Add the phone numbers of a contact to the contact last added to
+ * results, using a query prepared to select number, type and speed_dial
+ * by contact id.
+ *
+ * @return database error code
+ */
+static int add_phone_numbers(Query &numbers, db_uint id, PhoneBook::ContactResults &results)
+{
+    int rc;
+
+    numbers.param(0) = id;
+    rc = print_error(numbers.execute(), numbers);
+    for (numbers.seek_first(); DB_SUCCESS(rc) && !numbers.is_eof(); numbers.seek_next())
+        rc = results.add_number(numbers[0].as_string().c_str(),
+            (PhoneBook::PhoneNumberType) (long) numbers[1].as_int(), numbers[2].as_int());
+    return rc;
+}
+
+/**
+ * Add the phone numbers encoded on a contact's card to the contact last
+ * added to results. A NULL encoding means they did not fit on the card,
+ * so they are read with add_phone_numbers() instead.
+ *
+ * @return database error code
+ */
+static int add_card_numbers(const char *encoded, db_uint id, Query &numbers,
+    PhoneBook::ContactResults &results)
+{
+    CardNumbers card_numbers;
+
+    if (encoded == NULL)
+        return add_phone_numbers(numbers, id, results);
+    if (!card_numbers.assign(encoded))
+        return DB_EINVAL;
+    return card_numbers.decode(results);
+}
+
+/**
+ * Construct a phone book with a connection of its own.
+ */
+SqlPhoneBook::SqlPhoneBook()
+    : state(own_state)
+{
+}
+
+/**
+ * Construct a phone book sharing the connection and caches of another.
+ */
+SqlPhoneBook::SqlPhoneBook(PhoneBookState &shared)
+    : state(shared)
+{
+}
+
 /** 
  * Create database tables, assuming an empty database has been created.
  * 
@@ -95,10 +152,16 @@ int print_error(int rc, const Query& query)
  * - DB_SUCCESS macro
  * - DB_NOERROR status code
  */
-int PhoneBook::create_tables(bool with_picture)
+int SqlPhoneBook::create_tables(bool with_picture)
 {
-    if (DB_SUCCESS(create_table_contact(with_picture)) &&
-        DB_SUCCESS(create_table_phone_number())) {
+    if (DB_SUCCESS(create_table(ContactRow::table)) &&
+        DB_SUCCESS(create_table(PhoneNumberRow::table)) &&
+        DB_SUCCESS(create_table(with_picture ? PictureRow::blob_table : PictureRow::file_table)) &&
+        DB_SUCCESS(create_table(ChangeLogRow::table)) &&
+        DB_SUCCESS(create_table(ContactGroupRow::table)) &&
+        DB_SUCCESS(create_table(GroupMemberRow::table)) &&
+        DB_SUCCESS(create_table(StatRow::table)) &&
+        (!state.contact_cards || DB_SUCCESS(create_table(ContactCardRow::table)))) {
         // Success
         return DB_NOERROR;
     } else {
@@ -108,93 +171,62 @@ int PhoneBook::create_tables(bool with_picture)
 }
 
 /**
- * Create the table "contact", which lists contacts in the phone book.
+ * Create a table and its secondary indexes from its description in
+ * phonebook_schema.h.
  *
  * Demonstrates:
- * - defining table schema: fields and indexes
+ * - defining table schema: fields, primary key and foreign keys
  * - unique and non-unique indexes
- * - add_datatype() functions return FieldDesc so they can be chained together
- * - add_index() functions return IndexDesc so they can be chained together
  */
-int PhoneBook::create_table_contact(bool with_picture)
+int SqlPhoneBook::create_table(const SchemaTable &table)
 {
+    static const char *const type_names[] = {
+        "uint64", "sint64", "utf16str", "varchar", "ansistr", "blob"
+    };
     int     rc;
-    char    buffer[256];
+    int     i;
+    char    buffer[1024];
+    size_t  n;
     Query q;
 
     //-------------------------------------------------------------------
-    // Create the CONTACT table
-    //   uint64         id
-    //   nvarchar       name(MAX_CONTACT_NAME)
-    //   uint64         ring_id
-    //   varchar        picture_name(FILENAME_MAX)
-    //   blob           picture
-    //-------------------------------------------------------------------
-    if (with_picture)
-        sprintf(buffer, 
-            "create table contact ("
-            "  id uint64 not null,"
-            "  name utf16str(%d) not null,"
-            "  ring_id uint64,"
-            "  picture_name varchar(%d),"
-            "  picture blob,"
-            "  constraint by_id primary key (id)"
-            ")",
-            MAX_CONTACT_NAME, MAX_FILE_NAME);
-    else
-        sprintf(buffer, 
-            "create table contact ("
-            "  id uint64 not null,"
-            "  name utf16str(%d) not null,"
-            "  ring_id uint64,"
-            "  picture_name varchar(%d),"
-            "  constraint by_id primary key (id)"
-            ")",
-            MAX_CONTACT_NAME, MAX_FILE_NAME);
-
-    if  (DB_SUCCESS(rc = q.exec_direct(db, buffer))) {
-        //-----------------------------------------------------------
-        // Create name index on CONTACT table
-        //-----------------------------------------------------------
-        rc = q.exec_direct(db, "create index by_name on contact(name)");
+    // Format the CREATE TABLE statement
+    //-------------------------------------------------------------------
+    n = sprintf(buffer, "create table %s (", table.name);
+    for (i = 0; i < table.field_count; i++) {
+        const SchemaField &field = table.fields[i];
+
+        n += sprintf(buffer + n, "%s %s", field.name, type_names[field.type]);
+        if (field.type == FIELD_UTF16STR || field.type == FIELD_VARCHAR || field.type == FIELD_ANSISTR)
+            n += sprintf(buffer + n, "(%d)", field.size);
+        n += sprintf(buffer + n, "%s,", field.nullable ? "" : " not null");
+    }
+    for (i = 0; i < table.index_count; i++) {
+        if (table.indexes[i].type == db::DB_PRIMARY)
+            n += sprintf(buffer + n, "constraint %s primary key (%s),",
+                table.indexes[i].name, table.indexes[i].field);
     }
+    for (i = 0; i < table.foreign_key_count; i++) {
+        const SchemaForeignKey &key = table.foreign_keys[i];
 
-    return print_error(rc, q);
-}
+        n += sprintf(buffer + n, "constraint %s foreign key (%s) references %s(%s),",
+            key.name, key.field, key.parent_table, key.parent_field);
+    }
+    // Replace the trailing comma
+    buffer[n - 1] = ')';
 
-/**
- * Create the table "phone_number", which lists all known telephone numbers.
- */
-int PhoneBook::create_table_phone_number()
-{
-    int     rc;
-    char    buffer[256];
-    Query q;
+    rc = q.exec_direct(state.db, buffer);
 
     //-------------------------------------------------------------------
-    // Create the phone_number table
-    //   uint64         id
-    //   nvarchar       name(MAX_CONTACT_NAME)
-    //   uint64         ring_id
-    //   varchar        picture_name(FILENAME_MAX)
-    //   blob           picture
-    //-------------------------------------------------------------------
-    sprintf( buffer,
-        "create table phone_number ("
-        "  contact_id uint64 not null,"
-        "  number ansistr(%d) not null,"
-        "  type uint64 not null,"
-        "  speed_dial sint64,"
-        "  constraint contact_ref foreign key (contact_id) references contact(id)"
-        ")",
-        MAX_PHONE_NUMBER);
-
-    if  (DB_SUCCESS(rc = q.exec_direct(db, buffer))) {
-        //---------------------------------------------------------------
-        // Create contact_id index on PHONE_NUMBER table
-        //---------------------------------------------------------------
-        rc = q.exec_direct(db,
-            "create index by_contact_id on phone_number(contact_id)" );
+    // Create the secondary indexes
+    //-------------------------------------------------------------------
+    for (i = 0; DB_SUCCESS(rc) && i < table.index_count; i++) {
+        if (table.indexes[i].type == db::DB_PRIMARY)
+            continue;
+        sprintf(buffer, "create %sindex %s on %s(%s)",
+            table.indexes[i].type == db::DB_UNIQUE ? "unique " : "",
+            table.indexes[i].name, table.name, table.indexes[i].field);
+        rc = q.exec_direct(state.db, buffer);
     }
 
     return print_error(rc, q);
@@ -206,13 +238,38 @@ int PhoneBook::create_table_phone_number()
  * Demonstrates:
  * - defining sequences
  */
-int PhoneBook::create_sequences()
+int SqlPhoneBook::create_sequences()
 {
     Query q;
-    //-------------------------------------------------------------------
-    // Create CONTACT_ID sequence
-    //-------------------------------------------------------------------
-    return print_error(q.exec_direct(db, "create sequence contact_id start with 1"), q);
+    int rc = DB_NOERROR;
+    char buffer[128];
+
+    for (size_t i = 0; DB_SUCCESS(rc) && i < sizeof(schema_sequences) / sizeof(schema_sequences[0]); i++) {
+        sprintf(buffer, "create sequence %s start with 1", schema_sequences[i]);
+        rc = q.exec_direct(state.db, buffer);
+    }
+    return print_error(rc, q);
+}
+
+/**
+ * Create the groups every phone book starts with.
+ */
+int SqlPhoneBook::create_groups()
+{
+    static const wchar_t *const names[] = { L"Favorites", L"Family", L"Work" };
+    Query q;
+    int rc;
+
+    rc = q.prepare(state.db,
+        "insert into contact_group (id, name) "
+        "  values ($<integer>0, $<nvarchar>1) ");
+
+    for (size_t i = 0; DB_SUCCESS(rc) && i < sizeof(names) / sizeof(names[0]); i++) {
+        q.param(0) = (db_uint) (GROUP_FAVORITES + i);
+        q.param(1) = names[i];
+        rc = q.execute();
+    }
+    return print_error(rc, q);
 }
 
 /** 
@@ -224,18 +281,39 @@ int PhoneBook::create_sequences()
  * - opening a database
  * - the DB_FAILED macro
  */
-int PhoneBook::open_database(int file_mode, const char* database_name)
+int SqlPhoneBook::open_database(int file_mode, const char* database_name)
 {
+    TRACE_SPAN("open_database");
     int rc = DB_NOERROR;
     StorageMode mode;        // Default database storage mode options
     mode.file_mode = file_mode;
 
-    rc = db.open(database_name, mode);
+    state.contact_index_loaded = false;
+    state.group_index.clear();
+    state.number_type_index.clear();
+    state.discard_id_block();
+    state.notifier.reset();
+    state.remove_connection();
+
+    rc = state.db.open(database_name, mode);
 
     if (DB_FAILED(rc)) {
         cerr << "Unable to open database: [" << database_name << "]." << endl;
         print_error(rc);
+        return rc;
     }
+    state.add_connection(database_name);
+
+    //-------------------------------------------------------------------
+    // Databases created without contact cards are read with joins
+    //-------------------------------------------------------------------
+    Table card;
+    state.contact_cards = DB_SUCCESS(card.open(state.db, ContactCardRow::name));
+    if (state.contact_cards)
+        card.close();
+
+    if (file_mode == db::DB_MEMORY_STORAGE)
+        rc = open_picture_file(database_name, false);
 
     return rc;
 }
@@ -247,24 +325,40 @@ int PhoneBook::open_database(int file_mode, const char* database_name)
  * - creation of an empty database
  * - StorageMode parameter
  */
-int PhoneBook::create_database(int file_mode, const char* database_name)
+int SqlPhoneBook::create_database(int file_mode, const char* database_name)
 {
+    TRACE_SPAN("create_database");
     int rc;
     StorageMode mode;
     mode.file_mode = file_mode;
+
+    state.contact_index_loaded = false;
+    state.group_index.clear();
+    state.number_type_index.clear();
+    state.discard_id_block();
+    state.notifier.reset();
+    state.remove_connection();
+    // Memory storage is too small to hold a second copy of every contact
+    state.contact_cards = file_mode != db::DB_MEMORY_STORAGE && PhoneBookState::default_contact_cards();
+
     if (file_mode == db::DB_MEMORY_STORAGE) {
-        mode.memory_storage_size = MEMORY_STORAGE_SIZE;
+        mode.memory_storage_size = (long) state.memory_storage_size;
         cout << "Creating " << mode.memory_storage_size << " byte memory storage." << endl;
     }
 
     //-------------------------------------------------------------------
     // Create a new empty database, overwriting existing files
     //-------------------------------------------------------------------
-    if  (DB_FAILED( rc = db.create(database_name, mode) )) {
+    if  (DB_FAILED( rc = state.db.create(database_name, mode) )) {
         cerr << "Error creating new database: [" << database_name << "]." << endl;
         print_error(rc);
         return rc;
     }
+    state.add_connection(database_name);
+    if (file_mode == db::DB_MEMORY_STORAGE &&
+        DB_FAILED( rc = open_picture_file(database_name, true) )) {
+        return rc;
+    }
     if (DB_FAILED( rc = create_tables(file_mode != db::DB_MEMORY_STORAGE) )) {
         cerr << "Error creating tables" << rc << endl;
         return rc;
@@ -273,6 +367,30 @@ int PhoneBook::create_database(int file_mode, const char* database_name)
         cerr << "Error creating sequences" << rc << endl;
         return rc;
     }
+    if (DB_FAILED( rc = create_groups() )) {
+        cerr << "Error creating groups" << rc << endl;
+        return rc;
+    }
+    return rc;
+}
+
+/**
+ * Open the side file that holds picture data for memory storage.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::open_picture_file(const char *database_name, bool create)
+{
+    char    file_name[FILENAME_MAX];
+    int     rc;
+
+    picture_file_name(database_name, file_name, sizeof file_name);
+
+    if (DB_FAILED( rc = state.side_file.open(file_name, create) )) {
+        cerr << "Unable to open picture file: [" << file_name << "]." << endl;
+        print_error(rc);
+    }
+
     return rc;
 }
 
@@ -281,123 +399,372 @@ int PhoneBook::create_database(int file_mode, const char* database_name)
  * 
  * @return database error code
  */
-int PhoneBook::close_database()
+int SqlPhoneBook::close_database()
 {
-    return db.close();
+    state.contact_index_loaded = false;
+    state.group_index.clear();
+    state.number_type_index.clear();
+    state.discard_id_block();
+    state.notifier.reset();
+    state.remove_connection();
+
+    state.side_file.close();
+    return state.db.close();
 }
 
 /**
  * Insert a contact into the database.
  *
  * Demonstrates:
- * - use of a sequence
  * - opening of a table
  * - insert mode
  * - assigning data to a row
  * - posting data to the database
  * - closing a table
- * - inserting data into a BLOB field
+ * - referencing a shared picture
  */
-db_uint PhoneBook::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name)
+db_uint SqlPhoneBook::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name)
 {
+    return insert_contact(name, ring_id, picture_name, picture_name);
+}
+
+/**
+ * Insert a contact whose picture is read from a different file than the
+ * picture name recorded, such as a picture decoded to a temporary file.
+ * Pass a NULL picture_file for a contact without a picture, and a NULL
+ * picture_name as well to leave the picture name unset.
+ */
+db_uint SqlPhoneBook::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+    const char *picture_file)
+{
+    TRACE_SPAN("insert_contact");
     Query       q;
-    Sequence    id_sequence;
     db_uint         id;
+    db_uint         picture_hash;
+    bool            has_picture;
 
-    id_sequence.open(db, "contact_id");
-    id_sequence.get_next_value(id);
+    state.next_contact_id(id);
 
-    q.prepare(db,
-        "insert into contact (id, name, ring_id, picture_name) "
-        "  values ($<integer>0, $<nvarchar>1, $<integer>2, $<varchar>3) ");
+    //-------------------------------------------------------------------
+    // Store the picture once, shared by all contacts with the same image
+    //-------------------------------------------------------------------
+    has_picture = picture_file != NULL && DB_SUCCESS(acquire_picture(picture_file, picture_hash));
+
+    if (has_picture) {
+        q.prepare(state.db,
+            "insert into contact (id, name, ring_id, picture_name, picture_hash) "
+            "  values ($<integer>0, $<nvarchar>1, $<integer>2, $<varchar>3, $<integer>4) ");
+        q.param(4) = picture_hash;
+    } else if (picture_name != NULL) {
+        q.prepare(state.db,
+            "insert into contact (id, name, ring_id, picture_name) "
+            "  values ($<integer>0, $<nvarchar>1, $<integer>2, $<varchar>3) ");
+    } else {
+        q.prepare(state.db,
+            "insert into contact (id, name, ring_id) "
+            "  values ($<integer>0, $<nvarchar>1, $<integer>2) ");
+    }
     q.param(0) = id;
     q.param(1) = name;
     q.param(2) = ring_id;
-    q.param(3) = picture_name;
-    if  (DB_SUCCESS(print_error(q.execute(), q))) {
-        //---------------------------------------------------------------
-        // Insert the BLOB field
-        //---------------------------------------------------------------
-        update_contact_picture(id, picture_name);
-    } else {
+    if (picture_name != NULL)
+        q.param(3) = picture_name;
+    if  (DB_FAILED(print_error(q.execute(), q))) {
         //---------------------------------------------------------------
         // Error returned from execute
         //---------------------------------------------------------------
         id = 0;
+        if (has_picture)
+            release_picture(picture_hash);
+    } else {
+        log_change(CONTACT_INSERTED, id, name, ring_id, picture_name, NULL, HOME, 0);
+        count_contact(ring_id, has_picture, 1);
+        insert_card(id, name, ring_id, picture_name);
     }
 
     return id;
 }
 
 /**
- * Update the value of a BLOB field.
- * Because BLOB fields can be larger than available memory,
- * they are accessed through a streaming interface instead of SQL.
+ * Find a picture in the "picture" table by content, storing it if it is
+ * new, and add a reference to it.
+ *
+ * The content hash is only where the search starts: a stored picture is
+ * shared after its size and bytes compare equal, and a different picture
+ * with the same hash is stored under the next free key. On return, hash
+ * holds the key of the picture.
+ *
+ * Stored BLOB fields are read and written through a streaming interface
+ * instead of SQL, and pictures are compressed block by block as they are
+ * written.
+ *
+ * @return database error code
  */
-void PhoneBook::update_contact_picture(db_uint contact_id, const char *picture_name)
+int SqlPhoneBook::acquire_picture(const char *picture_name, db_uint &hash)
 {
-    Table contact;
+    TRACE_SPAN("acquire_picture");
+    Query   q;
+    BlobField blob;
+    std::vector<char> data;
+    db_uint stored_size;
+    int     encoding;
+    bool    found = false;
+    int     rc;
+
+    if (!read_picture_file(picture_name, data, hash)) {
+        cerr << "Cannot open " << picture_name << endl;
+        return DB_ENOENT;
+    }
+
+    //-------------------------------------------------------------------
+    // Look for an identical picture that is already stored, probing past
+    // pictures that only share the hash.
+    //-------------------------------------------------------------------
+    if  (DB_FAILED(rc = print_error(q.prepare(state.db, state.side_file.is_open()
+            ? "select data_size, stored_size, encoding, file_offset from picture where content_hash = $<integer>0"
+            : "select data_size, stored_size, encoding, data from picture where content_hash = $<integer>0"), q)))
+        return rc;
+
+    for (;; hash++) {
+        q.param(0) = hash;
+
+        if  (DB_FAILED(rc = print_error(q.execute(), q)))
+            return rc;
+        if  (q.seek_first() != DB_NOERROR || q.is_eof())
+            break;
+
+        if  ((db_uint) q[0].as_int() != data.size())
+            continue;
+
+        stored_size = q[1].as_int();
+        encoding = (int) q[2].as_int();
+        if (state.side_file.is_open()) {
+            found = state.side_file.matches(q[3].as_int(), stored_size, encoding,
+                                            data.data(), data.size());
+        } else {
+            blob.attach(q, 3);
+            BlobFieldReader reader(blob);
+            found = picture_matches(reader, stored_size, encoding, data.data(), data.size());
+        }
+        if  (found)
+            break;
+    }
+
+    if  (found) {
+        //---------------------------------------------------------------
+        // Share the stored picture.
+        //---------------------------------------------------------------
+        print_error(q.prepare(state.db,
+            "update picture "
+            "  set ref_count = ref_count + 1 "
+            "  where content_hash = $<integer>0 "), q);
+        q.param(0) = hash;
+
+        return print_error(q.execute(), q);
+    }
 
-    contact.open(db, "contact");
+    if (state.side_file.is_open()) {
+        //---------------------------------------------------------------
+        // Memory storage: keep the picture data in the side file.
+        //---------------------------------------------------------------
+        db_uint offset;
+
+        if  (DB_FAILED(rc = print_error(state.side_file.append(data.data(), data.size(),
+                                                       state.compress_pictures,
+                                                       offset, stored_size, encoding))))
+            return rc;
+
+        q.prepare(state.db,
+            "insert into picture (content_hash, data_size, stored_size, encoding, ref_count, file_offset) "
+            "  values ($<integer>0, $<integer>1, $<integer>2, $<integer>3, 1, $<integer>4) ");
+        q.param(0) = hash;
+        q.param(1) = (db_uint) data.size();
+        q.param(2) = stored_size;
+        q.param(3) = encoding;
+        q.param(4) = offset;
+
+        return print_error(q.execute(), q);
+    }
+
+    q.prepare(state.db,
+        "insert into picture (content_hash, data_size, stored_size, encoding, ref_count) "
+        "  values ($<integer>0, $<integer>1, 0, 0, 1) ");
+    q.param(0) = hash;
+    q.param(1) = (db_uint) data.size();
+
+    if  (DB_FAILED(rc = print_error(q.execute(), q)))
+        return rc;
+
+    //-------------------------------------------------------------------
+    // Insert the BLOB field
+    //-------------------------------------------------------------------
+    TypedTable<PictureRow> picture;
+
+    picture.open(state.db);
 
     //---------------------------------------------------------------
-    contact.set_sort_order("$PK");
-    contact.begin_seek(DB_SEEK_EQUAL);
+    picture.set_sort_order("$PK");
+    picture.begin_seek(DB_SEEK_EQUAL);
     //---------------------------------------------------------------
 
-    contact["id"] = contact_id;
-    if (DB_SUCCESS(contact.apply_seek())) {
+    picture[PictureRow::CONTENT_HASH] = hash;
+    if (DB_SUCCESS(rc = print_error(picture.apply_seek()))) {
         //-----------------------------------------------------------
-        // Open picture file
+        // Store picture into BLOB field
         //-----------------------------------------------------------
-        FILE *picture_file;
-        if ((picture_file = fopen(picture_name, "rb")) != NULL) {
-
-            //-------------------------------------------------------
-            // Prepare BLOB variables
-            //-------------------------------------------------------
-            int picture_field = contact.find_field("picture");
-            int num_chunks = 0;
-            int bytes_read = 0;
-            const db_len_t data_size = 256;
-            char data[data_size];
-
-            //-------------------------------------------------------
-            // Store picture into BLOB field
-            //-------------------------------------------------------
-            while((bytes_read = (int)fread(data, 1, data_size, picture_file)) > 0) {
-                contact.write_blob(picture_field, data_size * num_chunks, data, bytes_read);
-                num_chunks++;
-            }
-            fclose(picture_file);
+        TableBlobIO blob_io(picture, PictureRow::DATA);
+        rc = print_error(store_picture(data.data(), data.size(), state.compress_pictures, blob_io,
+                                       stored_size, encoding));
+    }
+    if (DB_SUCCESS(rc)) {
+        //-----------------------------------------------------------
+        // Record how the BLOB was encoded
+        //-----------------------------------------------------------
+        picture.edit();
+        picture[PictureRow::STORED_SIZE] = stored_size;
+        picture[PictureRow::ENCODING] = encoding;
+        if (DB_FAILED(rc = print_error(picture.post())))
+            picture.cancel();
+    }
 
-        } else {
-            cerr << "Cannot open " << picture_name << endl;
-        }
-    } else {
+    picture.close();
+
+    //-------------------------------------------------------------------
+    // Leave no half-stored picture for later lookups to match.
+    //-------------------------------------------------------------------
+    if  (DB_FAILED(rc)) {
+        q.prepare(state.db, "delete from picture where content_hash = $<integer>0");
+        q.param(0) = hash;
+        print_error(q.execute(), q);
+    }
+
+    return rc;
+}
+
+/**
+ * Remove a reference to a stored picture, deleting the picture when no
+ * contacts refer to it.
+ */
+void SqlPhoneBook::release_picture(db_uint hash)
+{
+    TRACE_SPAN("release_picture");
+    Query q;
+
+    q.prepare(state.db,
+        "update picture "
+        "  set ref_count = ref_count - 1 "
+        "  where content_hash = $<integer>0 ");
+    q.param(0) = hash;
+
+    if (DB_SUCCESS(print_error(q.execute(), q))) {
+        //---------------------------------------------------------------
+        // Delete the picture once the last reference is gone.
+        //---------------------------------------------------------------
+        q.prepare(state.db,
+            "delete from picture "
+            "  where content_hash = $<integer>0 and ref_count = 0 ");
+        q.param(0) = hash;
+
+        print_error(q.execute(), q);
+    }
+}
+
+/**
+ * Replace a contact's picture.
+ *
+ * Demonstrates:
+ * - updating a reference into a shared table
+ */
+void SqlPhoneBook::update_contact_picture(db_uint contact_id, const char *picture_name)
+{
+    TRACE_SPAN("update_contact_picture");
+    set_contact_picture(contact_id, picture_name, picture_name);
+}
+
+/**
+ * Replace a contact's picture with the contents of picture_file, naming
+ * it picture_name.
+ */
+void SqlPhoneBook::set_contact_picture(db_uint contact_id, const char *picture_name,
+    const char *picture_file)
+{
+    Query   q;
+    db_uint old_hash, new_hash;
+    bool    had_picture;
+
+    //-------------------------------------------------------------------
+    // Find the picture currently referenced by the contact.
+    //-------------------------------------------------------------------
+    print_error(q.prepare(state.db, "select picture_hash from contact where id = $<integer>0"), q);
+    q.param(0) = contact_id;
+
+    if  (DB_FAILED(print_error(q.execute(), q)) || q.seek_first() != DB_NOERROR) {
         cerr << "Could not find contact with id " << (int) contact_id << endl;
+        return;
     }
+    had_picture = !q[0].is_null();
+    old_hash = q[0].as_int();
 
-    contact.close();
+    if (DB_FAILED(acquire_picture(picture_file, new_hash)))
+        return;
+
+    q.prepare(state.db,
+        "update contact "
+        "  set picture_name = $<varchar>1, picture_hash = $<integer>2 "
+        "  where id = $<integer>0 ");
+    q.param(0) = contact_id;
+    q.param(1) = picture_name;
+    q.param(2) = new_hash;
+
+    //-------------------------------------------------------------------
+    // Release the old picture only after the new one is referenced,
+    // so replacing a picture with itself never deletes it.
+    //-------------------------------------------------------------------
+    if (DB_SUCCESS(print_error(q.execute(), q))) {
+        log_change(PICTURE_CHANGED, contact_id, NULL, 0, picture_name, NULL, HOME, 0);
+        update_card(contact_id, NULL, picture_name);
+        if (had_picture)
+            release_picture(old_hash);
+        else
+            add_stat(StatRow::id(StatRow::PICTURES, 0), 1);
+    } else {
+        // The contact still refers to the old picture
+        release_picture(new_hash);
+    }
 }
 
 /**
  * Insert a phone entry into the database.
  */
-void PhoneBook::insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial)
+void SqlPhoneBook::insert_phone_number(db_uint contact_id, const char *number, PhoneNumberType type, db_sint speed_dial)
 {
+    TRACE_SPAN("insert_phone_number");
     Query q;
 
-    q.prepare(db,
-        "insert into phone_number (contact_id,number,type,speed_dial) "
-        "  values ($<integer>0, $<varchar>1, $<integer>2, $<integer>3) ");
+    q.prepare(state.db,
+        "insert into phone_number (contact_id,number,number_key,number_suffix,type,speed_dial) "
+        "  values ($<integer>0, $<varchar>1, $<integer>2, $<integer>3, $<integer>4, $<integer>5) ");
 
     q.param(0) = contact_id;
     q.param(1) = number;
-    q.param(2) = (int) type;
-    q.param(3) = speed_dial;
+    q.param(2) = number_key(number);
+    q.param(3) = number_suffix_key(number);
+    q.param(4) = (int) type;
+    q.param(5) = speed_dial;
 
-    print_error(q.execute(), q);
+    if (DB_SUCCESS(print_error(q.execute(), q))) {
+        log_change(PHONE_NUMBER_INSERTED, contact_id, NULL, 0, NULL, number, type, speed_dial);
+        add_stat(StatRow::id(StatRow::NUMBERS, type), 1);
+        add_card_number(contact_id, number, type, speed_dial);
+
+        // Keep the bitmap index current
+        if (state.contact_index_loaded) {
+            ContactBitmap *contacts = state.number_type_index.get(type);
+
+            if (contacts == NULL || DB_FAILED(contacts->add(contact_id)))
+                state.contact_index_loaded = false;
+        }
+    }
 }
 
 /**
@@ -407,11 +774,12 @@ void PhoneBook::insert_phone_number(db_uint contact_id, const char *number, Phon
  * - searching for existence of a record using an index
  * - edit mode
  */
-void PhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
+void SqlPhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
 {
+    TRACE_SPAN("update_contact_name");
     Query q;
 
-    q.prepare(db,
+    q.prepare(state.db,
         "update contact "
         "  set name = $<nvarchar>1 "
         "  where id = $<integer>0 ");
@@ -419,7 +787,10 @@ void PhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
     q.param(0) = id;
     q.param(1) = newname;
 
-    print_error(q.execute(), q);
+    if (DB_SUCCESS(print_error(q.execute(), q))) {
+        log_change(CONTACT_RENAMED, id, newname, 0, NULL, NULL, HOME, 0);
+        update_card(id, newname, NULL);
+    }
 }
 
 /**
@@ -431,44 +802,128 @@ void PhoneBook::update_contact_name(db_uint id, const wchar_t *newname)
  * - range search loop using seek_next()
  * - seek_next() returns OK on end, so must explicitly check for is_eof()
  */
-void PhoneBook::remove_contact(db_uint id)
+void SqlPhoneBook::remove_contact(db_uint id)
 {
-    Query q;
+    TRACE_SPAN("remove_contact");
+    Query   q;
+    bool    found = false;
+    bool    had_picture = false;
+    db_uint picture_hash = 0;
+    db_uint ring_id = 0;
+    db_sint numbers[PAGER + 1] = { 0 };
+
+    //---------------------------------------------------------------
+    // Remember the contact's picture so its reference can be dropped,
+    // and what it contributes to the counters.
+    //---------------------------------------------------------------
+    q.prepare(state.db, "select picture_hash, ring_id from contact where id = $<integer>0");
+    q.param(0) = id;
+    if (DB_SUCCESS(print_error(q.execute(), q)) && q.seek_first() == DB_NOERROR) {
+        found = true;
+        had_picture = !q[0].is_null();
+        picture_hash = q[0].as_int();
+        ring_id = q[1].as_int();
+    }
+
+    q.prepare(state.db,
+        "select type, count(*) from phone_number "
+        "  where contact_id = $<integer>0 "
+        "  group by type");
+    q.param(0) = id;
+    if (DB_SUCCESS(print_error(q.execute(), q))) {
+        for (q.seek_first(); !q.is_eof(); q.seek_next()) {
+            if ((db_uint) q[0].as_int() <= PAGER)
+                numbers[q[0].as_int()] = q[1].as_int();
+        }
+    }
 
     //---------------------------------------------------------------
     // Remove the corresponding recs from the phone_number table.
     //---------------------------------------------------------------
-    q.prepare(db,
+    q.prepare(state.db,
         "delete from phone_number "
         "  where contact_id = $<integer>0 ");
     q.param(0) = id;
 
     if (DB_SUCCESS(print_error(q.execute(), q))) {
+        //-------------------------------------------------------------------
+        // Remove the contact from its groups.
+        //-------------------------------------------------------------------
+        q.prepare(state.db,
+            "delete from group_member "
+            "  where contact_id = $<integer>0 ");
+        q.param(0) = id;
+        print_error(q.execute(), q);
+
         //-------------------------------------------------------------------
         // Remove record from contact table.
         //-------------------------------------------------------------------
-        q.prepare(db,
+        q.prepare(state.db,
             "delete from contact "
             "  where id = $<integer>0 ");
         q.param(0) = id;
 
-        print_error(q.execute(), q);
+        if (DB_SUCCESS(print_error(q.execute(), q)) && found) {
+            log_change(CONTACT_REMOVED, id, NULL, 0, NULL, NULL, HOME, 0);
+            state.group_index.remove_contact(id);
+            state.number_type_index.remove_contact(id);
+            remove_card(id);
+
+            count_contact(ring_id, had_picture, -1);
+            for (int type = HOME; type <= PAGER; type++) {
+                if (numbers[type] != 0)
+                    add_stat(StatRow::id(StatRow::NUMBERS, type), -numbers[type]);
+            }
+            if (had_picture)
+                release_picture(picture_hash);
+        }
     }
 }
 
 /**
  * Briefly list all contacts in the database.
  */
-void PhoneBook::list_contacts_brief()
+void SqlPhoneBook::list_contacts_brief()
 {
+    TRACE_SPAN("list_contacts_brief");
+    ContactResults results;
+
+    if  (DB_SUCCESS(print_error(get_contacts_brief(results))))
+        print_contacts_brief(results);
+}
+
+/**
+ * List all contacts in the database with full phone numbers
+ */
+void SqlPhoneBook::list_contacts(int sort)
+{
+    TRACE_SPAN("list_contacts");
+    ContactResults results;
+
+    if  (DB_SUCCESS(print_error(get_contacts(sort, results))))
+        print_contacts(results);
+}
+
+/**
+ * Read the id and name of every contact, in name order, replacing the
+ * contents of results.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::get_contacts_brief(ContactResults &results)
+{
+    TRACE_SPAN("get_contacts_brief");
     Query       q;
     const char  *cmd;
+    int         rc;
+
+    results.clear();
 
     cmd = "select id, name "
           "  from contact "
-          "  order by name ";
+          "  order by name, id ";
 
-    if  (DB_SUCCESS(print_error(q.exec_direct(db, cmd), q))) {
+    if  (DB_SUCCESS(rc = print_error(q.exec_direct(state.db, cmd), q))) {
         //---------------------------------------------------------------
         // Bind local data fields to the data retrieved by the SQL call.
         // The field number is determined by the order of the fields
@@ -479,44 +934,58 @@ void PhoneBook::list_contacts_brief()
         IntegerField  id(q, "id");
         WStringField  name(q, "name");
 
-        for (q.seek_first(); !q.is_eof(); q.seek_next()) {
-            char name_mbs[50];
-            wcstombs(name_mbs, WString(name).c_str(), sizeof name_mbs/sizeof name_mbs[0]);
-
-            cout << (long) id << '\t';
-            cout << name_mbs << endl;
-        }
+        for (q.seek_first(); DB_SUCCESS(rc) && !q.is_eof(); q.seek_next())
+            rc = results.add_contact(id, WString(name).c_str(), false, 0, NULL);
     }
-    return;
+
+    results.finish();
+    return rc;
 }
 
 /**
- * List all contacts in the database with full phone numbers
+ * Read every contact with its phone numbers, replacing the contents of
+ * results. Contacts are sorted by id (0), name (1), or ring id and name
+ * (2).
+ *
+ * @return database error code
  *
  * Demonstrates:
  * - parent/child relationships
  */
-void PhoneBook::list_contacts(int sort)
+int SqlPhoneBook::get_contacts(int sort, ContactResults &results)
 {
+    TRACE_SPAN("get_contacts");
     Query       q;
     const char  *cmd;
+    int         rc;
     uint64_t    prev_id = 0;
+    bool        first = true;
 
+    //-------------------------------------------------------------------
+    // Rows of one contact must be adjacent, so ties are broken by id. The
+    // outer join keeps contacts without phone numbers, as one row with a
+    // null number.
+    //-------------------------------------------------------------------
     const char* query_by_name = 
         "select A.id, A.name, A.ring_id, A.picture_name, B.number, B.type, B.speed_dial"
-        "  from contact A, phone_number B"
-        "  where A.id = B.contact_id"
-        "  order by A.name, B.type";
+        "  from contact A left outer join phone_number B"
+        "    on A.id = B.contact_id"
+        "  order by A.name, A.id, B.type";
     const char* query_by_id =
         "select A.id, A.name, A.ring_id, A.picture_name, B.number, B.type, B.speed_dial"
-        "  from contact A, phone_number B"
-        "  where A.id = B.contact_id"
+        "  from contact A left outer join phone_number B"
+        "    on A.id = B.contact_id"
         "  order by A.id, B.type";
     const char* query_by_ring_id_name =
         "select A.id, A.name, A.ring_id, A.picture_name, B.number, B.type, B.speed_dial"
-        "  from contact A, phone_number B"
-        "  where A.id = B.contact_id"
-        "  order by A.ring_id, A.name, B.type";
+        "  from contact A left outer join phone_number B"
+        "    on A.id = B.contact_id"
+        "  order by A.ring_id, A.name, A.id, B.type";
+
+    if (state.contact_cards)
+        return get_contact_cards(sort, results);
+
+    results.clear();
 
     /* Choose the query for the selected sort order. */
     switch (sort) {
@@ -530,10 +999,16 @@ void PhoneBook::list_contacts(int sort)
             cmd = query_by_ring_id_name;
             break;
         default:
-            return;
+            results.finish();
+            return DB_EINVAL;
+    }
+
+    {
+        TRACE_SPAN("contact query");
+        rc = print_error(q.exec_direct(state.db, cmd), q);
     }
 
-    if  (DB_SUCCESS(print_error(q.exec_direct(db, cmd), q))) {
+    if  (DB_SUCCESS(rc)) {
         //---------------------------------------------------------------
         // Bind local data fields to the data retrieved by the SQL call.
         // The field number is determined by the order of the fields
@@ -541,6 +1016,7 @@ void PhoneBook::list_contacts(int sort)
         //
         // Field bindings can be created before or after the query is executed.
         //---------------------------------------------------------------
+        TRACE_SPAN("contact fetch");
         IntegerField    id          (q, "id");
         WStringField    name        (q, "name");
         IntegerField    ring_id     (q, "ring_id");
@@ -549,149 +1025,1625 @@ void PhoneBook::list_contacts(int sort)
         IntegerField    type        (q, "type");
         IntegerField    speed_dial  (q, "speed_dial");
 
-        for (q.seek_first(); !q.is_eof(); q.seek_next()) {
+        for (q.seek_first(); DB_SUCCESS(rc) && !q.is_eof(); q.seek_next()) {
             //-----------------------------------------------------------
-            // Otherwise, if brief is NOT set we want to display the
-            // entire row from the selected data.
-            //
-            // For contacts with numerous phone numbers, only display
-            //   the ID, NAME, RING_TONE, and PICTURE_NAME once.
+            // For contacts with numerous phone numbers, only add the
+            //   ID, NAME, RING_TONE, and PICTURE_NAME once.
             //-----------------------------------------------------------
-            if  ( (uint64_t)id != prev_id ) {
-                char name_mbs[50];
-                wcstombs(name_mbs, WString(name).c_str(), sizeof name_mbs/sizeof name_mbs[0]);
-                
+            if  (first || (uint64_t)id != prev_id) {
+                String picture_name_value = picture_name;
+
+                first = false;
                 prev_id = id;
-                cout << "Id: " << (long) id << endl;
-                cout << "Name: " << name_mbs << endl;
+                rc = results.add_contact(id, WString(name).c_str(),
+                    !ring_id.is_null(), (db_sint) ring_id,
+                    picture_name.is_null() ? NULL : picture_name_value.c_str());
+            }
 
-                if (!ring_id.is_null())
-                    cout << "Ring tone id: " << (int) ring_id << endl;
+            if  (DB_SUCCESS(rc) && !number.is_null())
+                rc = results.add_number(String(number).c_str(),
+                    (PhoneNumberType) (long) type, speed_dial);
+        }
+    }
 
-                if (!picture_name.is_null())
-                    cout << "Picture name: " << String(picture_name).c_str() << endl;
-            }
+    results.finish();
+    return rc;
+}
 
-            cout << "Phone number: " << String(number).c_str() << " (";
-            switch ((long)type) {
-                case HOME:   cout << "Home"; break;
-                case MOBILE: cout << "Mobile"; break;
-                case WORK:   cout << "Work"; break;
-                case FAX:    cout << "Fax"; break;
-                case PAGER:  cout << "Pager"; break;
-            }
-            if (((long)speed_dial) >= 0)
-                cout << ", speed dial " << (long) speed_dial;
+/**
+ * Read every contact with its phone numbers from the "contact_card"
+ * table, one row per contact, replacing the contents of results. Sorted
+ * as by get_contacts().
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::get_contact_cards(int sort, ContactResults &results)
+{
+    TRACE_SPAN("contact card scan");
+    Query       q;
+    Query       numbers;
+    const char  *cmd;
+    int         rc;
+
+    results.clear();
+
+    switch (sort) {
+        case 0:
+            cmd = "select id, name, ring_id, picture_name, numbers from contact_card"
+                  "  order by id";
+            break;
+        case 1:
+            cmd = "select id, name, ring_id, picture_name, numbers from contact_card"
+                  "  order by name, id";
+            break;
+        case 2:
+            cmd = "select id, name, ring_id, picture_name, numbers from contact_card"
+                  "  order by ring_id, name, id";
+            break;
+        default:
+            results.finish();
+            return DB_EINVAL;
+    }
 
-            cout << ")" << endl;
+    //-------------------------------------------------------------------
+    // Numbers are only read for cards they did not fit on.
+    //-------------------------------------------------------------------
+    if  (DB_SUCCESS(rc = print_error(numbers.prepare(state.db,
+            "select number, type, speed_dial from phone_number "
+            "  where contact_id = $<integer>0 "
+            "  order by type"), numbers)) &&
+         DB_SUCCESS(rc = print_error(q.exec_direct(state.db, cmd), q))) {
+        for (q.seek_first(); DB_SUCCESS(rc) && !q.is_eof(); q.seek_next()) {
+            db_uint id = q[0].as_int();
+            String picture_name = q[3].as_string();
+            String encoded = q[4].as_string();
+
+            rc = results.add_contact(id, q[1].as_wstring().c_str(),
+                !q[2].is_null(), q[2].as_int(),
+                q[3].is_null() ? NULL : picture_name.c_str());
+            if  (DB_SUCCESS(rc))
+                rc = add_card_numbers(q[4].is_null() ? NULL : encoded.c_str(), id, numbers, results);
         }
     }
-    return;
+
+    results.finish();
+    return rc;
 }
 
 /**
  * Retrieve picture_name field from a contact
  */
-String PhoneBook::get_picture_name(db_uint id)
+String SqlPhoneBook::get_picture_name(db_uint id)
+{
+    ResultArena arena;
+    const char  *picture_name = get_picture_name(id, arena);
+
+    return String(picture_name != NULL ? picture_name : "");
+}
+
+/**
+ * Retrieve picture_name field from a contact into an arena.
+ *
+ * @return the picture name, or NULL if the contact has none or does not
+ * exist
+ */
+const char *SqlPhoneBook::get_picture_name(db_uint id, ResultArena &arena)
 {
+    TRACE_SPAN("get_picture_name");
     Query q;
 
     //-------------------------------------------------------------------
     // Select a specific record from the contact table.
     //-------------------------------------------------------------------
-    print_error(q.prepare(db, "select picture_name from contact where id = $<integer>0"), q);
+    print_error(q.prepare(state.db, "select picture_name from contact where id = $<integer>0"), q);
     q.param(0) = id;
 
     if  (DB_SUCCESS(print_error(q.execute(), q))) {
         q.seek_first();
-        return String(q[0].as_string());
+        if  (!q.is_eof() && !q[0].is_null())
+            return arena.copy(q[0].as_string().c_str());
     }
 
-    return String("");
+    return NULL;
 }
 
 /**
  * Export picture file to disk
+ */
+void SqlPhoneBook::export_picture(db_uint id, const char *file_name)
+{
+    //-------------------------------------------------------------------
+    // Open the output file.
+    //-------------------------------------------------------------------
+    FILE    *picture_file = fopen(file_name, "wb");
+    int     rc;
+
+    if (picture_file == NULL) {
+        cerr << "Cannot open " << file_name << endl;
+        return;
+    }
+
+    rc = export_picture(id, picture_file);
+    fclose(picture_file);
+
+    if (rc == DB_ENOENT) {
+        cerr << "Could not find picture for contact with id " << (long) id << endl;
+        remove(file_name);
+    }
+}
+
+/**
+ * Write a contact's picture to an open file.
+ *
+ * @return DB_ENOENT if the contact does not exist or has no picture, or
+ * another database error code
  *
  * Demonstrates:
+ * - following a reference into a shared table
  * - reading the contents of a BLOB
+ * - streaming decompression
  */
-void PhoneBook::export_picture(db_uint id, const char *file_name)
+int SqlPhoneBook::export_picture(db_uint id, FILE *picture_file)
 {
+    TRACE_SPAN("export_picture");
     Query q;
     BlobField   blob;
+    int     rc;
 
     enum FieldOrder {
-        PICTURE_FIELD = 0
+        PICTURE_FIELD = 0,
+        STORED_SIZE_FIELD,
+        ENCODING_FIELD
     };
 
+    if (state.side_file.is_open()) {
+        //---------------------------------------------------------------
+        // Memory storage: locate the picture data in the side file.
+        //---------------------------------------------------------------
+        print_error(q.prepare(state.db,
+            "select B.file_offset, B.stored_size, B.encoding "
+            "  from contact A, picture B "
+            "  where A.picture_hash = B.content_hash and A.id = $<integer>0"), q);
+        q.param(0) = id;
+
+        if  (DB_FAILED(rc = print_error(q.execute(), q)))
+            return rc;
+        if  (q.seek_first() != DB_NOERROR || q.is_eof())
+            return DB_ENOENT;
+
+        //---------------------------------------------------------------
+        // Copy from the mapped side file
+        //---------------------------------------------------------------
+        return print_error(state.side_file.export_to(q[0].as_int(), q[1].as_int(),
+                                               (int) q[2].as_int(), picture_file));
+    }
+
     //-------------------------------------------------------------------
-    // Select a specific record from the contact table.
+    // Select the shared picture referenced by a specific contact.
     //-------------------------------------------------------------------
-    print_error(q.prepare(db, "select picture from contact where id = $<integer>0"), q);
+    print_error(q.prepare(state.db,
+        "select B.data, B.stored_size, B.encoding "
+        "  from contact A, picture B "
+        "  where A.picture_hash = B.content_hash and A.id = $<integer>0"), q);
     q.param(0) = id;
 
+    if  (DB_FAILED(rc = print_error(q.execute(), q)))
+        return rc;
+
+    blob.attach(q, PICTURE_FIELD);
+
+    //-------------------------------------------------------------------
+    // Position the cursor to the first record (only 1 record).
+    //-------------------------------------------------------------------
+    if  (q.seek_first() != DB_NOERROR || q.is_eof())
+        return DB_ENOENT;
+
+    //-------------------------------------------------------------------
+    // Export the BLOB to the output image file, one block at a time
+    //-------------------------------------------------------------------
+    BlobFieldReader reader(blob);
+    return print_error(load_picture(reader, q[STORED_SIZE_FIELD].as_int(),
+                                    (int) q[ENCODING_FIELD].as_int(), picture_file));
+}
+
+/**
+ * Measure how much space is saved by sharing identical pictures.
+ *
+ * Demonstrates:
+ * - aggregate functions
+ */
+void SqlPhoneBook::get_picture_stats(PictureStats &stats)
+{
+    TRACE_SPAN("get_picture_stats");
+    Query q;
+
+    stats.pictures = 0;
+    stats.references = 0;
+    stats.logical_bytes = 0;
+    stats.stored_bytes = 0;
+
+    //-------------------------------------------------------------------
+    // The table holds one row per distinct picture.
+    //-------------------------------------------------------------------
+    if  (DB_SUCCESS(print_error(q.exec_direct(state.db,
+            "select count(*), sum(ref_count), sum(data_size * ref_count), sum(stored_size) "
+            "  from picture "), q)) &&
+         q.seek_first() == DB_NOERROR) {
+        stats.pictures = q[0].as_int();
+        if (stats.pictures > 0) {
+            stats.references = q[1].as_int();
+            stats.logical_bytes = q[2].as_int();
+            stats.stored_bytes = q[3].as_int();
+        }
+    }
+}
+
+/**
+ * Enable or disable compression of newly stored pictures. Pictures
+ * already stored keep their encoding.
+ */
+void SqlPhoneBook::set_picture_compression(bool enable)
+{
+    state.compress_pictures = enable;
+}
+
+/**
+ * Append a change to the change log, in the same transaction as the
+ * change itself. Only the fields belonging to the change type are stored.
+ */
+void SqlPhoneBook::log_change(ChangeType type, db_uint contact_id, const wchar_t *name,
+    db_uint ring_id, const char *picture_name,
+    const char *number, PhoneNumberType number_type, db_sint speed_dial,
+    db_uint group_id)
+{
+    TRACE_SPAN("log_change");
+    Query       q;
+    Sequence    seq_sequence;
+    db_uint     seq;
+
+    if (!state.log_changes)
+        return;
+
+    seq_sequence.open(state.db, "change_seq");
+    if (DB_FAILED(print_error(seq_sequence.get_next_value(seq)))) {
+        // Without a sequence number the change cannot be logged
+        state.contact_index_loaded = false;
+        return;
+    }
+
+    //-------------------------------------------------------------------
+    // Each type of change stores its own fields; the rest are null.
+    //-------------------------------------------------------------------
+    switch (type) {
+        case CONTACT_INSERTED:
+            q.prepare(state.db,
+                "insert into change_log (seq, operation, contact_id, name, ring_id, picture_name) "
+                "  values ($<integer>0, $<integer>1, $<integer>2, $<nvarchar>3, $<integer>4, $<varchar>5) ");
+            q.param(3) = name;
+            q.param(4) = ring_id;
+            q.param(5) = picture_name;
+            break;
+        case PHONE_NUMBER_INSERTED:
+            q.prepare(state.db,
+                "insert into change_log (seq, operation, contact_id, number, type, speed_dial) "
+                "  values ($<integer>0, $<integer>1, $<integer>2, $<varchar>3, $<integer>4, $<integer>5) ");
+            q.param(3) = number;
+            q.param(4) = (int) number_type;
+            q.param(5) = speed_dial;
+            break;
+        case CONTACT_RENAMED:
+            q.prepare(state.db,
+                "insert into change_log (seq, operation, contact_id, name) "
+                "  values ($<integer>0, $<integer>1, $<integer>2, $<nvarchar>3) ");
+            q.param(3) = name;
+            break;
+        case PICTURE_CHANGED:
+            q.prepare(state.db,
+                "insert into change_log (seq, operation, contact_id, picture_name) "
+                "  values ($<integer>0, $<integer>1, $<integer>2, $<varchar>3) ");
+            q.param(3) = picture_name;
+            break;
+        case GROUP_CREATED:
+            q.prepare(state.db,
+                "insert into change_log (seq, operation, contact_id, name, group_id) "
+                "  values ($<integer>0, $<integer>1, $<integer>2, $<nvarchar>3, $<integer>4) ");
+            q.param(3) = name;
+            q.param(4) = group_id;
+            break;
+        case GROUP_MEMBER_ADDED:
+        case GROUP_MEMBER_REMOVED:
+            q.prepare(state.db,
+                "insert into change_log (seq, operation, contact_id, group_id) "
+                "  values ($<integer>0, $<integer>1, $<integer>2, $<integer>3) ");
+            q.param(3) = group_id;
+            break;
+        default:
+            q.prepare(state.db,
+                "insert into change_log (seq, operation, contact_id) "
+                "  values ($<integer>0, $<integer>1, $<integer>2) ");
+            break;
+    }
+    q.param(0) = seq;
+    q.param(1) = (int) type;
+    q.param(2) = contact_id;
+
+    print_error(q.execute(), q);
+
+    //-------------------------------------------------------------------
+    // The bitmap index stays valid only while it has seen every change.
+    //-------------------------------------------------------------------
+    if (state.contact_index_loaded && seq == state.contact_index_seq + 1)
+        state.contact_index_seq = seq;
+    else
+        state.contact_index_loaded = false;
+}
+
+/**
+ * Stream the changes made after a sequence number, oldest first. Pass 0
+ * to read the whole log.
+ *
+ * @return false if changes after seq have been compacted away or the log
+ * cannot be read, in which case the caller must read the whole phone book
+ */
+bool SqlPhoneBook::changes_since(db_uint seq, ChangeVisitor &visitor)
+{
+    TRACE_SPAN("changes_since");
+    Query q;
+
+    //-------------------------------------------------------------------
+    // The oldest entry marks how far the log has been compacted.
+    //-------------------------------------------------------------------
+    if  (DB_FAILED(print_error(q.exec_direct(state.db,
+            "select seq, operation from change_log order by seq"), q)))
+        return false;
+    if  (q.seek_first() == DB_NOERROR && !q.is_eof() &&
+         q[1].as_int() == CHANGES_COMPACTED && (db_uint) q[0].as_int() > seq) {
+        return false;
+    }
+
+    if  (DB_FAILED(print_error(q.prepare(state.db,
+            "select seq, operation, contact_id, name, ring_id, picture_name, number, type, speed_dial, group_id "
+            "  from change_log "
+            "  where seq > $<integer>0 and operation <> $<integer>1 "
+            "  order by seq"), q)))
+        return false;
+    q.param(0) = seq;
+    q.param(1) = (int) CHANGES_COMPACTED;
+
+    if  (DB_FAILED(print_error(q.execute(), q)))
+        return false;
+
+    //-------------------------------------------------------------------
+    // Bind local data fields to the data retrieved by the SQL call.
+    //-------------------------------------------------------------------
+    IntegerField    seq_field   (q, "seq");
+    IntegerField    operation   (q, "operation");
+    IntegerField    contact_id  (q, "contact_id");
+    WStringField    name        (q, "name");
+    IntegerField    ring_id     (q, "ring_id");
+    StringField     picture_name(q, "picture_name");
+    StringField     number      (q, "number");
+    IntegerField    type        (q, "type");
+    IntegerField    speed_dial  (q, "speed_dial");
+    IntegerField    group_id    (q, "group_id");
+
+    for (q.seek_first(); !q.is_eof(); q.seek_next()) {
+        ChangeRecord    record;
+        WString         name_value = name;
+        String          picture_name_value = picture_name;
+        String          number_value = number;
+
+        record.seq = seq_field;
+        record.type = (ChangeType) (long) operation;
+        record.contact_id = contact_id;
+        record.name = name.is_null() ? NULL : name_value.c_str();
+        record.ring_id = ring_id;
+        record.picture_name = picture_name.is_null() ? NULL : picture_name_value.c_str();
+        record.picture_file = NULL;
+        record.number = number.is_null() ? NULL : number_value.c_str();
+        record.number_type = (PhoneNumberType) (long) type;
+        record.speed_dial = speed_dial;
+        record.group_id = group_id;
+
+        if (!visitor.change(record))
+            break;
+    }
+
+    return true;
+}
+
+/**
+ * Discard change log entries up to and including a sequence number, once
+ * every device has synchronized past it. A marker entry remembers the
+ * point of compaction so older devices know to read the whole phone book.
+ */
+void SqlPhoneBook::compact_change_log(db_uint through_seq)
+{
+    TRACE_SPAN("compact_change_log");
+    Query   q;
+    db_uint newest = 0;
+
+    //-------------------------------------------------------------------
+    // Never compact past the newest entry, or behind an earlier marker.
+    //-------------------------------------------------------------------
+    if  (DB_FAILED(print_error(q.exec_direct(state.db,
+            "select max(seq), min(seq), count(*) from change_log"), q)) ||
+         q.seek_first() != DB_NOERROR || q[2].as_int() == 0)
+        return;
+
+    newest = q[0].as_int();
+    if (through_seq > newest)
+        through_seq = newest;
+    if ((db_uint) q[1].as_int() > through_seq)
+        return;
+
+    q.prepare(state.db,
+        "delete from change_log "
+        "  where seq <= $<integer>0 ");
+    q.param(0) = through_seq;
+
     if  (DB_SUCCESS(print_error(q.execute(), q))) {
+        q.prepare(state.db,
+            "insert into change_log (seq, operation, contact_id) "
+            "  values ($<integer>0, $<integer>1, 0) ");
+        q.param(0) = through_seq;
+        q.param(1) = (int) CHANGES_COMPACTED;
+
+        print_error(q.execute(), q);
+    }
+}
+
+/**
+ * Find the sequence number of the newest change log entry.
+ *
+ * @return 0 if the log is empty
+ */
+db_uint SqlPhoneBook::last_change_seq()
+{
+    TRACE_SPAN("last_change_seq");
+    Query   q;
+    db_uint seq = 0;
+
+    if  (DB_SUCCESS(print_error(q.exec_direct(state.db,
+            "select max(seq), count(*) from change_log"), q)) &&
+         q.seek_first() == DB_NOERROR && q[1].as_int() != 0)
+        seq = q[0].as_int();
+
+    return seq;
+}
+
+/**
+ * Enable or disable the change log. A replica that applies changes read
+ * from another phone book does not need to record them again.
+ *
+ * Changes made while the log is off leave no sequence number behind, so
+ * the bitmap indexes are rebuilt once it is turned back on.
+ */
+void SqlPhoneBook::set_change_logging(bool enable)
+{
+    if (enable != state.log_changes)
+        state.contact_index_loaded = false;
+    state.log_changes = enable;
+}
+
+/**
+ * Reserve contact ids for this connection in blocks of the given size,
+ * or one at a time for a size of 1.
+ */
+void SqlPhoneBook::set_id_block_size(unsigned size)
+{
+    state.set_id_block_size(size);
+}
+
+/**
+ * Set the RAM given to memory storage databases created from now on.
+ */
+void SqlPhoneBook::set_memory_storage_size(db_uint size)
+{
+    state.memory_storage_size = size;
+}
+
+/**
+ * Find the smallest and largest contact id.
+ *
+ * @return false if there are no contacts
+ */
+bool SqlPhoneBook::get_contact_id_range(db_uint &first_id, db_uint &last_id)
+{
+    Query q;
+
+    if  (DB_SUCCESS(print_error(q.exec_direct(state.db,
+            "select min(id), max(id), count(*) from contact"), q)) &&
+         q.seek_first() == DB_NOERROR && q[2].as_int() != 0) {
+        first_id = q[0].as_int();
+        last_id = q[1].as_int();
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Stream the contacts with ids from first_id to last_id, inclusive, in id
+ * order, as if each had just been inserted: a CONTACT_INSERTED record
+ * followed by a PHONE_NUMBER_INSERTED record for each of its phone
+ * numbers. Records carry sequence number 0. By default every contact is
+ * streamed.
+ *
+ * Contacts without phone numbers are included, so the two tables are
+ * read with separate queries in the same order and merged.
+ */
+void SqlPhoneBook::visit_contacts(ChangeVisitor &visitor, db_uint first_id, db_uint last_id)
+{
+    TRACE_SPAN("visit_contacts");
+    Query   contacts;
+    Query   numbers;
+    bool    more = true;
+
+    contacts.prepare(state.db,
+        "select id, name, ring_id, picture_name from contact "
+        "  where id between $<integer>0 and $<integer>1 "
+        "  order by id");
+    contacts.param(0) = first_id;
+    contacts.param(1) = last_id;
+
+    numbers.prepare(state.db,
+        "select contact_id, number, type, speed_dial from phone_number "
+        "  where contact_id between $<integer>0 and $<integer>1 "
+        "  order by contact_id");
+    numbers.param(0) = first_id;
+    numbers.param(1) = last_id;
+
+    if  (DB_FAILED(print_error(contacts.execute(), contacts)) ||
+         DB_FAILED(print_error(numbers.execute(), numbers)))
+        return;
 
-        blob.attach(q, PICTURE_FIELD);
+    //-------------------------------------------------------------------
+    // Bind local data fields to the data retrieved by the SQL calls.
+    //-------------------------------------------------------------------
+    IntegerField    id          (contacts, "id");
+    WStringField    name        (contacts, "name");
+    IntegerField    ring_id     (contacts, "ring_id");
+    StringField     picture_name(contacts, "picture_name");
+    IntegerField    contact_id  (numbers, "contact_id");
+    StringField     number      (numbers, "number");
+    IntegerField    type        (numbers, "type");
+    IntegerField    speed_dial  (numbers, "speed_dial");
+
+    numbers.seek_first();
+    for (contacts.seek_first(); more && !contacts.is_eof(); contacts.seek_next()) {
+        ChangeRecord    record;
+        WString         name_value = name;
+        String          picture_name_value = picture_name;
+
+        record.seq = 0;
+        record.type = CONTACT_INSERTED;
+        record.contact_id = id;
+        record.name = name_value.c_str();
+        record.ring_id = ring_id;
+        record.picture_name = picture_name.is_null() ? NULL : picture_name_value.c_str();
+        record.picture_file = NULL;
+        record.number = NULL;
+        record.number_type = HOME;
+        record.speed_dial = 0;
+        record.group_id = 0;
+        more = visitor.change(record);
 
         //---------------------------------------------------------------
-        // Position the cursor to the first record (only 1 record).
+        // Follow with the contact's phone numbers, skipping orphans.
         //---------------------------------------------------------------
-        if  (q.seek_first() == DB_NOERROR) {
-            int             offset, bytes_read;
-            db_len_t        blob_size = blob.size();
-            const db_len_t  data_size = 256;
-            char            data[data_size];
-
-            //-----------------------------------------------------------
-            // Open the output file.
-            //-----------------------------------------------------------
-            FILE *picture_file;
-            if ((picture_file = fopen(file_name, "wb")) != NULL) {
-
-                //-------------------------------------------------------
-                // Export the BLOB to the output image file
-                //-------------------------------------------------------
-                for(offset = 0; offset < blob_size; offset += data_size) {
-                    if  (bytes_read = blob.read(offset, data, data_size)) {
-                        fwrite(data, bytes_read, 1, picture_file);
-                    }
-                }
-
-                //-------------------------------------------------------
-                // Close the output file.
-                //-------------------------------------------------------
-                fclose(picture_file);
+        for (; more && !numbers.is_eof() && (db_uint) contact_id <= record.contact_id; numbers.seek_next()) {
+            if ((db_uint) contact_id < record.contact_id)
+                continue;
+
+            String number_value = number;
+
+            record.type = PHONE_NUMBER_INSERTED;
+            record.name = NULL;
+            record.ring_id = 0;
+            record.picture_name = NULL;
+            record.picture_file = NULL;
+            record.number = number_value.c_str();
+            record.number_type = (PhoneNumberType) (long) type;
+            record.speed_dial = speed_dial;
+            more = visitor.change(record);
+        }
+    }
+}
 
-            } else {
-                cerr << "Cannot open " << file_name << endl;
-            }
+/**
+ * Pass every group to the visitor as a GROUP_CREATED record, then every
+ * membership as a GROUP_MEMBER_ADDED record, with sequence number 0.
+ * Applying them after visit_contacts() rebuilds the groups.
+ */
+void SqlPhoneBook::visit_groups(ChangeVisitor &visitor)
+{
+    TRACE_SPAN("visit_groups");
+    Query           q;
+    ChangeRecord    record;
+    bool            more = true;
+
+    record.seq = 0;
+    record.contact_id = 0;
+    record.ring_id = 0;
+    record.picture_name = NULL;
+    record.picture_file = NULL;
+    record.number = NULL;
+    record.number_type = HOME;
+    record.speed_dial = 0;
+
+    if  (DB_SUCCESS(print_error(q.exec_direct(state.db,
+            "select id, name from contact_group order by id"), q))) {
+        IntegerField    id  (q, "id");
+        WStringField    name(q, "name");
+
+        for (q.seek_first(); more && !q.is_eof(); q.seek_next()) {
+            WString name_value = name;
+
+            record.type = GROUP_CREATED;
+            record.group_id = id;
+            record.name = name_value.c_str();
+            more = visitor.change(record);
+        }
+    }
 
-        } else {
-            cerr << "Could not find contact with id " << (long) id << endl;
+    record.name = NULL;
+    if  (more && DB_SUCCESS(print_error(q.exec_direct(state.db,
+            "select group_id, contact_id from group_member order by group_id, contact_id"), q))) {
+        IntegerField    group_id  (q, "group_id");
+        IntegerField    contact_id(q, "contact_id");
+
+        for (q.seek_first(); more && !q.is_eof(); q.seek_next()) {
+            record.type = GROUP_MEMBER_ADDED;
+            record.group_id = group_id;
+            record.contact_id = contact_id;
+            more = visitor.change(record);
         }
     }
-    return;
 }
 
 /**
- * Start transaction
+ * Find the phone numbers starting with the given digits, in E.164 order.
+ * Punctuation is ignored and a number without a leading '+' is taken to
+ * be in the default country. Each match is passed to the visitor as a
+ * PHONE_NUMBER_INSERTED record with sequence number 0 and the name of the
+ * contact it belongs to.
+ *
+ * Demonstrates:
+ * - range search on an integer index with a between predicate
+ */
+void SqlPhoneBook::find_phone_numbers(const char *number, ChangeVisitor &visitor)
+{
+    TRACE_SPAN("find_phone_numbers");
+    Query   q;
+    db_uint low, high;
+    bool    more = true;
+
+    if  (!number_key_range(number, low, high))
+        return;
+
+    q.prepare(state.db,
+        "select A.id, A.name, B.number, B.type, B.speed_dial"
+        "  from contact A, phone_number B"
+        "  where A.id = B.contact_id"
+        "    and B.number_key between $<integer>0 and $<integer>1"
+        "  order by B.number_key");
+    q.param(0) = low;
+    q.param(1) = high;
+
+    if  (DB_FAILED(print_error(q.execute(), q)))
+        return;
+
+    //-------------------------------------------------------------------
+    // Bind local data fields to the data retrieved by the SQL calls.
+    //-------------------------------------------------------------------
+    IntegerField    id          (q, "id");
+    WStringField    name        (q, "name");
+    StringField     number_field(q, "number");
+    IntegerField    type        (q, "type");
+    IntegerField    speed_dial  (q, "speed_dial");
+
+    for (q.seek_first(); more && !q.is_eof(); q.seek_next()) {
+        ChangeRecord    record;
+        WString         name_value = name;
+        String          number_value = number_field;
+
+        record.seq = 0;
+        record.type = PHONE_NUMBER_INSERTED;
+        record.contact_id = id;
+        record.name = name_value.c_str();
+        record.ring_id = 0;
+        record.picture_name = NULL;
+        record.picture_file = NULL;
+        record.number = number_value.c_str();
+        record.number_type = (PhoneNumberType) (long) type;
+        record.speed_dial = speed_dial;
+        record.group_id = 0;
+        more = visitor.change(record);
+    }
+}
+
+/**
+ * Find the phone numbers ending with the given digits, ordered by their
+ * digits read backwards. Punctuation is ignored. At most limit matches are
+ * passed to the visitor, or all of them if limit is 0, each as a
+ * PHONE_NUMBER_INSERTED record with sequence number 0 and the name of the
+ * contact it belongs to.
+ *
+ * Demonstrates:
+ * - range search on an index of reversed keys
+ *
+ * @return database error code; DB_EINVAL if digits holds no digits
+ */
+int SqlPhoneBook::search_by_number_suffix(const char *digits, size_t limit, ChangeVisitor &visitor)
+{
+    TRACE_SPAN("search_by_number_suffix");
+    Query   q;
+    char    sql[320];
+    db_uint low, high;
+    bool    more = true;
+    int     rc;
+
+    if  (!number_suffix_range(digits, low, high))
+        return DB_EINVAL;
+
+    //-------------------------------------------------------------------
+    // Let the database stop after the first limit rows.
+    //-------------------------------------------------------------------
+    strcpy(sql,
+        "select A.id, A.name, B.number, B.type, B.speed_dial"
+        "  from contact A, phone_number B"
+        "  where A.id = B.contact_id"
+        "    and B.number_suffix between $<integer>0 and $<integer>1"
+        "  order by B.number_suffix");
+    if  (limit != 0)
+        sprintf(sql + strlen(sql), " limit %lu", (unsigned long) limit);
+
+    if  (DB_FAILED(rc = print_error(q.prepare(state.db, sql), q)))
+        return rc;
+    q.param(0) = low;
+    q.param(1) = high;
+
+    rc = q.execute();
+    if  (DB_FAILED(print_error(rc, q)))
+        return rc;
+
+    //-------------------------------------------------------------------
+    // Bind local data fields to the data retrieved by the SQL calls.
+    //-------------------------------------------------------------------
+    IntegerField    id          (q, "id");
+    WStringField    name        (q, "name");
+    StringField     number_field(q, "number");
+    IntegerField    type        (q, "type");
+    IntegerField    speed_dial  (q, "speed_dial");
+
+    for (q.seek_first(); more && !q.is_eof(); q.seek_next()) {
+        ChangeRecord    record;
+        WString         name_value = name;
+        String          number_value = number_field;
+
+        record.seq = 0;
+        record.type = PHONE_NUMBER_INSERTED;
+        record.contact_id = id;
+        record.name = name_value.c_str();
+        record.ring_id = 0;
+        record.picture_name = NULL;
+        record.picture_file = NULL;
+        record.number = number_value.c_str();
+        record.number_type = (PhoneNumberType) (long) type;
+        record.speed_dial = speed_dial;
+        record.group_id = 0;
+        more = visitor.change(record);
+    }
+    return DB_NOERROR;
+}
+
+/**
+ * Apply a change read from another phone book, keeping its contact id.
+ * Picture data is copied only from a record's picture_file; otherwise the
+ * contact keeps only its picture name.
  */
-void PhoneBook::tx_start()
+void SqlPhoneBook::apply_change(const ChangeRecord &record)
 {
+    TRACE_SPAN("apply_change");
     Query q;
-    // Equivalent to: db.tx_begin();
-    print_error(q.exec_direct(db, "start transaction"), q);
+
+    switch (record.type) {
+        case CONTACT_INSERTED:
+            // A contact without a picture name keeps it null
+            if (record.picture_name != NULL) {
+                q.prepare(state.db,
+                    "insert into contact (id, name, ring_id, picture_name) "
+                    "  values ($<integer>0, $<nvarchar>1, $<integer>2, $<varchar>3) ");
+                q.param(3) = record.picture_name;
+            } else {
+                q.prepare(state.db,
+                    "insert into contact (id, name, ring_id) "
+                    "  values ($<integer>0, $<nvarchar>1, $<integer>2) ");
+            }
+            q.param(0) = record.contact_id;
+            q.param(1) = record.name;
+            q.param(2) = record.ring_id;
+
+            if (DB_SUCCESS(print_error(q.execute(), q))) {
+                log_change(CONTACT_INSERTED, record.contact_id, record.name,
+                    record.ring_id, record.picture_name, NULL, HOME, 0);
+                count_contact(record.ring_id, false, 1);
+                insert_card(record.contact_id, record.name, record.ring_id, record.picture_name);
+                reserve_contact_id(record.contact_id);
+                if (record.picture_file != NULL)
+                    set_contact_picture(record.contact_id, record.picture_name, record.picture_file);
+            }
+            break;
+        case PHONE_NUMBER_INSERTED:
+            insert_phone_number(record.contact_id, record.number, record.number_type,
+                record.speed_dial);
+            break;
+        case CONTACT_RENAMED:
+            update_contact_name(record.contact_id, record.name);
+            break;
+        case PICTURE_CHANGED:
+            if (record.picture_file != NULL) {
+                set_contact_picture(record.contact_id, record.picture_name, record.picture_file);
+                break;
+            }
+            q.prepare(state.db,
+                "update contact "
+                "  set picture_name = $<varchar>1 "
+                "  where id = $<integer>0 ");
+            q.param(0) = record.contact_id;
+            q.param(1) = record.picture_name;
+
+            if (DB_SUCCESS(print_error(q.execute(), q))) {
+                log_change(PICTURE_CHANGED, record.contact_id, NULL, 0,
+                    record.picture_name, NULL, HOME, 0);
+                update_card(record.contact_id, NULL, record.picture_name);
+            }
+            break;
+        case CONTACT_REMOVED:
+            remove_contact(record.contact_id);
+            break;
+        case GROUP_CREATED:
+            q.prepare(state.db,
+                "insert into contact_group (id, name) "
+                "  values ($<integer>0, $<nvarchar>1) ");
+            q.param(0) = record.group_id;
+            q.param(1) = record.name;
+
+            if (DB_SUCCESS(print_error(q.execute(), q)))
+                log_change(GROUP_CREATED, 0, record.name, 0, NULL, NULL, HOME, 0,
+                    record.group_id);
+            break;
+        case GROUP_MEMBER_ADDED:
+            add_to_group(record.contact_id, record.group_id);
+            break;
+        case GROUP_MEMBER_REMOVED:
+            remove_from_group(record.contact_id, record.group_id);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Add a contact's card, with no phone numbers yet.
+ */
+void SqlPhoneBook::insert_card(db_uint id, const wchar_t *name, db_uint ring_id,
+    const char *picture_name)
+{
+    Query q;
+
+    if (!state.contact_cards)
+        return;
+
+    if (picture_name != NULL) {
+        q.prepare(state.db,
+            "insert into contact_card (id, name, ring_id, picture_name, number_count, numbers) "
+            "  values ($<integer>0, $<nvarchar>1, $<integer>2, $<varchar>3, 0, '') ");
+        q.param(3) = picture_name;
+    } else {
+        q.prepare(state.db,
+            "insert into contact_card (id, name, ring_id, number_count, numbers) "
+            "  values ($<integer>0, $<nvarchar>1, $<integer>2, 0, '') ");
+    }
+    q.param(0) = id;
+    q.param(1) = name;
+    q.param(2) = ring_id;
+    print_error(q.execute(), q);
+}
+
+/**
+ * Copy a contact's new name or picture name, whichever is not NULL, to
+ * its card.
+ */
+void SqlPhoneBook::update_card(db_uint id, const wchar_t *name, const char *picture_name)
+{
+    Query q;
+
+    if (!state.contact_cards)
+        return;
+
+    if (name != NULL) {
+        q.prepare(state.db,
+            "update contact_card "
+            "  set name = $<nvarchar>1 "
+            "  where id = $<integer>0 ");
+        q.param(0) = id;
+        q.param(1) = name;
+        print_error(q.execute(), q);
+    }
+    if (picture_name != NULL) {
+        q.prepare(state.db,
+            "update contact_card "
+            "  set picture_name = $<varchar>1 "
+            "  where id = $<integer>0 ");
+        q.param(0) = id;
+        q.param(1) = picture_name;
+        print_error(q.execute(), q);
+    }
+}
+
+/**
+ * Add a phone number to a contact's card. Once the numbers no longer fit,
+ * the card's numbers are set to null and read from the "phone_number"
+ * table instead.
+ */
+void SqlPhoneBook::add_card_number(db_uint id, const char *number, PhoneNumberType type,
+    db_sint speed_dial)
+{
+    Query       q;
+    CardNumbers numbers;
+    db_uint     count;
+    bool        fits = false;
+
+    if (!state.contact_cards)
+        return;
+
+    q.prepare(state.db, "select number_count, numbers from contact_card where id = $<integer>0");
+    q.param(0) = id;
+    if  (DB_FAILED(print_error(q.execute(), q)) || q.seek_first() != DB_NOERROR || q.is_eof())
+        return;
+
+    count = q[0].as_int();
+    if (!q[1].is_null())
+        fits = numbers.assign(q[1].as_string().c_str()) && numbers.insert(number, type, speed_dial);
+
+    if (fits) {
+        q.prepare(state.db,
+            "update contact_card "
+            "  set number_count = $<integer>1, numbers = $<varchar>2 "
+            "  where id = $<integer>0 ");
+        q.param(2) = numbers.c_str();
+    } else {
+        q.prepare(state.db,
+            "update contact_card "
+            "  set number_count = $<integer>1, numbers = null "
+            "  where id = $<integer>0 ");
+    }
+    q.param(0) = id;
+    q.param(1) = count + 1;
+    print_error(q.execute(), q);
+}
+
+/**
+ * Remove a contact's card.
+ */
+void SqlPhoneBook::remove_card(db_uint id)
+{
+    Query q;
+
+    if (!state.contact_cards)
+        return;
+
+    q.prepare(state.db,
+        "delete from contact_card "
+        "  where id = $<integer>0 ");
+    q.param(0) = id;
+    print_error(q.execute(), q);
+}
+
+/**
+ * Draw from the contact id sequence until it has passed an id assigned
+ * elsewhere, so that insert_contact() never issues it again. An id from a
+ * block reserves its whole block.
+ */
+void SqlPhoneBook::reserve_contact_id(db_uint id)
+{
+    Sequence    id_sequence;
+    db_uint     next = 0;
+
+    if (id >= CONTACT_ID_BLOCK_BASE) {
+        id_sequence.open(state.db, "contact_id_block");
+        id = (id - CONTACT_ID_BLOCK_BASE) >> CONTACT_ID_BLOCK_BITS;
+    } else {
+        id_sequence.open(state.db, "contact_id");
+    }
+    while (next < id && DB_SUCCESS(print_error(id_sequence.get_next_value(next))))
+        ;
+    id_sequence.close();
+}
+
+/**
+ * Create a contact group.
+ *
+ * @return the new group id, or 0 on failure
+ */
+db_uint SqlPhoneBook::create_group(const wchar_t *name)
+{
+    TRACE_SPAN("create_group");
+    Query   q;
+    db_uint id = GROUP_FAVORITES;
+
+    //-------------------------------------------------------------------
+    // Group ids follow the largest id in use.
+    //-------------------------------------------------------------------
+    if  (DB_SUCCESS(print_error(q.exec_direct(state.db,
+            "select max(id), count(*) from contact_group"), q)) &&
+         q.seek_first() == DB_NOERROR && q[1].as_int() != 0)
+        id = q[0].as_int() + 1;
+
+    q.prepare(state.db,
+        "insert into contact_group (id, name) "
+        "  values ($<integer>0, $<nvarchar>1) ");
+    q.param(0) = id;
+    q.param(1) = name;
+
+    if (DB_FAILED(print_error(q.execute(), q)))
+        return 0;
+
+    log_change(GROUP_CREATED, 0, name, 0, NULL, NULL, HOME, 0, id);
+    return id;
+}
+
+/**
+ * Add a contact to a group. Adding a contact that is already a member
+ * has no effect.
+ */
+void SqlPhoneBook::add_to_group(db_uint contact_id, db_uint group_id)
+{
+    TRACE_SPAN("add_to_group");
+    Query q;
+
+    q.prepare(state.db,
+        "select count(*) from group_member "
+        "  where contact_id = $<integer>0 and group_id = $<integer>1 ");
+    q.param(0) = contact_id;
+    q.param(1) = group_id;
+
+    if  (DB_FAILED(print_error(q.execute(), q)) ||
+         q.seek_first() != DB_NOERROR || q[0].as_int() != 0)
+        return;
+
+    q.prepare(state.db,
+        "insert into group_member (group_id, contact_id) "
+        "  values ($<integer>0, $<integer>1) ");
+    q.param(0) = group_id;
+    q.param(1) = contact_id;
+
+    if (DB_SUCCESS(print_error(q.execute(), q))) {
+        log_change(GROUP_MEMBER_ADDED, contact_id, NULL, 0, NULL, NULL, HOME, 0, group_id);
+
+        if (state.contact_index_loaded) {
+            ContactBitmap *contacts = state.group_index.get(group_id);
+
+            if (contacts == NULL || DB_FAILED(contacts->add(contact_id)))
+                state.contact_index_loaded = false;
+        }
+    }
+}
+
+/**
+ * Remove a contact from a group.
+ */
+void SqlPhoneBook::remove_from_group(db_uint contact_id, db_uint group_id)
+{
+    TRACE_SPAN("remove_from_group");
+    Query q;
+
+    q.prepare(state.db,
+        "select count(*) from group_member "
+        "  where contact_id = $<integer>0 and group_id = $<integer>1 ");
+    q.param(0) = contact_id;
+    q.param(1) = group_id;
+
+    if  (DB_FAILED(print_error(q.execute(), q)) ||
+         q.seek_first() != DB_NOERROR || q[0].as_int() == 0)
+        return;
+
+    q.prepare(state.db,
+        "delete from group_member "
+        "  where contact_id = $<integer>0 and group_id = $<integer>1 ");
+    q.param(0) = contact_id;
+    q.param(1) = group_id;
+
+    if (DB_SUCCESS(print_error(q.execute(), q))) {
+        log_change(GROUP_MEMBER_REMOVED, contact_id, NULL, 0, NULL, NULL, HOME, 0, group_id);
+
+        ContactBitmap *contacts = state.group_index.get(group_id);
+        if (contacts != NULL)
+            contacts->remove(contact_id);
+    }
+}
+
+/**
+ * Build the in-memory bitmap indexes from the group_member and
+ * phone_number tables. The indexes remember the change log position they
+ * reflect, so a change made by another connection causes a reload.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::load_contact_index()
+{
+    TRACE_SPAN("load_contact_index");
+    Query           q;
+    ContactBitmap   *contacts = NULL;
+    db_uint         key = 0;
+    int             rc;
+
+    state.contact_index_loaded = false;
+    state.group_index.clear();
+    state.number_type_index.clear();
+
+    //-------------------------------------------------------------------
+    // Members arrive grouped by group id, so look up each bitmap once.
+    //-------------------------------------------------------------------
+    if  (DB_SUCCESS(rc = print_error(q.exec_direct(state.db,
+            "select group_id, contact_id from group_member order by group_id"), q))) {
+        IntegerField    group_id    (q, "group_id");
+        IntegerField    contact_id  (q, "contact_id");
+
+        for (q.seek_first(); DB_SUCCESS(rc) && !q.is_eof(); q.seek_next()) {
+            if (contacts == NULL || key != (db_uint) group_id) {
+                key = group_id;
+                contacts = state.group_index.get(key);
+            }
+            rc = contacts != NULL ? contacts->add(contact_id) : DB_ENOMEM;
+        }
+    }
+
+    contacts = NULL;
+    if  (DB_SUCCESS(rc) && DB_SUCCESS(rc = print_error(q.exec_direct(state.db,
+            "select type, contact_id from phone_number order by type"), q))) {
+        IntegerField    type        (q, "type");
+        IntegerField    contact_id  (q, "contact_id");
+
+        for (q.seek_first(); DB_SUCCESS(rc) && !q.is_eof(); q.seek_next()) {
+            if (contacts == NULL || key != (db_uint) type) {
+                key = type;
+                contacts = state.number_type_index.get(key);
+            }
+            rc = contacts != NULL ? contacts->add(contact_id) : DB_ENOMEM;
+        }
+    }
+
+    if (DB_SUCCESS(rc)) {
+        state.contact_index_seq = last_change_seq();
+        state.contact_index_loaded = true;
+    } else {
+        state.group_index.clear();
+        state.number_type_index.clear();
+    }
+
+    return rc;
+}
+
+/**
+ * Reload the bitmap indexes unless they already reflect the newest change.
+ * Without the change log there is no way to tell whether another
+ * connection changed the tables, so the indexes are reloaded every time.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::refresh_contact_index()
+{
+    if (state.contact_index_loaded && state.log_changes && last_change_seq() == state.contact_index_seq)
+        return DB_NOERROR;
+
+    return load_contact_index();
+}
+
+/**
+ * Find the members of a group, replacing the contents of contacts.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::get_group_members(db_uint group_id, ContactBitmap &contacts)
+{
+    int rc = refresh_contact_index();
+    const ContactBitmap *members = state.group_index.find(group_id);
+
+    if (DB_FAILED(rc))
+        return rc;
+
+    if (members == NULL) {
+        contacts.clear();
+        return DB_NOERROR;
+    }
+
+    return contacts.assign(*members);
+}
+
+/**
+ * Find the contacts with at least one phone number of a type, replacing
+ * the contents of contacts.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::get_contacts_with_number_type(PhoneNumberType type, ContactBitmap &contacts)
+{
+    int rc = refresh_contact_index();
+    const ContactBitmap *matches = state.number_type_index.find(type);
+
+    if (DB_FAILED(rc))
+        return rc;
+
+    if (matches == NULL) {
+        contacts.clear();
+        return DB_NOERROR;
+    }
+
+    return contacts.assign(*matches);
+}
+
+/**
+ * Read the contacts in a bitmap with their phone numbers, in id order,
+ * replacing the contents of results. Each contact is found by its primary
+ * key, so contacts outside the bitmap are never read.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::get_contacts(const ContactBitmap &ids, ContactResults &results)
+{
+    TRACE_SPAN("get_contacts by id");
+    Query   contact;
+    Query   numbers;
+    int     rc;
+
+    results.clear();
+
+    //-------------------------------------------------------------------
+    // Prepare once, then execute for each contact id in the bitmap. With
+    // contact cards, numbers are only read for cards they did not fit on.
+    //-------------------------------------------------------------------
+    if  (DB_SUCCESS(rc = print_error(contact.prepare(state.db, state.contact_cards ?
+            "select name, ring_id, picture_name, numbers from contact_card "
+            "  where id = $<integer>0 " :
+            "select name, ring_id, picture_name from contact "
+            "  where id = $<integer>0 "), contact)) &&
+         DB_SUCCESS(rc = print_error(numbers.prepare(state.db,
+            "select number, type, speed_dial from phone_number "
+            "  where contact_id = $<integer>0 "
+            "  order by type"), numbers))) {
+        for (db_uint id = 0; DB_SUCCESS(rc) && ids.find_next(id); id++) {
+            contact.param(0) = id;
+            if  (DB_FAILED(rc = print_error(contact.execute(), contact)))
+                break;
+            if  (contact.seek_first() != DB_NOERROR || contact.is_eof())
+                continue;
+
+            String picture_name = contact[2].as_string();
+
+            rc = results.add_contact(id, contact[0].as_wstring().c_str(),
+                !contact[1].is_null(), contact[1].as_int(),
+                contact[2].is_null() ? NULL : picture_name.c_str());
+
+            if  (DB_SUCCESS(rc) && state.contact_cards) {
+                String encoded = contact[3].as_string();
+
+                rc = add_card_numbers(contact[3].is_null() ? NULL : encoded.c_str(), id, numbers, results);
+            } else if (DB_SUCCESS(rc)) {
+                rc = add_phone_numbers(numbers, id, results);
+            }
+        }
+    }
+
+    results.finish();
+    return rc;
+}
+
+/**
+ * Read the members of a group with their phone numbers, replacing the
+ * contents of results. When number_type is not negative, only members
+ * with a phone number of that type are read.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::get_group_contacts(db_uint group_id, int number_type, ContactResults &results)
+{
+    TRACE_SPAN("get_group_contacts");
+    ContactBitmap contacts;
+    int rc = get_group_members(group_id, contacts);
+
+    if (DB_SUCCESS(rc) && number_type >= 0) {
+        const ContactBitmap *matches = state.number_type_index.find(number_type);
+
+        if (matches != NULL)
+            rc = contacts.intersect(*matches);
+        else
+            contacts.clear();
+    }
+
+    if (DB_FAILED(rc)) {
+        results.clear();
+        results.finish();
+        return rc;
+    }
+
+    return get_contacts(contacts, results);
+}
+
+/**
+ * Read a counter from the "statistic" table. A counter that has never
+ * been changed reads as 0.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::read_stat(db_uint id, db_sint &value)
+{
+    Query   q;
+    int     rc;
+
+    q.prepare(state.db, "select value from statistic where id = $<integer>0");
+    q.param(0) = id;
+
+    value = 0;
+    if  (DB_SUCCESS(rc = print_error(q.execute(), q)) && q.seek_first() == DB_NOERROR && !q.is_eof())
+        value = q[0].as_int();
+
+    return rc;
+}
+
+/**
+ * Add to a counter in the "statistic" table, in the same transaction as
+ * the change it counts.
+ *
+ * @return database error code
+ *
+ * Demonstrates:
+ * - updating a row, or inserting it if it does not exist
+ */
+int SqlPhoneBook::add_stat(db_uint id, db_sint delta)
+{
+    TRACE_SPAN("add_stat");
+    Query   q;
+    db_sint value;
+    int     rc;
+
+    q.prepare(state.db, "select value from statistic where id = $<integer>0");
+    q.param(0) = id;
+
+    if  (DB_FAILED(rc = print_error(q.execute(), q)))
+        return rc;
+
+    if  (q.seek_first() == DB_NOERROR && !q.is_eof()) {
+        value = q[0].as_int();
+        q.prepare(state.db,
+            "update statistic "
+            "  set value = $<integer>1 "
+            "  where id = $<integer>0 ");
+        q.param(1) = value + delta;
+    } else {
+        q.prepare(state.db,
+            "insert into statistic (id, value) "
+            "  values ($<integer>0, $<integer>1) ");
+        q.param(1) = delta;
+    }
+    q.param(0) = id;
+
+    return print_error(q.execute(), q);
+}
+
+/**
+ * Count a contact being inserted (delta 1) or removed (delta -1).
+ */
+void SqlPhoneBook::count_contact(db_uint ring_id, bool has_picture, db_sint delta)
+{
+    add_stat(StatRow::id(StatRow::CONTACTS, 0), delta);
+    add_stat(StatRow::id(StatRow::RING_ID, ring_id), delta);
+    if (has_picture)
+        add_stat(StatRow::id(StatRow::PICTURES, 0), delta);
+}
+
+/**
+ * Read the phone book counters. Each is a single primary key lookup, so
+ * the cost does not grow with the number of contacts.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::get_stats(Stats &stats)
+{
+    TRACE_SPAN("get_stats");
+    db_sint value;
+    int     rc;
+
+    rc = read_stat(StatRow::id(StatRow::CONTACTS, 0), value);
+    stats.contacts = value;
+    if (DB_SUCCESS(rc))
+        rc = read_stat(StatRow::id(StatRow::PICTURES, 0), value);
+    stats.contacts_with_picture = value;
+    for (int type = HOME; type <= PAGER; type++) {
+        value = 0;
+        if (DB_SUCCESS(rc))
+            rc = read_stat(StatRow::id(StatRow::NUMBERS, type), value);
+        stats.numbers[type] = value;
+    }
+
+    return rc;
+}
+
+/**
+ * Read the number of contacts using a ring id.
+ *
+ * @return database error code
+ */
+int SqlPhoneBook::get_ring_id_contacts(db_uint ring_id, db_uint &count)
+{
+    db_sint value;
+    int     rc = read_stat(StatRow::id(StatRow::RING_ID, ring_id), value);
+
+    count = value;
+    return rc;
+}
+
+/**
+ * Report a counter whose stored value differs from its recomputed value.
+ */
+static void check_stat(const char *counter, db_uint key, db_sint stored, db_sint actual,
+    db_uint &drift)
+{
+    if (stored != actual) {
+        cerr << "Counter " << counter << " " << (unsigned long) key << ": stored "
+             << (long) stored << ", actual " << (long) actual << endl;
+        drift++;
+    }
+}
+
+/**
+ * Recompute every counter from the contact and phone_number tables and
+ * compare it with the stored value. Each difference is printed.
+ *
+ * @param drift the number of counters that differ
+ * @return database error code
+ *
+ * Demonstrates:
+ * - aggregate queries
+ * - merging two sorted result sets
+ */
+int SqlPhoneBook::verify_stats(db_uint &drift)
+{
+    TRACE_SPAN("verify_stats");
+    Query   counts;
+    Query   stat;
+    db_sint contacts = 0;
+    db_sint pictures = 0;
+    db_sint numbers[PAGER + 1] = { 0 };
+    db_sint stored;
+    int     rc;
+
+    drift = 0;
+
+    //-------------------------------------------------------------------
+    // Merge the contact count of each ring id with the ring id counters.
+    // Both are in ring id order.
+    //-------------------------------------------------------------------
+    if  (DB_FAILED(rc = print_error(counts.exec_direct(state.db,
+            "select ring_id, count(*), count(picture_hash) from contact "
+            "  group by ring_id "
+            "  order by ring_id"), counts)))
+        return rc;
+
+    stat.prepare(state.db,
+        "select id, value from statistic "
+        "  where id >= $<integer>0 "
+        "  order by id");
+    stat.param(0) = StatRow::id(StatRow::RING_ID, 0);
+    if  (DB_FAILED(rc = print_error(stat.execute(), stat)))
+        return rc;
+
+    counts.seek_first();
+    stat.seek_first();
+    for (;;) {
+        bool    more = !counts.is_eof();
+        db_uint ring_id = 0;
+        db_sint actual = 0;
+
+        if (more) {
+            ring_id = counts[0].as_int() & StatRow::KEY_MASK;
+            actual = counts[1].as_int();
+            contacts += actual;
+            pictures += counts[2].as_int();
+            counts.seek_next();
+        }
+
+        // Counters for ring ids that no contact uses
+        for (; !stat.is_eof() &&
+                (!more || (stat[0].as_int() & StatRow::KEY_MASK) < ring_id);
+                stat.seek_next())
+            check_stat("ring_id", stat[0].as_int() & StatRow::KEY_MASK, stat[1].as_int(), 0, drift);
+        if (!more)
+            break;
+
+        stored = 0;
+        if (!stat.is_eof() && (stat[0].as_int() & StatRow::KEY_MASK) == ring_id) {
+            stored = stat[1].as_int();
+            stat.seek_next();
+        }
+        check_stat("ring_id", ring_id, stored, actual, drift);
+    }
+
+    if  (DB_FAILED(rc = print_error(counts.exec_direct(state.db,
+            "select type, count(*) from phone_number group by type"), counts)))
+        return rc;
+    for (counts.seek_first(); !counts.is_eof(); counts.seek_next()) {
+        if ((db_uint) counts[0].as_int() <= PAGER)
+            numbers[counts[0].as_int()] = counts[1].as_int();
+    }
+
+    if (DB_SUCCESS(rc = read_stat(StatRow::id(StatRow::CONTACTS, 0), stored)))
+        check_stat("contacts", 0, stored, contacts, drift);
+    if (DB_SUCCESS(rc) && DB_SUCCESS(rc = read_stat(StatRow::id(StatRow::PICTURES, 0), stored)))
+        check_stat("pictures", 0, stored, pictures, drift);
+    for (int type = HOME; DB_SUCCESS(rc) && type <= PAGER; type++) {
+        if (DB_SUCCESS(rc = read_stat(StatRow::id(StatRow::NUMBERS, type), stored)))
+            check_stat("numbers", type, stored, numbers[type], drift);
+    }
+
+    return rc;
+}
+
+/**
+ * Deliver committed changes to a subscriber, coalesced per contact, from
+ * now on. Call outside a transaction.
+ */
+void SqlPhoneBook::subscribe(ChangeSubscriber &subscriber, const SubscriptionOptions &options)
+{
+    state.notifier.subscribe(*this, subscriber, options);
+}
+
+void SqlPhoneBook::unsubscribe(ChangeSubscriber &subscriber)
+{
+    state.notifier.unsubscribe(subscriber);
+}
+
+/**
+ * Deliver events whose coalescing window has passed since the last
+ * commit, and changes committed by other connections. Call outside a
+ * transaction.
+ */
+void SqlPhoneBook::poll_subscriptions()
+{
+    state.notifier.poll(*this);
+}
+
+/**
+ * Start transaction
+ */
+void SqlPhoneBook::tx_start()
+{
+    Query q;
+    // Equivalent to: db.tx_begin();
+    print_error(q.exec_direct(state.db, "start transaction"), q);
+}
+
+/**
+ * Start read-only snapshot transaction
+ */
+void SqlPhoneBook::tx_start_snapshot()
+{
+    // The isolation level is chosen through the database API; a plain
+    // "start transaction" would take read locks
+    print_error(state.db.tx_begin(SNAPSHOT_TX_MODE));
 }
 
 /**
  * Commit transaction
  */
-void PhoneBook::tx_commit()
+void SqlPhoneBook::tx_commit()
 {
+    TRACE_SPAN("tx_commit");
     Query q;
     // Equivalent to: db.tx_commit();
-    print_error(q.exec_direct(db, "commit"), q);
+    if (DB_SUCCESS(print_error(q.exec_direct(state.db, "commit"), q)))
+        state.notifier.poll(*this);
 }
 
@@ -0,0 +1,954 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Recording PhoneBook calls to a binary trace, and reading them back
+ */
+
+#include "phonebook_trace.h"
+
+#include <string.h>
+
+#include <chrono>
+
+const char *const trace_op_names[TRACE_OP_COUNT] = {
+    "insert_contact",
+    "insert_phone_number",
+    "update_contact_name",
+    "update_contact_picture",
+    "remove_contact",
+    "list_contacts_brief",
+    "list_contacts",
+    "get_contacts_brief",
+    "get_contacts",
+    "get_picture_name",
+    "export_picture",
+    "get_picture_stats",
+    "set_picture_compression",
+    "changes_since",
+    "compact_change_log",
+    "last_change_seq",
+    "set_change_logging",
+    "get_contact_id_range",
+    "visit_contacts",
+    "find_phone_numbers",
+    "apply_change",
+    "create_group",
+    "add_to_group",
+    "remove_from_group",
+    "get_group_members",
+    "get_contacts_with_number_type",
+    "get_contacts_by_id",
+    "get_group_contacts",
+    "get_stats",
+    "get_ring_id_contacts",
+    "verify_stats",
+    "tx_start",
+    "tx_commit",
+    "visit_groups",
+    "set_id_block_size",
+    "search_by_number_suffix",
+    "tx_start_snapshot",
+    "set_memory_storage_size",
+};
+
+const char *const trace_signatures[TRACE_OP_COUNT] = {
+    "wuccu",        // name, ring_id, picture_name, picture_file; new id
+    "ucus",         // contact_id, number, type, speed_dial
+    "uw",           // id, newname
+    "uc",           // contact_id, picture_name
+    "u",            // id
+    "",
+    "s",            // sort
+    "",
+    "s",            // sort
+    "u",            // id
+    "uc",           // id, file_name (NULL for a FILE)
+    "",
+    "u",            // enable
+    "u",            // seq
+    "u",            // through_seq
+    "",
+    "u",            // enable
+    "",
+    "uu",           // first_id, last_id
+    "c",            // number
+    "uuuwuccusu",   // seq, type, contact_id, name, ring_id, picture_name,
+                    // number, number_type, speed_dial, group_id
+    "wu",           // name; new id
+    "uu",           // contact_id, group_id
+    "uu",           // contact_id, group_id
+    "u",            // group_id
+    "u",            // type
+    "b",            // ids
+    "us",           // group_id, number_type
+    "",
+    "u",            // ring_id
+    "",
+    "",
+    "",
+    "",
+    "u",            // size
+    "cu",           // digits, limit
+    "",
+    "u",            // size
+};
+
+static db_uint steady_us()
+{
+    return (db_uint) std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//=======================================================================
+// TraceWriter
+//=======================================================================
+
+TraceWriter::TraceWriter()
+    : file(NULL)
+    , origin_us(0)
+    , last_start_us(0)
+{
+}
+
+TraceWriter::~TraceWriter()
+{
+    close();
+}
+
+/**
+ * Create a trace file, replacing any existing file.
+ *
+ * @return database error code
+ */
+int TraceWriter::open(const char *file_name)
+{
+    close();
+
+    if ((file = fopen(file_name, "wb")) == NULL)
+        return DB_EIO;
+    if (fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, file) != TRACE_MAGIC_SIZE) {
+        close();
+        return DB_EIO;
+    }
+
+    origin_us = steady_us();
+    last_start_us = 0;
+    return DB_NOERROR;
+}
+
+/**
+ * Close the trace file.
+ *
+ * @return database error code
+ */
+int TraceWriter::close()
+{
+    int rc = DB_NOERROR;
+
+    if (file != NULL && fclose(file) != 0)
+        rc = DB_EIO;
+    file = NULL;
+    return rc;
+}
+
+db_uint TraceWriter::now_us() const
+{
+    return steady_us() - origin_us;
+}
+
+bool TraceWriter::begin(TraceOp op, db_uint start_us)
+{
+    if (file == NULL)
+        return false;
+
+    record.clear();
+    put_byte((unsigned char) op);
+    put_uint(start_us - last_start_us);
+    put_uint(now_us() - start_us);
+    last_start_us = start_us;
+    return true;
+}
+
+/* Seven bits per byte, low bits first; the high bit marks a continuation. */
+void TraceWriter::put_uint(db_uint value)
+{
+    while (value >= 0x80) {
+        put_byte((unsigned char) (value | 0x80));
+        value >>= 7;
+    }
+    put_byte((unsigned char) value);
+}
+
+/* Zigzag encoding keeps small negative numbers short. */
+void TraceWriter::put_sint(db_sint value)
+{
+    put_uint(((db_uint) value << 1) ^ (db_uint) (value >> 63));
+}
+
+/* The length is stored plus one, so 0 stands for NULL. */
+void TraceWriter::put_string(const char *value)
+{
+    if (value == NULL) {
+        put_uint(0);
+    } else {
+        size_t length = strlen(value);
+
+        put_uint(length + 1);
+        record.insert(record.end(), value, value + length);
+    }
+}
+
+void TraceWriter::put_wstring(const wchar_t *value)
+{
+    if (value == NULL) {
+        put_uint(0);
+    } else {
+        size_t length = wcslen(value);
+
+        put_uint(length + 1);
+        for (size_t i = 0; i < length; i++)
+            put_uint((db_uint) (unsigned) value[i]);
+    }
+}
+
+/* The number of ids, then each id as the difference from the last. */
+void TraceWriter::put_contacts(const ContactBitmap &contacts)
+{
+    db_uint last = 0;
+
+    put_uint(contacts.cardinality());
+    for (db_uint id = 0; contacts.find_next(id); id++) {
+        put_uint(id - last);
+        last = id;
+    }
+}
+
+/**
+ * Write the record started by begin().
+ *
+ * @return database error code
+ */
+int TraceWriter::end()
+{
+    if (file == NULL)
+        return DB_EINVAL;
+    if (fwrite(&record[0], 1, record.size(), file) != record.size())
+        return DB_EIO;
+    return DB_NOERROR;
+}
+
+//=======================================================================
+// TraceReader
+//=======================================================================
+
+TraceReader::TraceReader()
+    : file(NULL)
+    , last_start_us(0)
+{
+}
+
+TraceReader::~TraceReader()
+{
+    close();
+}
+
+/**
+ * Open a trace file and check its format.
+ *
+ * @return database error code
+ */
+int TraceReader::open(const char *file_name)
+{
+    char magic[TRACE_MAGIC_SIZE];
+
+    close();
+
+    if ((file = fopen(file_name, "rb")) == NULL)
+        return DB_ENOENT;
+    if (fread(magic, 1, TRACE_MAGIC_SIZE, file) != TRACE_MAGIC_SIZE ||
+            memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+        close();
+        return DB_EINVAL;
+    }
+
+    last_start_us = 0;
+    return DB_NOERROR;
+}
+
+void TraceReader::close()
+{
+    if (file != NULL)
+        fclose(file);
+    file = NULL;
+}
+
+bool TraceReader::get_uint(db_uint &value)
+{
+    int byte;
+
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if ((byte = getc(file)) == EOF)
+            return false;
+        value |= (db_uint) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool TraceReader::get_string(int arg, TraceCall &call)
+{
+    std::vector<char> &data = string_data[arg];
+    db_uint length;
+
+    call.strings[arg] = NULL;
+    if (!get_uint(length))
+        return false;
+    if (length-- == 0)
+        return true;
+
+    data.resize(length + 1);
+    if (length > 0 && fread(&data[0], 1, length, file) != length)
+        return false;
+    data[length] = '\0';
+    call.strings[arg] = &data[0];
+    return true;
+}
+
+bool TraceReader::get_wstring(int arg, TraceCall &call)
+{
+    std::vector<wchar_t> &data = wstring_data[arg];
+    db_uint length;
+    db_uint c;
+
+    call.wstrings[arg] = NULL;
+    if (!get_uint(length))
+        return false;
+    if (length-- == 0)
+        return true;
+
+    data.resize(length + 1);
+    for (db_uint i = 0; i < length; i++) {
+        if (!get_uint(c))
+            return false;
+        data[i] = (wchar_t) c;
+    }
+    data[length] = L'\0';
+    call.wstrings[arg] = &data[0];
+    return true;
+}
+
+bool TraceReader::get_contacts(TraceCall &call)
+{
+    db_uint count;
+    db_uint id = 0;
+    db_uint delta;
+
+    call.contacts.clear();
+    if (!get_uint(count))
+        return false;
+    for (db_uint i = 0; i < count; i++) {
+        if (!get_uint(delta) || DB_FAILED(call.contacts.add(id += delta)))
+            return false;
+    }
+    return true;
+}
+
+bool TraceReader::next(TraceCall &call)
+{
+    int op;
+    db_uint delta;
+    db_uint value;
+
+    if (file == NULL || (op = getc(file)) == EOF || op >= TRACE_OP_COUNT)
+        return false;
+    if (!get_uint(delta) || !get_uint(call.duration_us))
+        return false;
+
+    call.op = (TraceOp) op;
+    call.start_us = last_start_us += delta;
+
+    const char *signature = trace_signatures[op];
+    for (int arg = 0; signature[arg] != '\0'; arg++) {
+        bool ok = false;
+
+        switch (signature[arg]) {
+            case 'u':
+                ok = get_uint(call.uints[arg]);
+                break;
+            case 's':
+                ok = get_uint(value);
+                call.sints[arg] = (db_sint) (value >> 1) ^ -(db_sint) (value & 1);
+                break;
+            case 'c':
+                ok = get_string(arg, call);
+                break;
+            case 'w':
+                ok = get_wstring(arg, call);
+                break;
+            case 'b':
+                ok = get_contacts(call);
+                break;
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+//=======================================================================
+// PhoneBookRecorder
+//=======================================================================
+
+PhoneBookRecorder::PhoneBookRecorder(PhoneBook &pbook)
+    : pbook(pbook)
+{
+}
+
+/**
+ * Start recording calls to a new trace file.
+ *
+ * @return database error code
+ */
+int PhoneBookRecorder::start(const char *trace_file)
+{
+    return trace.open(trace_file);
+}
+
+/**
+ * Stop recording and close the trace file.
+ *
+ * @return database error code
+ */
+int PhoneBookRecorder::stop()
+{
+    return trace.close();
+}
+
+int PhoneBookRecorder::open_database(int file_mode, const char* database_name)
+{
+    return pbook.open_database(file_mode, database_name);
+}
+
+int PhoneBookRecorder::create_database(int file_mode, const char* database_name)
+{
+    return pbook.create_database(file_mode, database_name);
+}
+
+int PhoneBookRecorder::close_database()
+{
+    return pbook.close_database();
+}
+
+db_uint PhoneBookRecorder::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name)
+{
+    return insert_contact(name, ring_id, picture_name, picture_name);
+}
+
+db_uint PhoneBookRecorder::insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+    const char *picture_file)
+{
+    db_uint start = trace.now_us();
+    db_uint id = pbook.insert_contact(name, ring_id, picture_name, picture_file);
+
+    if (trace.begin(TRACE_INSERT_CONTACT, start)) {
+        trace.put_wstring(name);
+        trace.put_uint(ring_id);
+        trace.put_string(picture_name);
+        trace.put_string(picture_file);
+        trace.put_uint(id);
+        trace.end();
+    }
+    return id;
+}
+
+void PhoneBookRecorder::insert_phone_number(db_uint contact_id, const char *number,
+    PhoneBook::PhoneNumberType type, db_sint speed_dial)
+{
+    db_uint start = trace.now_us();
+
+    pbook.insert_phone_number(contact_id, number, type, speed_dial);
+    if (trace.begin(TRACE_INSERT_PHONE_NUMBER, start)) {
+        trace.put_uint(contact_id);
+        trace.put_string(number);
+        trace.put_uint(type);
+        trace.put_sint(speed_dial);
+        trace.end();
+    }
+}
+
+void PhoneBookRecorder::update_contact_name(db_uint id, const wchar_t *newname)
+{
+    db_uint start = trace.now_us();
+
+    pbook.update_contact_name(id, newname);
+    if (trace.begin(TRACE_UPDATE_CONTACT_NAME, start)) {
+        trace.put_uint(id);
+        trace.put_wstring(newname);
+        trace.end();
+    }
+}
+
+void PhoneBookRecorder::update_contact_picture(db_uint contact_id, const char *picture_name)
+{
+    db_uint start = trace.now_us();
+
+    pbook.update_contact_picture(contact_id, picture_name);
+    if (trace.begin(TRACE_UPDATE_CONTACT_PICTURE, start)) {
+        trace.put_uint(contact_id);
+        trace.put_string(picture_name);
+        trace.end();
+    }
+}
+
+void PhoneBookRecorder::remove_contact(db_uint id)
+{
+    db_uint start = trace.now_us();
+
+    pbook.remove_contact(id);
+    if (trace.begin(TRACE_REMOVE_CONTACT, start)) {
+        trace.put_uint(id);
+        trace.end();
+    }
+}
+
+void PhoneBookRecorder::list_contacts_brief()
+{
+    db_uint start = trace.now_us();
+
+    pbook.list_contacts_brief();
+    if (trace.begin(TRACE_LIST_CONTACTS_BRIEF, start))
+        trace.end();
+}
+
+void PhoneBookRecorder::list_contacts(int sort)
+{
+    db_uint start = trace.now_us();
+
+    pbook.list_contacts(sort);
+    if (trace.begin(TRACE_LIST_CONTACTS, start)) {
+        trace.put_sint(sort);
+        trace.end();
+    }
+}
+
+int PhoneBookRecorder::get_contacts_brief(PhoneBook::ContactResults &results)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.get_contacts_brief(results);
+
+    if (trace.begin(TRACE_GET_CONTACTS_BRIEF, start))
+        trace.end();
+    return rc;
+}
+
+int PhoneBookRecorder::get_contacts(int sort, PhoneBook::ContactResults &results)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.get_contacts(sort, results);
+
+    if (trace.begin(TRACE_GET_CONTACTS, start)) {
+        trace.put_sint(sort);
+        trace.end();
+    }
+    return rc;
+}
+
+db::String PhoneBookRecorder::get_picture_name(db_uint id)
+{
+    db_uint start = trace.now_us();
+    db::String picture_name = pbook.get_picture_name(id);
+
+    if (trace.begin(TRACE_GET_PICTURE_NAME, start)) {
+        trace.put_uint(id);
+        trace.end();
+    }
+    return picture_name;
+}
+
+const char *PhoneBookRecorder::get_picture_name(db_uint id, ResultArena &arena)
+{
+    db_uint start = trace.now_us();
+    const char *picture_name = pbook.get_picture_name(id, arena);
+
+    if (trace.begin(TRACE_GET_PICTURE_NAME, start)) {
+        trace.put_uint(id);
+        trace.end();
+    }
+    return picture_name;
+}
+
+void PhoneBookRecorder::export_picture(db_uint id, const char *file_name)
+{
+    db_uint start = trace.now_us();
+
+    pbook.export_picture(id, file_name);
+    if (trace.begin(TRACE_EXPORT_PICTURE, start)) {
+        trace.put_uint(id);
+        trace.put_string(file_name);
+        trace.end();
+    }
+}
+
+int PhoneBookRecorder::export_picture(db_uint id, FILE *picture_file)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.export_picture(id, picture_file);
+
+    if (trace.begin(TRACE_EXPORT_PICTURE, start)) {
+        trace.put_uint(id);
+        trace.put_string(NULL);
+        trace.end();
+    }
+    return rc;
+}
+
+void PhoneBookRecorder::get_picture_stats(PhoneBook::PictureStats &stats)
+{
+    db_uint start = trace.now_us();
+
+    pbook.get_picture_stats(stats);
+    if (trace.begin(TRACE_GET_PICTURE_STATS, start))
+        trace.end();
+}
+
+void PhoneBookRecorder::set_picture_compression(bool enable)
+{
+    db_uint start = trace.now_us();
+
+    pbook.set_picture_compression(enable);
+    if (trace.begin(TRACE_SET_PICTURE_COMPRESSION, start)) {
+        trace.put_uint(enable);
+        trace.end();
+    }
+}
+
+bool PhoneBookRecorder::changes_since(db_uint seq, PhoneBook::ChangeVisitor &visitor)
+{
+    db_uint start = trace.now_us();
+    bool complete = pbook.changes_since(seq, visitor);
+
+    if (trace.begin(TRACE_CHANGES_SINCE, start)) {
+        trace.put_uint(seq);
+        trace.end();
+    }
+    return complete;
+}
+
+void PhoneBookRecorder::compact_change_log(db_uint through_seq)
+{
+    db_uint start = trace.now_us();
+
+    pbook.compact_change_log(through_seq);
+    if (trace.begin(TRACE_COMPACT_CHANGE_LOG, start)) {
+        trace.put_uint(through_seq);
+        trace.end();
+    }
+}
+
+db_uint PhoneBookRecorder::last_change_seq()
+{
+    db_uint start = trace.now_us();
+    db_uint seq = pbook.last_change_seq();
+
+    if (trace.begin(TRACE_LAST_CHANGE_SEQ, start))
+        trace.end();
+    return seq;
+}
+
+void PhoneBookRecorder::set_change_logging(bool enable)
+{
+    db_uint start = trace.now_us();
+
+    pbook.set_change_logging(enable);
+    if (trace.begin(TRACE_SET_CHANGE_LOGGING, start)) {
+        trace.put_uint(enable);
+        trace.end();
+    }
+}
+
+void PhoneBookRecorder::set_id_block_size(unsigned size)
+{
+    db_uint start = trace.now_us();
+
+    pbook.set_id_block_size(size);
+    if (trace.begin(TRACE_SET_ID_BLOCK_SIZE, start)) {
+        trace.put_uint(size);
+        trace.end();
+    }
+}
+
+void PhoneBookRecorder::set_memory_storage_size(db_uint size)
+{
+    db_uint start = trace.now_us();
+
+    pbook.set_memory_storage_size(size);
+    if (trace.begin(TRACE_SET_MEMORY_STORAGE_SIZE, start)) {
+        trace.put_uint(size);
+        trace.end();
+    }
+}
+
+bool PhoneBookRecorder::get_contact_id_range(db_uint &first_id, db_uint &last_id)
+{
+    db_uint start = trace.now_us();
+    bool found = pbook.get_contact_id_range(first_id, last_id);
+
+    if (trace.begin(TRACE_GET_CONTACT_ID_RANGE, start))
+        trace.end();
+    return found;
+}
+
+void PhoneBookRecorder::visit_contacts(PhoneBook::ChangeVisitor &visitor, db_uint first_id,
+    db_uint last_id)
+{
+    db_uint start = trace.now_us();
+
+    pbook.visit_contacts(visitor, first_id, last_id);
+    if (trace.begin(TRACE_VISIT_CONTACTS, start)) {
+        trace.put_uint(first_id);
+        trace.put_uint(last_id);
+        trace.end();
+    }
+}
+
+void PhoneBookRecorder::visit_groups(PhoneBook::ChangeVisitor &visitor)
+{
+    db_uint start = trace.now_us();
+
+    pbook.visit_groups(visitor);
+    if (trace.begin(TRACE_VISIT_GROUPS, start))
+        trace.end();
+}
+
+void PhoneBookRecorder::find_phone_numbers(const char *number, PhoneBook::ChangeVisitor &visitor)
+{
+    db_uint start = trace.now_us();
+
+    pbook.find_phone_numbers(number, visitor);
+    if (trace.begin(TRACE_FIND_PHONE_NUMBERS, start)) {
+        trace.put_string(number);
+        trace.end();
+    }
+}
+
+int PhoneBookRecorder::search_by_number_suffix(const char *digits, size_t limit, PhoneBook::ChangeVisitor &visitor)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.search_by_number_suffix(digits, limit, visitor);
+
+    if (trace.begin(TRACE_SEARCH_BY_NUMBER_SUFFIX, start)) {
+        trace.put_string(digits);
+        trace.put_uint(limit);
+        trace.end();
+    }
+    return rc;
+}
+
+void PhoneBookRecorder::apply_change(const PhoneBook::ChangeRecord &record)
+{
+    db_uint start = trace.now_us();
+
+    pbook.apply_change(record);
+    if (trace.begin(TRACE_APPLY_CHANGE, start)) {
+        trace.put_uint(record.seq);
+        trace.put_uint(record.type);
+        trace.put_uint(record.contact_id);
+        trace.put_wstring(record.name);
+        trace.put_uint(record.ring_id);
+        trace.put_string(record.picture_name);
+        // picture_file is not recorded; its contents would not survive
+        trace.put_string(record.number);
+        trace.put_uint(record.number_type);
+        trace.put_sint(record.speed_dial);
+        trace.put_uint(record.group_id);
+        trace.end();
+    }
+}
+
+db_uint PhoneBookRecorder::create_group(const wchar_t *name)
+{
+    db_uint start = trace.now_us();
+    db_uint id = pbook.create_group(name);
+
+    if (trace.begin(TRACE_CREATE_GROUP, start)) {
+        trace.put_wstring(name);
+        trace.put_uint(id);
+        trace.end();
+    }
+    return id;
+}
+
+void PhoneBookRecorder::add_to_group(db_uint contact_id, db_uint group_id)
+{
+    db_uint start = trace.now_us();
+
+    pbook.add_to_group(contact_id, group_id);
+    if (trace.begin(TRACE_ADD_TO_GROUP, start)) {
+        trace.put_uint(contact_id);
+        trace.put_uint(group_id);
+        trace.end();
+    }
+}
+
+void PhoneBookRecorder::remove_from_group(db_uint contact_id, db_uint group_id)
+{
+    db_uint start = trace.now_us();
+
+    pbook.remove_from_group(contact_id, group_id);
+    if (trace.begin(TRACE_REMOVE_FROM_GROUP, start)) {
+        trace.put_uint(contact_id);
+        trace.put_uint(group_id);
+        trace.end();
+    }
+}
+
+int PhoneBookRecorder::get_group_members(db_uint group_id, ContactBitmap &contacts)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.get_group_members(group_id, contacts);
+
+    if (trace.begin(TRACE_GET_GROUP_MEMBERS, start)) {
+        trace.put_uint(group_id);
+        trace.end();
+    }
+    return rc;
+}
+
+int PhoneBookRecorder::get_contacts_with_number_type(PhoneBook::PhoneNumberType type,
+    ContactBitmap &contacts)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.get_contacts_with_number_type(type, contacts);
+
+    if (trace.begin(TRACE_GET_CONTACTS_WITH_NUMBER_TYPE, start)) {
+        trace.put_uint(type);
+        trace.end();
+    }
+    return rc;
+}
+
+int PhoneBookRecorder::get_contacts(const ContactBitmap &ids, PhoneBook::ContactResults &results)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.get_contacts(ids, results);
+
+    if (trace.begin(TRACE_GET_CONTACTS_BY_ID, start)) {
+        trace.put_contacts(ids);
+        trace.end();
+    }
+    return rc;
+}
+
+int PhoneBookRecorder::get_group_contacts(db_uint group_id, int number_type,
+    PhoneBook::ContactResults &results)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.get_group_contacts(group_id, number_type, results);
+
+    if (trace.begin(TRACE_GET_GROUP_CONTACTS, start)) {
+        trace.put_uint(group_id);
+        trace.put_sint(number_type);
+        trace.end();
+    }
+    return rc;
+}
+
+int PhoneBookRecorder::get_stats(PhoneBook::Stats &stats)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.get_stats(stats);
+
+    if (trace.begin(TRACE_GET_STATS, start))
+        trace.end();
+    return rc;
+}
+
+int PhoneBookRecorder::get_ring_id_contacts(db_uint ring_id, db_uint &count)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.get_ring_id_contacts(ring_id, count);
+
+    if (trace.begin(TRACE_GET_RING_ID_CONTACTS, start)) {
+        trace.put_uint(ring_id);
+        trace.end();
+    }
+    return rc;
+}
+
+int PhoneBookRecorder::verify_stats(db_uint &drift)
+{
+    db_uint start = trace.now_us();
+    int rc = pbook.verify_stats(drift);
+
+    if (trace.begin(TRACE_VERIFY_STATS, start))
+        trace.end();
+    return rc;
+}
+
+void PhoneBookRecorder::subscribe(PhoneBook::ChangeSubscriber &subscriber,
+    const PhoneBook::SubscriptionOptions &options)
+{
+    pbook.subscribe(subscriber, options);
+}
+
+void PhoneBookRecorder::unsubscribe(PhoneBook::ChangeSubscriber &subscriber)
+{
+    pbook.unsubscribe(subscriber);
+}
+
+void PhoneBookRecorder::poll_subscriptions()
+{
+    pbook.poll_subscriptions();
+}
+
+void PhoneBookRecorder::tx_start()
+{
+    db_uint start = trace.now_us();
+
+    pbook.tx_start();
+    if (trace.begin(TRACE_TX_START, start))
+        trace.end();
+}
+
+void PhoneBookRecorder::tx_start_snapshot()
+{
+    db_uint start = trace.now_us();
+
+    pbook.tx_start_snapshot();
+    if (trace.begin(TRACE_TX_START_SNAPSHOT, start))
+        trace.end();
+}
+
+void PhoneBookRecorder::tx_commit()
+{
+    db_uint start = trace.now_us();
+
+    pbook.tx_commit();
+    if (trace.begin(TRACE_TX_COMMIT, start))
+        trace.end();
+}
@@ -0,0 +1,277 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Recording PhoneBook calls to a binary trace, and reading them back
+ */
+
+#ifndef PHONEBOOK_TRACE_H
+#define PHONEBOOK_TRACE_H 1
+
+#include "phonebook.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+/* First bytes of a trace file; the last byte is the format version. */
+#define TRACE_MAGIC             "PBTRACE\001"
+#define TRACE_MAGIC_SIZE        8
+/* Most arguments recorded for one call */
+#define TRACE_MAX_ARGS          10
+
+/**
+ * Recorded PhoneBook methods. Values are stored in trace files, so new
+ * methods are added at the end.
+ */
+enum TraceOp {
+    TRACE_INSERT_CONTACT,
+    TRACE_INSERT_PHONE_NUMBER,
+    TRACE_UPDATE_CONTACT_NAME,
+    TRACE_UPDATE_CONTACT_PICTURE,
+    TRACE_REMOVE_CONTACT,
+    TRACE_LIST_CONTACTS_BRIEF,
+    TRACE_LIST_CONTACTS,
+    TRACE_GET_CONTACTS_BRIEF,
+    TRACE_GET_CONTACTS,
+    TRACE_GET_PICTURE_NAME,
+    TRACE_EXPORT_PICTURE,
+    TRACE_GET_PICTURE_STATS,
+    TRACE_SET_PICTURE_COMPRESSION,
+    TRACE_CHANGES_SINCE,
+    TRACE_COMPACT_CHANGE_LOG,
+    TRACE_LAST_CHANGE_SEQ,
+    TRACE_SET_CHANGE_LOGGING,
+    TRACE_GET_CONTACT_ID_RANGE,
+    TRACE_VISIT_CONTACTS,
+    TRACE_FIND_PHONE_NUMBERS,
+    TRACE_APPLY_CHANGE,
+    TRACE_CREATE_GROUP,
+    TRACE_ADD_TO_GROUP,
+    TRACE_REMOVE_FROM_GROUP,
+    TRACE_GET_GROUP_MEMBERS,
+    TRACE_GET_CONTACTS_WITH_NUMBER_TYPE,
+    TRACE_GET_CONTACTS_BY_ID,
+    TRACE_GET_GROUP_CONTACTS,
+    TRACE_GET_STATS,
+    TRACE_GET_RING_ID_CONTACTS,
+    TRACE_VERIFY_STATS,
+    TRACE_TX_START,
+    TRACE_TX_COMMIT,
+    TRACE_VISIT_GROUPS,
+    TRACE_SET_ID_BLOCK_SIZE,
+    TRACE_SEARCH_BY_NUMBER_SUFFIX,
+    TRACE_TX_START_SNAPSHOT,
+    TRACE_SET_MEMORY_STORAGE_SIZE,
+    TRACE_OP_COUNT
+};
+
+/* Method name of each TraceOp */
+extern const char *const trace_op_names[TRACE_OP_COUNT];
+
+/**
+ * Argument types of each TraceOp, one character per argument: 'u'
+ * unsigned, 's' signed, 'c' char string, 'w' wide string, 'b' contact
+ * bitmap. Return values that a replay needs, such as new ids, follow the
+ * arguments.
+ */
+extern const char *const trace_signatures[TRACE_OP_COUNT];
+
+/**
+ * One recorded call. Strings point into the TraceReader that read it and
+ * are NULL where the caller passed NULL.
+ */
+struct TraceCall {
+    TraceOp op;
+    /* Microseconds from the start of the trace to the call */
+    db_uint start_us;
+    /* Microseconds the call took */
+    db_uint duration_us;
+
+    db_uint uints[TRACE_MAX_ARGS];
+    db_sint sints[TRACE_MAX_ARGS];
+    const char *strings[TRACE_MAX_ARGS];
+    const wchar_t *wstrings[TRACE_MAX_ARGS];
+    ContactBitmap contacts;
+};
+
+/**
+ * Writes calls to a trace file. Each call is one record: the operation,
+ * its start time relative to the previous call and its duration as
+ * variable-length integers, followed by its arguments.
+ */
+class TraceWriter {
+private:
+    FILE *file;
+    db_uint origin_us;
+    db_uint last_start_us;
+    /* The record being written, flushed whole by end() */
+    std::vector<unsigned char> record;
+
+    void put_byte(unsigned char byte) { record.push_back(byte); }
+
+    /* Not copyable */
+    TraceWriter(const TraceWriter &);
+    TraceWriter &operator=(const TraceWriter &);
+
+public:
+    TraceWriter();
+    ~TraceWriter();
+
+    int open(const char *file_name);
+    int close();
+    bool is_open() const { return file != NULL; }
+
+    /* Microseconds since the trace was opened */
+    db_uint now_us() const;
+
+    /* Start a record for a call that started at start_us and ends now.
+       Returns false if no trace is open. */
+    bool begin(TraceOp op, db_uint start_us);
+    void put_uint(db_uint value);
+    void put_sint(db_sint value);
+    void put_string(const char *value);
+    void put_wstring(const wchar_t *value);
+    void put_contacts(const ContactBitmap &contacts);
+    int end();
+};
+
+/**
+ * Reads the calls of a trace file in order.
+ */
+class TraceReader {
+private:
+    FILE *file;
+    db_uint last_start_us;
+    std::vector<char> string_data[TRACE_MAX_ARGS];
+    std::vector<wchar_t> wstring_data[TRACE_MAX_ARGS];
+
+    bool get_uint(db_uint &value);
+    bool get_string(int arg, TraceCall &call);
+    bool get_wstring(int arg, TraceCall &call);
+    bool get_contacts(TraceCall &call);
+
+    /* Not copyable */
+    TraceReader(const TraceReader &);
+    TraceReader &operator=(const TraceReader &);
+
+public:
+    TraceReader();
+    ~TraceReader();
+
+    int open(const char *file_name);
+    void close();
+
+    /* Read the next call. Returns false at the end of the trace, or if the
+       trace is damaged. */
+    bool next(TraceCall &call);
+};
+
+/**
+ * A PhoneBook that forwards calls to another and, while recording, writes
+ * each one to a trace with its arguments and how long it took. Opening and
+ * closing the database and subscriptions are not recorded: a replay
+ * starts from its own database, and notifications follow from the calls
+ * that are.
+ */
+class PhoneBookRecorder : public PhoneBook {
+private:
+    PhoneBook &pbook;
+    TraceWriter trace;
+
+public:
+    PhoneBookRecorder(PhoneBook &pbook);
+
+    int start(const char *trace_file);
+    int stop();
+    bool recording() const { return trace.is_open(); }
+
+    /* The phone book being recorded, for calls that should not be */
+    PhoneBook &target() { return pbook; }
+
+    int open_database(int file_mode, const char* database_name);
+    int create_database(int file_mode, const char* database_name);
+    int close_database();
+
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name);
+    db_uint insert_contact(const wchar_t *name, db_uint ring_id, const char *picture_name,
+        const char *picture_file);
+    void insert_phone_number(db_uint contact_id, const char *number,
+        PhoneBook::PhoneNumberType type, db_sint speed_dial);
+
+    void update_contact_name(db_uint id, const wchar_t *newname);
+    void update_contact_picture(db_uint contact_id, const char *picture_name);
+    void remove_contact(db_uint id);
+
+    void list_contacts_brief();
+    void list_contacts(int sort);
+    int get_contacts_brief(PhoneBook::ContactResults &results);
+    int get_contacts(int sort, PhoneBook::ContactResults &results);
+
+    db::String get_picture_name(db_uint id);
+    const char *get_picture_name(db_uint id, ResultArena &arena);
+    void export_picture(db_uint id, const char *file_name);
+    int export_picture(db_uint id, FILE *picture_file);
+    void get_picture_stats(PhoneBook::PictureStats &stats);
+    void set_picture_compression(bool enable);
+
+    bool changes_since(db_uint seq, PhoneBook::ChangeVisitor &visitor);
+    void compact_change_log(db_uint through_seq);
+    db_uint last_change_seq();
+    void set_change_logging(bool enable);
+    void set_id_block_size(unsigned size);
+    void set_memory_storage_size(db_uint size);
+
+    bool get_contact_id_range(db_uint &first_id, db_uint &last_id);
+    void visit_contacts(PhoneBook::ChangeVisitor &visitor, db_uint first_id = 0,
+        db_uint last_id = ~(db_uint) 0 >> 1);
+    void visit_groups(PhoneBook::ChangeVisitor &visitor);
+    void find_phone_numbers(const char *number, PhoneBook::ChangeVisitor &visitor);
+    int search_by_number_suffix(const char *digits, size_t limit, PhoneBook::ChangeVisitor &visitor);
+    void apply_change(const PhoneBook::ChangeRecord &record);
+
+    db_uint create_group(const wchar_t *name);
+    void add_to_group(db_uint contact_id, db_uint group_id);
+    void remove_from_group(db_uint contact_id, db_uint group_id);
+    int get_group_members(db_uint group_id, ContactBitmap &contacts);
+    int get_contacts_with_number_type(PhoneBook::PhoneNumberType type, ContactBitmap &contacts);
+    int get_contacts(const ContactBitmap &ids, PhoneBook::ContactResults &results);
+    int get_group_contacts(db_uint group_id, int number_type, PhoneBook::ContactResults &results);
+
+    int get_stats(PhoneBook::Stats &stats);
+    int get_ring_id_contacts(db_uint ring_id, db_uint &count);
+    int verify_stats(db_uint &drift);
+
+    void subscribe(PhoneBook::ChangeSubscriber &subscriber, const PhoneBook::SubscriptionOptions &options);
+    void unsubscribe(PhoneBook::ChangeSubscriber &subscriber);
+    void poll_subscriptions();
+
+    void tx_start();
+    void tx_start_snapshot();
+    void tx_commit();
+};
+
+
+#endif
@@ -0,0 +1,972 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Streaming vCard 3.0 and 4.0 import and export
+ */
+
+#include "phonebook_vcard.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VCARD_SSE2 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/* Picture name given to a PHOTO without an X-PHONEBOOK-PICTURE. */
+#define VCARD_DEFAULT_PICTURE   "photo"
+
+
+#ifdef VCARD_SSE2
+/**
+ * Index of the lowest set bit of a non-zero mask.
+ */
+static inline int first_bit(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+const char *vcard_find_line_end(const char *p, const char *end)
+{
+#ifdef VCARD_SSE2
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf));
+
+        if (mask != 0)
+            return p + first_bit(mask);
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\n')
+            return p;
+    }
+    return end;
+}
+
+const char *vcard_find_delimiter(const char *p, const char *end)
+{
+#ifdef VCARD_SSE2
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i semicolon = _mm_set1_epi8(';');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = (unsigned) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(block, colon), _mm_cmpeq_epi8(block, semicolon)));
+
+        if (mask != 0)
+            return p + first_bit(mask);
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == ':' || *p == ';')
+            return p;
+    }
+    return end;
+}
+
+/**
+ * Compare a counted string with a word, ignoring ASCII case.
+ */
+static bool iequals(const char *p, size_t length, const char *word)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        char a = p[i], b = word[i];
+
+        if (b == '\0')
+            return false;
+        if (a >= 'a' && a <= 'z')
+            a -= 'a' - 'A';
+        if (b >= 'a' && b <= 'z')
+            b -= 'a' - 'A';
+        if (a != b)
+            return false;
+    }
+    return word[length] == '\0';
+}
+
+/**
+ * Check whether a counted string starts with a prefix, ignoring ASCII case.
+ */
+static bool istarts(const char *p, size_t length, const char *prefix)
+{
+    size_t n = strlen(prefix);
+    return length >= n && iequals(p, n, prefix);
+}
+
+/**
+ * Remove vCard text escapes in place.
+ *
+ * @return new length
+ */
+static size_t unescape(char *p, size_t length)
+{
+    size_t i, j;
+
+    for (i = 0, j = 0; i < length; i++, j++) {
+        if (p[i] == '\\' && i + 1 < length) {
+            i++;
+            p[j] = p[i] == 'n' || p[i] == 'N' ? ' ' : p[i];
+        } else {
+            p[j] = p[i];
+        }
+    }
+    return j;
+}
+
+/**
+ * Convert UTF-8 to a NUL-terminated wide string, replacing invalid
+ * sequences and truncating to the output size.
+ */
+static void utf8_to_wide(const char *p, size_t length, wchar_t *out, size_t size)
+{
+    const unsigned char *s = (const unsigned char *) p;
+    const unsigned char *end = s + length;
+    size_t n = 0;
+
+    while (s < end) {
+        unsigned long c = *s++;
+        int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+
+        if (c >= 0x80 && extra == 0) {
+            c = 0xfffd;
+        } else if (extra > 0) {
+            c &= 0x3f >> extra;
+            for (; extra > 0 && s < end && (*s & 0xc0) == 0x80; extra--)
+                c = (c << 6) | (*s++ & 0x3f);
+            if (extra > 0)
+                c = 0xfffd;
+        }
+
+        if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+            if (n + 3 > size)
+                break;
+            out[n++] = (wchar_t) (0xd800 + ((c - 0x10000) >> 10));
+            out[n++] = (wchar_t) (0xdc00 + ((c - 0x10000) & 0x3ff));
+        } else {
+            if (n + 2 > size)
+                break;
+            out[n++] = (wchar_t) c;
+        }
+    }
+    out[n] = 0;
+}
+
+/**
+ * Convert a wide string to NUL-terminated UTF-8, truncating to the
+ * output size.
+ */
+static void wide_to_utf8(const wchar_t *s, char *out, size_t size)
+{
+    size_t n = 0;
+
+    for (; s != NULL && *s != 0; s++) {
+        unsigned long c = (unsigned long) *s;
+        char bytes[4];
+        int length;
+
+        // Combine UTF-16 surrogate pairs where wchar_t is 16 bits
+        if (sizeof(wchar_t) == 2 && c >= 0xd800 && c < 0xdc00 &&
+            s[1] >= 0xdc00 && s[1] < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + ((unsigned long) s[1] - 0xdc00);
+            s++;
+        }
+
+        if (c < 0x80) {
+            bytes[0] = (char) c;
+            length = 1;
+        } else if (c < 0x800) {
+            bytes[0] = (char) (0xc0 | (c >> 6));
+            bytes[1] = (char) (0x80 | (c & 0x3f));
+            length = 2;
+        } else if (c < 0x10000) {
+            bytes[0] = (char) (0xe0 | (c >> 12));
+            bytes[1] = (char) (0x80 | ((c >> 6) & 0x3f));
+            bytes[2] = (char) (0x80 | (c & 0x3f));
+            length = 3;
+        } else {
+            bytes[0] = (char) (0xf0 | (c >> 18));
+            bytes[1] = (char) (0x80 | ((c >> 12) & 0x3f));
+            bytes[2] = (char) (0x80 | ((c >> 6) & 0x3f));
+            bytes[3] = (char) (0x80 | (c & 0x3f));
+            length = 4;
+        }
+
+        if (n + length + 1 > size)
+            break;
+        memcpy(out + n, bytes, length);
+        n += length;
+    }
+    out[n] = '\0';
+}
+
+//-----------------------------------------------------------------------
+// Parser
+//-----------------------------------------------------------------------
+
+VCardParser::VCardParser(FILE *in, const char *photo_file)
+    : in(in)
+    , photo_file_name(photo_file)
+    , buffer((char *) malloc(VCARD_BUFFER_SIZE))
+    , begin(0)
+    , end(0)
+    , eof(false)
+    , at_line_start(true)
+    , bytes(0)
+    , in_card(false)
+    , has_fn(false)
+    , property(PROPERTY_IGNORED)
+    , value_length(0)
+    , tel_type(PhoneBook::HOME)
+    , tel_speed_dial(-1)
+    , photo(NULL)
+    , photo_file_size(0)
+    , photo_bits(0)
+    , photo_bit_count(0)
+    , photo_done(false)
+    , photo_size(0)
+    , photo_buffered(0)
+{
+}
+
+VCardParser::~VCardParser()
+{
+    if (photo != NULL)
+        fclose(photo);
+    free(buffer);
+}
+
+/**
+ * Return the next line of input, located in place in the buffer, without
+ * its line break. A line longer than the buffer is returned in pieces;
+ * every piece after the first has line_start set to false.
+ *
+ * @return false at the end of the input
+ */
+bool VCardParser::next_segment(const char *&p, size_t &length, bool &line_start)
+{
+    for (;;) {
+        const char *start = buffer + begin;
+        const char *stop = buffer + end;
+        const char *lf = vcard_find_line_end(start, stop);
+
+        if (lf != stop || (eof && start != stop)) {
+            // A whole line, or the last line without a line break
+            p = start;
+            length = lf - start;
+            begin = (lf != stop ? lf + 1 : stop) - buffer;
+            if (length > 0 && p[length - 1] == '\r')
+                length--;
+            line_start = at_line_start;
+            at_line_start = true;
+            return true;
+        }
+        if (eof)
+            return false;
+
+        if (begin == 0 && end == VCARD_BUFFER_SIZE) {
+            // The buffer holds part of a single line: pass it on, keeping
+            // a trailing CR in case the LF is the next byte read
+            p = buffer;
+            length = buffer[end - 1] == '\r' ? end - 1 : end;
+            begin = length;
+            line_start = at_line_start;
+            at_line_start = false;
+            return true;
+        }
+
+        // Move the incomplete line to the front and read more after it
+        memmove(buffer, buffer + begin, end - begin);
+        end -= begin;
+        begin = 0;
+
+        size_t n = fread(buffer + end, 1, VCARD_BUFFER_SIZE - end, in);
+        bytes += n;
+        end += n;
+        if (n == 0)
+            eof = true;
+    }
+}
+
+/**
+ * Start a property from the first line that holds it.
+ */
+void VCardParser::begin_property(const char *p, size_t length)
+{
+    const char *stop = p + length;
+    const char *name = p;
+    const char *name_end = vcard_find_delimiter(p, stop);
+    const char *colon = name_end;
+    const char *q;
+
+    property = PROPERTY_IGNORED;
+    value_length = 0;
+
+    // The value starts after the first ':' that is not in the parameters
+    while (colon < stop && *colon != ':')
+        colon = vcard_find_delimiter(colon + 1, stop);
+    if (colon == stop)
+        return;
+
+    // Skip a group prefix such as "item1."
+    for (q = p; q < name_end; q++) {
+        if (*q == '.')
+            name = q + 1;
+    }
+
+    length = name_end - name;
+    if (iequals(name, length, "BEGIN"))
+        property = PROPERTY_BEGIN;
+    else if (iequals(name, length, "END"))
+        property = PROPERTY_END;
+    else if (!in_card)
+        return;
+    else if (iequals(name, length, "FN"))
+        property = PROPERTY_FN;
+    else if (iequals(name, length, "N"))
+        property = PROPERTY_N;
+    else if (iequals(name, length, "X-PHONEBOOK-RING-ID"))
+        property = PROPERTY_RING_ID;
+    else if (iequals(name, length, "X-PHONEBOOK-PICTURE"))
+        property = PROPERTY_PICTURE;
+    else if (iequals(name, length, "TEL")) {
+        property = PROPERTY_TEL;
+        parse_tel_parameters(name_end, colon);
+    } else if (iequals(name, length, "PHOTO") && photo_file_name != NULL) {
+        const char *v = colon + 1;
+
+        // vCard 4.0 embeds the picture in a data URI
+        if (istarts(v, stop - v, "data:")) {
+            v = (const char *) memchr(v, ',', stop - v);
+            if (v == NULL)
+                return;
+            v++;
+        } else if (memchr(v, ':', stop - v) != NULL) {
+            // A link to a picture elsewhere, which is not fetched
+            return;
+        }
+
+        if (photo == NULL)
+            photo = fopen(photo_file_name, "w+b");
+        if (photo == NULL)
+            return;
+        rewind(photo);
+
+        property = PROPERTY_PHOTO;
+        photo_bits = 0;
+        photo_bit_count = 0;
+        photo_done = false;
+        photo_size = 0;
+        photo_buffered = 0;
+        decode_photo(v, stop - v);
+        return;
+    }
+
+    continue_property(colon + 1, stop - (colon + 1));
+}
+
+/**
+ * Add the next part of a property value, from a folded line.
+ */
+void VCardParser::continue_property(const char *p, size_t length)
+{
+    if (property == PROPERTY_PHOTO) {
+        decode_photo(p, length);
+    } else if (property != PROPERTY_IGNORED) {
+        if (length > VCARD_MAX_VALUE - 1 - value_length)
+            length = VCARD_MAX_VALUE - 1 - value_length;
+        memcpy(value + value_length, p, length);
+        value_length += length;
+    }
+}
+
+/**
+ * Read the type and speed dial of a phone number from TEL parameters.
+ */
+void VCardParser::parse_tel_parameters(const char *p, const char *end)
+{
+    int rank = -1;
+
+    tel_type = PhoneBook::HOME;
+    tel_speed_dial = -1;
+
+    while (p < end && *p == ';') {
+        const char *param = p + 1;
+        const char *param_end = vcard_find_delimiter(param, end);
+
+        p = param_end;
+        if (istarts(param, param_end - param, "X-SPEED-DIAL=")) {
+            tel_speed_dial = atoi(param + 13);
+            continue;
+        }
+        if (istarts(param, param_end - param, "TYPE="))
+            param += 5;
+
+        // Types are listed with commas or repeated; keep the most specific
+        while (param < param_end) {
+            const char *type = param;
+            const char *type_end = (const char *) memchr(type, ',', param_end - type);
+
+            if (type_end == NULL)
+                type_end = param_end;
+            param = type_end + 1;
+
+            if (*type == '"')
+                type++;
+            size_t length = type_end - type;
+            if (length > 0 && type[length - 1] == '"')
+                length--;
+
+            if ((iequals(type, length, "FAX") || iequals(type, length, "PAGER")) && rank < 3) {
+                tel_type = iequals(type, length, "FAX") ? PhoneBook::FAX : PhoneBook::PAGER;
+                rank = 3;
+            } else if (iequals(type, length, "CELL") && rank < 2) {
+                tel_type = PhoneBook::MOBILE;
+                rank = 2;
+            } else if (iequals(type, length, "WORK") && rank < 1) {
+                tel_type = PhoneBook::WORK;
+                rank = 1;
+            } else if (iequals(type, length, "HOME") && rank < 0) {
+                tel_type = PhoneBook::HOME;
+                rank = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Decode base64 picture data as it streams past. Whitespace and line
+ * breaks are skipped; decoding stops at padding.
+ */
+void VCardParser::decode_photo(const char *p, size_t length)
+{
+    const char *end = p + length;
+
+    for (; p < end && !photo_done; p++) {
+        unsigned char c = (unsigned char) *p;
+        int v;
+
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '+' || c == '-')
+            v = 62;
+        else if (c == '/' || c == '_')
+            v = 63;
+        else if (c == '=') {
+            photo_done = true;
+            break;
+        } else
+            continue;
+
+        photo_bits = (photo_bits << 6) | v;
+        photo_bit_count += 6;
+        if (photo_bit_count >= 8) {
+            photo_bit_count -= 8;
+            photo_buffer[photo_buffered++] = (unsigned char) (photo_bits >> photo_bit_count);
+            photo_bits &= (1UL << photo_bit_count) - 1;
+            if (photo_buffered == sizeof photo_buffer)
+                flush_photo();
+        }
+    }
+}
+
+void VCardParser::flush_photo()
+{
+    if (photo != NULL && photo_buffered > 0)
+        photo_size += fwrite(photo_buffer, 1, photo_buffered, photo);
+    photo_buffered = 0;
+}
+
+/**
+ * Complete the photo file, cutting off any longer picture written before.
+ */
+void VCardParser::finish_photo()
+{
+    flush_photo();
+    fflush(photo);
+
+    if (photo_size < photo_file_size) {
+#ifdef _WIN32
+        _chsize_s(_fileno(photo), (__int64) photo_size);
+#else
+        if (ftruncate(fileno(photo), (off_t) photo_size) != 0)
+            photo_size = 0;
+#endif
+    }
+    photo_file_size = photo_size;
+}
+
+/**
+ * Act on a complete property.
+ *
+ * @return false if the handler asked to stop
+ */
+bool VCardParser::finish_property(VCardHandler &handler)
+{
+    Property finished = property;
+    char *v = value;
+    size_t length = value_length;
+
+    property = PROPERTY_IGNORED;
+    value_length = 0;
+    value[length] = '\0';
+
+    switch (finished) {
+        case PROPERTY_BEGIN:
+            if (iequals(v, length, "VCARD")) {
+                memset(&current, 0, sizeof current);
+                in_card = true;
+                has_fn = false;
+            }
+            break;
+        case PROPERTY_END:
+            if (in_card && iequals(v, length, "VCARD")) {
+                in_card = false;
+                return handler.card(current);
+            }
+            break;
+        case PROPERTY_FN:
+            length = unescape(v, length);
+            utf8_to_wide(v, length, current.name, VCARD_MAX_NAME);
+            has_fn = true;
+            break;
+        case PROPERTY_N:
+            if (!has_fn) {
+                // "Family;Given;..." becomes "Given Family"
+                char name[VCARD_MAX_VALUE];
+                const char *family = v;
+                const char *family_end = vcard_find_delimiter(v, v + length);
+                const char *given = family_end < v + length ? family_end + 1 : family_end;
+                const char *given_end = vcard_find_delimiter(given, v + length);
+                size_t n = 0;
+
+                memcpy(name, given, given_end - given);
+                n = given_end - given;
+                if (n > 0 && family_end > family)
+                    name[n++] = ' ';
+                memcpy(name + n, family, family_end - family);
+                n += family_end - family;
+
+                n = unescape(name, n);
+                utf8_to_wide(name, n, current.name, VCARD_MAX_NAME);
+            }
+            break;
+        case PROPERTY_TEL:
+            if (current.number_count < VCARD_MAX_NUMBERS) {
+                int i = current.number_count++;
+
+                if (istarts(v, length, "tel:")) {
+                    v += 4;
+                    length -= 4;
+                }
+                if (length > VCARD_MAX_NUMBER - 1)
+                    length = VCARD_MAX_NUMBER - 1;
+                memcpy(current.numbers[i].number, v, length);
+                current.numbers[i].number[length] = '\0';
+                current.numbers[i].type = tel_type;
+                current.numbers[i].speed_dial = tel_speed_dial;
+            }
+            break;
+        case PROPERTY_RING_ID:
+            current.ring_id = strtoul(v, NULL, 10);
+            break;
+        case PROPERTY_PICTURE:
+            length = unescape(v, length);
+            if (length > VCARD_MAX_FILE_NAME - 1)
+                length = VCARD_MAX_FILE_NAME - 1;
+            memcpy(current.picture_name, v, length);
+            current.picture_name[length] = '\0';
+            break;
+        case PROPERTY_PHOTO:
+            finish_photo();
+            current.has_photo = photo_size > 0;
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+int VCardParser::parse(VCardHandler &handler)
+{
+    const char *p;
+    size_t length;
+    bool line_start;
+
+    if (buffer == NULL)
+        return DB_ENOMEM;
+
+    while (next_segment(p, length, line_start)) {
+        if (!line_start) {
+            // The rest of a line longer than the buffer
+            continue_property(p, length);
+        } else if (length > 0 && (*p == ' ' || *p == '\t')) {
+            // A folded line continues the property
+            continue_property(p + 1, length - 1);
+        } else {
+            if (!finish_property(handler))
+                return DB_NOERROR;
+            if (length > 0)
+                begin_property(p, length);
+        }
+    }
+    finish_property(handler);
+
+    return ferror(in) ? DB_EIO : DB_NOERROR;
+}
+
+//-----------------------------------------------------------------------
+// Import
+//-----------------------------------------------------------------------
+
+/**
+ * Inserts parsed cards into a phone book, committing in batches.
+ */
+class VCardImporter : public VCardHandler {
+private:
+    PhoneBook &pbook;
+    const char *photo_file;
+
+public:
+    db_uint count;
+
+    VCardImporter(PhoneBook &pbook, const char *photo_file)
+        : pbook(pbook)
+        , photo_file(photo_file)
+        , count(0)
+    {
+    }
+
+    bool card(const VCard &card)
+    {
+        const char *picture_name = NULL;
+        db_uint id;
+
+        if (card.picture_name[0] != '\0')
+            picture_name = card.picture_name;
+        else if (card.has_photo)
+            picture_name = VCARD_DEFAULT_PICTURE;
+
+        id = pbook.insert_contact(card.name, card.ring_id, picture_name,
+                                  card.has_photo ? photo_file : NULL);
+        if (id != 0) {
+            for (int i = 0; i < card.number_count; i++)
+                pbook.insert_phone_number(id, card.numbers[i].number, card.numbers[i].type,
+                                          card.numbers[i].speed_dial);
+        }
+
+        if (++count % VCARD_IMPORT_BATCH == 0) {
+            pbook.tx_commit();
+            pbook.tx_start();
+        }
+        return true;
+    }
+};
+
+int import_vcards(PhoneBook &pbook, FILE *in, const char *photo_file, db_uint *imported)
+{
+    VCardImporter importer(pbook, photo_file);
+    int rc;
+
+    {
+        // The parser holds the photo file open until it is destroyed
+        VCardParser parser(in, photo_file);
+
+        pbook.tx_start();
+        rc = parser.parse(importer);
+        pbook.tx_commit();
+    }
+
+    if (photo_file != NULL)
+        remove(photo_file);
+    if (imported != NULL)
+        *imported = importer.count;
+    return rc;
+}
+
+//-----------------------------------------------------------------------
+// Export
+//-----------------------------------------------------------------------
+
+/**
+ * Writes content lines, folding them at VCARD_LINE_LENGTH octets without
+ * splitting a UTF-8 sequence.
+ */
+class VCardWriter {
+private:
+    FILE *out;
+    int column;
+
+public:
+    VCardWriter(FILE *out) : out(out), column(0) {}
+
+    void put(const char *s, size_t length)
+    {
+        for (size_t i = 0; i < length; i++) {
+            unsigned char c = (unsigned char) s[i];
+
+            if (column >= VCARD_LINE_LENGTH && (c & 0xc0) != 0x80) {
+                fputs("\r\n ", out);
+                column = 1;
+            }
+            putc(c, out);
+            column++;
+        }
+    }
+
+    void put(const char *s) { put(s, strlen(s)); }
+
+    /* Write text with ',', ';', '\' and line breaks escaped. */
+    void put_text(const char *s)
+    {
+        for (; *s != '\0'; s++) {
+            if (*s == ',' || *s == ';' || *s == '\\')
+                put("\\", 1);
+            if (*s == '\n')
+                put("\\n", 2);
+            else
+                put(s, 1);
+        }
+    }
+
+    void end_line()
+    {
+        fputs("\r\n", out);
+        column = 0;
+    }
+};
+
+/**
+ * Formats contacts streamed by PhoneBook::visit_contacts as vCards.
+ */
+class VCardExporter : public PhoneBook::ChangeVisitor {
+private:
+    PhoneBook &pbook;
+    VCardWriter writer;
+    int version;
+    bool open_card;
+
+    void write_photo(db_uint id);
+
+public:
+    /* Scratch file each picture is exported into before encoding */
+    FILE *photo;
+
+    VCardExporter(PhoneBook &pbook, FILE *out, int version)
+        : pbook(pbook)
+        , writer(out)
+        , version(version)
+        , open_card(false)
+        , photo(tmpfile())
+    {
+    }
+
+    ~VCardExporter()
+    {
+        if (photo != NULL)
+            fclose(photo);
+    }
+
+    bool change(const PhoneBook::ChangeRecord &record);
+    void finish();
+};
+
+bool VCardExporter::change(const PhoneBook::ChangeRecord &record)
+{
+    char text[VCARD_MAX_VALUE];
+
+    if (record.type == PhoneBook::CONTACT_INSERTED) {
+        finish();
+        open_card = true;
+
+        writer.put("BEGIN:VCARD");
+        writer.end_line();
+        writer.put(version >= 4 ? "VERSION:4.0" : "VERSION:3.0");
+        writer.end_line();
+
+        wide_to_utf8(record.name, text, sizeof text);
+        writer.put("FN:");
+        writer.put_text(text);
+        writer.end_line();
+        // The name is not split, so it is all given name
+        writer.put("N:;");
+        writer.put_text(text);
+        writer.put(";;;");
+        writer.end_line();
+
+        sprintf(text, "X-PHONEBOOK-RING-ID:%lu", (unsigned long) record.ring_id);
+        writer.put(text);
+        writer.end_line();
+
+        if (record.picture_name != NULL) {
+            writer.put("X-PHONEBOOK-PICTURE:");
+            writer.put_text(record.picture_name);
+            writer.end_line();
+            write_photo(record.contact_id);
+        }
+    } else if (record.type == PhoneBook::PHONE_NUMBER_INSERTED) {
+        static const char *const types[] = { "HOME", "CELL", "WORK", "FAX", "PAGER" };
+        static const char *const types4[] = { "home", "cell", "work", "fax", "pager" };
+
+        if ((unsigned) record.number_type < sizeof types / sizeof types[0]) {
+            writer.put("TEL;TYPE=");
+            writer.put(version >= 4 ? types4[record.number_type] : types[record.number_type]);
+        } else {
+            writer.put("TEL");
+        }
+        if (record.speed_dial >= 0) {
+            sprintf(text, ";X-SPEED-DIAL=%ld", (long) record.speed_dial);
+            writer.put(text);
+        }
+        writer.put(":");
+        writer.put(record.number);
+        writer.end_line();
+    }
+    return true;
+}
+
+/**
+ * Write a contact's picture, if it has one, as a base64 PHOTO property.
+ */
+void VCardExporter::write_photo(db_uint id)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned char data[3 * 256];
+    char encoded[4 * 256];
+    long size;
+
+    if (photo == NULL)
+        return;
+
+    // The scratch file is reused, so only its first size bytes are current
+    rewind(photo);
+    if (DB_FAILED(pbook.export_picture(id, photo)) || (size = ftell(photo)) <= 0)
+        return;
+    rewind(photo);
+
+    size_t n = fread(data, 1, size < (long) sizeof data ? (size_t) size : sizeof data, photo);
+    const char *mime = NULL;
+    const char *type = NULL;
+
+    if (n >= 4 && memcmp(data, "\x89PNG", 4) == 0)
+        mime = "image/png", type = "PNG";
+    else if (n >= 3 && memcmp(data, "\xff\xd8\xff", 3) == 0)
+        mime = "image/jpeg", type = "JPEG";
+    else if (n >= 4 && memcmp(data, "GIF8", 4) == 0)
+        mime = "image/gif", type = "GIF";
+    else if (n >= 2 && memcmp(data, "BM", 2) == 0)
+        mime = "image/bmp", type = "BMP";
+
+    if (version >= 4) {
+        writer.put("PHOTO:data:");
+        writer.put(mime != NULL ? mime : "application/octet-stream");
+        writer.put(";base64,");
+    } else {
+        writer.put("PHOTO;ENCODING=b");
+        if (type != NULL) {
+            writer.put(";TYPE=");
+            writer.put(type);
+        }
+        writer.put(":");
+    }
+
+    while (n > 0) {
+        size_t length = 0;
+
+        for (size_t i = 0; i < n; i += 3) {
+            unsigned long bits = (unsigned long) data[i] << 16;
+
+            if (i + 1 < n)
+                bits |= (unsigned long) data[i + 1] << 8;
+            if (i + 2 < n)
+                bits |= data[i + 2];
+
+            encoded[length++] = alphabet[(bits >> 18) & 0x3f];
+            encoded[length++] = alphabet[(bits >> 12) & 0x3f];
+            encoded[length++] = i + 1 < n ? alphabet[(bits >> 6) & 0x3f] : '=';
+            encoded[length++] = i + 2 < n ? alphabet[bits & 0x3f] : '=';
+        }
+        writer.put(encoded, length);
+
+        size -= (long) n;
+        n = size <= 0 ? 0 : fread(data, 1, size < (long) sizeof data ? (size_t) size : sizeof data, photo);
+    }
+    writer.end_line();
+}
+
+/**
+ * Close the card being written.
+ */
+void VCardExporter::finish()
+{
+    if (open_card) {
+        writer.put("END:VCARD");
+        writer.end_line();
+        open_card = false;
+    }
+}
+
+int export_vcards(PhoneBook &pbook, FILE *out, int version)
+{
+    VCardExporter exporter(pbook, out, version);
+
+    if (exporter.photo == NULL)
+        return DB_EIO;
+
+    pbook.tx_start_snapshot();
+    pbook.visit_contacts(exporter);
+    exporter.finish();
+    pbook.tx_commit();
+
+    return ferror(out) ? DB_EIO : DB_NOERROR;
+}
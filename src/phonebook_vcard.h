@@ -0,0 +1,198 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Streaming vCard 3.0 and 4.0 import and export
+ */
+
+#ifndef PHONEBOOK_VCARD_H
+#define PHONEBOOK_VCARD_H 1
+
+#include "phonebook.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Input is read in blocks of this size; longer lines are streamed. */
+#define VCARD_BUFFER_SIZE       (1024 * 1024)
+/* Longest text property value kept, after unfolding. */
+#define VCARD_MAX_VALUE         1024
+#define VCARD_MAX_NAME          256
+#define VCARD_MAX_FILE_NAME     256
+#define VCARD_MAX_NUMBER        32
+/* Phone numbers kept per card; further numbers are dropped. */
+#define VCARD_MAX_NUMBERS       16
+/* Cards inserted per transaction during import. */
+#define VCARD_IMPORT_BATCH      1000
+/* Lines are folded after this many octets, as the standard recommends. */
+#define VCARD_LINE_LENGTH       75
+
+/**
+ * Find the next line feed, scanning 16 bytes at a time with SSE2 where
+ * available.
+ *
+ * @return pointer to the line feed, or end if there is none
+ */
+const char *vcard_find_line_end(const char *p, const char *end);
+
+/**
+ * Find the next ':' or ';', which separate a property's name, parameters
+ * and value, scanning 16 bytes at a time with SSE2 where available.
+ *
+ * @return pointer to the delimiter, or end if there is none
+ */
+const char *vcard_find_delimiter(const char *p, const char *end);
+
+/**
+ * One contact read from a vCard. All storage is inline, so cards are
+ * parsed without allocating memory for each field.
+ */
+struct VCard {
+    wchar_t name[VCARD_MAX_NAME];
+    db_uint ring_id;
+    /* X-PHONEBOOK-PICTURE, or empty */
+    char picture_name[VCARD_MAX_FILE_NAME];
+    /* The PHOTO was decoded into the parser's photo file. */
+    bool has_photo;
+
+    int number_count;
+    struct {
+        char number[VCARD_MAX_NUMBER];
+        PhoneBook::PhoneNumberType type;
+        db_sint speed_dial;
+    } numbers[VCARD_MAX_NUMBERS];
+};
+
+/**
+ * Receives each card read by VCardParser
+ */
+class VCardHandler {
+public:
+    virtual ~VCardHandler() {}
+    /* Return false to stop parsing. */
+    virtual bool card(const VCard &card) = 0;
+};
+
+/**
+ * Streaming vCard parser.
+ *
+ * The input is read in large blocks. Lines are located in place in the
+ * block and unfolded into a fixed buffer; PHOTO values are base64-decoded
+ * as they stream past, into a file, so pictures of any size are read
+ * without holding them in memory.
+ */
+class VCardParser {
+private:
+    enum Property {
+        PROPERTY_IGNORED,
+        PROPERTY_BEGIN,
+        PROPERTY_END,
+        PROPERTY_FN,
+        PROPERTY_N,
+        PROPERTY_TEL,
+        PROPERTY_RING_ID,
+        PROPERTY_PICTURE,
+        PROPERTY_PHOTO
+    };
+
+    FILE *in;
+    const char *photo_file_name;
+    char *buffer;
+    size_t begin;
+    size_t end;
+    bool eof;
+    bool at_line_start;
+    db_uint bytes;
+
+    VCard current;
+    bool in_card;
+    bool has_fn;
+
+    /* Property being read, which may continue on folded lines */
+    Property property;
+    char value[VCARD_MAX_VALUE];
+    size_t value_length;
+    PhoneBook::PhoneNumberType tel_type;
+    db_sint tel_speed_dial;
+
+    /* Base64 decoder state for PHOTO. The photo file stays open and is
+     * overwritten by each picture, which is much faster than creating it
+     * again for every card. */
+    FILE *photo;
+    db_uint photo_file_size;
+    unsigned long photo_bits;
+    int photo_bit_count;
+    bool photo_done;
+    db_uint photo_size;
+    unsigned char photo_buffer[4096];
+    size_t photo_buffered;
+
+    bool next_segment(const char *&p, size_t &length, bool &line_start);
+    void begin_property(const char *p, size_t length);
+    void continue_property(const char *p, size_t length);
+    bool finish_property(VCardHandler &handler);
+    void parse_tel_parameters(const char *p, const char *end);
+    void decode_photo(const char *p, size_t length);
+    void flush_photo();
+    void finish_photo();
+
+public:
+    /**
+     * @param photo_file temporary file to decode pictures into, or NULL
+     * to skip pictures
+     */
+    VCardParser(FILE *in, const char *photo_file);
+    ~VCardParser();
+
+    /**
+     * Read cards until the end of the input or until the handler stops.
+     *
+     * @return database error code
+     */
+    int parse(VCardHandler &handler);
+
+    /* Input bytes consumed so far. */
+    db_uint bytes_read() const { return bytes; }
+};
+
+/**
+ * Insert every card of a vCard stream into a phone book, in batches of
+ * VCARD_IMPORT_BATCH cards per transaction. Pictures are decoded through
+ * photo_file and stored like any other picture.
+ *
+ * @return database error code
+ */
+int import_vcards(PhoneBook &pbook, FILE *in, const char *photo_file, db_uint *imported);
+
+/**
+ * Write every contact of a phone book as vCard 3.0 or 4.0, with pictures
+ * as base64 PHOTO properties.
+ *
+ * @return database error code
+ */
+int export_vcards(PhoneBook &pbook, FILE *out, int version);
+
+
+#endif
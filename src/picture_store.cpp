@@ -0,0 +1,771 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Content-addressed picture storage shared by both data access layers
+ */
+
+#include "picture_store.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* FNV-1a parameters for 64-bit hashes. */
+#define FNV_OFFSET_BASIS        0xcbf29ce484222325ULL
+#define FNV_PRIME               0x100000001b3ULL
+
+/* Picture file header: magic number followed by the end of stored data. */
+#define PICTURE_FILE_MAGIC      "PBPICT01"
+#define PICTURE_FILE_HEADER     16
+/* The mapping grows by doubling, starting from this size. */
+#define PICTURE_FILE_MIN_SIZE   (64 * 1024)
+
+/* Block compression: LZ77 sequences of literals and back-references. */
+#define BLOCK_HEADER_SIZE       8
+#define MIN_MATCH               4
+#define MAX_OFFSET              65535
+/* The last match must end this far from the end of the block. */
+#define LAST_LITERALS           5
+#define MATCH_LIMIT             12
+#define HASH_BITS               12
+
+
+PictureHash::PictureHash()
+    : h(FNV_OFFSET_BASIS)
+{
+}
+
+/**
+ * Add a block of picture data to the hash.
+ */
+void PictureHash::update(const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) data;
+
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+}
+
+/**
+ * Name the picture side file after the database file, dropping any
+ * server URL prefix so the side file is always local.
+ */
+void picture_file_name(const char *database_name, char *buffer, size_t size)
+{
+    const char *base_name = strrchr(database_name, '/');
+
+    base_name = base_name != NULL ? base_name + 1 : database_name;
+    snprintf(buffer, size, "%s.pictures", base_name);
+}
+
+/**
+ * Read a picture file into memory and hash its contents. The same bytes
+ * are then compared against stored pictures and stored, so the file is
+ * read only once.
+ *
+ * @return true if the file could be read
+ */
+bool read_picture_file(const char *file_name, std::vector<char> &data, db_uint &hash)
+{
+    FILE *picture_file;
+    if ((picture_file = fopen(file_name, "rb")) == NULL)
+        return false;
+
+    PictureHash hasher;
+    char chunk[PICTURE_BLOCK_SIZE];
+    size_t bytes_read;
+
+    data.clear();
+    while ((bytes_read = fread(chunk, 1, sizeof chunk, picture_file)) > 0) {
+        hasher.update(chunk, bytes_read);
+        data.insert(data.end(), chunk, chunk + bytes_read);
+    }
+    bool ok = !ferror(picture_file);
+    fclose(picture_file);
+
+    hash = hasher.value();
+    return ok;
+}
+
+PictureFile::PictureFile()
+#ifdef _WIN32
+    : file_handle(INVALID_HANDLE_VALUE)
+    , mapping_handle(NULL)
+#else
+    : fd(-1)
+#endif
+    , base(NULL)
+    , capacity(0)
+{
+}
+
+PictureFile::~PictureFile()
+{
+    close();
+}
+
+/**
+ * Open the picture file, or create an empty one.
+ *
+ * @return database error code
+ */
+int PictureFile::open(const char *file_name, bool create)
+{
+    db_uint size = 0;
+
+    close();
+
+#ifdef _WIN32
+    file_handle = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                              create ? CREATE_ALWAYS : OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE)
+        return DB_EIO;
+
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file_handle, &file_size))
+        size = (db_uint) file_size.QuadPart;
+#else
+    fd = ::open(file_name, O_RDWR | O_CREAT | (create ? O_TRUNC : 0), 0644);
+    if (fd < 0)
+        return DB_EIO;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+        size = (db_uint) st.st_size;
+#endif
+
+    if (size < PICTURE_FILE_HEADER) {
+        // New file: write an empty header
+        if (DB_FAILED(map(PICTURE_FILE_MIN_SIZE))) {
+            close();
+            return DB_EIO;
+        }
+        memcpy(base, PICTURE_FILE_MAGIC, 8);
+        used() = PICTURE_FILE_HEADER;
+    } else {
+        if (DB_FAILED(map(size)) || memcmp(base, PICTURE_FILE_MAGIC, 8) != 0) {
+            close();
+            return DB_EIO;
+        }
+    }
+
+    return DB_NOERROR;
+}
+
+/**
+ * Unmap and close the picture file.
+ */
+void PictureFile::close()
+{
+    unmap();
+
+#ifdef _WIN32
+    if (file_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_handle);
+        file_handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+/**
+ * Map the file, extending it to at least the given size.
+ *
+ * @return database error code
+ */
+int PictureFile::map(db_uint size)
+{
+    unmap();
+
+#ifdef _WIN32
+    mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READWRITE,
+                                        (DWORD) (size >> 32), (DWORD) size, NULL);
+    if (mapping_handle == NULL)
+        return DB_EIO;
+
+    base = (char *) MapViewOfFile(mapping_handle, FILE_MAP_WRITE, 0, 0, (SIZE_T) size);
+    if (base == NULL)
+        return DB_ENOMEM;
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return DB_EIO;
+    if ((db_uint) st.st_size < size && ftruncate(fd, (off_t) size) != 0)
+        return DB_EIO;
+
+    void *p = mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return DB_ENOMEM;
+    base = (char *) p;
+#endif
+
+    capacity = size;
+    return DB_NOERROR;
+}
+
+void PictureFile::unmap()
+{
+#ifdef _WIN32
+    if (base != NULL)
+        UnmapViewOfFile(base);
+    if (mapping_handle != NULL) {
+        CloseHandle(mapping_handle);
+        mapping_handle = NULL;
+    }
+#else
+    if (base != NULL)
+        munmap(base, (size_t) capacity);
+#endif
+    base = NULL;
+    capacity = 0;
+}
+
+/**
+ * Write data at a position in the file, growing the mapping as needed.
+ *
+ * @return database error code
+ */
+int PictureFile::write_at(db_uint offset, const void *data, size_t size)
+{
+    if (base == NULL)
+        return DB_EINVAL;
+
+    if (offset + size > capacity) {
+        db_uint new_capacity = capacity;
+        while (offset + size > new_capacity)
+            new_capacity *= 2;
+        if (DB_FAILED(map(new_capacity)))
+            return DB_ENOMEM;
+    }
+
+    memcpy(base + offset, data, size);
+    return DB_NOERROR;
+}
+
+/**
+ * Writes a picture at the end of the side file.
+ */
+class PictureFileWriter : public PictureWriter {
+private:
+    PictureFile &file;
+    db_uint start;
+
+public:
+    PictureFileWriter(PictureFile &file, db_uint start) : file(file), start(start) {}
+
+    int write(db_uint offset, const void *data, size_t size)
+    {
+        return file.write_at(start + offset, data, size);
+    }
+};
+
+/**
+ * Reads a picture from the side file's mapping.
+ */
+class PictureFileReader : public PictureReader {
+private:
+    PictureFile &file;
+    db_uint start;
+    db_uint end;
+
+public:
+    PictureFileReader(PictureFile &file, db_uint start, db_uint end)
+        : file(file), start(start), end(end) {}
+
+    int read(db_uint offset, void *data, size_t size)
+    {
+        if (start + offset + size > end)
+            return DB_EINVAL;
+        memcpy(data, file.base + start + offset, size);
+        return (int) size;
+    }
+};
+
+/**
+ * Copy a picture to the end of the store.
+ *
+ * @return database error code
+ */
+int PictureFile::append(const char *data, size_t size, bool compress, db_uint &offset,
+                        db_uint &stored_size, int &encoding)
+{
+    int rc;
+
+    if (base == NULL)
+        return DB_EINVAL;
+
+    offset = used();
+
+    PictureFileWriter writer(*this, offset);
+    if (DB_FAILED(rc = store_picture(data, size, compress, writer, stored_size, encoding)))
+        return rc;
+
+    // Publish the new end of data only after the picture is complete
+    used() = offset + stored_size;
+    return DB_NOERROR;
+}
+
+/**
+ * Write stored picture data to a file.
+ *
+ * @return database error code
+ */
+int PictureFile::export_to(db_uint offset, db_uint stored_size, int encoding, FILE *file)
+{
+    if (base == NULL || offset < PICTURE_FILE_HEADER || offset + stored_size > used())
+        return DB_EINVAL;
+
+    if (encoding == PICTURE_RAW) {
+        // The mapping is written directly; pages are read in on demand
+        if (fwrite(base + offset, 1, (size_t) stored_size, file) != stored_size)
+            return DB_EIO;
+        return DB_NOERROR;
+    }
+
+    PictureFileReader reader(*this, offset, offset + stored_size);
+    return load_picture(reader, stored_size, encoding, file);
+}
+
+/**
+ * Compare stored picture data with a picture in memory.
+ *
+ * @return true if the stored picture has exactly the same bytes
+ */
+bool PictureFile::matches(db_uint offset, db_uint stored_size, int encoding,
+                          const char *data, size_t size)
+{
+    if (base == NULL || offset < PICTURE_FILE_HEADER || offset + stored_size > used())
+        return false;
+
+    if (encoding == PICTURE_RAW)
+        return stored_size == size && memcmp(base + offset, data, size) == 0;
+
+    PictureFileReader reader(*this, offset, offset + stored_size);
+    return picture_matches(reader, stored_size, encoding, data, size);
+}
+
+/**
+ * Recognize image and archive formats that are already compressed, so
+ * no time is spent trying to compress them again.
+ */
+bool is_compressed_format(const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) data;
+
+    if (size >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0)
+        return true;
+    if (size >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff)  // JPEG
+        return true;
+    if (size >= 4 && memcmp(p, "GIF8", 4) == 0)
+        return true;
+    if (size >= 12 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WEBP", 4) == 0)
+        return true;
+    if (size >= 12 && memcmp(p + 4, "ftyp", 4) == 0)  // HEIF, AVIF
+        return true;
+    if (size >= 2 && p[0] == 0x1f && p[1] == 0x8b)  // gzip
+        return true;
+    if (size >= 4 && memcmp(p, "PK\x03\x04", 4) == 0)  // zip
+        return true;
+    if (size >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)  // zstd
+        return true;
+
+    return false;
+}
+
+static inline unsigned read32(const char *p)
+{
+    unsigned v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline unsigned hash32(unsigned v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static char *write_length(char *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = (char) 255;
+    *op++ = (char) length;
+    return op;
+}
+
+/**
+ * Compress one block of at most PICTURE_BLOCK_SIZE bytes.
+ *
+ * The output is a series of sequences: a token holding 4-bit literal and
+ * match lengths, extra length bytes, the literals, and a 2-byte offset of
+ * the match. The last sequence has literals only.
+ *
+ * @return compressed size, at most PICTURE_BLOCK_BOUND
+ */
+size_t compress_block(const char *src, size_t size, char *dst)
+{
+    /* Positions are relative to src, so a block must fit 16 bits. */
+    unsigned short table[1 << HASH_BITS];
+    size_t ip = 0, anchor = 0;
+    char *op = dst;
+
+    memset(table, 0, sizeof table);
+
+    if (size > MATCH_LIMIT) {
+        size_t limit = size - MATCH_LIMIT;
+
+        // Position 0 is never a match candidate, so 0 marks an empty slot
+        while (ip < limit) {
+            unsigned seq = read32(src + ip);
+            unsigned h = hash32(seq);
+            size_t ref = table[h];
+
+            table[h] = (unsigned short) ip;
+            if (ref == 0 || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            // Extend the match, leaving literals at the end of the block
+            size_t match = MIN_MATCH;
+            while (ip + match < size - LAST_LITERALS && src[ref + match] == src[ip + match])
+                match++;
+
+            size_t literals = ip - anchor;
+            size_t extra = match - MIN_MATCH;
+            char *token = op++;
+
+            *token = (char) (((literals < 15 ? literals : 15) << 4) | (extra < 15 ? extra : 15));
+            if (literals >= 15)
+                op = write_length(op, literals - 15);
+            memcpy(op, src + anchor, literals);
+            op += literals;
+
+            *op++ = (char) ((ip - ref) & 0xff);
+            *op++ = (char) ((ip - ref) >> 8);
+            if (extra >= 15)
+                op = write_length(op, extra - 15);
+
+            ip += match;
+            anchor = ip;
+        }
+    }
+
+    // Final literals
+    size_t literals = size - anchor;
+    *op++ = (char) ((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+        op = write_length(op, literals - 15);
+    memcpy(op, src + anchor, literals);
+    op += literals;
+
+    return (size_t) (op - dst);
+}
+
+/**
+ * Decompress one block, checking every length against the buffers.
+ *
+ * @return database error code
+ */
+int decompress_block(const char *src, size_t size, char *dst, size_t raw_size)
+{
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *iend = ip + size;
+    char *op = dst;
+    char *oend = dst + raw_size;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        unsigned char b;
+
+        if (literals == 15) {
+            do {
+                if (ip >= iend)
+                    return DB_EINVAL;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (size_t) (iend - ip) || literals > (size_t) (oend - op))
+            return DB_EINVAL;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return DB_EINVAL;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t match = token & 15;
+        if (match == 15) {
+            do {
+                if (ip >= iend)
+                    return DB_EINVAL;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        match += MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t) (op - dst) || match > (size_t) (oend - op))
+            return DB_EINVAL;
+
+        // Copy byte by byte, since the match may overlap its own output
+        const char *ref = op - offset;
+        for (size_t i = 0; i < match; i++)
+            op[i] = ref[i];
+        op += match;
+    }
+
+    return op == oend ? DB_NOERROR : DB_EINVAL;
+}
+
+static void put32(char *p, unsigned v)
+{
+    p[0] = (char) v;
+    p[1] = (char) (v >> 8);
+    p[2] = (char) (v >> 16);
+    p[3] = (char) (v >> 24);
+}
+
+static unsigned get32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *) p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((unsigned) u[3] << 24);
+}
+
+/**
+ * Copy a picture into storage, compressing it block by block unless
+ * compression is disabled or the picture is already in a compressed format.
+ *
+ * @return database error code
+ */
+int store_picture(const char *data, size_t size, bool compress, PictureWriter &writer,
+                  db_uint &stored_size, int &encoding)
+{
+    char block[BLOCK_HEADER_SIZE + PICTURE_BLOCK_BOUND];
+    size_t done = 0;
+    int rc = DB_NOERROR;
+
+    stored_size = 0;
+    encoding = compress && !is_compressed_format(data, size) ? PICTURE_BLOCK_COMPRESSED : PICTURE_RAW;
+
+    if (encoding == PICTURE_RAW) {
+        for (; DB_SUCCESS(rc) && done < size; done += PICTURE_BLOCK_SIZE) {
+            size_t chunk = size - done < PICTURE_BLOCK_SIZE ? size - done : PICTURE_BLOCK_SIZE;
+            rc = writer.write(stored_size, data + done, chunk);
+            stored_size += chunk;
+        }
+        return DB_FAILED(rc) ? rc : DB_NOERROR;
+    }
+
+    for (; DB_SUCCESS(rc) && done < size; done += PICTURE_BLOCK_SIZE) {
+        size_t chunk = size - done < PICTURE_BLOCK_SIZE ? size - done : PICTURE_BLOCK_SIZE;
+        size_t packed;
+        {
+            TRACE_SPAN("compress_block");
+            packed = compress_block(data + done, chunk, block + BLOCK_HEADER_SIZE);
+        }
+        if (packed >= chunk) {
+            // Incompressible block: store it as is
+            memcpy(block + BLOCK_HEADER_SIZE, data + done, chunk);
+            packed = chunk;
+        }
+        put32(block, (unsigned) chunk);
+        put32(block + 4, (unsigned) packed);
+
+        rc = writer.write(stored_size, block, BLOCK_HEADER_SIZE + packed);
+        stored_size += BLOCK_HEADER_SIZE + packed;
+    }
+
+    return DB_FAILED(rc) ? rc : DB_NOERROR;
+}
+
+/**
+ * Read exactly the requested number of bytes from storage.
+ */
+static int read_fully(PictureReader &reader, db_uint offset, char *data, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        int bytes_read = reader.read(offset + done, data + done, size - done);
+        if (DB_FAILED(bytes_read))
+            return bytes_read;
+        if (bytes_read == 0)
+            return DB_EIO;
+        done += bytes_read;
+    }
+
+    return DB_NOERROR;
+}
+
+/**
+ * Receives decoded picture data in order.
+ */
+class PictureSink {
+public:
+    virtual ~PictureSink() {}
+
+    /* @return database error code; a failure stops decoding */
+    virtual int put(const char *data, size_t size) = 0;
+};
+
+/**
+ * Writes decoded picture data to a file.
+ */
+class FileSink : public PictureSink {
+private:
+    FILE *file;
+
+public:
+    FileSink(FILE *file) : file(file) {}
+
+    int put(const char *data, size_t size)
+    {
+        return fwrite(data, 1, size, file) == size ? DB_NOERROR : DB_EIO;
+    }
+};
+
+/**
+ * Compares decoded picture data with a picture in memory.
+ */
+class CompareSink : public PictureSink {
+private:
+    const char *data;
+    size_t size;
+
+public:
+    size_t position;
+
+    CompareSink(const char *data, size_t size) : data(data), size(size), position(0) {}
+
+    int put(const char *block, size_t length)
+    {
+        if (length > size - position || memcmp(data + position, block, length) != 0)
+            return DB_ENOTFOUND;
+        position += length;
+        return DB_NOERROR;
+    }
+};
+
+/**
+ * Decode a stored picture one block at a time.
+ *
+ * @return database error code
+ */
+static int decode_picture(PictureReader &reader, db_uint stored_size, int encoding, PictureSink &sink)
+{
+    char data[PICTURE_BLOCK_SIZE];
+    char block[PICTURE_BLOCK_BOUND];
+    db_uint offset = 0;
+    int rc;
+
+    if (encoding == PICTURE_RAW) {
+        while (offset < stored_size) {
+            size_t chunk = (size_t) (stored_size - offset < sizeof data ? stored_size - offset : sizeof data);
+            if (DB_FAILED(rc = read_fully(reader, offset, data, chunk)))
+                return rc;
+            if (DB_FAILED(rc = sink.put(data, chunk)))
+                return rc;
+            offset += chunk;
+        }
+        return DB_NOERROR;
+    }
+
+    while (offset < stored_size) {
+        char header[BLOCK_HEADER_SIZE];
+
+        if (DB_FAILED(rc = read_fully(reader, offset, header, sizeof header)))
+            return rc;
+        offset += sizeof header;
+
+        size_t raw = get32(header);
+        size_t packed = get32(header + 4);
+        if (raw > PICTURE_BLOCK_SIZE || packed > PICTURE_BLOCK_BOUND || offset + packed > stored_size)
+            return DB_EINVAL;
+
+        if (packed == raw) {
+            if (DB_FAILED(rc = read_fully(reader, offset, data, raw)))
+                return rc;
+        } else {
+            if (DB_FAILED(rc = read_fully(reader, offset, block, packed)))
+                return rc;
+            TRACE_SPAN("decompress_block");
+            if (DB_FAILED(rc = decompress_block(block, packed, data, raw)))
+                return rc;
+        }
+        offset += packed;
+
+        if (DB_FAILED(rc = sink.put(data, raw)))
+            return rc;
+    }
+
+    return DB_NOERROR;
+}
+
+/**
+ * Write a stored picture to a file, decompressing one block at a time.
+ *
+ * @return database error code
+ */
+int load_picture(PictureReader &reader, db_uint stored_size, int encoding, FILE *file)
+{
+    FileSink sink(file);
+    return decode_picture(reader, stored_size, encoding, sink);
+}
+
+/**
+ * Compare a stored picture with a picture in memory, stopping at the first
+ * block that differs.
+ *
+ * @return true if the stored picture has exactly the same bytes
+ */
+bool picture_matches(PictureReader &reader, db_uint stored_size, int encoding,
+                     const char *data, size_t size)
+{
+    CompareSink sink(data, size);
+    return DB_SUCCESS(decode_picture(reader, stored_size, encoding, sink)) && sink.position == size;
+}
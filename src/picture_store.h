@@ -0,0 +1,205 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Content-addressed picture storage shared by both data access layers
+ */
+
+#ifndef PICTURE_STORE_H
+#define PICTURE_STORE_H 1
+
+#include <ittia/db++.h>
+
+#include "span_trace.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <vector>
+
+/* Pictures are compressed in independent blocks of this size. */
+#define PICTURE_BLOCK_SIZE      16384
+/* Largest possible compressed block, including incompressible data. */
+#define PICTURE_BLOCK_BOUND     (PICTURE_BLOCK_SIZE + PICTURE_BLOCK_SIZE / 255 + 16)
+
+/**
+ * How picture data is laid out in storage
+ */
+enum PictureEncoding {
+    /* The picture file, byte for byte */
+    PICTURE_RAW = 0,
+    /* A sequence of blocks, each with an 8-byte header giving the raw and
+     * stored length; blocks that do not shrink are stored raw. */
+    PICTURE_BLOCK_COMPRESSED = 1
+};
+
+/**
+ * Incremental 64-bit FNV-1a hash of picture content.
+ *
+ * The hash is where the search for a stored copy of a picture starts, so
+ * identical images shared by many contacts occupy a single BLOB. Pictures
+ * are only shared after their size and bytes compare equal; a different
+ * picture with the same hash is stored under the next free key.
+ */
+class PictureHash {
+private:
+    db_uint h;
+
+public:
+    PictureHash();
+
+    void update(const void *data, size_t size);
+    db_uint value() const { return h; }
+};
+
+/**
+ * Read a picture file into memory and hash its contents.
+ *
+ * @return true if the file could be read
+ */
+bool read_picture_file(const char *file_name, std::vector<char> &data, db_uint &hash);
+
+/**
+ * Name of the picture side file used with a memory storage database.
+ */
+void picture_file_name(const char *database_name, char *buffer, size_t size);
+
+/**
+ * Destination for stored picture data, written sequentially from offset 0.
+ */
+class PictureWriter {
+public:
+    virtual ~PictureWriter() {}
+
+    /* @return database error code */
+    virtual int write(db_uint offset, const void *data, size_t size) = 0;
+};
+
+/**
+ * Source of stored picture data.
+ */
+class PictureReader {
+public:
+    virtual ~PictureReader() {}
+
+    /* @return number of bytes read, or a database error code */
+    virtual int read(db_uint offset, void *data, size_t size) = 0;
+};
+
+/**
+ * Reads and writes picture data in a BLOB field of a table's current row.
+ */
+class TableBlobIO : public PictureWriter, public PictureReader {
+private:
+    db::Table &table;
+    int field;
+
+public:
+    TableBlobIO(db::Table &table, int field) : table(table), field(field) {}
+
+    int write(db_uint offset, const void *data, size_t size)
+    {
+        TRACE_SPAN("write_blob");
+        return table.write_blob(field, (db_len_t) offset, data, (db_len_t) size);
+    }
+    int read(db_uint offset, void *data, size_t size)
+    {
+        TRACE_SPAN("read_blob");
+        return table.read_blob(field, (db_len_t) offset, data, (db_len_t) size);
+    }
+};
+
+/**
+ * Reads picture data from a BLOB column of a query result.
+ */
+class BlobFieldReader : public PictureReader {
+private:
+    db::BlobField &blob;
+
+public:
+    BlobFieldReader(db::BlobField &blob) : blob(blob) {}
+
+    int read(db_uint offset, void *data, size_t size)
+    {
+        TRACE_SPAN("read_blob");
+        return blob.read((db_len_t) offset, data, (db_len_t) size);
+    }
+};
+
+bool is_compressed_format(const void *data, size_t size);
+size_t compress_block(const char *src, size_t size, char *dst);
+int decompress_block(const char *src, size_t size, char *dst, size_t raw_size);
+
+int store_picture(const char *data, size_t size, bool compress, PictureWriter &writer,
+                  db_uint &stored_size, int &encoding);
+int load_picture(PictureReader &reader, db_uint stored_size, int encoding, FILE *file);
+bool picture_matches(PictureReader &reader, db_uint stored_size, int encoding,
+                     const char *data, size_t size);
+
+/**
+ * Memory-mapped side file holding picture data for memory storage.
+ *
+ * Memory storage is too small to hold images, so the "picture" table
+ * records only an offset into this file. Pictures are appended and never
+ * moved; space is reclaimed when the database is created again. The file
+ * is written by a single process.
+ */
+class PictureFile {
+private:
+#ifdef _WIN32
+    void *file_handle;
+    void *mapping_handle;
+#else
+    int fd;
+#endif
+    char *base;
+    /* Size of the mapping, which may extend beyond the stored data */
+    db_uint capacity;
+
+    int map(db_uint size);
+    void unmap();
+    int write_at(db_uint offset, const void *data, size_t size);
+
+    db_uint &used() const { return *(db_uint *) (base + 8); }
+
+    friend class PictureFileWriter;
+    friend class PictureFileReader;
+
+public:
+    PictureFile();
+    ~PictureFile();
+
+    int open(const char *file_name, bool create);
+    void close();
+    bool is_open() const { return base != NULL; }
+
+    int append(const char *data, size_t size, bool compress, db_uint &offset,
+               db_uint &stored_size, int &encoding);
+    int export_to(db_uint offset, db_uint stored_size, int encoding, FILE *file);
+    bool matches(db_uint offset, db_uint stored_size, int encoding,
+                 const char *data, size_t size);
+};
+
+#endif
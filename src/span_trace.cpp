@@ -0,0 +1,178 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Scoped timing spans, written as Chrome trace-event JSON
+ */
+
+#include "span_trace.h"
+
+#ifdef PHONEBOOK_TRACING
+
+#include <ittia/db++.h>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+
+/**
+ * The spans of one thread. Only the owning thread writes; the count is
+ * published after each span is complete, so a reader on another thread
+ * sees only whole spans.
+ */
+struct SpanBuffer {
+    struct Span {
+        const char *name;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+    };
+
+    SpanBuffer *next;
+    unsigned thread_id;
+    std::atomic<size_t> count;
+    std::atomic<uint64_t> dropped;
+    Span spans[SPAN_BUFFER_EVENTS];
+};
+
+/* Every thread's buffer, newest first. Buffers outlive their threads so
+   spans can still be written after a worker exits. */
+static std::atomic<SpanBuffer *> span_buffers(NULL);
+static std::atomic<unsigned> span_thread_count(0);
+static thread_local SpanBuffer *span_buffer = NULL;
+
+static const std::chrono::steady_clock::time_point span_origin = std::chrono::steady_clock::now();
+
+uint64_t span_clock_ns()
+{
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - span_origin).count();
+}
+
+/**
+ * Allocate the calling thread's buffer and add it to the list.
+ */
+static SpanBuffer *span_register_thread()
+{
+    SpanBuffer *buffer = new (std::nothrow) SpanBuffer;
+
+    if (buffer == NULL)
+        return NULL;
+
+    buffer->thread_id = ++span_thread_count;
+    buffer->count.store(0, std::memory_order_relaxed);
+    buffer->dropped.store(0, std::memory_order_relaxed);
+    buffer->next = span_buffers.load(std::memory_order_relaxed);
+    while (!span_buffers.compare_exchange_weak(buffer->next, buffer,
+            std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return buffer;
+}
+
+void span_record(const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+    SpanBuffer *buffer = span_buffer;
+
+    if (buffer == NULL && (buffer = span_buffer = span_register_thread()) == NULL)
+        return;
+
+    size_t n = buffer->count.load(std::memory_order_relaxed);
+    if (n == SPAN_BUFFER_EVENTS) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    buffer->spans[n].name = name;
+    buffer->spans[n].start_ns = start_ns;
+    buffer->spans[n].duration_ns = end_ns - start_ns;
+    buffer->count.store(n + 1, std::memory_order_release);
+}
+
+static void write_json_string(FILE *out, const char *s)
+{
+    putc('"', out);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            putc('\\', out);
+        if ((unsigned char) *s >= 0x20)
+            putc(*s, out);
+    }
+    putc('"', out);
+}
+
+/**
+ * Write every span recorded so far, as complete ("X") events with
+ * microsecond timestamps, one track per thread. Spans dropped because a
+ * buffer was full are reported in the trace metadata.
+ *
+ * @return database error code
+ */
+int span_trace_write(FILE *out)
+{
+    uint64_t dropped = 0;
+    bool first = true;
+
+    fputs("{\"traceEvents\":[\n", out);
+
+    for (SpanBuffer *buffer = span_buffers.load(std::memory_order_acquire);
+            buffer != NULL; buffer = buffer->next) {
+        size_t count = buffer->count.load(std::memory_order_acquire);
+
+        for (size_t i = 0; i < count; i++) {
+            const SpanBuffer::Span &span = buffer->spans[i];
+
+            fputs(first ? "{\"name\":" : ",\n{\"name\":", out);
+            write_json_string(out, span.name);
+            fprintf(out, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    buffer->thread_id, span.start_ns / 1000.0, span.duration_ns / 1000.0);
+            first = false;
+        }
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+    }
+
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_spans\":%llu}}\n",
+            (unsigned long long) dropped);
+
+    return ferror(out) ? DB_EIO : DB_NOERROR;
+}
+
+/**
+ * Write every span recorded so far to a new file.
+ *
+ * @return database error code
+ */
+int span_trace_write_file(const char *file_name)
+{
+    FILE *out = fopen(file_name, "w");
+    int rc;
+
+    if (out == NULL)
+        return DB_EIO;
+    rc = span_trace_write(out);
+    if (fclose(out) != 0)
+        rc = DB_EIO;
+    return rc;
+}
+
+#endif
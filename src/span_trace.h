@@ -0,0 +1,96 @@
+/**************************************************************************/
+/*                                                                        */
+/*      Copyright (c) 2005-2014 by ITTIA L.L.C. All rights reserved.      */
+/*                                                                        */
+/*  This software is copyrighted by and is the sole property of ITTIA     */
+/*  L.L.C.  All rights, title, ownership, or other interests in the       */
+/*  software remain the property of ITTIA L.L.C.  This software may only  */
+/*  be used in accordance with the corresponding license agreement.  Any  */
+/*  unauthorized use, duplication, transmission, distribution, or         */
+/*  disclosure of this software is expressly forbidden.                   */
+/*                                                                        */
+/*  This Copyright notice may not be removed or modified without prior    */
+/*  written consent of ITTIA L.L.C.                                       */
+/*                                                                        */
+/*  ITTIA L.L.C. reserves the right to modify this software without       */
+/*  notice.                                                               */
+/*                                                                        */
+/*  info@ittia.com                                                        */
+/*  http://www.ittia.com                                                  */
+/*                                                                        */
+/*                                                                        */
+/**************************************************************************/
+
+
+/** @file
+ *
+ * Scoped timing spans, written as Chrome trace-event JSON
+ *
+ * TRACE_SPAN("name") times the rest of the enclosing scope. Each thread
+ * appends its spans to a buffer of its own without locks; span_trace_write
+ * can be called from any thread to write every span recorded so far in the
+ * trace-event format read by chrome://tracing and Perfetto. Unless
+ * PHONEBOOK_TRACING is defined, TRACE_SPAN expands to nothing and the
+ * rest of this header is left out.
+ */
+
+#ifndef SPAN_TRACE_H
+#define SPAN_TRACE_H 1
+
+#ifdef PHONEBOOK_TRACING
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Spans each thread can hold; later spans are counted and dropped. */
+#ifndef SPAN_BUFFER_EVENTS
+#define SPAN_BUFFER_EVENTS      65536
+#endif
+
+/* Nanoseconds since the first span of the process */
+uint64_t span_clock_ns();
+/* Append a finished span to the calling thread's buffer. The name must
+   outlive the trace, such as a string literal. */
+void span_record(const char *name, uint64_t start_ns, uint64_t end_ns);
+
+/* Write every span recorded so far as trace-event JSON. */
+int span_trace_write(FILE *out);
+int span_trace_write_file(const char *file_name);
+
+/**
+ * Records a span from its construction to the end of its scope
+ */
+class TraceSpan {
+private:
+    const char *name;
+    uint64_t start_ns;
+
+    /* Not copyable */
+    TraceSpan(const TraceSpan &);
+    TraceSpan &operator=(const TraceSpan &);
+
+public:
+    explicit TraceSpan(const char *name)
+        : name(name)
+        , start_ns(span_clock_ns())
+    {
+    }
+
+    ~TraceSpan()
+    {
+        span_record(name, start_ns, span_clock_ns());
+    }
+};
+
+#define SPAN_CONCAT2(a, b)      a##b
+#define SPAN_CONCAT(a, b)       SPAN_CONCAT2(a, b)
+#define TRACE_SPAN(name)        TraceSpan SPAN_CONCAT(trace_span_, __LINE__)(name)
+
+#else
+
+#define TRACE_SPAN(name)        ((void) 0)
+
+#endif
+
+
+#endif